@@ -0,0 +1,60 @@
+/*
+ * Filename: src/bench/alt-writes.c
+ * Project: errmark
+ * Brief: Synthetic tracee: lines alternating between stdout and stderr
+ *
+ * Copyright (C) 2016-2019 Guy Shaw
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Usage: alt-writes [ <count> [ <size> ] ]
+ *
+ * Make <count> write() calls of <size> bytes each, alternating
+ * between fd 1 and fd 2, so that every write is a transition.
+ * Defaults are 100000 writes of 40 bytes.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+int
+main(int argc, char **argv)
+{
+    unsigned long count = 100000;
+    size_t size = 40;
+    char *buf;
+    unsigned long i;
+
+    if (argc > 1) {
+        count = strtoul(argv[1], NULL, 0);
+    }
+    if (argc > 2) {
+        size = strtoul(argv[2], NULL, 0);
+    }
+
+    buf = malloc(size);
+    memset(buf, '.', size);
+    if (size != 0) {
+        buf[size - 1] = '\n';
+    }
+    for (i = 0; i < count; ++i) {
+        if (write(1 + (i & 1), buf, size) == -1) {
+            return (1);
+        }
+    }
+    return (0);
+}
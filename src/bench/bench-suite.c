@@ -0,0 +1,427 @@
+/*
+ * Filename: src/bench/bench-suite.c
+ * Project: errmark
+ * Brief: Run the synthetic tracees under each errmark mode; report CSV
+ *
+ * Copyright (C) 2016-2019 Guy Shaw
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Usage: bench-suite [ --errmark=<path> ] [ --reps=<n> ]
+ *                    [ --out=<csv> ] [ --baseline=<csv> ]
+ *                    [ --tolerance=<percent> ] [ <workload>... ]
+ *
+ * Run each workload (default: all of them) without errmark, and then
+ * under each mode of errmark, <n> times (default 3), with stdout and
+ * stderr going to /dev/null, and keep the fastest run.
+ *
+ * Write CSV, to stdout and, with --out, to <csv>:
+ *
+ *     workload,mode,wall_s,cpu_s,stops,bytes_per_s,overhead
+ *
+ * cpu_s is user + system time of errmark and of the workload together,
+ * from wait4().  stops and bytes come from errmark --stats.
+ * overhead is wall_s over the wall_s of the same workload without errmark.
+ *
+ * With --baseline, a CSV written by an earlier run, exit with status 1
+ * if the overhead of any workload and mode is more than <percent>
+ * (default 25) above that in the baseline, or is not in it at all.
+ * Overhead, not time, is compared, so that a baseline taken on one
+ * machine means something on another one that is not too different.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#define MAX_ARGS 16
+
+struct workload {
+    const char *name;
+    const char *argv[6];
+};
+
+static const struct workload workloads[] = {
+    { "tiny-writes",   { "./tiny-writes", "100000", "16", "2", NULL } },
+    { "huge-writes",   { "./tiny-writes", "64", "1048576", "2", NULL } },
+    { "alt-writes",    { "./alt-writes", "100000", "40", NULL } },
+    { "syscall-storm", { "./syscall-storm", "200000", NULL } },
+    { "thread-writes", { "./thread-writes", "4", "20000", "40", NULL } },
+    { "fork-storm",    { "./fork-storm", "500", "4", NULL } },
+    { "proc-writes",   { "./proc-writes", "8", "20000", "40", NULL } },
+    { NULL, { NULL } }
+};
+
+struct mode {
+    const char *name;
+    const char *opts[3];        // errmark options; NULL name: no errmark
+};
+
+static const struct mode modes[] = {
+    { "none",            { NULL } },
+    { "ptrace",          { "--engine=ptrace", NULL } },
+    { "seccomp",         { "--engine=seccomp", NULL } },
+    { "notify",          { "--engine=notify", NULL } },
+    { "notify-coalesce", { "--engine=notify", "--coalesce", NULL } },
+    { NULL, { NULL } }
+};
+
+struct result {
+    double wall;
+    double cpu;
+    unsigned long long stops;
+    unsigned long long bytes;
+};
+
+static const char *errmark_path = "../cmd/errmark";
+static char stats_fname[64];
+
+static double
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+/*
+ * Sum the numbers in the JSON object |key| of the --stats file.
+ * Objects inside it count, too, but only their member |member|,
+ * if |member| is not NULL.
+ */
+static unsigned long long
+stats_sum(const char *json, const char *key, const char *member)
+{
+    unsigned long long sum;
+    const char *p;
+    int depth;
+
+    p = strstr(json, key);
+    if (p == NULL || (p = strchr(p, '{')) == NULL) {
+        return (0);
+    }
+    sum = 0;
+    depth = 0;
+    for (; *p; ++p) {
+        if (*p == '{') {
+            ++depth;
+        }
+        else if (*p == '}') {
+            if (--depth == 0) {
+                break;
+            }
+        }
+        else if (*p == ':') {
+            if (member == NULL && depth == 1) {
+                sum += strtoull(p + 1, NULL, 10);
+            }
+            else if (member != NULL && depth == 2
+                     && p - strlen(member) >= json
+                     && strncmp(p - strlen(member), member,
+                                strlen(member)) == 0) {
+                sum += strtoull(p + 1, NULL, 10);
+            }
+        }
+    }
+    return (sum);
+}
+
+static bool
+read_stats(struct result *r)
+{
+    char buf[16384];
+    ssize_t n;
+    int fd;
+
+    fd = open(stats_fname, O_RDONLY);
+    if (fd == -1) {
+        return (false);
+    }
+    n = read(fd, buf, sizeof (buf) - 1);
+    close(fd);
+    if (n <= 0) {
+        return (false);
+    }
+    buf[n] = '\0';
+    r->stops = stats_sum(buf, "\"stops\"", NULL);
+    r->bytes = stats_sum(buf, "\"fds\"", "\"bytes\"");
+    return (true);
+}
+
+/*
+ * Run |w| once, under |m|.
+ */
+static bool
+run_once(const struct workload *w, const struct mode *m, struct result *r)
+{
+    const char *argv[MAX_ARGS];
+    char stats_opt[96];
+    struct rusage ru;
+    double t0;
+    int argc, i, status, devnull;
+    pid_t pid;
+
+    argc = 0;
+    if (m->opts[0] != NULL) {
+        snprintf(stats_opt, sizeof (stats_opt), "--stats=%s", stats_fname);
+        argv[argc++] = errmark_path;
+        for (i = 0; m->opts[i] != NULL; ++i) {
+            argv[argc++] = m->opts[i];
+        }
+        argv[argc++] = stats_opt;
+        argv[argc++] = "--stats-format=json";
+        argv[argc++] = "--";
+    }
+    for (i = 0; w->argv[i] != NULL; ++i) {
+        argv[argc++] = w->argv[i];
+    }
+    argv[argc] = NULL;
+
+    unlink(stats_fname);
+    t0 = now();
+    pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        return (false);
+    }
+    if (pid == 0) {
+        devnull = open("/dev/null", O_WRONLY);
+        dup2(devnull, 1);
+        dup2(devnull, 2);
+        execv(argv[0], (char * const *)argv);
+        _exit(127);
+    }
+    if (wait4(pid, &status, 0, &ru) == -1) {
+        perror("wait4");
+        return (false);
+    }
+    r->wall = now() - t0;
+    r->cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6
+        + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+    r->stops = 0;
+    r->bytes = 0;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "bench-suite: %s under %s: status 0x%x\n",
+            w->name, m->name, status);
+        return (false);
+    }
+    if (m->opts[0] != NULL && !read_stats(r)) {
+        fprintf(stderr, "bench-suite: %s under %s: no stats\n",
+            w->name, m->name);
+        return (false);
+    }
+    return (true);
+}
+
+/*
+ * The overhead for |workload|,|mode| in the CSV file |csv|; 0 if none.
+ */
+static double
+baseline_overhead(const char *csv, const char *workload, const char *mode)
+{
+    const char *p;
+    size_t wl, ml;
+    int i;
+
+    wl = strlen(workload);
+    ml = strlen(mode);
+    for (p = csv; p != NULL && *p; p = strchr(p, '\n'), p = p ? p + 1 : p) {
+        if (strncmp(p, workload, wl) == 0 && p[wl] == ','
+            && strncmp(p + wl + 1, mode, ml) == 0 && p[wl + 1 + ml] == ',') {
+            /*
+             * overhead is the 7th field.
+             */
+            for (i = 0; i < 6 && p != NULL; ++i) {
+                p = strchr(p, ',');
+                p = p ? p + 1 : p;
+            }
+            return (p ? strtod(p, NULL) : 0.0);
+        }
+    }
+    return (0.0);
+}
+
+static char *
+slurp(const char *fname)
+{
+    FILE *f;
+    char *buf;
+    long size;
+
+    f = fopen(fname, "r");
+    if (f == NULL) {
+        return (NULL);
+    }
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    rewind(f);
+    buf = malloc(size + 1);
+    size = fread(buf, 1, size, f);
+    buf[size] = '\0';
+    fclose(f);
+    return (buf);
+}
+
+static bool
+selected(const char *name, int argc, char **argv, int first)
+{
+    int i;
+
+    if (first >= argc) {
+        return (true);
+    }
+    for (i = first; i < argc; ++i) {
+        if (strcmp(argv[i], name) == 0) {
+            return (true);
+        }
+    }
+    return (false);
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *out_fname = NULL;
+    const char *baseline_fname = NULL;
+    char *baseline = NULL;
+    double tolerance = 25.0;
+    int reps = 3;
+    struct result res[sizeof (modes) / sizeof (modes[0])];
+    struct result r;
+    unsigned long long bytes;
+    double overhead, base;
+    FILE *out = NULL;
+    int regressions = 0;
+    int wi, mi, rep, a;
+
+    for (a = 1; a < argc && strncmp(argv[a], "--", 2) == 0; ++a) {
+        if (strncmp(argv[a], "--errmark=", 10) == 0) {
+            errmark_path = argv[a] + 10;
+        }
+        else if (strncmp(argv[a], "--reps=", 7) == 0) {
+            reps = atoi(argv[a] + 7);
+        }
+        else if (strncmp(argv[a], "--out=", 6) == 0) {
+            out_fname = argv[a] + 6;
+        }
+        else if (strncmp(argv[a], "--baseline=", 11) == 0) {
+            baseline_fname = argv[a] + 11;
+        }
+        else if (strncmp(argv[a], "--tolerance=", 12) == 0) {
+            tolerance = strtod(argv[a] + 12, NULL);
+        }
+        else {
+            fprintf(stderr, "bench-suite: unknown option, '%s'\n", argv[a]);
+            return (2);
+        }
+    }
+    if (reps < 1) {
+        reps = 1;
+    }
+    if (baseline_fname != NULL) {
+        baseline = slurp(baseline_fname);
+        if (baseline == NULL) {
+            fprintf(stderr, "bench-suite: %s: %s\n",
+                baseline_fname, strerror(errno));
+            return (2);
+        }
+    }
+    if (out_fname != NULL) {
+        out = fopen(out_fname, "w");
+        if (out == NULL) {
+            fprintf(stderr, "bench-suite: %s: %s\n", out_fname, strerror(errno));
+            return (2);
+        }
+    }
+    snprintf(stats_fname, sizeof (stats_fname), "/tmp/bench-suite.%d.json",
+        (int)getpid());
+
+    printf("workload,mode,wall_s,cpu_s,stops,bytes_per_s,overhead\n");
+    if (out != NULL) {
+        fprintf(out, "workload,mode,wall_s,cpu_s,stops,bytes_per_s,overhead\n");
+    }
+    for (wi = 0; workloads[wi].name != NULL; ++wi) {
+        if (!selected(workloads[wi].name, argc, argv, a)) {
+            continue;
+        }
+        bytes = 0;
+        for (mi = 0; modes[mi].name != NULL; ++mi) {
+            res[mi].wall = 0.0;
+            for (rep = 0; rep < reps; ++rep) {
+                if (!run_once(&workloads[wi], &modes[mi], &r)) {
+                    return (2);
+                }
+                if (rep == 0 || r.wall < res[mi].wall) {
+                    res[mi] = r;
+                }
+            }
+            if (res[mi].bytes > bytes) {
+                bytes = res[mi].bytes;
+            }
+        }
+        /*
+         * Without errmark, there is nobody to count the bytes;
+         * they are the same as with it.
+         */
+        for (mi = 0; modes[mi].name != NULL; ++mi) {
+            overhead = res[mi].wall / res[0].wall;
+            printf("%s,%s,%.4f,%.4f,%llu,%.0f,%.3f\n",
+                workloads[wi].name, modes[mi].name, res[mi].wall, res[mi].cpu,
+                res[mi].stops, bytes / res[mi].wall, overhead);
+            if (out != NULL) {
+                fprintf(out, "%s,%s,%.4f,%.4f,%llu,%.0f,%.3f\n",
+                    workloads[wi].name, modes[mi].name, res[mi].wall,
+                    res[mi].cpu, res[mi].stops, bytes / res[mi].wall, overhead);
+            }
+            fflush(stdout);
+            if (baseline == NULL || mi == 0) {
+                continue;
+            }
+            base = baseline_overhead(baseline, workloads[wi].name, modes[mi].name);
+            if (base <= 0.0) {
+                fprintf(stderr, "bench-suite: MISSING %s,%s: "
+                    "not in the baseline\n",
+                    workloads[wi].name, modes[mi].name);
+                ++regressions;
+            }
+            else if (overhead > base * (1.0 + tolerance / 100.0)) {
+                fprintf(stderr, "bench-suite: REGRESSION %s,%s: "
+                    "overhead %.3f, baseline %.3f\n",
+                    workloads[wi].name, modes[mi].name, overhead, base);
+                ++regressions;
+            }
+        }
+    }
+    unlink(stats_fname);
+    if (out != NULL) {
+        fclose(out);
+    }
+    if (baseline != NULL) {
+        fprintf(stderr, "bench-suite: %d regression(s) against %s\n",
+            regressions, baseline_fname);
+    }
+    return (regressions != 0);
+}
@@ -0,0 +1,204 @@
+/*
+ * Filename: src/bench/ctx-threads.c
+ * Project: errmark
+ * Brief: Several errmark_ctx, each run by a thread of its own, at once
+ *
+ * Copyright (C) 2016-2019 Guy Shaw
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Usage: ctx-threads [ <threads> [ <count> ] ]
+ *
+ * Start <threads> threads (default 4), each of which runs
+ * `./tiny-writes <count> 16 2` (default 20000) with an errmark_ctx
+ * of its own, with marks and a line prefix, and sinks that count
+ * what they get.  Timestamps, which are for the process as a whole,
+ * are on.  Check that each context got all of the data, and every
+ * line with its timestamp and prefix, and nothing else; report
+ * the time it took.  Exit status 1 if anything is wrong.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <errmark.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+FILE *errprint_fh;
+FILE *dbgprint_fh;
+bool verbose = false;
+bool debug   = false;
+const char *program_name = "ctx-threads";
+
+#define MAX_THREADS 64
+#define LINE_SIZE   16
+
+struct counts {
+    errmark_ctx_t *ctx;
+    char count_str[24];
+    size_t data;                // Bytes given to on_data
+    size_t output;              // Bytes given to on_write
+    size_t lines;               // Lines seen by on_write
+    size_t stamped;             // Of them, with a timestamp and the prefix
+    size_t other_fd;            // Bytes to fd 1
+    bool bol;
+    int status;
+};
+
+static const char prefix[] = "E| ";
+
+static double
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+static void
+on_data(errmark_ctx_t *ctx, pid_t pid, int fd, const void *buf, size_t len)
+{
+    struct counts *c = (struct counts *)ctx->arg;
+
+    (void)pid;
+    (void)fd;
+    (void)buf;
+    c->data += len;
+}
+
+/*
+ * Each line is "<[+s.mmm] E| ...............\n", the start mark
+ * coming only before the first.  Pieces never split the timestamp,
+ * the prefix, or the data of a line.
+ */
+static void
+on_write(errmark_ctx_t *ctx, pid_t pid, int fd, const void *buf, size_t len)
+{
+    struct counts *c = (struct counts *)ctx->arg;
+    const char *p, *end, *nl;
+
+    (void)pid;
+    c->output += len;
+    if (fd != 2) {
+        c->other_fd += len;
+        return;
+    }
+    p = (const char *)buf;
+    end = p + len;
+    if (p < end && *p == '<') {
+        ++p;
+    }
+    while (p < end) {
+        if (c->bol && *p == '[') {
+            nl = memchr(p, ']', end - p);
+            if (nl != NULL && (size_t)(end - nl) >= sizeof (prefix) + 1
+                && memcmp(nl + 2, prefix, sizeof (prefix) - 1) == 0) {
+                ++c->stamped;
+            }
+        }
+        nl = memchr(p, '\n', end - p);
+        if (nl == NULL) {
+            c->bol = false;
+            break;
+        }
+        ++c->lines;
+        c->bol = true;
+        p = nl + 1;
+    }
+}
+
+static void *
+run(void *arg)
+{
+    struct counts *c = (struct counts *)arg;
+    char *argv[5];
+
+    argv[0] = (char *)"./tiny-writes";
+    argv[1] = c->count_str;
+    argv[2] = (char *)"16";
+    argv[3] = (char *)"2";
+    argv[4] = NULL;
+    c->status = errmark_ctx_run(c->ctx, 4, argv);
+    return (NULL);
+}
+
+int
+main(int argc, char **argv)
+{
+    struct counts counts[MAX_THREADS];
+    pthread_t threads[MAX_THREADS];
+    unsigned long count = 20000;
+    double t0, t1;
+    int nr_threads = 4;
+    int bad;
+    int i;
+
+    if (argc > 1) {
+        nr_threads = atoi(argv[1]);
+    }
+    if (argc > 2) {
+        count = strtoul(argv[2], NULL, 0);
+    }
+    errprint_fh = stderr;
+    if (nr_threads < 1 || nr_threads > MAX_THREADS) {
+        fprintf(stderr, "ctx-threads: 1 to %d threads.\n", MAX_THREADS);
+        return (2);
+    }
+
+    stamp_set(STAMP_MONO);
+    memset(counts, 0, sizeof (counts));
+    for (i = 0; i < nr_threads; ++i) {
+        counts[i].ctx = errmark_ctx_new();
+        counts[i].bol = true;
+        snprintf(counts[i].count_str, sizeof (counts[i].count_str), "%lu", count);
+        errmark_ctx_set_mark(counts[i].ctx, 2, "<", ">");
+        errmark_ctx_set_line_prefix(counts[i].ctx, 2, prefix);
+        mark_ctx_use(counts[i].ctx->marks);
+        mark_set_timestamp(STAMP_MONO, false);
+        mark_ctx_use(NULL);
+        errmark_ctx_set_sink(counts[i].ctx, on_write, on_data, &counts[i]);
+    }
+
+    t0 = now();
+    for (i = 0; i < nr_threads; ++i) {
+        pthread_create(&threads[i], NULL, run, &counts[i]);
+    }
+    for (i = 0; i < nr_threads; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    t1 = now();
+
+    bad = 0;
+    for (i = 0; i < nr_threads; ++i) {
+        struct counts *c = &counts[i];
+        bool ok;
+
+        ok = (c->status == 0 && c->data == count * LINE_SIZE
+            && c->lines == count && c->stamped == count && c->other_fd == 0);
+        printf("context %d: data=%zu output=%zu lines=%zu stamped=%zu %s\n",
+            i, c->data, c->output, c->lines, c->stamped, ok ? "ok" : "WRONG");
+        if (!ok) {
+            ++bad;
+        }
+        errmark_ctx_free(c->ctx);
+    }
+    printf("%d contexts, %lu writes each: %.3f s\n", nr_threads, count, t1 - t0);
+    return (bad != 0);
+}
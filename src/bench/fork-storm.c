@@ -0,0 +1,70 @@
+/*
+ * Filename: src/bench/fork-storm.c
+ * Project: errmark
+ * Brief: Synthetic tracee: many short-lived child processes
+ *
+ * Copyright (C) 2016-2019 Guy Shaw
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Usage: fork-storm [ <children> [ <lines> ] ]
+ *
+ * Fork <children> processes, one after the other, each of which
+ * writes <lines> lines to stderr and exits, like the jobs
+ * of a make or of a shell script.  Defaults are 500 children,
+ * 4 lines each.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+int
+main(int argc, char **argv)
+{
+    unsigned long children = 500;
+    unsigned long lines = 4;
+    unsigned long i, j;
+    char buf[64];
+    int len;
+    pid_t pid;
+
+    if (argc > 1) {
+        children = strtoul(argv[1], NULL, 0);
+    }
+    if (argc > 2) {
+        lines = strtoul(argv[2], NULL, 0);
+    }
+    for (i = 0; i < children; ++i) {
+        pid = fork();
+        if (pid == -1) {
+            return (1);
+        }
+        if (pid == 0) {
+            for (j = 0; j < lines; ++j) {
+                len = snprintf(buf, sizeof (buf), "child %6lu line %lu\n", i, j);
+                if (write(2, buf, len) == -1) {
+                    _exit(1);
+                }
+            }
+            _exit(0);
+        }
+        waitpid(pid, NULL, 0);
+    }
+    return (0);
+}
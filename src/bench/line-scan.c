@@ -0,0 +1,141 @@
+/*
+ * Filename: src/bench/line-scan.c
+ * Project: errmark
+ * Brief: Microbenchmark of finding newlines, nl_scan vs memchr()
+ *
+ * Copyright (C) 2016-2019 Guy Shaw
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Usage: line-scan [ <line-length>... ]
+ *
+ * For each line length (default: 8, 40, 120, 4096), fill 1 MiB
+ * with lines of that length, and count the newlines in it,
+ * once with nl_scan_next(), once with one memchr() per line.
+ * Report bytes per second for each, and check that they agree.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <errmark.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define BUF_SIZE (1024 * 1024)
+#define ROUNDS   200
+
+static double
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+static size_t
+count_nl_scan(const char *buf, size_t len)
+{
+    struct nl_scan ns;
+    size_t n;
+
+    n = 0;
+    nl_scan_init(&ns, buf, len);
+    while (nl_scan_next(&ns) != NULL) {
+        ++n;
+    }
+    return (n);
+}
+
+static size_t
+count_memchr(const char *buf, size_t len)
+{
+    const char *p, *end, *nl;
+    size_t n;
+
+    n = 0;
+    p = buf;
+    end = buf + len;
+    while (p < end && (nl = memchr(p, '\n', end - p)) != NULL) {
+        ++n;
+        p = nl + 1;
+    }
+    return (n);
+}
+
+static void
+bench(const char *buf, size_t len, size_t line_len)
+{
+    volatile size_t sink;
+    size_t n_scan, n_memchr;
+    double t0, t_scan, t_memchr;
+    int i;
+
+    n_scan = count_nl_scan(buf, len);
+    n_memchr = count_memchr(buf, len);
+
+    t0 = now();
+    for (i = 0; i < ROUNDS; ++i) {
+        sink = count_nl_scan(buf, len);
+    }
+    t_scan = now() - t0;
+
+    t0 = now();
+    for (i = 0; i < ROUNDS; ++i) {
+        sink = count_memchr(buf, len);
+    }
+    t_memchr = now() - t0;
+    (void)sink;
+
+    printf("%6zu  %10.1f  %10.1f  %s\n", line_len,
+        (double)len * ROUNDS / t_scan / 1e6,
+        (double)len * ROUNDS / t_memchr / 1e6,
+        n_scan == n_memchr ? "ok" : "MISMATCH");
+}
+
+int
+main(int argc, char **argv)
+{
+    static const size_t default_lens[] = { 8, 40, 120, 4096 };
+    char *buf;
+    size_t line_len;
+    size_t i;
+    int a;
+
+    buf = malloc(BUF_SIZE);
+    if (buf == NULL) {
+        perror("malloc");
+        return (1);
+    }
+    printf("nl_scan: %s\n", nl_scan_impl());
+    printf("%6s  %10s  %10s\n", "line", "nl_scan", "memchr");
+    printf("%6s  %10s  %10s\n", "", "MB/s", "MB/s");
+    for (a = 0; a < (argc > 1 ? argc - 1 : 4); ++a) {
+        line_len = argc > 1 ? strtoul(argv[a + 1], NULL, 0)
+            : default_lens[a];
+        if (line_len == 0) {
+            line_len = 1;
+        }
+        for (i = 0; i < BUF_SIZE; ++i) {
+            buf[i] = ((i + 1) % line_len == 0) ? '\n' : 'x';
+        }
+        bench(buf, BUF_SIZE, line_len);
+    }
+    free(buf);
+    return (0);
+}
@@ -0,0 +1,201 @@
+/*
+ * Filename: src/bench/pmem-bench.c
+ * Project: errmark
+ * Brief: Microbenchmark of the ways to read memory of a traced process
+ *
+ * Copyright (C) 2016-2019 Guy Shaw
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Usage: pmem-bench [ <size>... ]
+ *
+ * For each region size (default: 64, 4096, 65536, 1048576),
+ * fork a stopped tracee holding a buffer of that size,
+ * read it back with each pmem_method, and report bytes per second.
+ *
+ * Then check that a read that runs into an unmapped page
+ * reports a partial read, for each method.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <errmark.h>
+#include <cscript.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/ptrace.h>
+#include <sys/wait.h>
+
+FILE *errprint_fh;
+FILE *dbgprint_fh;
+bool verbose = false;
+bool debug   = false;
+const char *program_name = "pmem-bench";
+
+static const char *method_names[] = {
+    "auto", "process_vm_readv", "/proc/pid/mem", "PTRACE_PEEKDATA",
+};
+
+static double
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+/*
+ * Fork a child that becomes our tracee and stops itself.
+ * The buffer at |addr| exists in the child at the same address.
+ */
+static pid_t
+start_tracee(void)
+{
+    pid_t pid;
+    int status;
+
+    pid = fork();
+    if (pid == 0) {
+        ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+        raise(SIGSTOP);
+        _exit(0);
+    }
+    waitpid(pid, &status, 0);
+    return (pid);
+}
+
+static void
+stop_tracee(pid_t pid)
+{
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+}
+
+static void
+bench_size(size_t size)
+{
+    char *rbuf;
+    char *lbuf;
+    pid_t pid;
+    int m;
+
+    rbuf = (char *)guard_malloc(size);
+    lbuf = (char *)guard_malloc(size);
+    memset(rbuf, 'x', size);
+    pid = start_tracee();
+
+    for (m = PMEM_VM_READV; m <= PMEM_PEEKDATA; ++m) {
+        double start, elapsed;
+        size_t iter, niter;
+        size_t total;
+        ssize_t rv;
+
+        pmem_set_method((enum pmem_method)m);
+        pmem_forget(0);
+        /*
+         * Aim for roughly 64 MiB worth of reads per method,
+         * but always at least a few hundred calls.
+         */
+        niter = (64 * 1024 * 1024) / size;
+        if (niter < 256) {
+            niter = 256;
+        }
+        if (m == PMEM_PEEKDATA) {
+            niter /= 8;
+        }
+        total = 0;
+        start = now();
+        for (iter = 0; iter < niter; ++iter) {
+            rv = pmem_read(lbuf, pid, rbuf, size);
+            if (rv != (ssize_t)size) {
+                fprintf(stderr, "%s: short read, %zd of %zu\n",
+                    method_names[m], rv, size);
+                break;
+            }
+            total += rv;
+        }
+        elapsed = now() - start;
+        printf("%-18s %10zu bytes  %12.1f MB/s  %10.0f reads/s\n",
+            method_names[m], size,
+            total / elapsed / 1e6, iter / elapsed);
+    }
+
+    stop_tracee(pid);
+    free(rbuf);
+    free(lbuf);
+}
+
+static void
+check_partial(void)
+{
+    long pgsz;
+    char *region;
+    char lbuf[64];
+    pid_t pid;
+    int m;
+
+    /*
+     * Two pages; the second one is unmapped.
+     * Read 32 bytes that straddle the boundary;
+     * we should get exactly the 16 bytes in the first page.
+     */
+    pgsz = sysconf(_SC_PAGESIZE);
+    region = mmap(NULL, 2 * pgsz, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    munmap(region + pgsz, pgsz);
+    pid = start_tracee();
+
+    for (m = PMEM_VM_READV; m <= PMEM_PEEKDATA; ++m) {
+        ssize_t rv;
+
+        pmem_set_method((enum pmem_method)m);
+        pmem_forget(0);
+        rv = pmem_read(lbuf, pid, region + pgsz - 16, 32);
+        printf("%-18s partial read at unmapped page: %zd bytes (%s)\n",
+            method_names[m], rv, rv == 16 ? "ok" : "WRONG");
+    }
+
+    stop_tracee(pid);
+}
+
+int
+main(int argc, char **argv)
+{
+    static const size_t default_sizes[] = { 64, 4096, 65536, 1048576 };
+    size_t i;
+
+    set_eprint_fh();
+    if (argc > 1) {
+        int argi;
+
+        for (argi = 1; argi < argc; ++argi) {
+            bench_size(strtoul(argv[argi], NULL, 0));
+        }
+    }
+    else {
+        for (i = 0; i < sizeof (default_sizes) / sizeof (default_sizes[0]); ++i) {
+            bench_size(default_sizes[i]);
+        }
+    }
+    check_partial();
+    return (0);
+}
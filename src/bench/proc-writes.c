@@ -0,0 +1,79 @@
+/*
+ * Filename: src/bench/proc-writes.c
+ * Project: errmark
+ * Brief: Synthetic tracee: several processes, all writing at once
+ *
+ * Copyright (C) 2016-2019 Guy Shaw
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Usage: proc-writes [ <processes> [ <count> [ <size> ] ] ]
+ *
+ * Fork <processes> processes, all at once, like the jobs of
+ * a parallel make, each of which writes <count> lines of <size>
+ * bytes, taking turns between stdout and stderr, one process
+ * to the one and the next to the other.  Defaults are 8 processes,
+ * 20000 lines of 40 bytes.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+int
+main(int argc, char **argv)
+{
+    unsigned long count = 20000;
+    size_t size = 40;
+    long procs = 8;
+    unsigned long i;
+    char *buf;
+    long p;
+    int fd;
+
+    if (argc > 1) {
+        procs = strtol(argv[1], NULL, 0);
+    }
+    if (argc > 2) {
+        count = strtoul(argv[2], NULL, 0);
+    }
+    if (argc > 3) {
+        size = strtoul(argv[3], NULL, 0);
+    }
+
+    for (p = 0; p < procs; ++p) {
+        if (fork() != 0) {
+            continue;
+        }
+        fd = 1 + (p & 1);
+        buf = malloc(size);
+        memset(buf, 'a' + p % 26, size);
+        if (size != 0) {
+            buf[size - 1] = '\n';
+        }
+        for (i = 0; i < count; ++i) {
+            if (write(fd, buf, size) == -1) {
+                break;
+            }
+        }
+        _exit(0);
+    }
+    while (wait(NULL) > 0) {
+        continue;
+    }
+    return (0);
+}
@@ -0,0 +1,70 @@
+/*
+ * Filename: src/bench/sendfile-cat.c
+ * Project: errmark
+ * Brief: Tracee that copies a file to stdout or stderr using sendfile()
+ *
+ * Copyright (C) 2016-2019 Guy Shaw
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Usage: sendfile-cat <file> [ <fd> [ <chunk> ] ]
+ *
+ * Copy <file> to <fd> using sendfile(), <chunk> bytes at a time,
+ * the way cat, pv and log shippers do.
+ * Defaults are fd 2, and 1 MiB at a time.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+
+int
+main(int argc, char **argv)
+{
+    size_t chunk = 1024 * 1024;
+    int fd = 2;
+    int in;
+    ssize_t rv;
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: sendfile-cat <file> [ <fd> [ <chunk> ] ]\n");
+        return (2);
+    }
+    if (argc > 2) {
+        fd = atoi(argv[2]);
+    }
+    if (argc > 3) {
+        chunk = strtoul(argv[3], NULL, 0);
+    }
+
+    in = open(argv[1], O_RDONLY);
+    if (in == -1) {
+        perror(argv[1]);
+        return (1);
+    }
+    do {
+        rv = sendfile(fd, in, NULL, chunk);
+    } while (rv > 0);
+    if (rv == -1) {
+        perror("sendfile");
+        return (1);
+    }
+    return (0);
+}
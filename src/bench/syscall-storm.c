@@ -0,0 +1,55 @@
+/*
+ * Filename: src/bench/syscall-storm.c
+ * Project: errmark
+ * Brief: Synthetic tracee: many system calls, and no output
+ *
+ * Copyright (C) 2016-2019 Guy Shaw
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Usage: syscall-storm [ <count> ]
+ *
+ * Make <count> getppid() system calls, and write nothing.
+ * Default is 200000.
+ *
+ * This is what errmark costs a program that never writes
+ * to stdout or stderr: a compiler, tar, find.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+int
+main(int argc, char **argv)
+{
+    unsigned long count = 200000;
+    unsigned long i;
+
+    if (argc > 1) {
+        count = strtoul(argv[1], NULL, 0);
+    }
+    for (i = 0; i < count; ++i) {
+        /*
+         * Not getppid(), which glibc might answer without
+         * a system call, one day.
+         */
+        syscall(SYS_getppid);
+    }
+    return (0);
+}
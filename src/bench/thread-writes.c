@@ -0,0 +1,84 @@
+/*
+ * Filename: src/bench/thread-writes.c
+ * Project: errmark
+ * Brief: Synthetic tracee: several threads writing at once
+ *
+ * Copyright (C) 2016-2019 Guy Shaw
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Usage: thread-writes [ <threads> [ <count> [ <size> ] ] ]
+ *
+ * Start <threads> threads, each of which makes <count> write() calls
+ * of <size> bytes each, to fd 2 if it is an odd-numbered thread,
+ * to fd 1 otherwise.  Defaults are 4 threads, 20000 writes, 40 bytes.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static unsigned long count = 20000;
+static size_t size = 40;
+
+static void *
+writer(void *arg)
+{
+    int fd = 1 + ((long)arg & 1);
+    char *buf;
+    unsigned long i;
+
+    buf = malloc(size);
+    memset(buf, 'a' + (long)arg % 26, size);
+    if (size != 0) {
+        buf[size - 1] = '\n';
+    }
+    for (i = 0; i < count; ++i) {
+        if (write(fd, buf, size) == -1) {
+            break;
+        }
+    }
+    free(buf);
+    return (NULL);
+}
+
+int
+main(int argc, char **argv)
+{
+    pthread_t *tids;
+    long threads = 4;
+    long i;
+
+    if (argc > 1) {
+        threads = strtol(argv[1], NULL, 0);
+    }
+    if (argc > 2) {
+        count = strtoul(argv[2], NULL, 0);
+    }
+    if (argc > 3) {
+        size = strtoul(argv[3], NULL, 0);
+    }
+
+    tids = calloc(threads, sizeof (*tids));
+    for (i = 0; i < threads; ++i) {
+        pthread_create(&tids[i], NULL, writer, (void *)i);
+    }
+    for (i = 0; i < threads; ++i) {
+        pthread_join(tids[i], NULL);
+    }
+    return (0);
+}
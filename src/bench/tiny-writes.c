@@ -0,0 +1,63 @@
+/*
+ * Filename: src/bench/tiny-writes.c
+ * Project: errmark
+ * Brief: Synthetic tracee: many small write() system calls
+ *
+ * Copyright (C) 2016-2019 Guy Shaw
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Usage: tiny-writes [ <count> [ <size> [ <fd> ] ] ]
+ *
+ * Make <count> write() calls of <size> bytes each, to <fd>.
+ * Defaults are 100000 writes of 16 bytes, to fd 2.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+int
+main(int argc, char **argv)
+{
+    unsigned long count = 100000;
+    size_t size = 16;
+    int fd = 2;
+    char *buf;
+    unsigned long i;
+
+    if (argc > 1) {
+        count = strtoul(argv[1], NULL, 0);
+    }
+    if (argc > 2) {
+        size = strtoul(argv[2], NULL, 0);
+    }
+    if (argc > 3) {
+        fd = atoi(argv[3]);
+    }
+
+    buf = malloc(size);
+    memset(buf, '.', size);
+    if (size != 0) {
+        buf[size - 1] = '\n';
+    }
+    for (i = 0; i < count; ++i) {
+        if (write(fd, buf, size) == -1) {
+            return (1);
+        }
+    }
+    return (0);
+}
@@ -0,0 +1,260 @@
+/*
+ * Filename: src/bench/write-latency.c
+ * Project: errmark
+ * Brief: How long a write() takes, as seen by the traced program
+ *
+ * Copyright (C) 2016-2019 Guy Shaw
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Usage: write-latency [ <count> [ <size> [ <drain-us> [ <engine> ] ] ] ]
+ *
+ * For each way errmark has of writing its output, writev() and
+ * io_uring, run a program under errmark that makes <count> write()
+ * calls of <size> bytes each to stdout, and times each one of them.
+ * The stdout of errmark is a pipe, emptied by a reader that takes
+ * 4096 bytes every <drain-us> microseconds, like a terminal that
+ * cannot keep up.
+ *
+ * Defaults are 20000 writes of 64 bytes, 50 microseconds,
+ * and the notify engine.
+ *
+ * Reports the latency percentiles, in microseconds, as seen
+ * by the traced program, and how long it took to run.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <errmark.h>
+#include <cscript.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+FILE *errprint_fh;
+FILE *dbgprint_fh;
+bool verbose = false;
+bool debug   = false;
+const char *program_name = "write-latency";
+
+#define RESULT_FD 3
+
+static double
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+
+    return ((x > y) - (x < y));
+}
+
+/*
+ * The traced program.  Report to RESULT_FD, which errmark
+ * does not mark.
+ */
+static int
+tracee_main(size_t count, size_t size)
+{
+    double *lat;
+    double start, t0;
+    char *buf;
+    size_t i;
+    FILE *rf;
+
+    lat = (double *)guard_malloc(count * sizeof (double));
+    buf = (char *)guard_malloc(size);
+    memset(buf, 'x', size);
+    buf[size - 1] = '\n';
+
+    start = now();
+    for (i = 0; i < count; ++i) {
+        t0 = now();
+        if (write(1, buf, size) == -1) {
+            break;
+        }
+        lat[i] = (now() - t0) * 1e6;
+    }
+    count = i;
+    t0 = now() - start;
+
+    qsort(lat, count, sizeof (double), cmp_double);
+    rf = fdopen(RESULT_FD, "w");
+    if (rf == NULL || count == 0) {
+        return (1);
+    }
+    fprintf(rf, "%10.1f %10.1f %10.1f %10.1f %10.3f\n",
+        lat[count / 2], lat[count * 99 / 100], lat[count * 999 / 1000],
+        lat[count - 1], t0);
+    fclose(rf);
+    return (0);
+}
+
+/*
+ * A slow consumer of the output of errmark.
+ *
+ * It must not be a child of ours; the ptrace engine waits
+ * for any child.  So it is a grandchild, and the pipe |done|
+ * is closed when it is gone.
+ */
+static void
+start_reader(int rfd, int wfd, int done, long drain_us)
+{
+    char buf[4096];
+    pid_t pid;
+
+    pid = fork();
+    if (pid == 0) {
+        close(wfd);
+        if (fork() != 0) {
+            _exit(0);
+        }
+        while (read(rfd, buf, sizeof (buf)) > 0) {
+            usleep(drain_us);
+        }
+        close(done);
+        _exit(0);
+    }
+    waitpid(pid, NULL, 0);
+}
+
+static void
+run(const char *label, bool use_uring, enum engine engine,
+    char **targv)
+{
+    cmd_t cmdbuf;
+    cmd_t *cmd = &cmdbuf;
+    long drain_us;
+    int pfd[2];
+    int done[2];
+    int saved;
+    char c;
+
+    printf("%-10s ", label);
+    if (use_uring && !uring_sink_open()) {
+        printf("(io_uring is not available) ");
+    }
+    fflush(stdout);
+
+    drain_us = strtol(targv[4], NULL, 0);
+    if (pipe(pfd) == -1 || pipe(done) == -1) {
+        perror("pipe");
+        exit(2);
+    }
+    start_reader(pfd[0], pfd[1], done[1], drain_us);
+    close(pfd[0]);
+    close(done[1]);
+    saved = dup(1);
+    dup2(pfd[1], 1);
+    close(pfd[1]);
+
+    memset(cmd, 0, sizeof (*cmd));
+    cmd->cmd_path = "/proc/self/exe";
+    cmd->cmd_name = "write-latency";
+    cmd->argv = targv;
+    cmd->argc = 5;
+    cmd->engine = engine;
+    cmd->emulate = true;
+    cmd->nullify = true;
+    cmd->syscall_info = true;
+
+    errmark_run_program(cmd);
+    uring_sink_close(false);
+
+    dup2(saved, 1);
+    close(saved);
+    while (read(done[0], &c, 1) > 0) {
+        continue;
+    }
+    close(done[0]);
+}
+
+int
+main(int argc, char **argv)
+{
+    char count_str[32], size_str[32], drain_str[32];
+    char *targv[6];
+    size_t count = 20000;
+    size_t size = 64;
+    long drain_us = 50;
+    enum engine engine = ENGINE_NOTIFY;
+
+    set_eprint_fh();
+    if (argc > 1 && strcmp(argv[1], "--tracee") == 0) {
+        return (tracee_main(strtoul(argv[2], NULL, 0),
+                            strtoul(argv[3], NULL, 0)));
+    }
+
+    if (argc > 1) {
+        count = strtoul(argv[1], NULL, 0);
+    }
+    if (argc > 2) {
+        size = strtoul(argv[2], NULL, 0);
+    }
+    if (argc > 3) {
+        drain_us = strtol(argv[3], NULL, 0);
+    }
+    if (argc > 4) {
+        if (strcmp(argv[4], "ptrace") == 0) {
+            engine = ENGINE_PTRACE;
+        }
+        else if (strcmp(argv[4], "seccomp") == 0) {
+            engine = ENGINE_SECCOMP;
+        }
+    }
+    if (count == 0 || size == 0) {
+        fprintf(stderr, "Usage: write-latency [ <count> [ <size> [ <drain-us> [ <engine> ] ] ] ]\n");
+        return (2);
+    }
+
+    snprintf(count_str, sizeof (count_str), "%zu", count);
+    snprintf(size_str, sizeof (size_str), "%zu", size);
+    snprintf(drain_str, sizeof (drain_str), "%ld", drain_us);
+    targv[0] = "write-latency";
+    targv[1] = "--tracee";
+    targv[2] = count_str;
+    targv[3] = size_str;
+    targv[4] = drain_str;
+    targv[5] = NULL;
+
+    /*
+     * The traced program reports to what is our stdout.
+     */
+    fflush(stdout);
+    dup2(1, RESULT_FD);
+    setmark(1, "<", ">");
+
+    printf("%zu writes of %zu bytes; reader takes 4096 bytes every %ld us\n",
+        count, size, drain_us);
+    printf("%-10s %10s %10s %10s %10s %10s\n",
+        "output", "p50 us", "p99 us", "p99.9 us", "max us", "total s");
+    fflush(stdout);
+    run("writev", false, engine, targv);
+    run("io_uring", true, engine, targv);
+    return (0);
+}
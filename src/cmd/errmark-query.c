@@ -0,0 +1,627 @@
+/*
+ * Filename: src/cmd/errmark-query.c
+ * Project: errmark
+ * Brief: Look up output in a file made by errmark --record
+ *
+ * Copyright (C) 2016-2019 Guy Shaw
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <stdlib.h>         // Import exit(), strtol()
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>         // Import uint64_t
+#include <getopt.h>
+#include <ctype.h>          // Import isprint(), isdigit()
+#include <string.h>         // Import strcmp(), memcmp()
+#include <time.h>           // Import mktime(), localtime_r(), strftime()
+#include <fcntl.h>          // Import open()
+#include <unistd.h>         // Import close()
+#include <sys/mman.h>       // Import mmap()
+#include <sys/stat.h>       // Import fstat()
+
+#include <errmark.h>
+#include <cscript.h>
+
+FILE *errprint_fh;
+FILE *dbgprint_fh;
+
+const char *program_path;
+const char *program_name;
+
+bool verbose = false;
+bool debug   = false;
+
+enum opt {
+    OPT_BASE = 0xf000,
+    OPT_FROM,
+    OPT_TO,
+    OPT_AROUND,
+    OPT_SPAN,
+    OPT_FD,
+    OPT_PID,
+    OPT_RAW,
+    OPT_LIST,
+    OPT_INFO,
+};
+
+static struct option long_options[] = {
+    {"help",     no_argument,       0,  'h'},
+    {"version",  no_argument,       0,  'V'},
+    {"verbose",  no_argument,       0,  'v'},
+    {"debug",    no_argument,       0,  'd'},
+    {"from",     required_argument, 0,  OPT_FROM},
+    {"to",       required_argument, 0,  OPT_TO},
+    {"around",   required_argument, 0,  OPT_AROUND},
+    {"span",     required_argument, 0,  OPT_SPAN},
+    {"fd",       required_argument, 0,  OPT_FD},
+    {"pid",      required_argument, 0,  OPT_PID},
+    {"raw",      no_argument,       0,  OPT_RAW},
+    {"list",     no_argument,       0,  OPT_LIST},
+    {"info",     no_argument,       0,  OPT_INFO},
+    {0, 0, 0, 0 }
+};
+
+static const char usage_text[] =
+    "Options:\n"
+    "  --help|-h|-?     Show this help message and exit\n"
+    "  --version        Show version information and exit\n"
+    "  --verbose|-v     verbose\n"
+    "  --debug|-d       debug\n"
+    "  --from           <time>\n"
+    "  --to             <time>\n"
+    "      Only output written from / up to <time>, which is one of\n"
+    "        [YYYY-MM-DD[T]]HH:MM[:SS[.frac]]   local time; the date\n"
+    "                                           defaults to that of\n"
+    "                                           the recording\n"
+    "        @<seconds>                         since the epoch\n"
+    "        +<seconds>                         since recording started\n"
+    "  --around         <time>\n"
+    "      Only output written within --span seconds of <time>.\n"
+    "  --span           <seconds>\n"
+    "      Default is 5.\n"
+    "  --fd             1|2\n"
+    "  --pid            <pid>\n"
+    "      Only output written to that fd, or by that process.\n"
+    "  --raw\n"
+    "      Do not put the marks back in.\n"
+    "  --list\n"
+    "      One line per write: time, pid, fd and length.\n"
+    "  --info\n"
+    "      Show what is in the file header.\n";
+
+static const char version_text[] =
+    "0.1\n"
+    ;
+
+static const char copyright_text[] =
+    "Copyright (C) 2016-2019 Guy Shaw\n"
+    ;
+
+static const char license_text[] =
+    "License GPLv3+: GNU GPL version 3 or later"
+    " <http://gnu.org/licenses/gpl.html>.\n"
+    "This is free software: you are free to change and redistribute it.\n"
+    "There is NO WARRANTY, to the extent permitted by law.\n"
+    ;
+
+/*
+ * What to show.
+ */
+static const char *from_str = NULL;
+static const char *to_str = NULL;
+static const char *around_str = NULL;
+static double span_sec = 5.0;
+static int   sel_fd = -1;
+static long  sel_pid = -1;
+static bool  opt_raw = false;
+static bool  opt_list = false;
+static bool  opt_info = false;
+
+/*
+ * The recording, mapped.
+ */
+static const char *rec_base;
+static size_t rec_size;
+static const struct rec_file_header *rec_hdr;
+static uint64_t data_start;
+static uint64_t data_end;
+static const struct rec_index_entry *rec_index;
+static size_t index_count;
+
+static const char *marks_start[3] = { "", "", "" };
+static const char *marks_end[3]   = { "", "", "" };
+
+static void
+fshow_program_version(FILE *f)
+{
+    fputs(version_text, f);
+    fputc('\n', f);
+    fputs(copyright_text, f);
+    fputc('\n', f);
+    fputs(license_text, f);
+    fputc('\n', f);
+}
+
+static void
+show_program_version(void)
+{
+    fshow_program_version(stdout);
+}
+
+static void
+usage(void)
+{
+    eprintf("usage: %s [ <options> ] <record-file>\n", program_name);
+    eprint(usage_text);
+}
+
+static inline bool
+is_long_option(const char *s)
+{
+    return (s[0] == '-' && s[1] == '-');
+}
+
+static inline char *
+vischar_r(char *buf, size_t sz, int c)
+{
+    if (isprint(c)) {
+        buf[0] = c;
+        buf[1] = '\0';
+    }
+    else {
+        snprintf(buf, sz, "\\x%02x", c);
+    }
+    return (buf);
+}
+
+/*
+ * Map |fname|, and check that it is a recording.
+ */
+static void
+open_recording(const char *fname)
+{
+    struct stat st;
+    int fd;
+
+    fd = open(fname, O_RDONLY);
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        eprintf("%s: Cannot open '%s'.\n", program_name, fname);
+        exit(2);
+    }
+    rec_size = (size_t)st.st_size;
+    if (rec_size < sizeof (struct rec_file_header)) {
+        eprintf("%s: '%s' is not an errmark recording.\n", program_name, fname);
+        exit(2);
+    }
+    rec_base = mmap(NULL, rec_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (rec_base == MAP_FAILED) {
+        eprintf("%s: Cannot map '%s'.\n", program_name, fname);
+        exit(2);
+    }
+    rec_hdr = (const struct rec_file_header *)rec_base;
+    if (memcmp(rec_hdr->magic, REC_MAGIC, sizeof (rec_hdr->magic)) != 0
+        || rec_hdr->version != REC_VERSION) {
+        eprintf("%s: '%s' is not an errmark recording.\n", program_name, fname);
+        exit(2);
+    }
+
+    data_start = rec_hdr->header_size;
+    data_end = rec_hdr->data_end;
+    if (data_end > rec_size) {
+        data_end = rec_size;
+    }
+    rec_index = NULL;
+    index_count = 0;
+    if (rec_hdr->index_off != 0
+        && rec_hdr->index_off + rec_hdr->index_count * sizeof (*rec_index) <= rec_size) {
+        rec_index = (const struct rec_index_entry *)(rec_base + rec_hdr->index_off);
+        index_count = rec_hdr->index_count;
+    }
+}
+
+/*
+ * The record at |off|, or NULL if there is none, or it is damaged.
+ */
+static inline const struct rec_header *
+rec_at(uint64_t off)
+{
+    const struct rec_header *rh;
+
+    if (off + sizeof (*rh) > data_end) {
+        return (NULL);
+    }
+    rh = (const struct rec_header *)(rec_base + off);
+    if (!(rh->flags & REC_F_NO_DATA)
+        && off + sizeof (*rh) + rh->len > data_end) {
+        return (NULL);
+    }
+    return (rh);
+}
+
+static inline uint64_t
+rec_next(uint64_t off, const struct rec_header *rh)
+{
+    size_t dlen;
+
+    dlen = (rh->flags & REC_F_NO_DATA) ? 0 : rh->len;
+    return (off + sizeof (*rh) + REC_ALIGN(dlen));
+}
+
+/*
+ * Pick up the marks, from the records at the start.
+ */
+static void
+read_marks(void)
+{
+    const struct rec_header *rh;
+    uint64_t off;
+
+    off = data_start;
+    while ((rh = rec_at(off)) != NULL && (rh->flags & REC_F_MARKS)) {
+        const char *p = (const char *)(rh + 1);
+
+        if (rh->fd == 1 || rh->fd == 2) {
+            marks_start[rh->fd] = p;
+            marks_end[rh->fd] = p + strlen(p) + 1;
+        }
+        off = rec_next(off, rh);
+    }
+}
+
+static uint64_t
+wall_ns(uint64_t t_ns)
+{
+    return (rec_hdr->real0_ns + (t_ns - rec_hdr->mono0_ns));
+}
+
+static uint64_t
+mono_ns(uint64_t wall)
+{
+    return (rec_hdr->mono0_ns + (wall - rec_hdr->real0_ns));
+}
+
+/*
+ * Parse a time, as described in usage_text, to CLOCK_MONOTONIC
+ * nanoseconds of the recording.
+ */
+static uint64_t
+parse_time(const char *str)
+{
+    struct tm tm;
+    time_t start, t;
+    double frac;
+    char *end;
+    int n;
+
+    if (str[0] == '+' || str[0] == '@') {
+        double sec = strtod(str + 1, &end);
+
+        if (end == str + 1 || *end != '\0' || sec < 0) {
+            goto bad;
+        }
+        if (str[0] == '+') {
+            return (rec_hdr->mono0_ns + (uint64_t)(sec * 1e9));
+        }
+        return (mono_ns((uint64_t)(sec * 1e9)));
+    }
+
+    start = (time_t)(rec_hdr->real0_ns / 1000000000);
+    localtime_r(&start, &tm);
+    n = 0;
+    if (isdigit((unsigned char)str[0]) && str[4] == '-') {
+        if (sscanf(str, "%d-%d-%d%n", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &n) != 3) {
+            goto bad;
+        }
+        tm.tm_year -= 1900;
+        tm.tm_mon -= 1;
+        str += n;
+        if (*str == 'T' || *str == ' ') {
+            ++str;
+        }
+    }
+    tm.tm_sec = 0;
+    n = 0;
+    if (sscanf(str, "%d:%d%n", &tm.tm_hour, &tm.tm_min, &n) != 2) {
+        goto bad;
+    }
+    str += n;
+    frac = 0.0;
+    if (*str == ':') {
+        double sec = strtod(str + 1, &end);
+
+        if (end == str + 1) {
+            goto bad;
+        }
+        tm.tm_sec = (int)sec;
+        frac = sec - tm.tm_sec;
+        str = end;
+    }
+    if (*str != '\0') {
+        goto bad;
+    }
+    tm.tm_isdst = -1;
+    t = mktime(&tm);
+    if (t == (time_t)-1) {
+        goto bad;
+    }
+    return (mono_ns((uint64_t)t * 1000000000 + (uint64_t)(frac * 1e9)));
+
+bad:
+    eprintf("%s: Invalid time, '%s'.\n", program_name, str);
+    exit(2);
+}
+
+/*
+ * Offset of the first record that could have been written at or
+ * after |t_ns|: binary search of the index, for the last entry
+ * that is strictly earlier.  Without an index, the start of the data.
+ */
+static uint64_t
+seek_time(uint64_t t_ns)
+{
+    size_t lo, hi;
+
+    if (index_count == 0 || rec_index[0].t_ns >= t_ns) {
+        return (data_start);
+    }
+    lo = 0;
+    hi = index_count;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (rec_index[mid].t_ns < t_ns) {
+            lo = mid;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    return (rec_index[lo].off);
+}
+
+static void
+show_info(void)
+{
+    char tbuf[64];
+    struct tm tm;
+    time_t t;
+
+    t = (time_t)(rec_hdr->real0_ns / 1000000000);
+    localtime_r(&t, &tm);
+    strftime(tbuf, sizeof (tbuf), "%Y-%m-%d %H:%M:%S", &tm);
+    printf("started   %s\n", tbuf);
+    printf("data      %llu bytes\n", (unsigned long long)(data_end - data_start));
+    printf("index     %zu entries%s\n", index_count,
+        rec_hdr->index_off == 0 ? " (recording not finished)" : "");
+    printf("marks     fd 1 [");
+    fshow_str(stdout, marks_start[1]);
+    printf("] [");
+    fshow_str(stdout, marks_end[1]);
+    printf("]\n          fd 2 [");
+    fshow_str(stdout, marks_start[2]);
+    printf("] [");
+    fshow_str(stdout, marks_end[2]);
+    printf("]\n");
+}
+
+static void
+list_record(const struct rec_header *rh)
+{
+    char tbuf[64];
+    struct tm tm;
+    uint64_t w;
+    time_t t;
+
+    w = wall_ns(rh->t_ns);
+    t = (time_t)(w / 1000000000);
+    localtime_r(&t, &tm);
+    strftime(tbuf, sizeof (tbuf), "%Y-%m-%d %H:%M:%S", &tm);
+    printf("%s.%06u %7d %2d %8u%s\n", tbuf,
+        (unsigned int)((w % 1000000000) / 1000),
+        rh->pid, rh->fd, rh->len,
+        (rh->flags & REC_F_NO_DATA) ? " (not captured)" : "");
+}
+
+static int
+query(void)
+{
+    const struct rec_header *rh;
+    uint64_t from_ns, to_ns;
+    uint64_t off;
+    unsigned long nr_scanned, nr_shown;
+    struct timespec t0, t1;
+    int cur_fd;
+
+    from_ns = 0;
+    to_ns = UINT64_MAX;
+    if (around_str != NULL) {
+        uint64_t at = parse_time(around_str);
+        uint64_t span = (uint64_t)(span_sec * 1e9);
+
+        from_ns = (at > span) ? at - span : 0;
+        to_ns = at + span;
+    }
+    if (from_str != NULL) {
+        from_ns = parse_time(from_str);
+    }
+    if (to_str != NULL) {
+        to_ns = parse_time(to_str);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    off = seek_time(from_ns);
+    nr_scanned = 0;
+    nr_shown = 0;
+    cur_fd = -1;
+    while ((rh = rec_at(off)) != NULL) {
+        ++nr_scanned;
+        if (rh->t_ns > to_ns) {
+            break;
+        }
+        if ((rh->flags & REC_F_MARKS)
+            || rh->t_ns < from_ns
+            || (sel_fd >= 0 && rh->fd != sel_fd)
+            || (sel_pid >= 0 && rh->pid != sel_pid)) {
+            off = rec_next(off, rh);
+            continue;
+        }
+
+        ++nr_shown;
+        if (opt_list) {
+            list_record(rh);
+        }
+        else if (!(rh->flags & REC_F_NO_DATA)) {
+            if (!opt_raw && rh->fd != cur_fd && (rh->fd == 1 || rh->fd == 2)) {
+                if (cur_fd == 1 || cur_fd == 2) {
+                    fputs(marks_end[cur_fd], stdout);
+                }
+                fputs(marks_start[rh->fd], stdout);
+                cur_fd = rh->fd;
+            }
+            fwrite(rh + 1, rh->len, 1, stdout);
+        }
+        off = rec_next(off, rh);
+    }
+    if (!opt_raw && (cur_fd == 1 || cur_fd == 2)) {
+        fputs(marks_end[cur_fd], stdout);
+    }
+    fflush(stdout);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    if (verbose) {
+        eprintf("scanned=%lu shown=%lu index=%zu time=%.3f ms\n",
+            nr_scanned, nr_shown, index_count,
+            (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6);
+    }
+    return (0);
+}
+
+int
+main(int argc, char * const *argv)
+{
+    extern char *optarg;
+    extern int optind, opterr, optopt;
+    int option_index;
+    int err_count;
+    int optc;
+
+    set_eprint_fh();
+    program_path = *argv;
+    program_name = sname(program_path);
+    option_index = 0;
+    err_count = 0;
+    opterr = 0;
+
+    while (true) {
+        int this_option_optind;
+
+        if (err_count > 10) {
+            eprintf("%s: Too many option errors.\n", program_name);
+            break;
+        }
+
+        this_option_optind = optind ? optind : 1;
+        optc = getopt_long(argc, argv, "+hVdv", long_options, &option_index);
+
+        if (optc == -1) {
+            break;
+        }
+
+        if (optc == '?' && optopt == '?') {
+            optc = 'h';
+        }
+
+        switch (optc) {
+        case 'V':
+            show_program_version();
+            exit(0);
+            break;
+        case 'h':
+            fputs(usage_text, stdout);
+            exit(0);
+            break;
+        case 'd':
+            debug = true;
+            break;
+        case 'v':
+            verbose = true;
+            break;
+        case OPT_FROM:
+            from_str = optarg;
+            break;
+        case OPT_TO:
+            to_str = optarg;
+            break;
+        case OPT_AROUND:
+            around_str = optarg;
+            break;
+        case OPT_SPAN:
+            span_sec = strtod(optarg, NULL);
+            break;
+        case OPT_FD:
+            sel_fd = atoi(optarg);
+            break;
+        case OPT_PID:
+            sel_pid = strtol(optarg, NULL, 10);
+            break;
+        case OPT_RAW:
+            opt_raw = true;
+            break;
+        case OPT_LIST:
+            opt_list = true;
+            break;
+        case OPT_INFO:
+            opt_info = true;
+            break;
+        case '?':
+            eprint(program_name);
+            eprint(": ");
+            if (is_long_option(argv[this_option_optind])) {
+                eprintf("unknown long option, '%s'\n",
+                    argv[this_option_optind]);
+            }
+            else {
+                char chrbuf[10];
+                eprintf("unknown short option, '%s'\n",
+                    vischar_r(chrbuf, sizeof (chrbuf), optopt));
+            }
+            ++err_count;
+            break;
+        default:
+            eprintf("%s: INTERNAL ERROR: unknown option, '%c'\n",
+                program_name, optopt);
+            exit(2);
+            break;
+        }
+    }
+
+    if (err_count != 0 || optind != argc - 1) {
+        usage();
+        exit(1);
+    }
+
+    verbose = verbose || debug;
+    open_recording(argv[optind]);
+    read_marks();
+    if (opt_info) {
+        show_info();
+        exit(0);
+    }
+    exit(query());
+}
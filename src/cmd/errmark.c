@@ -4,7 +4,13 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <getopt.h>
-#include <ctype.h>          // Import isprint()
+#include <ctype.h>          // Import isprint(), tolower()
+#include <string.h>         // Import strcmp(), strncmp(), strchr(), strcspn(), strtok_r()
+#include <unistd.h>         // Import sysconf(), write()
+#include <fcntl.h>          // Import open()
+#include <errno.h>          // Import errno
+#include <sys/stat.h>       // Import fstat()
+#include <sys/time.h>       // Import timeradd()
 
 #include <errmark.h>
 #include <cscript.h>
@@ -12,9 +18,42 @@
 FILE *errprint_fh;
 FILE *dbgprint_fh;
 
-static cmd_t cmdbuf;
+static cmd_t cmdbuf = {
+    .emulate = true,
+    .syscall_info = true,
+    .copy_ring_size = 1024 * 1024,
+    .copy_compress = -1,
+    .copy_rotate = { .keep = 8 },
+};
 static cmd_t *cmd = &cmdbuf;
 
+/*
+ * Where the --copy-* options say to copy to.
+ */
+struct copy_spec {
+    const char *fname;
+    unsigned int fds;
+    bool tagged;
+    bool per_cmd;       // With --batch, one for each command; has {#}
+};
+
+static struct copy_spec *copy_specs = NULL;
+static size_t nr_copy_specs = 0;
+
+/*
+ * --highlight: the rules file, if any, and which fds.
+ */
+static const char *highlight_fname = NULL;
+static bool highlight_fd[3] = { false, false, false };
+
+/*
+ * --batch: where the command lines come from, and how many
+ * of the commands to run at once.
+ */
+static bool batch = false;
+static const char *batch_fname = NULL;
+static int nr_jobs = 0;
+
 const char *program_path;
 const char *program_name;
 
@@ -26,6 +65,29 @@ enum opt {
     OPT_COLOR,
     OPT_MARK,
     OPT_COPY,
+    OPT_ENGINE,
+    OPT_NO_EMULATE,
+    OPT_NO_SYSCALL_INFO,
+    OPT_COALESCE,
+    OPT_COPY_STDOUT,
+    OPT_COPY_STDERR,
+    OPT_COPY_COMBINED,
+    OPT_COPY_RING,
+    OPT_COPY_OVERFLOW,
+    OPT_COPY_COMPRESS,
+    OPT_COPY_ROTATE,
+    OPT_IO_URING,
+    OPT_RECORD,
+    OPT_LINE_PREFIX,
+    OPT_HIGHLIGHT,
+    OPT_HIGHLIGHT_STDOUT,
+    OPT_TIMESTAMP,
+    OPT_STATS,
+    OPT_STATS_FORMAT,
+    OPT_PID,
+    OPT_DURATION,
+    OPT_BATCH,
+    OPT_JOBS,
 };
 
 static struct option long_options[] = {
@@ -36,6 +98,29 @@ static struct option long_options[] = {
     {"mark",     required_argument, 0,  OPT_MARK},
     {"color",    required_argument, 0,  OPT_COLOR},
     {"copy",     required_argument, 0,  OPT_COPY},
+    {"engine",   required_argument, 0,  OPT_ENGINE},
+    {"no-emulate", no_argument,     0,  OPT_NO_EMULATE},
+    {"no-syscall-info", no_argument, 0, OPT_NO_SYSCALL_INFO},
+    {"coalesce", optional_argument, 0,  OPT_COALESCE},
+    {"copy-stdout", required_argument, 0, OPT_COPY_STDOUT},
+    {"copy-stderr", required_argument, 0, OPT_COPY_STDERR},
+    {"copy-combined", required_argument, 0, OPT_COPY_COMBINED},
+    {"copy-ring", required_argument, 0, OPT_COPY_RING},
+    {"copy-overflow", required_argument, 0, OPT_COPY_OVERFLOW},
+    {"copy-compress", required_argument, 0, OPT_COPY_COMPRESS},
+    {"copy-rotate", required_argument, 0, OPT_COPY_ROTATE},
+    {"io-uring", no_argument,       0,  OPT_IO_URING},
+    {"record",   required_argument, 0,  OPT_RECORD},
+    {"line-prefix", optional_argument, 0, OPT_LINE_PREFIX},
+    {"highlight", optional_argument, 0, OPT_HIGHLIGHT},
+    {"highlight-stdout", no_argument, 0, OPT_HIGHLIGHT_STDOUT},
+    {"timestamp", optional_argument, 0, OPT_TIMESTAMP},
+    {"stats",    optional_argument, 0,  OPT_STATS},
+    {"stats-format", required_argument, 0, OPT_STATS_FORMAT},
+    {"pid",      required_argument, 0,  OPT_PID},
+    {"duration", required_argument, 0,  OPT_DURATION},
+    {"batch",    optional_argument, 0,  OPT_BATCH},
+    {"jobs",     required_argument, 0,  OPT_JOBS},
     {0, 0, 0, 0 }
 };
 
@@ -48,7 +133,113 @@ static const char usage_text[] =
     "  --mark|-m        <mark-specification>\n"
     "      Where mark-specification = fd:start:end.\n"
     "  --color          <color-name>\n"
-    "  -c|copy          <filename>\n";
+    "  -c|copy          <filename>\n"
+    "  --copy-stderr    <filename>\n"
+    "      Also copy stderr to <filename>.  Copies are written\n"
+    "      by a thread of its own, so that a slow disk\n"
+    "      does not hold up the program.\n"
+    "  --copy-stdout    <filename>\n"
+    "      Also copy stdout to <filename>.\n"
+    "  --copy-combined  <filename>\n"
+    "      Copy both to <filename>, each line tagged\n"
+    "      with '1> ' or '2> '.\n"
+    "      Any of them can be given more than once;\n"
+    "      /dev/fd/<n> copies to an open file descriptor.\n"
+    "  --copy-ring      <size>[k|m]\n"
+    "      Size of the buffer between errmark and that thread.\n"
+    "      Default is 1m.\n"
+    "  --copy-overflow  block|drop\n"
+    "      When that buffer is full, wait for room (the default),\n"
+    "      or leave the write out of the copy.  A write bigger\n"
+    "      than the buffer goes in as far as there is room, and\n"
+    "      only the rest is left out.  With --verbose,\n"
+    "      or if anything was dropped, the counts are reported.\n"
+    "  --copy-compress  zlib[:<level>]\n"
+    "      Write the copy gzip-compressed, from that same thread.\n"
+    "      It is flushed every 256k of input, and after a second\n"
+    "      without any, so that a run that is killed still leaves\n"
+    "      a copy that zcat can read, up to that point.\n"
+    "      Level is 0-9; default is 6.\n"
+    "  --copy-rotate    size=<n>[k|m|g],time=<n>[s|m|h|d],keep=<n>,fsync=<n>[s|m|h]\n"
+    "      Start a new copy file when it gets to <size>, or <time> old,\n"
+    "      whichever comes first; the old one is renamed <filename>.1,\n"
+    "      and so on, up to <keep> of them (default 8).\n"
+    "      Copy files are preallocated.  With fsync, the copy is\n"
+    "      flushed to disk that often, and when a file is done.\n"
+    "      All of it is done by the thread that writes the copy.\n"
+    "  --engine         ptrace|seccomp|notify\n"
+    "      How to intercept writes.  'ptrace' stops the program\n"
+    "      at every system call; 'seccomp' stops it only\n"
+    "      at writes to stdout or stderr; 'notify' gets those\n"
+    "      writes handed over by the kernel, without using ptrace.\n"
+    "      Default is ptrace.\n"
+    "  --no-emulate\n"
+    "      Let the kernel perform each (nullified) write(),\n"
+    "      instead of cancelling it at entry.\n"
+    "      Costs one more stop of the program per write().\n"
+    "  --no-syscall-info\n"
+    "      Fetch all registers with PTRACE_GETREGS at each system call,\n"
+    "      instead of using PTRACE_GET_SYSCALL_INFO.  For comparison;\n"
+    "      with --verbose, the number of ptrace() calls is reported.\n"
+    "  --coalesce[=<ms>]\n"
+    "      Collect consecutive output to the same fd, with its marks,\n"
+    "      and write it out in one go, at most <ms> milliseconds\n"
+    "      later (default 5).  Output is written out sooner on\n"
+    "      a switch between stdout and stderr, and whenever\n"
+    "      the program reads from stdin.\n"
+    "  --io-uring\n"
+    "      Queue output to stdout and stderr using io_uring,\n"
+    "      so that the program need not wait for it to be written.\n"
+    "      Falls back to writev(), if io_uring is not available.\n"
+    "  --record         <filename>\n"
+    "      Record all output to stdout and stderr, with the time,\n"
+    "      the writer and the fd of each write, to be looked at\n"
+    "      later with errmark-query.\n"
+    "  --line-prefix[=<fd>:<prefix>]\n"
+    "      Start every line written to <fd> with <prefix>,\n"
+    "      after the start mark.  A line that a process writes\n"
+    "      in pieces gets one prefix.  Default is '2:E| '.\n"
+    "  --highlight[=<rules-file>]\n"
+    "      Color each line of stderr by what is in it.  Each line\n"
+    "      of <rules-file> is '<color> <literal>'; a line that\n"
+    "      contains <literal> is shown in <color>.  Without a file,\n"
+    "      'error:', 'Error:' and 'ERROR' are bright-red, and\n"
+    "      'warning:', 'Warning:' and 'WARNING' are yellow.\n"
+    "  --highlight-stdout\n"
+    "      Color the lines of stdout, as well.\n"
+    "  --timestamp[=wall|mono|delta][,write]\n"
+    "      Start each line of output with the time of day (wall,\n"
+    "      the default), the time since the start (mono), or the\n"
+    "      time since the output before (delta), to the millisecond.\n"
+    "      With ',write', each write, instead of each line.\n"
+    "  --stats[=<filename>]\n"
+    "      At exit, report what errmark cost the program: stops,\n"
+    "      by kind and by system call number, writes and bytes\n"
+    "      per fd, the time the program was stopped, and what for,\n"
+    "      a histogram of that time per write, and the rusage\n"
+    "      of the program and of errmark.  Default is stderr.\n"
+    "  --stats-format   text|json\n"
+    "  --pid            <pid>\n"
+    "      Instead of running a program, attach to process <pid>,\n"
+    "      which is already running, and mark its output to stdout\n"
+    "      and stderr, wherever they go, until it exits or errmark\n"
+    "      gets SIGINT, SIGTERM or SIGHUP.  Then detach, and leave\n"
+    "      it to run as before.  Uses the ptrace engine.\n"
+    "  --duration       <seconds>\n"
+    "      With --pid, detach after <seconds>.\n"
+    "  --batch[=<file>]\n"
+    "      Instead of running a program, run each line of <file>\n"
+    "      (default stdin) as a command, with /bin/sh, several\n"
+    "      at once, all traced by errmark.  The output of each,\n"
+    "      marked, is held back until it is done, and then written\n"
+    "      out all together.  A --copy file name with {#} in it\n"
+    "      is one for each command, {#} being its line number;\n"
+    "      --copy-compress and --copy-rotate are not for those.\n"
+    "      The exit status is the number of commands that failed,\n"
+    "      up to 101.  For the ptrace and seccomp engines.\n"
+    "  --jobs           <n>\n"
+    "      With --batch, run <n> commands at once.  Default is\n"
+    "      the number of CPUs.\n";
 
 
 static const char version_text[] =
@@ -124,6 +315,18 @@ opt_mark(char *mark_specs)
     if (!mark_ok) {
         exit(2);
     }
+    if (debug) {
+        const char *m_start, *m_end;
+        int fd = mark_specs[0] - '0';
+
+        getmark(fd, &m_start, &m_end);
+        fprintf(stderr, "start%d=[", fd);
+        fshow_str(stderr, m_start);
+        fprintf(stderr, "]\n");
+        fprintf(stderr, "end%d  =[", fd);
+        fshow_str(stderr, m_end);
+        fprintf(stderr, "]\n");
+    }
 }
 
 void
@@ -164,6 +367,611 @@ opt_color(char const *color_name)
     }
 }
 
+void
+opt_engine(char const *engine_name)
+{
+    if (strcmp(engine_name, "ptrace") == 0) {
+        cmd->engine = ENGINE_PTRACE;
+    }
+    else if (strcmp(engine_name, "seccomp") == 0) {
+        cmd->engine = ENGINE_SECCOMP;
+    }
+    else if (strcmp(engine_name, "notify") == 0) {
+        cmd->engine = ENGINE_NOTIFY;
+    }
+    else {
+        fprintf(stderr, "Unknown engine, '%s'.\n", engine_name);
+        fputs("Known engines are: ptrace seccomp notify\n", stderr);
+        exit(2);
+    }
+}
+
+void
+opt_copy(char const *fname, unsigned int fds, bool tagged)
+{
+    struct copy_spec *c;
+
+    copy_specs = (struct copy_spec *)
+        guard_realloc(copy_specs, (nr_copy_specs + 1) * sizeof (*copy_specs));
+    c = &copy_specs[nr_copy_specs++];
+    c->fname = fname;
+    c->fds = fds;
+    c->tagged = tagged;
+    c->per_cmd = (strstr(fname, "{#}") != NULL);
+}
+
+void
+opt_copy_ring(char const *size_str)
+{
+    char *end;
+    unsigned long size;
+
+    size = strtoul(size_str, &end, 10);
+    if (*end == 'k' || *end == 'K') {
+        size *= 1024;
+        ++end;
+    }
+    else if (*end == 'm' || *end == 'M') {
+        size *= 1024 * 1024;
+        ++end;
+    }
+    if (end == size_str || *end != '\0' || size == 0
+        || size > 1024UL * 1024 * 1024) {
+        eprintf("%s: Invalid size for --copy-ring, '%s'.\n",
+            program_name, size_str);
+        exit(2);
+    }
+    cmd->copy_ring_size = size;
+}
+
+void
+opt_copy_overflow(char const *policy)
+{
+    if (strcmp(policy, "block") == 0) {
+        cmd->copy_overflow = COPY_OVERFLOW_BLOCK;
+    }
+    else if (strcmp(policy, "drop") == 0) {
+        cmd->copy_overflow = COPY_OVERFLOW_DROP;
+    }
+    else {
+        fprintf(stderr, "Unknown overflow policy, '%s'.\n", policy);
+        fputs("Known policies are: block drop\n", stderr);
+        exit(2);
+    }
+}
+
+void
+opt_copy_compress(char const *spec)
+{
+    char *end;
+    long level;
+
+    if (strncmp(spec, "zlib", 4) != 0 || (spec[4] != '\0' && spec[4] != ':')) {
+        fprintf(stderr, "Unknown compression, '%s'.\n", spec);
+        fputs("Known compression is: zlib[:<level>]\n", stderr);
+        exit(2);
+    }
+    level = 6;
+    if (spec[4] == ':') {
+        level = strtol(spec + 5, &end, 10);
+        if (end == spec + 5 || *end != '\0' || level < 0 || level > 9) {
+            eprintf("%s: Invalid level for --copy-compress, '%s'.\n",
+                program_name, spec + 5);
+            exit(2);
+        }
+    }
+    cmd->copy_compress = (int)level;
+}
+
+/*
+ * A number, with an optional unit suffix, from |units|,
+ * each with its multiplier, in |mult|.
+ */
+static bool
+parse_scaled(const char *str, const char *units, const unsigned long *mult,
+    unsigned long *result)
+{
+    const char *u;
+    char *end;
+    unsigned long n;
+
+    n = strtoul(str, &end, 10);
+    if (end == str) {
+        return (false);
+    }
+    if (*end != '\0') {
+        u = strchr(units, tolower((unsigned char)*end));
+        if (u == NULL || end[1] != '\0') {
+            return (false);
+        }
+        n *= mult[u - units];
+    }
+    *result = n;
+    return (true);
+}
+
+void
+opt_copy_rotate(char const *spec)
+{
+    static const unsigned long size_mult[] = { 1024, 1024 * 1024, 1024 * 1024 * 1024 };
+    static const unsigned long time_mult[] = { 1, 60, 60 * 60, 24 * 60 * 60 };
+    struct copy_rotate *r = &cmd->copy_rotate;
+    char *buf, *item, *save, *val;
+    unsigned long n;
+    bool ok;
+
+    buf = (char *)guard_malloc(strlen(spec) + 1);
+    strcpy(buf, spec);
+    for (item = strtok_r(buf, ",", &save); item != NULL;
+         item = strtok_r(NULL, ",", &save)) {
+        val = strchr(item, '=');
+        ok = false;
+        if (val != NULL) {
+            *val++ = '\0';
+            if (strcmp(item, "size") == 0) {
+                ok = parse_scaled(val, "kmg", size_mult, &n) && n != 0;
+                r->size = n;
+            }
+            else if (strcmp(item, "time") == 0) {
+                ok = parse_scaled(val, "smhd", time_mult, &n) && n != 0;
+                r->time_sec = (long)n;
+            }
+            else if (strcmp(item, "keep") == 0) {
+                ok = parse_scaled(val, "", NULL, &n) && n <= 1000;
+                r->keep = (int)n;
+            }
+            else if (strcmp(item, "fsync") == 0) {
+                ok = parse_scaled(val, "smh", time_mult, &n);
+                r->fsync_sec = (long)n;
+            }
+        }
+        if (!ok) {
+            eprintf("%s: Invalid --copy-rotate, '%s'.\n", program_name, spec);
+            exit(2);
+        }
+    }
+    free(buf);
+    if (r->size == 0 && r->time_sec == 0) {
+        eprintf("%s: --copy-rotate needs size= or time=.\n", program_name);
+        exit(2);
+    }
+}
+
+/*
+ * --line-prefix[=<fd>:<prefix>]
+ */
+static void
+opt_line_prefix(char const *spec)
+{
+    if (spec == NULL) {
+        spec = "2:E| ";
+    }
+    if (!((spec[0] == '1' || spec[0] == '2') && spec[1] == ':')) {
+        eprintf("%s: Invalid --line-prefix, '%s'.\n", program_name, spec);
+        exit(2);
+    }
+    mark_set_line_prefix(spec[0] - '0', spec + 2);
+}
+
+/*
+ * --timestamp[=wall|mono|delta][,write]
+ */
+static void
+opt_timestamp(char const *spec)
+{
+    enum stamp_clock clk;
+    bool per_write;
+    size_t n;
+
+    clk = STAMP_WALL;
+    per_write = false;
+    if (spec != NULL) {
+        n = strcspn(spec, ",");
+        if (n == 0 || strncmp(spec, "wall", n) == 0) {
+            clk = STAMP_WALL;
+        }
+        else if (strncmp(spec, "mono", n) == 0) {
+            clk = STAMP_MONO;
+        }
+        else if (strncmp(spec, "delta", n) == 0) {
+            clk = STAMP_DELTA;
+        }
+        else {
+            eprintf("%s: Invalid clock for --timestamp, '%s'.\n",
+                program_name, spec);
+            exit(2);
+        }
+        if (spec[n] == ',') {
+            if (strcmp(spec + n + 1, "write") != 0) {
+                eprintf("%s: Invalid --timestamp, '%s'.\n",
+                    program_name, spec);
+                exit(2);
+            }
+            per_write = true;
+        }
+    }
+    mark_set_timestamp(clk, per_write);
+}
+
+/*
+ * --pid=<pid>
+ */
+static void
+opt_pid(char const *pid_str)
+{
+    char *end;
+    long pid;
+
+    pid = strtol(pid_str, &end, 10);
+    if (end == pid_str || *end != '\0' || pid <= 0 || pid != (pid_t)pid) {
+        eprintf("%s: Invalid --pid, '%s'.\n", program_name, pid_str);
+        exit(2);
+    }
+    cmd->attach_pid = (pid_t)pid;
+}
+
+/*
+ * --duration=<seconds>
+ */
+static void
+opt_duration(char const *sec_str)
+{
+    char *end;
+    double sec;
+
+    sec = strtod(sec_str, &end);
+    if (end == sec_str || *end != '\0' || !(sec > 0.0) || sec > 1e9) {
+        eprintf("%s: Invalid --duration, '%s'.\n", program_name, sec_str);
+        exit(2);
+    }
+    cmd->duration_ms = (long)(sec * 1000.0);
+    if (cmd->duration_ms == 0) {
+        cmd->duration_ms = 1;
+    }
+}
+
+/*
+ * --jobs=<n>
+ */
+static void
+opt_jobs(char const *n_str)
+{
+    char *end;
+    long n;
+
+    n = strtol(n_str, &end, 10);
+    if (end == n_str || *end != '\0' || n < 1 || n > 65536) {
+        eprintf("%s: Invalid --jobs, '%s'.\n", program_name, n_str);
+        exit(2);
+    }
+    nr_jobs = (int)n;
+}
+
+/*
+ * Size of the buffer for coalesced output.
+ */
+#define COALESCE_SIZE (64 * 1024)
+
+void
+opt_coalesce(char const *ms_str)
+{
+    char *end;
+    double ms;
+
+    if (ms_str == NULL) {
+        cmd->coalesce_us = 5000;
+        return;
+    }
+    ms = strtod(ms_str, &end);
+    if (end == ms_str || *end != '\0' || !(ms > 0.0) || ms > 60000.0) {
+        eprintf("%s: Invalid latency for --coalesce, '%s'.\n",
+            program_name, ms_str);
+        exit(2);
+    }
+    cmd->coalesce_us = (long)(ms * 1000.0);
+    if (cmd->coalesce_us == 0) {
+        cmd->coalesce_us = 1;
+    }
+}
+
+/*
+ * --batch
+ *
+ * All the command lines are read first; then stdin is /dev/null,
+ * for errmark and the commands alike.  Each command is an errmark_ctx,
+ * with the marks of errmark, and sinks that collect its output, by fd,
+ * or all of it in one, if stdout and stderr are the same file.
+ * When it is done, that goes out, in two writes at most.
+ * Copies for each command are written by the tracer, using stdio;
+ * they are opened when the command starts.
+ */
+struct job_out {
+    char  *buf;
+    size_t len;
+    size_t alloc;
+};
+
+struct job {
+    unsigned long nr;           // Line number, from 1, for {#}
+    char *argv[4];
+    struct job_out out[3];
+    FILE **copy;                // One per per_cmd copy_spec, or NULL
+    bool *copy_bol;             // For tagged copies
+};
+
+static char **batch_lines = NULL;
+static unsigned long *batch_line_nr = NULL;
+static size_t nr_batch_lines = 0;
+static size_t batch_next = 0;
+static bool batch_same_12 = true;
+
+static void
+read_batch(void)
+{
+    FILE *f;
+    char *line;
+    size_t sz;
+    ssize_t len;
+    unsigned long nr;
+
+    f = stdin;
+    if (batch_fname != NULL && strcmp(batch_fname, "-") != 0) {
+        f = fopen(batch_fname, "r");
+        if (f == NULL) {
+            eprintf("%s: Cannot open '%s': %s\n", program_name,
+                batch_fname, strerror(errno));
+            exit(2);
+        }
+    }
+    line = NULL;
+    sz = 0;
+    nr = 0;
+    while ((len = getline(&line, &sz, f)) != -1) {
+        ++nr;
+        if (len != 0 && line[len - 1] == '\n') {
+            line[--len] = '\0';
+        }
+        if (line[strspn(line, " \t")] == '\0') {
+            continue;
+        }
+        batch_lines = (char **)guard_realloc(batch_lines,
+            (nr_batch_lines + 1) * sizeof (*batch_lines));
+        batch_line_nr = (unsigned long *)guard_realloc(batch_line_nr,
+            (nr_batch_lines + 1) * sizeof (*batch_line_nr));
+        batch_lines[nr_batch_lines] = strdup(line);
+        batch_line_nr[nr_batch_lines] = nr;
+        ++nr_batch_lines;
+    }
+    free(line);
+    if (f != stdin) {
+        fclose(f);
+    }
+}
+
+/*
+ * |pattern|, with each {#} in it replaced by |nr|.
+ */
+static char *
+job_fname(const char *pattern, unsigned long nr)
+{
+    char num[24];
+    char *fname;
+    const char *p, *q;
+    size_t len, num_len;
+
+    num_len = snprintf(num, sizeof (num), "%lu", nr);
+    fname = (char *)guard_malloc(strlen(pattern) * (num_len + 1) + 1);
+    len = 0;
+    for (p = pattern; (q = strstr(p, "{#}")) != NULL; p = q + 3) {
+        memcpy(fname + len, p, q - p);
+        len += q - p;
+        memcpy(fname + len, num, num_len);
+        len += num_len;
+    }
+    strcpy(fname + len, p);
+    return (fname);
+}
+
+static void
+job_out_add(struct job_out *o, const void *buf, size_t len)
+{
+    if (o->len + len > o->alloc) {
+        o->alloc = o->alloc ? o->alloc : 4096;
+        while (o->alloc < o->len + len) {
+            o->alloc *= 2;
+        }
+        o->buf = (char *)guard_realloc(o->buf, o->alloc);
+    }
+    memcpy(o->buf + o->len, buf, len);
+    o->len += len;
+}
+
+/*
+ * on_write sink: output of a command, marks and all.
+ */
+static void
+job_write(errmark_ctx_t *ctx, pid_t pid, int fd, const void *buf, size_t len)
+{
+    struct job *job = (struct job *)ctx->arg;
+
+    (void)pid;
+    job_out_add(&job->out[batch_same_12 ? 1 : fd], buf, len);
+}
+
+/*
+ * on_data sink: the data, as written by a command, for its copies.
+ */
+static void
+job_data(errmark_ctx_t *ctx, pid_t pid, int fd, const void *buf, size_t len)
+{
+    static const char *const tag[] = { "0> ", "1> ", "2> " };
+    struct job *job = (struct job *)ctx->arg;
+    const char *p, *end, *nl;
+    size_t i, c;
+
+    (void)pid;
+    c = 0;
+    for (i = 0; i < nr_copy_specs; ++i) {
+        if (!copy_specs[i].per_cmd) {
+            continue;
+        }
+        if (job->copy[c] != NULL && (copy_specs[i].fds & COPY_FD(fd))) {
+            if (!copy_specs[i].tagged) {
+                fwrite(buf, 1, len, job->copy[c]);
+            }
+            else {
+                p = (const char *)buf;
+                end = p + len;
+                while (p < end) {
+                    if (job->copy_bol[c]) {
+                        fputs(tag[fd], job->copy[c]);
+                    }
+                    nl = (const char *)memchr(p, '\n', end - p);
+                    nl = (nl != NULL) ? nl + 1 : end;
+                    fwrite(p, 1, nl - p, job->copy[c]);
+                    job->copy_bol[c] = (nl[-1] == '\n');
+                    p = nl;
+                }
+            }
+        }
+        ++c;
+    }
+}
+
+static void
+write_all(int fd, const char *buf, size_t len)
+{
+    ssize_t rv;
+
+    while (len != 0) {
+        rv = write(fd, buf, len);
+        if (rv == -1 && errno == EINTR) {
+            continue;
+        }
+        if (rv <= 0) {
+            break;
+        }
+        buf += rv;
+        len -= rv;
+    }
+}
+
+/*
+ * The next command of the batch, ready to run.
+ */
+static errmark_ctx_t *
+batch_next_cmd(void *arg)
+{
+    errmark_ctx_t *ctx;
+    struct job *job;
+    char *fname;
+    size_t i, c;
+
+    (void)arg;
+    if (batch_next == nr_batch_lines) {
+        return (NULL);
+    }
+    job = (struct job *)guard_calloc(1, sizeof (*job));
+    job->nr = batch_line_nr[batch_next];
+    job->argv[0] = (char *)"/bin/sh";
+    job->argv[1] = (char *)"-c";
+    job->argv[2] = batch_lines[batch_next];
+    job->argv[3] = NULL;
+    ++batch_next;
+
+    job->copy = (FILE **)guard_calloc(nr_copy_specs + 1, sizeof (FILE *));
+    job->copy_bol = (bool *)guard_calloc(nr_copy_specs + 1, sizeof (bool));
+    c = 0;
+    for (i = 0; i < nr_copy_specs; ++i) {
+        if (!copy_specs[i].per_cmd) {
+            continue;
+        }
+        fname = job_fname(copy_specs[i].fname, job->nr);
+        job->copy[c] = fopen(fname, "w");
+        if (job->copy[c] == NULL) {
+            eprintf("%s: open('%s', \"w\") failed: %s\n", program_name,
+                fname, strerror(errno));
+        }
+        job->copy_bol[c] = true;
+        free(fname);
+        ++c;
+    }
+
+    ctx = errmark_ctx_new();
+    errmark_ctx_set_argv(ctx, 3, job->argv);
+    ctx->cmd.cmd_name = job->argv[2];
+    ctx->cmd.verbose = cmd->verbose;
+    ctx->cmd.debug = cmd->debug;
+    errmark_ctx_inherit_marks(ctx);
+    errmark_ctx_set_sink(ctx, job_write, c != 0 ? job_data : NULL, job);
+    return (ctx);
+}
+
+/*
+ * A command of the batch is done.  Out goes its output.
+ */
+static void
+batch_done(errmark_ctx_t *ctx, void *arg)
+{
+    struct job *job = (struct job *)ctx->arg;
+    struct rusage *ru = &ctx->cmd.child_rusage;
+    struct rusage *sum = &cmd->child_rusage;
+    size_t i;
+    int fd;
+
+    (void)arg;
+    for (fd = 1; fd <= 2; ++fd) {
+        write_all(fd, job->out[fd].buf, job->out[fd].len);
+        free(job->out[fd].buf);
+    }
+    for (i = 0; i < nr_copy_specs; ++i) {
+        if (job->copy[i] != NULL) {
+            fclose(job->copy[i]);
+        }
+    }
+    if (cmd->verbose && ctx->cmd.child_status != 0) {
+        fshow_wait_status(errprint_fh, ctx->cmd.cmd_name,
+            ctx->cmd.child_status);
+    }
+
+    timeradd(&sum->ru_utime, &ru->ru_utime, &sum->ru_utime);
+    timeradd(&sum->ru_stime, &ru->ru_stime, &sum->ru_stime);
+    if (ru->ru_maxrss > sum->ru_maxrss) {
+        sum->ru_maxrss = ru->ru_maxrss;
+    }
+    free(job->copy);
+    free(job->copy_bol);
+    free(job);
+    errmark_ctx_free(ctx);
+}
+
+/*
+ * Run the commands of --batch.
+ *
+ * @return the exit status for errmark
+ */
+static int
+run_batch(void)
+{
+    struct stat st1, st2;
+    unsigned long failed;
+    int jobs;
+
+    jobs = nr_jobs;
+    if (jobs == 0) {
+        jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        if (jobs < 1) {
+            jobs = 1;
+        }
+    }
+    batch_same_12 = true;
+    if (fstat(1, &st1) == 0 && fstat(2, &st2) == 0) {
+        batch_same_12 = (st1.st_dev == st2.st_dev && st1.st_ino == st2.st_ino);
+    }
+    failed = errmark_run_batch(cmd, jobs, batch_next_cmd, batch_done, NULL);
+    return (failed > 101 ? 101 : (int)failed);
+}
+
 int
 main(int argc, char * const *argv)
 {
@@ -171,6 +979,7 @@ main(int argc, char * const *argv)
     extern int optind, opterr, optopt;
     int option_index;
     int err_count;
+    int exit_status;
     int optc;
     int rv;
 
@@ -179,6 +988,7 @@ main(int argc, char * const *argv)
     program_name = sname(program_path);
     option_index = 0;
     err_count = 0;
+    exit_status = 0;
     opterr = 0;
 
     while (true) {
@@ -231,7 +1041,87 @@ main(int argc, char * const *argv)
             opt_color(optarg);
             break;
         case OPT_COPY:
-            cmd->copy_fname = optarg;
+        case OPT_COPY_STDERR:
+            opt_copy(optarg, COPY_FD(2), false);
+            break;
+        case OPT_COPY_STDOUT:
+            opt_copy(optarg, COPY_FD(1), false);
+            break;
+        case OPT_COPY_COMBINED:
+            opt_copy(optarg, COPY_FD(1) | COPY_FD(2), true);
+            break;
+        case OPT_ENGINE:
+            opt_engine(optarg);
+            break;
+        case OPT_NO_EMULATE:
+            cmd->emulate = false;
+            break;
+        case OPT_NO_SYSCALL_INFO:
+            cmd->syscall_info = false;
+            break;
+        case OPT_COALESCE:
+            opt_coalesce(optarg);
+            break;
+        case OPT_COPY_RING:
+            opt_copy_ring(optarg);
+            break;
+        case OPT_COPY_OVERFLOW:
+            opt_copy_overflow(optarg);
+            break;
+        case OPT_COPY_COMPRESS:
+            opt_copy_compress(optarg);
+            break;
+        case OPT_COPY_ROTATE:
+            opt_copy_rotate(optarg);
+            break;
+        case OPT_IO_URING:
+            cmd->io_uring = true;
+            break;
+        case OPT_RECORD:
+            cmd->record_fname = optarg;
+            break;
+        case OPT_LINE_PREFIX:
+            opt_line_prefix(optarg);
+            break;
+        case OPT_HIGHLIGHT:
+            highlight_fname = optarg;
+            highlight_fd[2] = true;
+            break;
+        case OPT_HIGHLIGHT_STDOUT:
+            highlight_fd[1] = true;
+            break;
+        case OPT_TIMESTAMP:
+            opt_timestamp(optarg);
+            break;
+        case OPT_STATS:
+            cmd->stats = true;
+            cmd->stats_fname = optarg;
+            break;
+        case OPT_STATS_FORMAT:
+            if (strcmp(optarg, "json") == 0) {
+                cmd->stats_json = true;
+            }
+            else if (strcmp(optarg, "text") == 0) {
+                cmd->stats_json = false;
+            }
+            else {
+                eprintf("%s: Invalid --stats-format, '%s'.\n",
+                    program_name, optarg);
+                exit(2);
+            }
+            break;
+        case OPT_PID:
+            opt_pid(optarg);
+            break;
+        case OPT_DURATION:
+            opt_duration(optarg);
+            break;
+        case OPT_BATCH:
+            batch = true;
+            batch_fname = optarg;
+            break;
+        case OPT_JOBS:
+            opt_jobs(optarg);
             break;
         case '?':
             eprint(program_name);
@@ -268,32 +1158,174 @@ main(int argc, char * const *argv)
     cmd->verbose = verbose;
     cmd->debug   = debug;
 
-    if (argc == 0) {
-        eprintf("%s: Must supply at least a command name.\n", program_name);
-        usage();
+    if (cmd->duration_ms != 0 && cmd->attach_pid == 0) {
+        eprintf("%s: --duration needs --pid.\n", program_name);
+        exit(2);
+    }
+    if (nr_jobs != 0 && !batch) {
+        eprintf("%s: --jobs needs --batch.\n", program_name);
+        exit(2);
+    }
+    if (batch && (cmd->attach_pid != 0 || cmd->engine == ENGINE_NOTIFY)) {
+        eprintf("%s: --batch cannot go with --pid"
+            " or --engine=notify.\n", program_name);
         exit(2);
     }
+    if (batch && (cmd->copy_compress >= 0 || cmd->copy_rotate.size != 0
+                  || cmd->copy_rotate.time_sec != 0)) {
+        size_t i;
 
-    cmd->cmd_path = argv[optind];
-    cmd->cmd_name = sname(cmd->cmd_path);
-    cmd->argc = argc - optind;
-    cmd->argv = argv + optind;
+        /*
+         * The copies of each command are written by the tracer,
+         * as is, when its output comes; it is only the one shared
+         * copy that has a thread of its own to compress and rotate.
+         */
+        for (i = 0; i < nr_copy_specs; ++i) {
+            if (copy_specs[i].per_cmd) {
+                eprintf("%s: --copy-compress and --copy-rotate cannot go"
+                    " with a --copy file for each command, '%s'.\n",
+                    program_name, copy_specs[i].fname);
+                exit(2);
+            }
+        }
+    }
+
+    if (cmd->attach_pid != 0) {
+        static char pid_name[32];
+
+        if (optind < argc) {
+            eprintf("%s: --pid, and a command, too.\n", program_name);
+            usage();
+            exit(2);
+        }
+        snprintf(pid_name, sizeof (pid_name), "pid %d", (int)cmd->attach_pid);
+        cmd->cmd_path = NULL;
+        cmd->cmd_name = pid_name;
+        cmd->argc = 0;
+        cmd->argv = NULL;
+    }
+    else if (batch) {
+        int null_fd;
+
+        if (optind < argc) {
+            eprintf("%s: --batch, and a command, too.\n", program_name);
+            usage();
+            exit(2);
+        }
+        read_batch();
+        cmd->cmd_path = NULL;
+        cmd->cmd_name = "batch";
+        cmd->argc = 0;
+        cmd->argv = NULL;
+        /*
+         * The commands run at the same time; none of them gets stdin.
+         */
+        null_fd = open("/dev/null", O_RDONLY);
+        if (null_fd != -1 && null_fd != 0) {
+            dup2(null_fd, 0);
+            close(null_fd);
+        }
+    }
+    else {
+        if (argc == 0) {
+            eprintf("%s: Must supply at least a command name.\n", program_name);
+            usage();
+            exit(2);
+        }
+        cmd->cmd_path = argv[optind];
+        cmd->cmd_name = sname(cmd->cmd_path);
+        cmd->argc = argc - optind;
+        cmd->argv = argv + optind;
+    }
     cmd->nullify = true;
     cmd->slow    = true;
 
-    if (verbose) {
+    if (verbose && cmd->argc != 0) {
         fshow_str_array(stderr, cmd->argc, cmd->argv);
     }
 
-    cmd->copy_fh = NULL;
-    if (cmd->copy_fname != NULL) {
-        cmd->copy_fh = fopen(cmd->copy_fname, "w");
-        if (cmd->copy_fh == NULL) {
-            eprintf("open('%s', \"w\") failed.\n", cmd->copy_fname);
+    if (highlight_fd[1] || highlight_fd[2]) {
+        if (highlight_fname != NULL && !highlight_load(highlight_fname)) {
             exit(2);
         }
+        highlight_compile();
+        if (highlight_fd[1]) {
+            mark_set_highlight(1);
+        }
+        if (highlight_fd[2]) {
+            mark_set_highlight(2);
+        }
+        if (verbose) {
+            size_t nr_rules, nr_states;
+
+            highlight_stats(&nr_rules, &nr_states);
+            eprintf("highlight: rules=%zu states=%zu\n", nr_rules, nr_states);
+        }
+    }
+
+    if (nr_copy_specs != 0) {
+        size_t i, nr_open;
+
+        nr_open = 0;
+        for (i = 0; i < nr_copy_specs; ++i) {
+            if (copy_specs[i].per_cmd && batch) {
+                continue;
+            }
+            if (!copy_sink_open(copy_specs[i].fname, copy_specs[i].fds,
+                                copy_specs[i].tagged)) {
+                eprintf("open('%s', \"w\") failed.\n", copy_specs[i].fname);
+                exit(2);
+            }
+            ++nr_open;
+        }
+        if (nr_open != 0) {
+            copy_writer_set_rotate(&cmd->copy_rotate);
+            copy_writer_start(cmd->copy_ring_size, cmd->copy_overflow,
+                              cmd->copy_compress);
+        }
+    }
+
+    if (cmd->record_fname != NULL && !record_open(cmd->record_fname)) {
+        eprintf("%s: Cannot record to '%s'.\n", program_name, cmd->record_fname);
+        exit(2);
+    }
+    if (batch) {
+        /*
+         * Output is held back until each command is done, anyway.
+         */
+        cmd->coalesce_us = 0;
+    }
+    if (cmd->coalesce_us != 0) {
+        mark_set_coalesce(COALESCE_SIZE, cmd->coalesce_us);
+    }
+    if (cmd->io_uring && !uring_sink_open() && verbose) {
+        eprintf("%s: io_uring is not available; using writev().\n",
+            program_name);
     }
 
-    cmd->child_status = errmark_run_program(cmd);
-    exit(cmd->child_status >> 8);
+    stats_start();
+    if (batch) {
+        exit_status = run_batch();
+    }
+    else if (cmd->attach_pid != 0) {
+        cmd->child_status = errmark_attach_program(cmd);
+    }
+    else {
+        cmd->child_status = errmark_run_program(cmd);
+    }
+    copy_writer_stop(cmd->verbose);
+    uring_sink_close(cmd->verbose);
+    record_close(cmd->verbose);
+    if (cmd->verbose) {
+        unsigned long reads, formats;
+
+        stamp_stats(&reads, &formats);
+        if (reads != 0) {
+            eprintf("timestamps: taken=%lu formatted=%lu\n", reads, formats);
+        }
+    }
+    if (cmd->stats) {
+        stats_report(cmd->stats_fname, cmd->stats_json, &cmd->child_rusage);
+    }
+    exit(batch ? exit_status : cmd->child_status >> 8);
 }
@@ -6,14 +6,95 @@ extern "C" {
 #endif
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <sys/types.h>
+#include <sys/resource.h>       // Import struct rusage
+#include <time.h>               // Import clock_gettime()
 
+/*
+ * One traced command, for a program that embeds liberrmark;
+ * see errmark-ctx.c.  Its output, marks and all, and the data
+ * as the command wrote it, can go to callbacks, instead of to fd 1
+ * and fd 2.  |pid| is the thread that wrote it; |fd| is 1 or 2.
+ */
+typedef struct errmark_ctx errmark_ctx_t;
+typedef void (*errmark_write_fn)(errmark_ctx_t *ctx, pid_t pid, int fd,
+    const void *buf, size_t len);
+
+/*
+ * Marks and output state; see mark-write.c.
+ */
+struct mark_ctx;
+
+extern struct mark_ctx *mark_ctx_new(void);
+extern struct mark_ctx *mark_ctx_dup(const struct mark_ctx *);
+extern void mark_ctx_free(struct mark_ctx *);
+extern struct mark_ctx *mark_ctx_use(struct mark_ctx *);
+extern void mark_set_sink(errmark_ctx_t *ctx, errmark_write_fn on_write,
+    errmark_write_fn on_data);
 extern void mark_open(void);
 extern void mark_close(void);
 extern bool parse_mark_specs(char *);
 extern bool setmark(int fd, char const *m_start, char const *m_end);
+extern void getmark(int fd, char const **m_start, char const **m_end);
 extern void before_write(int fd, void *buf, size_t len);
 extern void after_write(int fd, void *buf, size_t len);
+extern ssize_t mark_write(int fd, const void *buf, size_t len);
+extern bool mark_wants_data(int fd);
+extern bool mark_has_sink(void);
+extern void mark_forget(pid_t tid);
+extern void mark_data(int fd, const void *buf, size_t len);
+extern void mark_set_coalesce(size_t size, long latency_us);
+extern void mark_flush(void);
+extern void mark_poll(void);
+extern bool mark_wait_begin(void);
+extern void mark_wait_end(void);
+extern bool mark_due(void);
+extern bool mark_coalescing(void);
+extern void mark_child_signals(void);
+extern unsigned long mark_output_calls(void);
+extern bool mark_set_line_prefix(int fd, const char *prefix);
+extern void mark_set_writer(pid_t tid);
+extern void mark_set_highlight(int fd);
+
+/*
+ * Timestamps for output; see timestamp.c.
+ */
+enum stamp_clock {
+    STAMP_NONE,
+    STAMP_WALL,             // Time of day
+    STAMP_MONO,             // Since the start
+    STAMP_DELTA,            // Since the output before
+};
+
+extern void stamp_set(enum stamp_clock clk);
+extern const char *stamp_now(size_t *len);
+extern void stamp_stats(unsigned long *reads, unsigned long *formats);
+extern void mark_set_timestamp(enum stamp_clock clk, bool per_write);
+
+/*
+ * Coloring of lines by content; see highlight.c.
+ */
+extern bool highlight_rule(const char *color, const char *literal);
+extern bool highlight_load(const char *fname);
+extern void highlight_compile(void);
+extern int highlight_scan(uint32_t *state, const char *buf, size_t len);
+extern void highlight_esc(int rule, const char **start, size_t *start_len,
+    const char **end, size_t *end_len);
+extern void highlight_stats(size_t *rules, size_t *states);
+
+/*
+ * Iterator over the newlines in a buffer; see newline-scan.c.
+ */
+struct nl_scan {
+    const char *blk;        // Block being looked at
+    const char *end;
+    uint32_t mask;          // Newlines in it not yet returned, one bit each
+};
+
+extern void nl_scan_init(struct nl_scan *, const char *buf, size_t len);
+extern const char *nl_scan_next(struct nl_scan *);
+extern const char *nl_scan_impl(void);
 
 #include <stdio.h>
 #include <sys/wait.h>
@@ -25,6 +106,85 @@ extern void after_write(int fd, void *buf, size_t len);
 
 #include <sys/syscall.h>
 
+/*
+ * How system calls of the child are intercepted.
+ *
+ * ENGINE_PTRACE:   stop at entry and exit of every system call
+ *                  (PTRACE_SYSCALL).
+ * ENGINE_SECCOMP:  a seccomp-BPF filter, installed in the child,
+ *                  stops only on writes to marked file descriptors
+ *                  (SECCOMP_RET_TRACE); everything else runs
+ *                  at full speed.
+ * ENGINE_NOTIFY:   the same filter, but writes are handed to us
+ *                  by seccomp user notification (SECCOMP_RET_USER_NOTIF);
+ *                  no ptrace at all.
+ */
+enum engine {
+    ENGINE_PTRACE = 0,
+    ENGINE_SECCOMP,
+    ENGINE_NOTIFY,
+};
+
+/*
+ * Interception state of one traced thread.
+ *
+ * in_syscall:  we have seen the entry to a system call,
+ *              and expect to see the exit from it.
+ * marked:      that system call is a write() to a marked fd.
+ * emulated:    that write() has been emulated; nothing left to do
+ *              at the exit from it.
+ * nullified:   that write() has been nullified; its return value
+ *              must be fixed up at the exit from it, to |wrote|.
+ * passed:      that write() has been left to the kernel; what it
+ *              wrote is copied and recorded at the exit from it.
+ */
+struct tracee {
+    pid_t tid;
+    bool in_syscall;
+    bool marked;
+    bool emulated;
+    bool nullified;
+    bool passed;
+    int wfd;
+    void *waddr;
+    size_t wlen;
+    long wrote;             // What we wrote for a nullified write(), or -errno
+    uint64_t wticks;        // Stopped so far for this write, for --stats
+    bool resync;            // Attached to mid-run; entry or exit not yet known
+    errmark_ctx_t *ctx;     // Command it belongs to, in a batch; see run-program.c
+};
+
+struct tracee_table {
+    struct tracee *slots;
+    size_t size;
+    size_t count;
+};
+
+extern void tracee_table_init(struct tracee_table *);
+extern void tracee_table_free(struct tracee_table *);
+extern struct tracee *tracee_lookup(struct tracee_table *, pid_t tid);
+extern struct tracee *tracee_insert(struct tracee_table *, pid_t tid);
+extern void tracee_remove(struct tracee_table *, pid_t tid);
+
+/*
+ * What the tracer does with the --copy of a write,
+ * when the writer thread has fallen behind.
+ */
+enum copy_overflow {
+    COPY_OVERFLOW_BLOCK,    // Wait for room; the tracee waits, too
+    COPY_OVERFLOW_DROP,     // Leave the write out of the copy, and count it
+};
+
+/*
+ * When to start a new --copy file, and how many old ones to keep.
+ */
+struct copy_rotate {
+    size_t size;            // Bytes; 0 for no limit
+    long   time_sec;        // Seconds; 0 for no limit
+    int    keep;            // Old ones: <name>.1 ... <name>.<keep>
+    long   fsync_sec;       // fdatasync() this often; 0 for only at the end
+};
+
 struct cmd {
     int argc;
     char * const *argv;
@@ -37,26 +197,278 @@ struct cmd {
     bool slow;
     FILE *trace_fbt;
     bool nullify;
+    bool emulate;
+    bool syscall_info;
+    enum engine engine;
+    long coalesce_us;
+    bool io_uring;
+    char *record_fname;
 
-    char *copy_fname;
-    FILE *copy_fh;
+    size_t copy_ring_size;
+    enum copy_overflow copy_overflow;
+    int copy_compress;          // zlib level, or -1 for none
+    struct copy_rotate copy_rotate;
+
+    const char *stats_fname;    // NULL for errprint_fh
+    bool stats;
+    bool stats_json;
+
+    pid_t attach_pid;           // --pid: trace this, instead of running a program
+    long duration_ms;           // --duration: detach after this long; 0 for never
 
     // State
     int  mark_state;
     pid_t child;
+    struct tracee_table tracees;
     int child_status;
     int rc;
     bool child_exited;
+    unsigned long nr_stops;
+    unsigned long nr_writes;
+    unsigned long nr_ptrace;
+    unsigned long nr_ptrace_get;
+    unsigned long nr_ptrace_set;
+    struct rusage child_rusage;
 };
 
 typedef struct cmd cmd_t;
 
+/*
+ * Counters for --stats; see stats.c.
+ */
+enum stats_stop {
+    STATS_STOP_SYSCALL,
+    STATS_STOP_SECCOMP,
+    STATS_STOP_EVENT,
+    STATS_STOP_SIGNAL,
+    STATS_STOP_NOTIFY,
+    STATS_NR_STOPS
+};
+
+enum stats_phase {
+    STATS_REGS,             // Getting and setting registers
+    STATS_MEM,              // Reading the memory of the writer
+    STATS_OUTPUT,           // Marks and data, to stdout and stderr
+    STATS_NR_PHASES
+};
+
+static inline uint64_t
+stats_tick(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return (__builtin_ia32_rdtsc());
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+#endif
+}
+
+extern void stats_start(void);
+extern void stats_stop(enum stats_stop kind, uint64_t t0);
+extern void stats_syscall(long nr);
+extern void stats_phase(enum stats_phase phase, uint64_t t0);
+extern void stats_write(int fd, size_t len);
+extern void stats_latency(uint64_t ticks);
+extern void stats_thread_start(void);
+extern void stats_thread_done(void);
+extern bool stats_report(const char *fname, bool json, const struct rusage *child);
+
 extern long guard_ptrace(cmd_t *, enum __ptrace_request request, pid_t pid, void *addr, void *data);
 
+#include <sys/uio.h>
+
+/*
+ * How to read the memory of a tracee.
+ * PMEM_AUTO means the fastest method that is permitted.
+ */
+enum pmem_method {
+    PMEM_AUTO = 0,
+    PMEM_VM_READV,
+    PMEM_PROC_MEM,
+    PMEM_PEEKDATA,
+};
+
+extern void    pmem_set_method(enum pmem_method);
+extern void    pmem_forget(pid_t tracee);
+extern ssize_t pmem_readv(pid_t tracee, const struct iovec *local, size_t lcnt, const struct iovec *remote, size_t rcnt);
+extern ssize_t pmem_read(void *buf, pid_t tracee, const void *raddr, size_t len);
 extern ssize_t pmem_fwrite(FILE *f, pid_t tracee, void *raddr, size_t len);
 extern ssize_t pmem_copy(char *buf, pid_t tracee, void *raddr, size_t len);
 
+/*
+ * Writes of more than this are gathered, and done, in pieces.
+ */
+#define PMEM_CHUNK (1024 * 1024)
+
+extern ssize_t pmem_read_piece(pid_t tracee, char *buf, size_t max, const struct iovec *remote, size_t rcnt, size_t *ri, size_t *roff, size_t *asked);
+extern ssize_t pmem_fwritev(FILE *f, int copy_fd, int rec_fd, pid_t tracee, const struct iovec *remote, size_t rcnt);
+extern ssize_t pmem_mark_writev(int fd, bool copy, pid_t tracee, const struct iovec *remote, size_t rcnt);
+extern ssize_t pmem_passed_writev(int fd, bool copy, pid_t tracee, const struct iovec *remote, size_t rcnt);
+
+extern bool tracee_fd_is_marked(pid_t pid, int fd);
+extern int  tracee_getfd(pid_t pid, int fd);
+extern pid_t tracee_tgid(pid_t tid);
+extern ssize_t pmem_write(pid_t tracee, void *raddr, const void *buf, size_t len);
+
+/*
+ * A system call of the write() family, decoded.
+ *
+ * raddr:       the buffer, iovec array, or msghdr argument,
+ *              as given to the system call
+ * len:         total number of bytes to be written
+ * emulatable:  errmark can perform it, itself (write, writev)
+ * iov:         where in the tracee the bytes to be written are
+ *
+ * For sendfile, splice, tee and copy_file_range, the data does not
+ * pass through the memory of the tracee, and iovcnt is 0:
+ *
+ * spliced:     the data comes from file descriptor in_fd
+ * in_off:      address of the input offset (loff_t or off_t), or NULL
+ * out_off:     address of the output offset, or NULL
+ */
+#define WRITE_IOV_MAX 1024
+
+struct write_call {
+    long nr;
+    int fd;
+    void *raddr;
+    size_t len;
+    bool emulatable;
+    bool spliced;
+    int in_fd;
+    void *in_off;
+    void *out_off;
+    unsigned int flags;
+    size_t iovcnt;
+    struct iovec iov[WRITE_IOV_MAX];
+};
+
+extern int  write_call_fd(long nr, const unsigned long *args);
+extern bool read_call_is_stdin(long nr, const unsigned long *args);
+extern bool write_call_decode(struct write_call *, pid_t tracee, long nr, const unsigned long *args);
+extern bool splice_copy(struct write_call *, pid_t tracee, long *retval);
+
+#define COPY_FD(fd) (1u << (fd))
+
+extern bool copy_sink_open(const char *fname, unsigned int fds, bool tagged);
+extern void copy_writer_set_rotate(const struct copy_rotate *);
+extern bool copy_writer_start(size_t size, enum copy_overflow, int level);
+extern bool copy_wanted(int fd);
+extern void copy_write(int fd, const void *buf, size_t len);
+extern int  copy_direct_fd(int fd);
+extern void copy_sync(void);
+extern void copy_writer_stop(bool verbose);
+
+extern bool   uring_sink_open(void);
+extern bool   uring_sink_active(void);
+extern size_t uring_sink_writev(int fd, const struct iovec *iov, int iovcnt);
+extern void   uring_sink_drain(void);
+extern void   uring_sink_close(bool verbose);
+
+/*
+ * --record file format.
+ *
+ * A file header, then records, each one a fixed header and
+ * the payload, padded to a multiple of 8 bytes; then, once
+ * recording is done, a sparse index of (time, offset) pairs.
+ * Everything is in the byte order of the machine that recorded it.
+ *
+ * The first records, flagged REC_F_MARKS, hold the marks in use,
+ * "<start>\0<end>", for fd 1 and fd 2.
+ *
+ * Times are CLOCK_MONOTONIC, in nanoseconds.  |real0_ns| is
+ * CLOCK_REALTIME at the time |mono0_ns| was taken, to convert.
+ *
+ * |data_end| is kept up to date as records are added, so that a
+ * recording that was never finished can still be read, by a scan.
+ */
+#define REC_MAGIC       "ERRMREC1"
+#define REC_VERSION     1
+
+#define REC_F_MARKS     0x0001  // Payload is the marks for |fd|
+#define REC_F_NO_DATA   0x0002  // Moved by the kernel; |len| bytes not captured
+
+struct rec_file_header {
+    char     magic[8];
+    uint32_t version;
+    uint32_t header_size;       // Offset of the first record
+    uint64_t mono0_ns;
+    uint64_t real0_ns;
+    uint64_t data_end;          // Offset just past the last record
+    uint64_t index_off;         // 0, if there is no index
+    uint64_t index_count;
+    uint64_t reserved[2];
+};
+
+struct rec_header {
+    uint64_t t_ns;
+    int32_t  pid;               // tid of the writer
+    int16_t  fd;
+    uint16_t flags;
+    uint32_t len;               // Bytes of payload
+    uint32_t reserved;
+};
+
+struct rec_index_entry {
+    uint64_t t_ns;
+    uint64_t off;               // Offset of a record
+};
+
+#define REC_ALIGN(n) (((n) + 7) & ~(size_t)7)
+
+extern bool record_open(const char *fname);
+extern bool record_active(void);
+extern void record_write(pid_t pid, int fd, const void *buf, size_t len, unsigned int flags);
+extern void record_close(bool verbose);
+
+extern int  seccomp_install_filter(uint32_t action, unsigned int flags, bool input);
+extern bool seccomp_filter_active(pid_t pid);
+
+extern int notify_run_program(cmd_t *);
+
+extern int errmark_trace_child(cmd_t *);
 extern int errmark_run_program(cmd_t *);
+extern int errmark_attach_program(cmd_t *);
+
+/*
+ * A traced command, with marks and sinks of its own; see errmark-ctx.c.
+ * Set the options in |cmd|, as errmark does, before running it.
+ */
+struct errmark_ctx {
+    cmd_t cmd;
+    struct mark_ctx *marks;
+    errmark_write_fn on_write;  // Output, marks and all; NULL for fd 1 and 2
+    errmark_write_fn on_data;   // Data as written; NULL for none
+    void *arg;                  // For the callbacks
+
+    // State, in a batch
+    bool exited;                // |cmd.child| is gone; some of its children may not be
+};
+
+extern errmark_ctx_t *errmark_ctx_new(void);
+extern void errmark_ctx_free(errmark_ctx_t *);
+extern void errmark_ctx_set_argv(errmark_ctx_t *, int argc, char * const *argv);
+extern void errmark_ctx_inherit_marks(errmark_ctx_t *);
+extern bool errmark_ctx_set_mark(errmark_ctx_t *, int fd,
+    const char *m_start, const char *m_end);
+extern bool errmark_ctx_set_line_prefix(errmark_ctx_t *, int fd,
+    const char *prefix);
+extern void errmark_ctx_set_highlight(errmark_ctx_t *, int fd);
+extern void errmark_ctx_set_sink(errmark_ctx_t *, errmark_write_fn on_write,
+    errmark_write_fn on_data, void *arg);
+extern int  errmark_ctx_run(errmark_ctx_t *, int argc, char * const *argv);
+extern unsigned long errmark_run_batch(cmd_t *, int jobs,
+    errmark_ctx_t *(*next)(void *arg),
+    void (*done)(errmark_ctx_t *, void *arg), void *arg);
+
+/*
+ * Output order, among tracer threads; see output-order.c.
+ */
+extern void order_share(void);
+extern void order_begin(void);
+extern void order_end(void);
 
 #ifdef  __cplusplus
 }
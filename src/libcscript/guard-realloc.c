@@ -0,0 +1,60 @@
+/*
+ * Filename: guard-realloc.c
+ * Library: libcscript
+ * Brief: Wrapper around realloc() that complains and dies
+ *
+ * Copyright (C) 2016 Guy Shaw
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+    // Import var errno
+#include <stddef.h>
+    // Import constant NULL
+#include <stdio.h>
+    // Import fprintf()
+#include <stdlib.h>
+    // Import exit()
+    // Import realloc()
+
+extern FILE *errprint_fh;
+
+extern void eexplain_err(int err);
+
+/**
+ * @brief Reallocate memory using realloc(), any error is fatal.
+ * @param memp   IN  The region of memory to reallocate, or NULL.
+ * @param size   IN  The new size of the region of memory.
+ * @return pointer to the reallocated memory.
+ *
+ * guard_realloc() is a wrapper around realloc() that complains and dies
+ * if there is any error.  It never returns a NULL pointer.
+ *
+ */
+void *
+guard_realloc(void *memp, size_t size)
+{
+    void *mem;
+    int err;
+
+    mem = realloc(memp, size);
+    if (mem != NULL) {
+        return (mem);
+    }
+    err = errno;
+    fprintf(errprint_fh, "realloc(%p, %#zx) failed\n", memp, size);
+    eexplain_err(err);
+    exit(8);
+}
@@ -0,0 +1,1132 @@
+/*
+ * Filename: src/liberrmark/copy-writer.c
+ * Project: errmark
+ * Library: liberrmark
+ * Brief: Write the copies of stdout and stderr from a thread of its own
+ *
+ * Copyright (C) 2016-2019 Guy Shaw
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The tracee is stopped, or waiting for our answer, for as long
+ * as it takes us to deal with one of its writes.  Writing copies
+ * to a slow disk, or over NFS, should not be part of that.
+ *
+ * A copy goes to a sink: a file that gets what is written to stdout,
+ * to stderr, or to both.  A sink that gets both can have each line
+ * tagged with the fd it was written to.
+ *
+ * The tracer hands the data over to a writer thread through a ring
+ * buffer of bytes, allocated once.  Each write is put in the ring
+ * once, behind a small frame header that says which fd it was
+ * written to, however many sinks want it.  The writer thread hands
+ * that one copy to each of them.  There is exactly one producer,
+ * the tracer, and one consumer, the writer, so the ring needs no lock.
+ * With more than one tracer thread, they take turns, holding the
+ * output order (see output-order.c), so there is still only one at a time.
+ * |head| is only ever stored to by the producer, |tail| only by the
+ * consumer.  Both count bytes since the start, and are reduced modulo
+ * the size of the ring, which is a power of 2, only to index it.
+ *
+ * A side that finds nothing to do sleeps on a futex, and says so,
+ * so that the other side makes a futex() call only when it is needed.
+ *
+ * When the ring is full, the tracer either waits for room (block),
+ * or throws the data away, and counts it (drop).
+ *
+ * With compression, the writer thread also runs each copy through
+ * zlib, as a gzip stream.  The compressor is flushed (Z_SYNC_FLUSH)
+ * at the end of every COPY_BLOCK bytes of input, and when there has
+ * been no new data for COPY_IDLE_FLUSH_MS, so that everything up to
+ * the last flush can be read back, even if errmark never gets
+ * to finish the stream.  The tracer still only copies into the ring.
+ *
+ * With rotation, the writer thread also starts a new copy file,
+ * a segment, when the current one gets too big, or too old.
+ * Only sinks that are regular files, with a name of their own,
+ * not /dev/fd/<n>, are rotated.
+ * Segments are preallocated, a chunk at a time, with fallocate(),
+ * so that appending to them does not wait for the file system to find
+ * blocks.  The new segment takes over the file descriptor of the sink,
+ * with dup3(), so that nothing else has to know.  A segment is ended
+ * at a newline, if one comes soon enough, and a compressed segment
+ * is a gzip stream of its own.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <errmark.h>
+#include <cscript.h>		// Import guard_malloc(), guard_realloc(), eprintf()
+#include <stdbool.h>
+#include <stdint.h>		// Import uint32_t
+#include <stdio.h>		// Import snprintf()
+#include <stdlib.h>		// Import free(), strtol()
+#include <string.h>		// Import memcpy(), memchr(), strcpy()
+#include <errno.h>		// Import errno, EINTR
+#include <limits.h>		// Import INT_MAX
+#include <pthread.h>		// Import pthread_create(), pthread_join()
+#include <signal.h>		// Import sigfillset(), pthread_sigmask()
+#include <fcntl.h>		// Import open(), fallocate(), fcntl()
+#include <time.h>		// Import clock_gettime()
+#include <unistd.h>		// Import write(), syscall(), fdatasync(), ftruncate()
+#include <sys/stat.h>		// Import fstat(), S_ISREG()
+#include <sys/uio.h>		// Import writev(), struct iovec
+#include <zlib.h>		// Import deflateInit2(), deflate(), deflateEnd()
+#include <linux/futex.h>	// Import FUTEX_WAIT, FUTEX_WAKE
+#include <syscall.h>		// Import SYS_futex
+
+#define COPY_BLOCK          (256 * 1024)
+#define COPY_ZOUT           (64 * 1024)
+#define COPY_IDLE_FLUSH_MS  1000
+#define COPY_TAG_IOV        64
+#define ROTATE_PREALLOC     (64 * 1024 * 1024)
+#define ROTATE_SLACK        (1024 * 1024)
+
+/*
+ * What goes in the ring, in front of the data of each write.
+ */
+struct copy_frame {
+    uint32_t len;
+    int32_t  fd;
+};
+
+struct copy_ring {
+    char   *buf;
+    size_t  size;
+    size_t  mask;
+
+    size_t  head;		// Stored to only by the producer
+    size_t  tail;		// Stored to only by the consumer
+
+    uint32_t head_seq;		// Futex word; bumped after each store to head
+    uint32_t tail_seq;		// Futex word; bumped after each store to tail
+    uint32_t consumer_waiting;
+    uint32_t producer_waiting;
+    uint32_t stop;
+
+    enum copy_overflow overflow;
+
+    // Statistics
+    unsigned long nr_puts;
+    unsigned long nr_drops;
+    unsigned long nr_blocks;
+    uint64_t block_ns;		// Time the tracer spent waiting for room
+    size_t  bytes;
+    size_t  dropped_bytes;
+    size_t  high_water;
+};
+
+/*
+ * Compression state of a sink.
+ */
+struct copy_zlib {
+    bool     on;
+    z_stream zs;
+    char    *out;
+    size_t   pending;		// Input since the last flush
+    unsigned long nr_flushes;
+    uint64_t done_in;		// Totals of the segments before this one
+    uint64_t done_out;
+};
+
+/*
+ * Rotation state of a sink.
+ */
+struct copy_segment {
+    bool     on;
+    bool     prealloc;		// Until fallocate() says it cannot
+    size_t   bytes;		// Written to this segment
+    off_t    alloc;		// Preallocated up to here
+    uint64_t start_ns;
+    bool     due;		// Time to rotate, at the next newline
+    size_t   in_since_due;
+    bool     dirty;		// Written to since the last fdatasync()
+    uint64_t sync_ns;
+
+    unsigned long nr_rotations;
+    unsigned long nr_syncs;
+};
+
+/*
+ * Everything about a sink is used only by the writer thread,
+ * or by the tracer, if there is no writer thread.
+ */
+struct copy_sink {
+    char    *fname;
+    int      fd;
+    bool     inherited;		// /dev/fd/<n>: a dup() of an fd we were given
+    unsigned int fds;		// COPY_FD(n) set: gets what is written to fd n
+    bool     tagged;		// Each line starts with the fd it came from
+    bool     bol;		// At the beginning of a line
+    int      last_fd;
+    size_t   bytes;		// Input, before compression
+    int      err;
+    struct copy_zlib z;
+    struct copy_segment seg;
+};
+
+static struct copy_ring ring;
+static struct copy_sink *sinks = NULL;
+static size_t nr_sinks = 0;
+static unsigned int copy_fds = 0;
+static struct copy_rotate rotate_cfg;
+static pthread_t writer_thread;
+static bool running = false;
+
+static const char *const fd_tag[] = { "0> ", "1> ", "2> " };
+
+static inline uint64_t
+clock_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+/*
+ * @return true if it timed out.
+ */
+static bool
+futex_wait(uint32_t *uaddr, uint32_t val, const struct timespec *timeout)
+{
+    long rv;
+
+    rv = syscall(SYS_futex, uaddr, FUTEX_WAIT_PRIVATE, val, timeout, NULL, 0);
+    return (rv == -1 && errno == ETIMEDOUT);
+}
+
+static void
+futex_wake(uint32_t *uaddr)
+{
+    syscall(SYS_futex, uaddr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+/*
+ * Make sure there is room on disk for |len| more bytes of |s|.
+ */
+static void
+seg_prealloc(struct copy_sink *s, size_t len)
+{
+    off_t chunk;
+
+    chunk = ROTATE_PREALLOC;
+    if (rotate_cfg.size != 0 && rotate_cfg.size < (size_t)chunk) {
+        chunk = (off_t)rotate_cfg.size;
+    }
+    while ((off_t)(s->seg.bytes + len) > s->seg.alloc) {
+        if (fallocate(s->fd, FALLOC_FL_KEEP_SIZE, s->seg.alloc, chunk) == -1) {
+            s->seg.prealloc = false;
+            break;
+        }
+        s->seg.alloc += chunk;
+    }
+}
+
+/*
+ * Write all of |iov|, unless there is an error other than EINTR.
+ * After the first error, the rest of the copy is consumed,
+ * but not written; the error is reported at the end.
+ */
+static void
+raw_writev(struct copy_sink *s, struct iovec *iov, int iovcnt)
+{
+    size_t len;
+    ssize_t rv;
+    int i;
+
+    if (s->seg.on && s->seg.prealloc) {
+        len = 0;
+        for (i = 0; i < iovcnt; ++i) {
+            len += iov[i].iov_len;
+        }
+        seg_prealloc(s, len);
+    }
+    while (iovcnt != 0 && s->err == 0) {
+        rv = writev(s->fd, iov, iovcnt);
+        if (rv == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            s->err = errno;
+            break;
+        }
+        s->seg.bytes += rv;
+        s->seg.dirty = true;
+        while (iovcnt != 0 && (size_t)rv >= iov->iov_len) {
+            rv -= iov->iov_len;
+            ++iov;
+            --iovcnt;
+        }
+        if (iovcnt != 0) {
+            iov->iov_base = (char *)iov->iov_base + rv;
+            iov->iov_len -= rv;
+        }
+    }
+}
+
+static void
+raw_write(struct copy_sink *s, const char *buf, size_t len)
+{
+    struct iovec iov;
+
+    iov.iov_base = (void *)buf;
+    iov.iov_len = len;
+    raw_writev(s, &iov, 1);
+}
+
+/*
+ * Run |len| bytes of |buf| through the compressor, with |flush|,
+ * and write out whatever it has to give.
+ */
+static void
+z_put(struct copy_sink *s, const char *buf, size_t len, int flush)
+{
+    struct copy_zlib *z = &s->z;
+
+    z->zs.next_in = (Bytef *)buf;
+    z->zs.avail_in = (uInt)len;
+    do {
+        z->zs.next_out = (Bytef *)z->out;
+        z->zs.avail_out = COPY_ZOUT;
+        deflate(&z->zs, flush);
+        raw_write(s, z->out, COPY_ZOUT - z->zs.avail_out);
+    } while (z->zs.avail_out == 0);
+}
+
+static void
+z_flush(struct copy_sink *s)
+{
+    if (s->z.pending != 0) {
+        z_put(s, NULL, 0, Z_SYNC_FLUSH);
+        s->z.pending = 0;
+        ++s->z.nr_flushes;
+    }
+}
+
+static void
+z_write(struct copy_sink *s, const char *buf, size_t len)
+{
+    size_t n;
+
+    while (len != 0) {
+        n = COPY_BLOCK - s->z.pending;
+        if (n > len) {
+            n = len;
+        }
+        z_put(s, buf, n, Z_NO_FLUSH);
+        s->z.pending += n;
+        if (s->z.pending == COPY_BLOCK) {
+            z_flush(s);
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+static void
+sink_putv(struct copy_sink *s, struct iovec *iov, int iovcnt)
+{
+    int i;
+
+    for (i = 0; i < iovcnt; ++i) {
+        s->bytes += iov[i].iov_len;
+    }
+    if (!s->z.on) {
+        raw_writev(s, iov, iovcnt);
+        return;
+    }
+    for (i = 0; i < iovcnt; ++i) {
+        z_write(s, (const char *)iov[i].iov_base, iov[i].iov_len);
+    }
+}
+
+static void
+sink_put(struct copy_sink *s, const char *buf, size_t len)
+{
+    struct iovec iov;
+
+    iov.iov_base = (void *)buf;
+    iov.iov_len = len;
+    sink_putv(s, &iov, 1);
+}
+
+static void
+seg_sync(struct copy_sink *s)
+{
+    if (s->seg.dirty) {
+        fdatasync(s->fd);
+        s->seg.dirty = false;
+        ++s->seg.nr_syncs;
+    }
+    s->seg.sync_ns = clock_ns();
+}
+
+static void
+seg_maybe_sync(struct copy_sink *s)
+{
+    if (s->seg.on && rotate_cfg.fsync_sec != 0 && s->seg.dirty
+        && clock_ns() - s->seg.sync_ns >= (uint64_t)rotate_cfg.fsync_sec * 1000000000) {
+        seg_sync(s);
+    }
+}
+
+/*
+ * Give back what was preallocated, but not used,
+ * and make sure it is on disk, if asked to.
+ */
+static void
+seg_finish(struct copy_sink *s)
+{
+    if (s->z.on) {
+        z_put(s, NULL, 0, Z_FINISH);
+        s->z.pending = 0;
+    }
+    if (s->seg.alloc != 0 && ftruncate(s->fd, (off_t)s->seg.bytes) == -1) {
+        s->seg.prealloc = false;
+    }
+    if (rotate_cfg.fsync_sec != 0) {
+        seg_sync(s);
+    }
+}
+
+/*
+ * <fname>.<keep-1> becomes <fname>.<keep>, and so on,
+ * <fname> becomes <fname>.1, and a new <fname> is started.
+ */
+static void
+seg_rotate(struct copy_sink *s)
+{
+    size_t sz;
+    char *from, *to;
+    int fd;
+    int i;
+
+    seg_finish(s);
+
+    sz = strlen(s->fname) + 16;
+    from = (char *)guard_malloc(sz);
+    to = (char *)guard_malloc(sz);
+    snprintf(to, sz, "%s.%d", s->fname, rotate_cfg.keep);
+    unlink(to);
+    for (i = rotate_cfg.keep - 1; i >= 1; --i) {
+        snprintf(from, sz, "%s.%d", s->fname, i);
+        snprintf(to, sz, "%s.%d", s->fname, i + 1);
+        rename(from, to);
+    }
+    if (rotate_cfg.keep >= 1) {
+        snprintf(to, sz, "%s.1", s->fname);
+        rename(s->fname, to);
+    }
+    else {
+        unlink(s->fname);
+    }
+    free(from);
+    free(to);
+
+    fd = open(s->fname, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd == -1 || dup3(fd, s->fd, O_CLOEXEC) == -1) {
+        /*
+         * Carry on with the old one, under its new name.
+         */
+        if (fd != -1) {
+            close(fd);
+        }
+        if (s->err == 0) {
+            s->err = errno;
+        }
+    }
+    else {
+        close(fd);
+        s->seg.alloc = 0;
+    }
+
+    if (s->z.on) {
+        s->z.done_in += s->z.zs.total_in;
+        s->z.done_out += s->z.zs.total_out;
+        deflateReset(&s->z.zs);
+    }
+    s->seg.bytes = 0;
+    s->seg.start_ns = clock_ns();
+    s->seg.due = false;
+    s->seg.in_since_due = 0;
+    ++s->seg.nr_rotations;
+}
+
+/*
+ * How big the current segment of |s| is, or may be.  What is still
+ * in the compressor counts as if it would not get any smaller;
+ * it is only ever a little more than that.
+ */
+static size_t
+seg_size(struct copy_sink *s)
+{
+    return (s->seg.bytes + (s->z.on ? s->z.pending : 0));
+}
+
+/*
+ * Is it time for a new segment?  The size that counts is that of
+ * what has been written to the file.  For a compressed copy, that
+ * lags behind the input by up to COPY_BLOCK, so, once it might be
+ * big enough, the compressor is flushed, to find out.
+ */
+static bool
+seg_rotate_due(struct copy_sink *s)
+{
+    if (!s->seg.due && rotate_cfg.size != 0 && seg_size(s) >= rotate_cfg.size) {
+        z_flush(s);
+        s->seg.due = (s->seg.bytes >= rotate_cfg.size);
+    }
+    if (!s->seg.due) {
+        s->seg.due = (rotate_cfg.time_sec != 0
+            && clock_ns() - s->seg.start_ns >= (uint64_t)rotate_cfg.time_sec * 1000000000);
+    }
+    return (s->seg.due);
+}
+
+/*
+ * Write |len| bytes of |buf| to |s|, starting a new segment
+ * first, if it is time to.  A segment is not let grow past its size
+ * by more than it takes to get to the next newline.
+ */
+static void
+sink_write(struct copy_sink *s, const char *buf, size_t len)
+{
+    const char *nl;
+    size_t n;
+
+    while (len != 0) {
+        if (s->seg.on && seg_rotate_due(s)) {
+            nl = (const char *)memchr(buf, '\n', len);
+            if (nl == NULL && s->seg.in_since_due < ROTATE_SLACK) {
+                s->seg.in_since_due += len;
+                sink_put(s, buf, len);
+                s->bol = false;
+                return;
+            }
+            n = (nl != NULL) ? (size_t)(nl + 1 - buf) : 0;
+            sink_put(s, buf, n);
+            seg_rotate(s);
+            buf += n;
+            len -= n;
+            continue;
+        }
+        n = len;
+        if (s->seg.on && rotate_cfg.size != 0 && rotate_cfg.size - seg_size(s) < n) {
+            n = rotate_cfg.size - seg_size(s);
+        }
+        sink_put(s, buf, n);
+        s->bol = (buf[n - 1] == '\n');
+        buf += n;
+        len -= n;
+    }
+}
+
+/*
+ * Write |len| bytes of |buf|, written to |fd|, to |s|,
+ * with each line tagged with |fd|.  A line that is cut short
+ * by a write to the other fd is ended, so that every line
+ * has a tag.  The data is not copied; the tags and the lines
+ * go out together, with writev().
+ */
+static void
+sink_write_tagged(struct copy_sink *s, int fd, const char *buf, size_t len)
+{
+    struct iovec iov[COPY_TAG_IOV];
+    const char *nl;
+    size_t n;
+    int cnt;
+
+    cnt = 0;
+    if (!s->bol && fd != s->last_fd) {
+        iov[cnt].iov_base = (void *)"\n";
+        iov[cnt].iov_len = 1;
+        ++cnt;
+        s->bol = true;
+    }
+    s->last_fd = fd;
+    while (len != 0) {
+        if (s->bol) {
+            if (s->seg.on && seg_rotate_due(s)) {
+                sink_putv(s, iov, cnt);
+                cnt = 0;
+                seg_rotate(s);
+            }
+            iov[cnt].iov_base = (void *)fd_tag[fd];
+            iov[cnt].iov_len = strlen(fd_tag[fd]);
+            ++cnt;
+            s->bol = false;
+        }
+        nl = (const char *)memchr(buf, '\n', len);
+        n = (nl != NULL) ? (size_t)(nl + 1 - buf) : len;
+        iov[cnt].iov_base = (void *)buf;
+        iov[cnt].iov_len = n;
+        ++cnt;
+        s->bol = (nl != NULL);
+        buf += n;
+        len -= n;
+        if (cnt >= COPY_TAG_IOV - 2) {
+            sink_putv(s, iov, cnt);
+            cnt = 0;
+        }
+    }
+    if (cnt != 0) {
+        sink_putv(s, iov, cnt);
+    }
+}
+
+/*
+ * Hand |len| bytes of |buf|, written to |fd|, to every sink that wants it.
+ */
+static void
+deliver(int fd, const char *buf, size_t len)
+{
+    struct copy_sink *s;
+
+    for (s = sinks; s < sinks + nr_sinks; ++s) {
+        if (!(s->fds & COPY_FD(fd))) {
+            continue;
+        }
+        if (s->tagged) {
+            sink_write_tagged(s, fd, buf, len);
+        }
+        else {
+            sink_write(s, buf, len);
+        }
+        seg_maybe_sync(s);
+    }
+}
+
+/*
+ * Is there anything for the writer thread to do, even if no more
+ * data comes: a flush, an fdatasync(), or a segment that is to be
+ * ended when it gets old, whether or not anything is written to it.
+ */
+static bool
+idle_work(void)
+{
+    struct copy_sink *s;
+
+    for (s = sinks; s < sinks + nr_sinks; ++s) {
+        if (s->z.pending != 0 || (s->seg.dirty && rotate_cfg.fsync_sec != 0)) {
+            return (true);
+        }
+        if (s->seg.on && rotate_cfg.time_sec != 0 && seg_size(s) != 0) {
+            return (true);
+        }
+    }
+    return (false);
+}
+
+/*
+ * A segment that is old enough is ended now, if it ends a line;
+ * if not, it is ended at the next newline, as usual.
+ */
+static void
+do_idle_work(void)
+{
+    struct copy_sink *s;
+
+    for (s = sinks; s < sinks + nr_sinks; ++s) {
+        if (s->seg.on && seg_size(s) != 0 && s->bol && seg_rotate_due(s)) {
+            seg_rotate(s);
+        }
+        z_flush(s);
+        seg_maybe_sync(s);
+    }
+}
+
+/*
+ * Copy |len| bytes out of the ring, at |pos|, which may wrap around.
+ */
+static void
+ring_get(void *dst, size_t pos, size_t len)
+{
+    size_t off, n;
+
+    off = pos & ring.mask;
+    n = ring.size - off;
+    if (n > len) {
+        n = len;
+    }
+    memcpy(dst, ring.buf + off, n);
+    memcpy((char *)dst + n, ring.buf, len - n);
+}
+
+static void *
+writer_main(void *arg)
+{
+    static const struct timespec idle_flush = {
+        COPY_IDLE_FLUSH_MS / 1000, (COPY_IDLE_FLUSH_MS % 1000) * 1000000
+    };
+    struct copy_frame fr;
+    size_t head, tail;
+    size_t left;
+    uint32_t seq;
+    bool timed_out;
+
+    (void)arg;
+    tail = ring.tail;
+    left = 0;
+    fr.fd = 0;
+    timed_out = false;
+    while (true) {
+        head = __atomic_load_n(&ring.head, __ATOMIC_ACQUIRE);
+        if (head == tail) {
+            if (__atomic_load_n(&ring.stop, __ATOMIC_ACQUIRE)) {
+                head = __atomic_load_n(&ring.head, __ATOMIC_ACQUIRE);
+                if (head == tail) {
+                    break;
+                }
+                continue;
+            }
+            if (timed_out) {
+                do_idle_work();
+                timed_out = false;
+            }
+            seq = __atomic_load_n(&ring.head_seq, __ATOMIC_SEQ_CST);
+            __atomic_store_n(&ring.consumer_waiting, 1, __ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&ring.head, __ATOMIC_SEQ_CST) == tail
+                && !__atomic_load_n(&ring.stop, __ATOMIC_SEQ_CST)) {
+                timed_out = futex_wait(&ring.head_seq, seq,
+                                       idle_work() ? &idle_flush : NULL);
+            }
+            __atomic_store_n(&ring.consumer_waiting, 0, __ATOMIC_SEQ_CST);
+            continue;
+        }
+
+        /*
+         * A frame and its data are published together, so if
+         * there is anything at all, there is a whole frame.
+         */
+        if (left == 0) {
+            ring_get(&fr, tail, sizeof (fr));
+            tail += sizeof (fr);
+            left = fr.len;
+        }
+
+        /*
+         * Hand over as much of the data as there is, up to the end
+         * of the ring.  The rest, if it wraps around, is next time.
+         */
+        {
+            size_t off = tail & ring.mask;
+            size_t n = head - tail;
+
+            if (n > left) {
+                n = left;
+            }
+            if (n > ring.size - off) {
+                n = ring.size - off;
+            }
+            deliver(fr.fd, ring.buf + off, n);
+            tail += n;
+            left -= n;
+        }
+        __atomic_store_n(&ring.tail, tail, __ATOMIC_RELEASE);
+        __atomic_add_fetch(&ring.tail_seq, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&ring.producer_waiting, __ATOMIC_SEQ_CST)) {
+            futex_wake(&ring.tail_seq);
+        }
+    }
+    return (NULL);
+}
+
+/*
+ * Wait until there are at least |room| free bytes in the ring.
+ */
+static void
+wait_for_room(size_t room)
+{
+    uint32_t seq;
+
+    while (ring.size - (ring.head - __atomic_load_n(&ring.tail, __ATOMIC_ACQUIRE)) < room) {
+        seq = __atomic_load_n(&ring.tail_seq, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&ring.producer_waiting, 1, __ATOMIC_SEQ_CST);
+        if (ring.size - (ring.head - __atomic_load_n(&ring.tail, __ATOMIC_SEQ_CST)) < room) {
+            futex_wait(&ring.tail_seq, seq, NULL);
+        }
+        __atomic_store_n(&ring.producer_waiting, 0, __ATOMIC_SEQ_CST);
+    }
+}
+
+/*
+ * Copy |len| bytes into the ring, at |pos|, which may wrap around.
+ */
+static void
+ring_put(size_t pos, const void *src, size_t len)
+{
+    size_t off, n;
+
+    off = pos & ring.mask;
+    n = ring.size - off;
+    if (n > len) {
+        n = len;
+    }
+    memcpy(ring.buf + off, src, n);
+    memcpy(ring.buf, (const char *)src + n, len - n);
+}
+
+static void
+publish(size_t head)
+{
+    __atomic_store_n(&ring.head, head, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&ring.head_seq, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring.consumer_waiting, __ATOMIC_SEQ_CST)) {
+        futex_wake(&ring.head_seq);
+    }
+}
+
+/*
+ * Open |fname|, for a sink.  /dev/fd/<n> is a dup() of fd <n>,
+ * as it is, not a new open file, which would be truncated, and,
+ * for a file with O_APPEND, or a pipe, might not be the same thing.
+ */
+static int
+sink_fd_open(const char *fname, bool *inherited)
+{
+    char *end;
+    long n;
+
+    *inherited = false;
+    if (strncmp(fname, "/dev/fd/", 8) == 0) {
+        n = strtol(fname + 8, &end, 10);
+        if (end != fname + 8 && *end == '\0' && n >= 0 && n <= INT_MAX) {
+            *inherited = true;
+            return (fcntl((int)n, F_DUPFD_CLOEXEC, 3));
+        }
+    }
+    return (open(fname, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666));
+}
+
+/**
+ * @brief Add a sink: create, or truncate, |fname|, and copy to it
+ *        what is written to each fd in |fds|.
+ *
+ * @param fname   file to copy to; /dev/fd/<n> for an open fd,
+ *                which is used as it is, and never rotated
+ * @param fds     COPY_FD(1), COPY_FD(2), or both
+ * @param tagged  start each line with the fd it was written to
+ * @return        false, with errno set, if |fname| cannot be opened.
+ *
+ * To be called before copy_writer_start().
+ */
+bool
+copy_sink_open(const char *fname, unsigned int fds, bool tagged)
+{
+    struct copy_sink *s;
+    bool inherited;
+    int fd;
+
+    fd = sink_fd_open(fname, &inherited);
+    if (fd == -1) {
+        return (false);
+    }
+    sinks = (struct copy_sink *)
+        guard_realloc(sinks, (nr_sinks + 1) * sizeof (*sinks));
+    s = &sinks[nr_sinks++];
+    memset(s, 0, sizeof (*s));
+    s->fname = (char *)guard_malloc(strlen(fname) + 1);
+    strcpy(s->fname, fname);
+    s->fd = fd;
+    s->inherited = inherited;
+    s->fds = fds;
+    s->tagged = tagged;
+    s->bol = true;
+    copy_fds |= fds;
+    return (true);
+}
+
+/**
+ * @brief Rotate the sinks that are regular files, as |cfg| says.
+ *
+ * To be called before copy_writer_start().
+ */
+void
+copy_writer_set_rotate(const struct copy_rotate *cfg)
+{
+    rotate_cfg = *cfg;
+}
+
+/**
+ * @brief Start a thread to write to the sinks.
+ *
+ * @param size      size of the ring buffer, in bytes;
+ *                  rounded up to a power of 2
+ * @param overflow  what to do when the ring is full
+ * @param level     zlib compression level, 0-9,
+ *                  or -1 to write the copies as they are
+ * @return          true if the thread is running; if not,
+ *                  copy_write() writes to the sinks itself.
+ */
+bool
+copy_writer_start(size_t size, enum copy_overflow overflow, int level)
+{
+    struct copy_sink *s;
+    struct stat st;
+    sigset_t all, old;
+    size_t sz;
+    int err;
+
+    if (running || nr_sinks == 0) {
+        return (running);
+    }
+    sz = 4096;
+    while (sz < size) {
+        sz *= 2;
+    }
+    memset(&ring, 0, sizeof (ring));
+    ring.overflow = overflow;
+
+    for (s = sinks; s < sinks + nr_sinks; ++s) {
+        s->seg.on = (rotate_cfg.size != 0 || rotate_cfg.time_sec != 0)
+            && !s->inherited && fstat(s->fd, &st) == 0 && S_ISREG(st.st_mode);
+        s->seg.prealloc = true;
+        s->seg.start_ns = clock_ns();
+        s->seg.sync_ns = s->seg.start_ns;
+
+        if (level >= 0) {
+            /*
+             * windowBits 15 + 16: a gzip header and trailer,
+             * so that the copy can be read with zcat.
+             */
+            if (deflateInit2(&s->z.zs, level, Z_DEFLATED, 15 + 16, 8,
+                             Z_DEFAULT_STRATEGY) != Z_OK) {
+                eprintf("copy: cannot start zlib; '%s' is not compressed.\n",
+                    s->fname);
+            }
+            else {
+                s->z.out = (char *)guard_malloc(COPY_ZOUT);
+                s->z.on = true;
+            }
+        }
+    }
+
+    ring.buf = (char *)guard_malloc(sz);
+    ring.size = sz;
+    ring.mask = sz - 1;
+
+    /*
+     * Signals are for the tracer.  SIGALRM, in particular,
+     * must interrupt its waitpid().
+     */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    err = pthread_create(&writer_thread, NULL, writer_main, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (err != 0) {
+        free(ring.buf);
+        ring.buf = NULL;
+        return (false);
+    }
+    running = true;
+    return (true);
+}
+
+/**
+ * @brief Is there any sink for what is written to |fd|?
+ */
+bool
+copy_wanted(int fd)
+{
+    return (fd >= 0 && fd < 32 && (copy_fds & COPY_FD(fd)));
+}
+
+/**
+ * @brief Copy |len| bytes of |buf|, written to |fd|, to every sink for |fd|.
+ *
+ * If the writer thread is running, the data is put in the ring, once,
+ * and written by that thread, later.
+ */
+void
+copy_write(int fd, const void *buf, size_t len)
+{
+    struct copy_frame fr;
+    const char *p;
+    size_t used;
+
+    if (!copy_wanted(fd) || len == 0) {
+        return;
+    }
+    if (!running) {
+        deliver(fd, (const char *)buf, len);
+        return;
+    }
+
+    ++ring.nr_puts;
+    if (ring.overflow == COPY_OVERFLOW_DROP && len + sizeof (fr) <= ring.size
+        && ring.size - (ring.head - __atomic_load_n(&ring.tail, __ATOMIC_ACQUIRE))
+           < len + sizeof (fr)) {
+        /*
+         * All or nothing.  Half a line in the copy is worse
+         * than a line missing.  A write that is bigger than
+         * the ring could never go in whole; that goes in
+         * as far as there is room for it, below.
+         */
+        ++ring.nr_drops;
+        ring.dropped_bytes += len;
+        return;
+    }
+
+    p = (const char *)buf;
+    fr.fd = fd;
+    while (len != 0) {
+        size_t chunk;
+        size_t room;
+
+        chunk = len < ring.size - sizeof (fr) ? len : ring.size - sizeof (fr);
+        room = ring.size - (ring.head - __atomic_load_n(&ring.tail, __ATOMIC_ACQUIRE));
+        if (room < chunk + sizeof (fr) && ring.overflow == COPY_OVERFLOW_DROP) {
+            if (room <= sizeof (fr)) {
+                ++ring.nr_drops;
+                ring.dropped_bytes += len;
+                return;
+            }
+            chunk = room - sizeof (fr);
+        }
+        else if (room < chunk + sizeof (fr)) {
+            uint64_t t0 = clock_ns();
+
+            ++ring.nr_blocks;
+            wait_for_room(chunk + sizeof (fr));
+            ring.block_ns += clock_ns() - t0;
+        }
+        fr.len = (uint32_t)chunk;
+        ring_put(ring.head, &fr, sizeof (fr));
+        ring_put(ring.head + sizeof (fr), p, chunk);
+        publish(ring.head + sizeof (fr) + chunk);
+        used = ring.head - __atomic_load_n(&ring.tail, __ATOMIC_ACQUIRE);
+        if (used > ring.high_water) {
+            ring.high_water = used;
+        }
+        ring.bytes += chunk;
+        p += chunk;
+        len -= chunk;
+    }
+}
+
+/**
+ * @brief The file descriptor to write a copy of what is written
+ *        to |fd| to, directly, or -1.
+ *
+ * Only if there is exactly one sink for |fd|, and nothing to do
+ * to the data on the way, is there such a file descriptor.
+ * Before writing to it, call copy_sync().
+ */
+int
+copy_direct_fd(int fd)
+{
+    struct copy_sink *s, *found;
+
+    found = NULL;
+    for (s = sinks; s < sinks + nr_sinks; ++s) {
+        if (s->fds & COPY_FD(fd)) {
+            if (found != NULL) {
+                return (-1);
+            }
+            found = s;
+        }
+    }
+    if (found == NULL || found->tagged || found->z.on || found->seg.on) {
+        return (-1);
+    }
+    return (found->fd);
+}
+
+/**
+ * @brief Make sure all of the copies so far have been written.
+ */
+void
+copy_sync(void)
+{
+    if (running) {
+        wait_for_room(ring.size);
+    }
+}
+
+/**
+ * @brief Write out whatever is left in the ring, stop the writer thread,
+ *        and finish and close the sinks.
+ *
+ * With |verbose|, or if anything was dropped or could not be written,
+ * report about it on stderr.
+ */
+void
+copy_writer_stop(bool verbose)
+{
+    struct copy_sink *s;
+
+    if (running) {
+        __atomic_store_n(&ring.stop, 1, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&ring.head_seq, 1, __ATOMIC_SEQ_CST);
+        futex_wake(&ring.head_seq);
+        pthread_join(writer_thread, NULL);
+        running = false;
+
+        if (verbose || ring.nr_drops != 0) {
+            eprintf("copy: writes=%lu bytes=%zu dropped=%lu (%zu bytes)"
+                " blocked=%lu (%.3f s) high-water=%zu of %zu\n",
+                ring.nr_puts, ring.bytes, ring.nr_drops, ring.dropped_bytes,
+                ring.nr_blocks, ring.block_ns / 1e9,
+                ring.high_water, ring.size);
+        }
+        free(ring.buf);
+        ring.buf = NULL;
+    }
+
+    for (s = sinks; s < sinks + nr_sinks; ++s) {
+        if (s->tagged && !s->bol) {
+            sink_put(s, "\n", 1);
+        }
+        if (s->seg.on) {
+            seg_finish(s);
+        }
+        else if (s->z.on) {
+            z_put(s, NULL, 0, Z_FINISH);
+        }
+        if (verbose) {
+            eprintf("copy: %s bytes=%zu", s->fname, s->bytes);
+            if (s->z.on) {
+                uint64_t in = s->z.done_in + s->z.zs.total_in;
+                uint64_t out = s->z.done_out + s->z.zs.total_out;
+
+                eprintf(" zlib out=%llu ratio=%.2f flushes=%lu",
+                    (unsigned long long)out,
+                    out ? (double)in / out : 0.0, s->z.nr_flushes);
+            }
+            if (s->seg.on) {
+                eprintf(" rotations=%lu syncs=%lu preallocated=%s",
+                    s->seg.nr_rotations, s->seg.nr_syncs,
+                    s->seg.prealloc ? "yes" : "no");
+            }
+            eprintf("\n");
+        }
+        if (s->z.on) {
+            deflateEnd(&s->z.zs);
+            free(s->z.out);
+        }
+        if (s->err != 0) {
+            eprintf("copy: '%s': ", s->fname);
+            fshow_errno(stderr, "write() failed - ", s->err);
+        }
+        close(s->fd);
+        free(s->fname);
+    }
+    free(sinks);
+    sinks = NULL;
+    nr_sinks = 0;
+    copy_fds = 0;
+}
@@ -0,0 +1,267 @@
+/*
+ * Filename: src/liberrmark/errmark-ctx.c
+ * Project: errmark
+ * Library: liberrmark
+ * Brief: Run traced commands from a program that embeds liberrmark
+ *
+ * Copyright (C) 2016-2019 Guy Shaw
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * An errmark_ctx is one command, with its options, in a cmd_t,
+ * as the errmark program sets them, and marks of its own.
+ * Any number of them can be run, one after another, or at the same
+ * time, each by a thread of its own; the thread that runs one is its
+ * tracer, and the marks it works on are those of the context it runs
+ * (see mark_ctx_use()).
+ *
+ * With an |on_write| sink, the output, marks and all, is handed to it,
+ * rather than written to fd 1 and fd 2, each piece with the fd it would
+ * have been written to.  Writes that errmark would otherwise leave
+ * to the kernel, pwrite() and sendto() with flags and the like, are
+ * emulated, so they come to the sink, too, and so does the data moved
+ * with sendfile() and the like, that errmark moves itself.  Only what
+ * it cannot move without waiting for it, from a pipe or a socket with
+ * nothing in it yet, still goes where the command sent it.
+ * With an |on_data| sink, it gets the data as the command wrote it,
+ * before marks, prefixes or colors.
+ *
+ * What is not in an errmark_ctx is for the process as a whole,
+ * and belongs to the program: --copy, --record, --coalesce, --io-uring,
+ * the --highlight rules, and the --timestamp clock.
+ * The highlight rules and the clock are only read, or changed while
+ * holding the output turn, so, once a context has been run, the output
+ * of all of them takes turns (see output-order.c), and the rest of
+ * the tracing still goes on at the same time.
+ * The copies, the record, the coalescing timer and the io_uring ring
+ * are one of each, opened and closed, and armed, without any turn
+ * being taken; while any of them is in use, errmark_ctx_run() will
+ * not run a context while another one is running.
+ *
+ * errmark_run_batch() (see run-program.c) runs many of them at once,
+ * all traced by the one thread that calls it.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <errmark.h>
+#include <cscript.h>		// Import guard_calloc(), sname(), eprintf()
+#include <stdbool.h>
+#include <stdlib.h>		// Import free()
+#include <errno.h>		// Import errno, EBUSY
+
+/*
+ * Number of contexts being run, by errmark_ctx_run(), just now.
+ */
+static unsigned int nr_live = 0;
+
+/*
+ * Is any of the state of the process that cannot be shared
+ * by two contexts, run at once, in use?
+ */
+static bool
+process_state_busy(void)
+{
+    return (copy_wanted(1) || copy_wanted(2) || record_active()
+            || mark_coalescing() || uring_sink_active());
+}
+
+/*
+ * Count one more context as being run, unless another is, and
+ * the state of the process cannot be shared.  Take no lock: two
+ * threads that get here at once cannot both see none running.
+ */
+static bool
+live_enter(void)
+{
+    unsigned int n;
+
+    n = __atomic_load_n(&nr_live, __ATOMIC_ACQUIRE);
+    do {
+        if (n != 0 && process_state_busy()) {
+            return (false);
+        }
+    } while (!__atomic_compare_exchange_n(&nr_live, &n, n + 1, false,
+                                          __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+    return (true);
+}
+
+/**
+ * @brief A new command context, with the defaults of errmark,
+ * and no marks.
+ */
+errmark_ctx_t *
+errmark_ctx_new(void)
+{
+    errmark_ctx_t *ctx;
+
+    ctx = (errmark_ctx_t *)guard_calloc(1, sizeof (*ctx));
+    ctx->cmd.nullify = true;
+    ctx->cmd.emulate = true;
+    ctx->cmd.syscall_info = true;
+    ctx->cmd.copy_compress = -1;
+    ctx->marks = mark_ctx_new();
+    return (ctx);
+}
+
+/**
+ * @brief Free what errmark_ctx_new() returned.
+ */
+void
+errmark_ctx_free(errmark_ctx_t *ctx)
+{
+    if (ctx == NULL) {
+        return;
+    }
+    mark_ctx_free(ctx->marks);
+    free(ctx);
+}
+
+/**
+ * @brief Say what command to run: |argv|, with |argc| arguments.
+ *
+ * argv[0] is looked up in $PATH.  |argv| is not copied.
+ */
+void
+errmark_ctx_set_argv(errmark_ctx_t *ctx, int argc, char * const *argv)
+{
+    ctx->cmd.argc = argc;
+    ctx->cmd.argv = argv;
+    ctx->cmd.cmd_path = argv[0];
+    ctx->cmd.cmd_name = sname(argv[0]);
+}
+
+/**
+ * @brief Take on the marks, line prefixes, highlighting and timestamps
+ * of the process, as set by setmark() and the rest of mark-write.c,
+ * in place of those of |ctx|.  Set the sink after.
+ */
+void
+errmark_ctx_inherit_marks(errmark_ctx_t *ctx)
+{
+    mark_ctx_free(ctx->marks);
+    ctx->marks = mark_ctx_dup(NULL);
+}
+
+/**
+ * @brief Mark output to |fd| with |m_start| and |m_end|.
+ */
+bool
+errmark_ctx_set_mark(errmark_ctx_t *ctx, int fd,
+    const char *m_start, const char *m_end)
+{
+    struct mark_ctx *prev;
+    bool ok;
+
+    prev = mark_ctx_use(ctx->marks);
+    ok = setmark(fd, m_start, m_end);
+    mark_ctx_use(prev);
+    return (ok);
+}
+
+/**
+ * @brief Start every line written to |fd| with |prefix|.
+ */
+bool
+errmark_ctx_set_line_prefix(errmark_ctx_t *ctx, int fd, const char *prefix)
+{
+    struct mark_ctx *prev;
+    bool ok;
+
+    prev = mark_ctx_use(ctx->marks);
+    ok = mark_set_line_prefix(fd, prefix);
+    mark_ctx_use(prev);
+    return (ok);
+}
+
+/**
+ * @brief Color the lines written to |fd|, by the highlight rules
+ * of the process.
+ */
+void
+errmark_ctx_set_highlight(errmark_ctx_t *ctx, int fd)
+{
+    struct mark_ctx *prev;
+
+    prev = mark_ctx_use(ctx->marks);
+    mark_set_highlight(fd);
+    mark_ctx_use(prev);
+}
+
+/**
+ * @brief Hand output to |on_write|, and the data, as written,
+ * to |on_data|.
+ *
+ * Either can be NULL.  They are called by the thread that runs
+ * |ctx|, with |ctx|, and can get at |arg| through it.  The output
+ * of other contexts waits for them, so they should be quick.
+ */
+void
+errmark_ctx_set_sink(errmark_ctx_t *ctx, errmark_write_fn on_write,
+    errmark_write_fn on_data, void *arg)
+{
+    struct mark_ctx *prev;
+
+    ctx->on_write = on_write;
+    ctx->on_data = on_data;
+    ctx->arg = arg;
+    prev = mark_ctx_use(ctx->marks);
+    mark_set_sink(ctx, on_write, on_data);
+    mark_ctx_use(prev);
+}
+
+/**
+ * @brief Run the command |argv|, traced, and wait for it to finish.
+ *
+ * The calling thread is the tracer.  Its --stats counters are added
+ * to those of the process when it is done.
+ *
+ * @param ctx   the command context
+ * @param argc  number of arguments
+ * @param argv  the command and its arguments; argv[0] is looked up
+ *              in $PATH
+ * @return      the wait status of the command, or -1, with errno
+ *              set to EBUSY, if another context is being run, and
+ *              --copy, --record, --coalesce or --io-uring is in use
+ */
+int
+errmark_ctx_run(errmark_ctx_t *ctx, int argc, char * const *argv)
+{
+    struct mark_ctx *prev;
+    cmd_t *cmd;
+    int status;
+
+    cmd = &ctx->cmd;
+    errmark_ctx_set_argv(ctx, argc, argv);
+    cmd->attach_pid = 0;
+
+    if (!live_enter()) {
+        eprintf("%s: Cannot run, with --copy, --record, --coalesce"
+                " or --io-uring, while another command is running.\n",
+                cmd->cmd_name);
+        errno = EBUSY;
+        return (-1);
+    }
+    order_share();
+    prev = mark_ctx_use(ctx->marks);
+    stats_thread_start();
+    status = errmark_run_program(cmd);
+    stats_thread_done();
+    mark_ctx_use(prev);
+    __atomic_sub_fetch(&nr_live, 1, __ATOMIC_RELEASE);
+    cmd->child_status = status;
+    return (status);
+}
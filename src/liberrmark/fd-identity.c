@@ -0,0 +1,171 @@
+/*
+ * Filename: src/liberrmark/fd-identity.c
+ * Project: errmark
+ * Library: liberrmark
+ * Brief: File descriptors of a tracee: are they ours?  Get a copy of one
+ *
+ * Copyright (C) 2016-2019 Guy Shaw
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Once children of the child are traced, fd 1 is not always
+ * the stdout that errmark was given.  A shell runs $(command)
+ * with fd 1 redirected to a pipe, and 2>file or 1>&2 are everywhere.
+ * Those writes are none of our business, and must be left alone.
+ *
+ * A tracee fd is marked only if it refers to the same open file
+ * description that fd 1 or fd 2 of errmark itself refers to,
+ * which is what the child inherited.
+ *
+ * kcmp(KCMP_FILE) answers exactly that question, in one system call.
+ * If kcmp is not available (CONFIG_CHECKPOINT_RESTORE=n),
+ * compare device and inode numbers, instead.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <errmark.h>
+#include <stdbool.h>
+#include <stdio.h>		// Import snprintf(), fopen(), fgets()
+#include <stdlib.h>		// Import strtol()
+#include <string.h>		// Import strncmp()
+#include <errno.h>		// Import errno
+#include <unistd.h>		// Import syscall(), getpid()
+#include <sys/stat.h>		// Import stat(), fstat()
+#include <syscall.h>		// Import SYS_kcmp, SYS_pidfd_open, SYS_pidfd_getfd
+#include <linux/kcmp.h>		// Import KCMP_FILE
+
+static bool kcmp_refused = false;
+
+static bool
+same_inode(pid_t pid, int fd, int ourfd)
+{
+    char fname[40];
+    struct stat st, ourst;
+
+    snprintf(fname, sizeof (fname), "/proc/%d/fd/%d", (int)pid, fd);
+    if (stat(fname, &st) == -1 || fstat(ourfd, &ourst) == -1) {
+        return (false);
+    }
+    return (st.st_dev == ourst.st_dev && st.st_ino == ourst.st_ino);
+}
+
+/**
+ * @brief Is fd |fd| of tracee |pid| one whose writes get marked?
+ *
+ * @param pid  tid of the tracee
+ * @param fd   file descriptor, as given to write()
+ * @return     true if |fd| is 1 or 2, and refers to the same open file
+ *             as our own fd of the same number.
+ */
+bool
+tracee_fd_is_marked(pid_t pid, int fd)
+{
+    long rv;
+
+    if (fd != 1 && fd != 2) {
+        return (false);
+    }
+
+    if (!kcmp_refused) {
+        rv = syscall(SYS_kcmp, getpid(), pid, KCMP_FILE, fd, fd);
+        if (rv >= 0) {
+            return (rv == 0);
+        }
+        if (errno == ENOSYS || errno == EPERM) {
+            kcmp_refused = true;
+        }
+        else {
+            /*
+             * EBADF: the tracee does not have |fd| open,
+             * or the tracee is gone.
+             */
+            return (false);
+        }
+    }
+    return (same_inode(pid, fd, fd));
+}
+
+/**
+ * @brief The thread group id of thread |tid|.
+ *
+ * |tid| itself, if it cannot be found out.
+ */
+pid_t
+tracee_tgid(pid_t tid)
+{
+    char fname[32];
+    char line[64];
+    FILE *f;
+    pid_t tgid;
+
+    snprintf(fname, sizeof (fname), "/proc/%d/status", (int)tid);
+    f = fopen(fname, "r");
+    if (f == NULL) {
+        return (tid);
+    }
+    tgid = tid;
+    while (fgets(line, sizeof (line), f) != NULL) {
+        if (strncmp(line, "Tgid:", 5) == 0) {
+            tgid = (pid_t)strtol(line + 5, NULL, 10);
+            break;
+        }
+    }
+    fclose(f);
+    return (tgid);
+}
+
+/**
+ * @brief Get a copy of file descriptor |fd| of tracee |pid|.
+ *
+ * The copy refers to the same open file description,
+ * so it shares the file offset and status flags with the original,
+ * unlike a file descriptor got by opening /proc/<pid>/fd/<fd>.
+ * Needs pidfd_getfd(2), which is Linux 5.6 or later.
+ *
+ * @param pid  tid of the tracee
+ * @param fd   file descriptor of the tracee
+ * @return     a file descriptor of our own (close-on-exec),
+ *             or -1, with errno set.
+ */
+int
+tracee_getfd(pid_t pid, int fd)
+{
+#if defined(SYS_pidfd_open) && defined(SYS_pidfd_getfd)
+    int pidfd;
+    int ourfd;
+
+    pidfd = (int)syscall(SYS_pidfd_open, pid, 0);
+    if (pidfd == -1 && errno == EINVAL) {
+        /*
+         * Not a thread group leader; file descriptors
+         * are (almost always) shared by all threads.
+         */
+        pidfd = (int)syscall(SYS_pidfd_open, tracee_tgid(pid), 0);
+    }
+    if (pidfd == -1) {
+        return (-1);
+    }
+    ourfd = (int)syscall(SYS_pidfd_getfd, pidfd, fd, 0);
+    close(pidfd);
+    return (ourfd);
+#else
+    (void)pid;
+    (void)fd;
+    errno = ENOSYS;
+    return (-1);
+#endif
+}
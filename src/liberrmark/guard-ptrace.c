@@ -14,6 +14,18 @@ guard_ptrace(cmd_t *cmd, enum __ptrace_request request, pid_t pid, void *addr, v
     }
 
     err = 0;
+    ++cmd->nr_ptrace;
+    switch (request) {
+    case PTRACE_GETREGS:
+        ++cmd->nr_ptrace_get;
+        break;
+    case PTRACE_SETREGS:
+    case PTRACE_POKEUSER:
+        ++cmd->nr_ptrace_set;
+        break;
+    default:
+        break;
+    }
     rc = ptrace(request, pid, addr, data);
 
     if (rc == -1L) {
@@ -24,7 +36,7 @@ guard_ptrace(cmd_t *cmd, enum __ptrace_request request, pid_t pid, void *addr, v
         fprintf(cmd->trace_fbt, "< ptrace\n");
     }
 
-    if (err != ESRCH) {
+    if (err == ESRCH) {
         cmd->child_exited = true;
     }
 
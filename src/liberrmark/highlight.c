@@ -0,0 +1,343 @@
+/*
+ * Filename: src/liberrmark/highlight.c
+ * Project: errmark
+ * Library: liberrmark
+ * Brief: Color lines by what is in them, using an Aho-Corasick automaton
+ *
+ * Copyright (C) 2016-2019 Guy Shaw
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A rule is a color and a literal string.  A line that contains
+ * the literal of some rule is shown in the color of that rule;
+ * if it contains more than one, the one that ends first wins.
+ *
+ * All the literals are compiled into one deterministic automaton,
+ * a full table of 256 transitions per state, with the failure links
+ * already followed.  Matching is then one table lookup per byte,
+ * however many rules there are.  A transition into a state where
+ * some literal ends has HL_ACCEPT set, so the loop over the bytes
+ * needs no second lookup to know when to stop.
+ *
+ * Each lookup has to wait for the one before it, though.  Most bytes
+ * leave the automaton where it is, at the root, so, there, bytes that
+ * cannot start any literal are skipped first, with lookups that do not
+ * depend on each other, in |can_start|.
+ *
+ * Rules come from a file, one per line:
+ *
+ *     # comment
+ *     <color>  <literal>
+ *
+ * where <color> is any name known to lookup_color(), and <literal>
+ * is the rest of the line, after the blanks that follow the color.
+ * Without a file, there are rules for "error:", "Error:" and "ERROR",
+ * and for "warning:", "Warning:" and "WARNING"; see default_rules.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <errmark.h>
+#include <cscript.h>		// Import guard_malloc(), guard_realloc(), lookup_color()
+#include <stdbool.h>
+#include <stdint.h>		// Import uint32_t
+#include <stdio.h>		// Import fopen(), getline()
+#include <stdlib.h>		// Import free()
+#include <string.h>		// Import strlen(), strerror(), memset()
+#include <errno.h>		// Import errno
+
+#define HL_ACCEPT 0x80000000u
+#define HL_STATE  0x7fffffffu
+
+struct hl_rule {
+    const char *esc_start;
+    const char *esc_end;
+    size_t esc_start_len;
+    size_t esc_end_len;
+    char *literal;
+};
+
+static struct hl_rule *rules = NULL;
+static size_t nr_rules = 0;
+static size_t rules_alloc = 0;
+
+static uint32_t *delta = NULL;  // delta[state * 256 + byte]
+static int *accept = NULL;      // Rule that ends in a state, or -1
+static size_t nr_states = 0;
+static size_t states_alloc = 0;
+static bool can_start[256];
+
+static const struct {
+    const char *color;
+    const char *literal;
+} default_rules[] = {
+    { "bright-red",  "error:" },
+    { "bright-red",  "Error:" },
+    { "bright-red",  "ERROR" },
+    { "yellow",      "warning:" },
+    { "yellow",      "Warning:" },
+    { "yellow",      "WARNING" },
+    { NULL, NULL }
+};
+
+/**
+ * @brief Add a rule: lines that contain |literal| are shown in |color|.
+ */
+bool
+highlight_rule(const char *color, const char *literal)
+{
+    color_esc_t *ent;
+    struct hl_rule *r;
+
+    ent = lookup_color(color);
+    if (ent == NULL) {
+        eprintf("errmark: unknown color, '%s'.\n", color);
+        return (false);
+    }
+    if (*literal == '\0') {
+        eprintf("errmark: empty literal, for color '%s'.\n", color);
+        return (false);
+    }
+    if (nr_rules == rules_alloc) {
+        rules_alloc = rules_alloc ? 2 * rules_alloc : 16;
+        rules = (struct hl_rule *)
+            guard_realloc(rules, rules_alloc * sizeof (*rules));
+    }
+    r = &rules[nr_rules++];
+    r->esc_start = ent->esc_start;
+    r->esc_end = ent->esc_end;
+    r->esc_start_len = strlen(ent->esc_start);
+    r->esc_end_len = strlen(ent->esc_end);
+    r->literal = (char *)guard_malloc(strlen(literal) + 1);
+    strcpy(r->literal, literal);
+    return (true);
+}
+
+/**
+ * @brief Add the rules in the file |fname|.
+ */
+bool
+highlight_load(const char *fname)
+{
+    FILE *f;
+    char *line;
+    size_t line_size;
+    ssize_t len;
+    char *color, *literal;
+    unsigned long lnr;
+    bool ok;
+
+    f = fopen(fname, "r");
+    if (f == NULL) {
+        eprintf("errmark: %s: %s\n", fname, strerror(errno));
+        return (false);
+    }
+    line = NULL;
+    line_size = 0;
+    lnr = 0;
+    ok = true;
+    while ((len = getline(&line, &line_size, f)) != -1) {
+        ++lnr;
+        if (len > 0 && line[len - 1] == '\n') {
+            line[--len] = '\0';
+        }
+        color = line;
+        while (*color == ' ' || *color == '\t') {
+            ++color;
+        }
+        if (*color == '\0' || *color == '#') {
+            continue;
+        }
+        literal = color;
+        while (*literal && *literal != ' ' && *literal != '\t') {
+            ++literal;
+        }
+        if (*literal != '\0') {
+            *literal++ = '\0';
+        }
+        while (*literal == ' ' || *literal == '\t') {
+            ++literal;
+        }
+        if (!highlight_rule(color, literal)) {
+            eprintf("errmark: %s, line %lu.\n", fname, lnr);
+            ok = false;
+        }
+    }
+    free(line);
+    fclose(f);
+    return (ok);
+}
+
+static uint32_t
+new_state(void)
+{
+    if (nr_states == states_alloc) {
+        states_alloc = states_alloc ? 2 * states_alloc : 64;
+        delta = (uint32_t *)
+            guard_realloc(delta, states_alloc * 256 * sizeof (*delta));
+        accept = (int *)
+            guard_realloc(accept, states_alloc * sizeof (*accept));
+    }
+    memset(&delta[nr_states * 256], 0, 256 * sizeof (*delta));
+    accept[nr_states] = -1;
+    return ((uint32_t)nr_states++);
+}
+
+/**
+ * @brief Build the automaton for all the rules so far.
+ *
+ * Without any rules, the default ones are used.
+ */
+void
+highlight_compile(void)
+{
+    uint32_t *fail, *queue;
+    const unsigned char *p;
+    uint32_t s, t, f;
+    size_t head, tail;
+    size_t i;
+    int c;
+
+    if (nr_rules == 0) {
+        for (i = 0; default_rules[i].color != NULL; ++i) {
+            highlight_rule(default_rules[i].color, default_rules[i].literal);
+        }
+    }
+
+    /*
+     * The trie.  0 is the root; a transition to 0, other than
+     * from the root, is a missing one, for now.
+     */
+    nr_states = 0;
+    new_state();
+    for (i = 0; i < nr_rules; ++i) {
+        s = 0;
+        for (p = (const unsigned char *)rules[i].literal; *p; ++p) {
+            if (delta[s * 256 + *p] == 0) {
+                t = new_state();
+                delta[s * 256 + *p] = t;
+            }
+            s = delta[s * 256 + *p];
+        }
+        if (accept[s] == -1) {
+            accept[s] = (int)i;
+        }
+    }
+
+    /*
+     * Breadth first, fill in the missing transitions of each state
+     * with those of its failure state, which is nearer the root,
+     * and so already complete.
+     */
+    fail = (uint32_t *)guard_calloc(nr_states, sizeof (*fail));
+    queue = (uint32_t *)guard_malloc(nr_states * sizeof (*queue));
+    head = tail = 0;
+    for (c = 0; c < 256; ++c) {
+        t = delta[c];
+        if (t != 0) {
+            fail[t] = 0;
+            queue[tail++] = t;
+        }
+    }
+    while (head < tail) {
+        s = queue[head++];
+        f = fail[s];
+        if (accept[s] == -1) {
+            accept[s] = accept[f];
+        }
+        for (c = 0; c < 256; ++c) {
+            t = delta[s * 256 + c];
+            if (t != 0) {
+                fail[t] = delta[f * 256 + c];
+                queue[tail++] = t;
+            }
+            else {
+                delta[s * 256 + c] = delta[f * 256 + c];
+            }
+        }
+    }
+    free(queue);
+    free(fail);
+
+    for (c = 0; c < 256; ++c) {
+        can_start[c] = (delta[c] != 0);
+    }
+
+    for (i = 0; i < nr_states * 256; ++i) {
+        if (accept[delta[i]] != -1) {
+            delta[i] |= HL_ACCEPT;
+        }
+    }
+}
+
+/**
+ * @brief Look for a literal in |len| bytes at |buf|.
+ *
+ * |*state| is where the last call left off; 0 at the start of a line.
+ *
+ * @return the rule whose literal was found first, or -1 if none
+ */
+int
+highlight_scan(uint32_t *state, const char *buf, size_t len)
+{
+    const unsigned char *p, *end;
+    uint32_t s;
+
+    s = *state;
+    p = (const unsigned char *)buf;
+    end = p + len;
+    while (p < end) {
+        if (s == 0) {
+            while (p < end && !can_start[*p]) {
+                ++p;
+            }
+            if (p == end) {
+                break;
+            }
+        }
+        s = delta[s * 256 + *p++];
+        if (s & HL_ACCEPT) {
+            s &= HL_STATE;
+            *state = s;
+            return (accept[s]);
+        }
+    }
+    *state = s;
+    return (-1);
+}
+
+/**
+ * @brief The escape sequences that start and end the color of |rule|.
+ */
+void
+highlight_esc(int rule, const char **start, size_t *start_len,
+    const char **end, size_t *end_len)
+{
+    *start = rules[rule].esc_start;
+    *start_len = rules[rule].esc_start_len;
+    *end = rules[rule].esc_end;
+    *end_len = rules[rule].esc_end_len;
+}
+
+/**
+ * @brief Number of rules and of states, for --verbose.
+ */
+void
+highlight_stats(size_t *rules_p, size_t *states_p)
+{
+    *rules_p = nr_rules;
+    *states_p = nr_states;
+}
@@ -8,20 +8,276 @@
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/uio.h>
 
 #include <cscript.h>
+#include <errmark.h>
 
-extern FILE *dbgprint_fh;
+/*
+ * Line prefixes.
+ *
+ * With a prefix for an fd, every line written to it starts with
+ * the prefix, after any start mark.  Whether the next byte a process
+ * writes to an fd starts a line is kept per process (thread group)
+ * and fd.  Starting a line is the usual case, so only the writers
+ * that are in the middle of a line are kept, in |lp_partial|;
+ * there are seldom more than one or two.
+ *
+ * Highlighting (see highlight.c) is done the same way, line by line.
+ * The color of a line starts after the prefix, or, if the line is
+ * written in pieces, at the start of the piece its literal is found in.
+ * It ends before the newline, and at the end of each piece, where
+ * the start mark of the fd is put back.  How far the matcher got
+ * in a line written in pieces is kept along with the rest.
+ *
+ * Timestamps (see timestamp.c) go at the start of each line, before
+ * the prefix, or, if |ts_per_write|, at the start of each write.
+ * The clock is read once per write; all the lines in it get the same.
+ *
+ * The data, with the prefixes and colors, is put together in |lp_buf|,
+ * a few memcpy() per line, and written in one go, like any other.
+ */
+struct lp_writer {
+    pid_t    tgid;
+    int      fd;
+    uint32_t hl_state;      // Where the matcher got to in this line
+    int      hl_rule;       // Rule matched in this line, or -1
+};
+
+/*
+ * Thread id to thread group id, for the last few threads seen.
+ */
+#define TGID_CACHE 64
+
+/*
+ * Everything about marking the output of one command:
+ * the marks, where output goes, and how far along it is.
+ *
+ * The errmark program has just the one, |mark_default|.
+ * A program that embeds liberrmark has one per errmark_ctx,
+ * and mark_ctx_use() says which one the functions below work on,
+ * for the calling thread.
+ */
+struct mark_ctx {
+    char *start1;
+    char *end1;
+    char *start2;
+    char *end2;
+
+    /*
+     * Lengths of the marks, computed once, when they are set.
+     */
+    size_t start1_len;
+    size_t end1_len;
+    size_t start2_len;
+    size_t end2_len;
+
+    int cur_fd;
+
+    /*
+     * Do fd 1 and fd 2 refer to the same open file?
+     * That is the usual case, both connected to a terminal,
+     * and then the end mark of one and the start mark of the other
+     * can go out together with the data, in one system call.
+     */
+    bool same_file_12;
+
+    /*
+     * Coalescing of output.
+     *
+     * Marks and data for consecutive writes to the same fd are
+     * collected in co_buf, and go out in one write() when:
+     *   - there is a transition to the other fd;
+     *   - the buffer is full;
+     *   - the oldest data in it has waited co_latency_us;
+     *   - the kernel is about to write to stdout or stderr,
+     *     on behalf of a tracee (a pass-through write);
+     *   - a tracee reads from stdin, so that a prompt is seen;
+     *   - marking is done.
+     * Output to stdout and to stderr is never reordered.
+     *
+     * Timing is done with ITIMER_REAL.  SIGALRM is blocked,
+     * except while the tracer waits for its tracees, between
+     * mark_wait_begin() and mark_wait_end(); there, it interrupts
+     * the wait, and the tracer calls mark_poll() to do the actual
+     * flush.  Nothing but a flag, |co_due|, is touched in the
+     * signal handler, and nothing else that the tracer does,
+     * reading /proc, writing a copy, is ever cut short by it.
+     */
+    char  *co_buf;
+    size_t co_size;
+    size_t co_len;
+    int    co_fd;
+    long   co_latency_us;
+
+    /*
+     * Line prefixes, highlighting and timestamps; see above.
+     */
+    char  *lp_prefix[3];
+    size_t lp_prefix_len[3];
+    bool   lp_hl[3];
+    bool   ts_on;
+    bool   ts_per_write;
+    bool   lp_on;
+    char  *lp_buf;
+    size_t lp_size;
+    struct lp_writer *lp_partial;
+    size_t lp_nr;
+    size_t lp_alloc;
+    pid_t  lp_tgid;
+
+    struct {
+        pid_t tid;
+        pid_t tgid;
+    } tgid_cache[TGID_CACHE];
+
+    /*
+     * Number of system calls, or calls of |on_write|,
+     * used for output, for --verbose.
+     */
+    unsigned long nr_output_calls;
+
+    /*
+     * Where output goes, instead of to fd 1 and fd 2, if |on_write|
+     * is set, and who to tell about the data that was written.
+     */
+    errmark_ctx_t *ctx;
+    errmark_write_fn on_write;
+    errmark_write_fn on_data;
+    pid_t writer;
+};
+
+static struct mark_ctx mark_default = {
+    .cur_fd = -1,
+    .co_fd = -1,
+};
+
+static __thread struct mark_ctx *mc = &mark_default;
+
+static volatile sig_atomic_t co_due = 0;
+static bool co_armed = false;           // ITIMER_REAL is running
+static bool co_blocked = false;         // We blocked SIGALRM
+static bool co_inherited = false;       // It was blocked already
+static __thread sigset_t co_wait_mask;  // Mask from before the wait
+
+/**
+ * @brief A new set of marks and output state, with no marks.
+ */
+struct mark_ctx *
+mark_ctx_new(void)
+{
+    struct mark_ctx *m;
+
+    m = (struct mark_ctx *)guard_calloc(1, sizeof (*m));
+    m->cur_fd = -1;
+    m->co_fd = -1;
+    return (m);
+}
+
+static char *
+dup_or_null(const char *s)
+{
+    return (s != NULL ? strdup(s) : NULL);
+}
+
+/**
+ * @brief A new set of marks, with the same marks, line prefixes,
+ * highlighting and timestamps as |m|, and no output yet.
+ *
+ * @param m  the one to copy, or NULL for that of the errmark program
+ */
+struct mark_ctx *
+mark_ctx_dup(const struct mark_ctx *m)
+{
+    struct mark_ctx *d;
+    int fd;
 
-extern bool verbose;
-extern bool debug;
+    if (m == NULL) {
+        m = &mark_default;
+    }
+    d = mark_ctx_new();
+    d->start1 = dup_or_null(m->start1);
+    d->end1 = dup_or_null(m->end1);
+    d->start2 = dup_or_null(m->start2);
+    d->end2 = dup_or_null(m->end2);
+    d->start1_len = m->start1_len;
+    d->end1_len = m->end1_len;
+    d->start2_len = m->start2_len;
+    d->end2_len = m->end2_len;
+    for (fd = 0; fd < 3; ++fd) {
+        d->lp_prefix[fd] = dup_or_null(m->lp_prefix[fd]);
+        d->lp_prefix_len[fd] = m->lp_prefix_len[fd];
+        d->lp_hl[fd] = m->lp_hl[fd];
+    }
+    d->ts_on = m->ts_on;
+    d->ts_per_write = m->ts_per_write;
+    d->lp_on = m->lp_on;
+    return (d);
+}
+
+/**
+ * @brief Free what mark_ctx_new() returned.
+ */
+void
+mark_ctx_free(struct mark_ctx *m)
+{
+    int fd;
 
-static char *start1 = NULL;
-static char *end1   = NULL;
-static char *start2 = NULL;
-static char *end2   = NULL;
+    if (m == NULL || m == &mark_default) {
+        return;
+    }
+    if (mc == m) {
+        mc = &mark_default;
+    }
+    free(m->start1);
+    free(m->end1);
+    free(m->start2);
+    free(m->end2);
+    free(m->co_buf);
+    for (fd = 0; fd < 3; ++fd) {
+        free(m->lp_prefix[fd]);
+    }
+    free(m->lp_buf);
+    free(m->lp_partial);
+    free(m);
+}
 
-static int cur_fd = -1;
+/**
+ * @brief Make the functions below work on |m|, in the calling thread.
+ *
+ * @param m  what mark_ctx_new() returned, or NULL for that of the
+ *           errmark program itself
+ * @return   the one they worked on before
+ */
+struct mark_ctx *
+mark_ctx_use(struct mark_ctx *m)
+{
+    struct mark_ctx *prev;
+
+    prev = mc;
+    mc = (m != NULL) ? m : &mark_default;
+    return (prev);
+}
+
+/**
+ * @brief Hand output to |on_write|, instead of writing it to fd 1 or 2,
+ * and the data, as written by the program, to |on_data|.
+ *
+ * Either can be NULL.  Both are called with |ctx|.
+ */
+void
+mark_set_sink(errmark_ctx_t *ctx, errmark_write_fn on_write,
+    errmark_write_fn on_data)
+{
+    mc->ctx = ctx;
+    mc->on_write = on_write;
+    mc->on_data = on_data;
+}
 
 /*
  * Parse a --mark option, and set start/end triggers
@@ -91,28 +347,20 @@ parse_mark_specs(char *mspec)
     }
 
     if (fd == 1) {
-        start1 = strndup(mark_start, mark_start_len);
-        end1   = strndup(mark_end, mark_end_len);
-        if (debug) {
-            fprintf(dbgprint_fh, "start1=[");
-            fshow_str(dbgprint_fh, start1);
-            fprintf(dbgprint_fh, "]\n");
-            fprintf(dbgprint_fh, "end1  =[");
-            fshow_str(dbgprint_fh, end1);
-            fprintf(dbgprint_fh, "]\n");
-        }
+        free(mc->start1);
+        free(mc->end1);
+        mc->start1 = strndup(mark_start, mark_start_len);
+        mc->end1   = strndup(mark_end, mark_end_len);
+        mc->start1_len = mark_start_len;
+        mc->end1_len   = mark_end_len;
     }
     if (fd == 2) {
-        start2 = strndup(mark_start, mark_start_len);
-        end2   = strndup(mark_end, mark_end_len);
-        if (debug) {
-            fprintf(dbgprint_fh, "start2=[");
-            fshow_str(dbgprint_fh, start2);
-            fprintf(dbgprint_fh, "]\n");
-            fprintf(dbgprint_fh, "end2  =[");
-            fshow_str(dbgprint_fh, end2);
-            fprintf(dbgprint_fh, "]\n");
-        }
+        free(mc->start2);
+        free(mc->end2);
+        mc->start2 = strndup(mark_start, mark_start_len);
+        mc->end2   = strndup(mark_end, mark_end_len);
+        mc->start2_len = mark_start_len;
+        mc->end2_len   = mark_end_len;
     }
 
     return (true);
@@ -122,12 +370,20 @@ bool
 setmark(int fd, char const *m_start, char const *m_end)
 {
     if (fd == 1) {
-        start1 = strdup(m_start);
-        end1   = strdup(m_end);
+        free(mc->start1);
+        free(mc->end1);
+        mc->start1 = strdup(m_start);
+        mc->end1   = strdup(m_end);
+        mc->start1_len = strlen(mc->start1);
+        mc->end1_len   = strlen(mc->end1);
     }
     else if (fd == 2) {
-        start2 = strdup(m_start);
-        end2   = strdup(m_end);
+        free(mc->start2);
+        free(mc->end2);
+        mc->start2 = strdup(m_start);
+        mc->end2   = strdup(m_end);
+        mc->start2_len = strlen(mc->start2);
+        mc->end2_len   = strlen(mc->end2);
     }
     else {
         fprintf(stderr, "fd=%d -- only fd 1 or 2 are supported.\n", fd);
@@ -137,80 +393,795 @@ setmark(int fd, char const *m_start, char const *m_end)
     return (true);
 }
 
+/**
+ * @brief The marks for |fd|; "" if there are none.
+ */
 void
-write_start_stdout(void)
+getmark(int fd, char const **m_start, char const **m_end)
 {
-    if (start1 != NULL) {
-        fflush(stdout);
-        fflush(stderr);
-        write(1, start1, strlen(start1));
+    *m_start = "";
+    *m_end = "";
+    if (fd == 1) {
+        *m_start = mc->start1 ? mc->start1 : "";
+        *m_end   = mc->end1 ? mc->end1 : "";
+    }
+    else if (fd == 2) {
+        *m_start = mc->start2 ? mc->start2 : "";
+        *m_end   = mc->end2 ? mc->end2 : "";
     }
 }
 
+/**
+ * @brief Start every line written to |fd| with |prefix|.
+ */
+bool
+mark_set_line_prefix(int fd, const char *prefix)
+{
+    if (!(fd == 1 || fd == 2)) {
+        fprintf(stderr, "fd=%d -- only fd 1 or 2 are supported.\n", fd);
+        return (false);
+    }
+    free(mc->lp_prefix[fd]);
+    mc->lp_prefix[fd] = strdup(prefix);
+    mc->lp_prefix_len[fd] = strlen(prefix);
+    mc->lp_on = true;
+    return (true);
+}
+
+static pid_t
+tgid_of(pid_t tid)
+{
+    char path[64];
+    char buf[512];
+    char *p;
+    ssize_t n;
+    pid_t tgid;
+    int fd;
+    int slot;
+
+    slot = (unsigned int)tid % TGID_CACHE;
+    if (mc->tgid_cache[slot].tid == tid) {
+        return (mc->tgid_cache[slot].tgid);
+    }
+    tgid = tid;
+    snprintf(path, sizeof (path), "/proc/%d/status", (int)tid);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd != -1) {
+        n = read(fd, buf, sizeof (buf) - 1);
+        close(fd);
+        if (n > 0) {
+            buf[n] = '\0';
+            p = strstr(buf, "\nTgid:");
+            if (p != NULL) {
+                tgid = (pid_t)strtol(p + 6, NULL, 10);
+            }
+        }
+    }
+    mc->tgid_cache[slot].tid = tid;
+    mc->tgid_cache[slot].tgid = tgid;
+    return (tgid);
+}
+
+/**
+ * @brief Thread |tid| is gone.  Forget what thread group it was in,
+ * and, if it was the last thread of its process, where that process
+ * was in its lines.
+ *
+ * A process is only reported gone once all of its threads are,
+ * and then its id is that of the thread group.  Either id may
+ * well be used again, by something else.
+ */
 void
-write_end_stdout(void)
+mark_forget(pid_t tid)
 {
-    if (end1 != NULL) {
-        fflush(stdout);
-        fflush(stderr);
-        write(1, end1, strlen(end1));
+    size_t i;
+    int slot;
+
+    slot = (unsigned int)tid % TGID_CACHE;
+    if (mc->tgid_cache[slot].tid == tid) {
+        mc->tgid_cache[slot].tid = 0;
+    }
+    i = 0;
+    while (i < mc->lp_nr) {
+        if (mc->lp_partial[i].tgid == tid) {
+            mc->lp_partial[i] = mc->lp_partial[--mc->lp_nr];
+        }
+        else {
+            ++i;
+        }
     }
 }
 
+/**
+ * @brief Say which thread the writes that follow are on behalf of.
+ *
+ * Needed for line prefixes, and to tell |on_write| and |on_data|.
+ */
 void
-write_start_stderr(void)
+mark_set_writer(pid_t tid)
 {
-    if (start2 != NULL) {
-        fflush(stdout);
-        fflush(stderr);
-        write(2, start2, strlen(start2));
+    mc->writer = tid;
+    if (mc->lp_on) {
+        mc->lp_tgid = tgid_of(tid);
     }
 }
 
+/**
+ * @brief Color the lines written to |fd| by what is in them.
+ */
 void
-write_end_stderr(void)
+mark_set_highlight(int fd)
 {
-    if (end2 != NULL) {
-        fflush(stdout);
-        fflush(stderr);
-        write(2, end2, strlen(end2));
+    if (fd == 1 || fd == 2) {
+        mc->lp_hl[fd] = true;
+        mc->lp_on = true;
     }
 }
 
+/**
+ * @brief Put a timestamp at the start of each line, or of each write,
+ * to stdout and stderr.
+ */
 void
-switch_from_fd(int fd)
+mark_set_timestamp(enum stamp_clock clk, bool per_write)
 {
-    if (fd == 1) {
-        write_end_stdout();
+    stamp_set(clk);
+    mc->ts_on = (clk != STAMP_NONE);
+    mc->ts_per_write = per_write;
+    mc->lp_on = mc->lp_on || mc->ts_on;
+}
+
+/*
+ * Is there anything to do, line by line, for |fd|?
+ */
+static inline bool
+lp_wanted(int fd)
+{
+    return ((fd == 1 || fd == 2)
+        && (mc->lp_prefix[fd] != NULL || mc->lp_hl[fd] || mc->ts_on));
+}
+
+/*
+ * The state of the current writer on |fd|; NULL if it is
+ * at the start of a line.
+ */
+static struct lp_writer *
+lp_find(int fd)
+{
+    size_t i;
+
+    for (i = 0; i < mc->lp_nr; ++i) {
+        if (mc->lp_partial[i].tgid == mc->lp_tgid
+            && mc->lp_partial[i].fd == fd) {
+            return (&mc->lp_partial[i]);
+        }
     }
-    if (fd == 2) {
-        write_end_stderr();
+    return (NULL);
+}
+
+static void
+lp_save(int fd, struct lp_writer *w, bool bol, uint32_t hl_state, int hl_rule)
+{
+    if (bol) {
+        if (w != NULL) {
+            *w = mc->lp_partial[--mc->lp_nr];
+        }
+        return;
+    }
+    if (w == NULL) {
+        if (mc->lp_nr == mc->lp_alloc) {
+            mc->lp_alloc = mc->lp_alloc ? 2 * mc->lp_alloc : 8;
+            mc->lp_partial = (struct lp_writer *)
+                guard_realloc(mc->lp_partial,
+                              mc->lp_alloc * sizeof (*mc->lp_partial));
+        }
+        w = &mc->lp_partial[mc->lp_nr++];
+        w->tgid = mc->lp_tgid;
+        w->fd = fd;
+    }
+    w->hl_state = hl_state;
+    w->hl_rule = hl_rule;
+}
+
+static void
+lp_reserve(size_t need)
+{
+    if (need > mc->lp_size) {
+        mc->lp_size = mc->lp_size ? mc->lp_size : 64 * 1024;
+        while (mc->lp_size < need) {
+            mc->lp_size *= 2;
+        }
+        mc->lp_buf = (char *)guard_realloc(mc->lp_buf, mc->lp_size);
+    }
+}
+
+static inline void
+lp_put(size_t *out, const char *p, size_t n)
+{
+    memcpy(mc->lp_buf + *out, p, n);
+    *out += n;
+}
+
+/*
+ * Put |len| bytes of |buf| into |mc->lp_buf|, with the timestamp and
+ * the prefix for |fd| at the start of each line, and with the color
+ * of the lines that are highlighted.
+ *
+ * @return the number of bytes in |mc->lp_buf|
+ */
+static size_t
+lp_lines(int fd, const char *buf, size_t len)
+{
+    struct lp_writer *w;
+    struct nl_scan ns;
+    const char *p, *end, *nl;
+    const char *hl_start, *hl_end, *restore;
+    size_t hl_start_len, hl_end_len, restore_len;
+    const char *stamp;
+    size_t plen, out, n, text, stamp_len;
+    uint32_t hl_state;
+    int hl_rule;
+    bool bol;
+
+    plen = mc->lp_prefix_len[fd];
+    restore = (fd == 1) ? mc->start1 : mc->start2;
+    restore_len = (fd == 1) ? mc->start1_len : mc->start2_len;
+    p = buf;
+    end = buf + len;
+    out = 0;
+    w = lp_find(fd);
+    bol = (w == NULL);
+    hl_state = w ? w->hl_state : 0;
+    hl_rule = w ? w->hl_rule : -1;
+    stamp = stamp_now(&stamp_len);
+    nl_scan_init(&ns, buf, len);
+    while (p < end) {
+        nl = nl_scan_next(&ns);
+        n = (nl != NULL) ? (size_t)(nl + 1 - p) : (size_t)(end - p);
+        text = (nl != NULL) ? n - 1 : n;
+        if (mc->lp_hl[fd] && hl_rule < 0) {
+            hl_rule = highlight_scan(&hl_state, p, text);
+        }
+        hl_start_len = hl_end_len = 0;
+        if (hl_rule >= 0) {
+            highlight_esc(hl_rule, &hl_start, &hl_start_len,
+                &hl_end, &hl_end_len);
+        }
+        lp_reserve(out + stamp_len + plen + hl_start_len + n + hl_end_len
+            + restore_len);
+        if (mc->ts_per_write ? p == buf : bol) {
+            lp_put(&out, stamp, stamp_len);
+        }
+        if (bol && plen != 0) {
+            lp_put(&out, mc->lp_prefix[fd], plen);
+        }
+        if (hl_rule >= 0) {
+            lp_put(&out, hl_start, hl_start_len);
+            lp_put(&out, p, text);
+            lp_put(&out, hl_end, hl_end_len);
+            if (restore_len != 0) {
+                lp_put(&out, restore, restore_len);
+            }
+            if (nl != NULL) {
+                lp_put(&out, "\n", 1);
+            }
+        }
+        else {
+            lp_put(&out, p, n);
+        }
+        p += n;
+        bol = (nl != NULL);
+        if (bol) {
+            hl_state = 0;
+            hl_rule = -1;
+        }
+    }
+    lp_save(fd, w, bol, hl_state, hl_rule);
+    return (out);
+}
+
+/*
+ * Write all of |iov|, however many tries it takes.
+ * Return the number of bytes written, which is less than
+ * the total only if there was an error.
+ *
+ * With an |on_write| sink, it gets each piece, instead,
+ * and it is all written, as far as we know.
+ */
+static size_t
+writev_all(int fd, struct iovec *iov, int iovcnt)
+{
+    size_t total;
+    ssize_t rv;
+
+    if (mc->on_write != NULL) {
+        total = 0;
+        for (; iovcnt != 0; ++iov, --iovcnt) {
+            ++mc->nr_output_calls;
+            mc->on_write(mc->ctx, mc->writer, fd, iov->iov_base, iov->iov_len);
+            total += iov->iov_len;
+        }
+        return (total);
+    }
+    if (uring_sink_active()) {
+        ++mc->nr_output_calls;
+        return (uring_sink_writev(fd, iov, iovcnt));
+    }
+    /*
+     * In case io_uring was given up on, with writes still in flight.
+     */
+    uring_sink_drain();
+
+    total = 0;
+    while (iovcnt != 0) {
+        ++mc->nr_output_calls;
+        rv = writev(fd, iov, iovcnt);
+        if (rv == -1 && errno == EINTR) {
+            continue;
+        }
+        if (rv <= 0) {
+            break;
+        }
+        total += rv;
+        while (iovcnt != 0 && (size_t)rv >= iov->iov_len) {
+            rv -= iov->iov_len;
+            ++iov;
+            --iovcnt;
+        }
+        if (iovcnt != 0) {
+            iov->iov_base = (char *)iov->iov_base + rv;
+            iov->iov_len -= rv;
+        }
+    }
+    return (total);
+}
+
+static inline void
+add_iov(struct iovec *iov, int *iovcnt, const void *buf, size_t len)
+{
+    if (len != 0) {
+        iov[*iovcnt].iov_base = (void *)buf;
+        iov[*iovcnt].iov_len = len;
+        ++*iovcnt;
+    }
+}
+
+static void
+co_alarm(int sig)
+{
+    (void)sig;
+    co_due = 1;
+}
+
+static void
+co_timer(long usec)
+{
+    struct itimerval itv;
+
+    itv.it_value.tv_sec = usec / 1000000;
+    itv.it_value.tv_usec = usec % 1000000;
+    /*
+     * Keep firing until disarmed, in case the first one
+     * comes just before the tracer goes to sleep.
+     */
+    itv.it_interval = itv.it_value;
+    setitimer(ITIMER_REAL, &itv, NULL);
+    co_armed = (usec != 0);
+}
+
+static void
+alarm_mask(int how, sigset_t *old)
+{
+    sigset_t alrm;
+
+    sigemptyset(&alrm);
+    sigaddset(&alrm, SIGALRM);
+    pthread_sigmask(how, &alrm, old);
+}
+
+/**
+ * @brief Coalesce output, for at most |latency_us| microseconds.
+ *
+ * SIGALRM is blocked in the calling thread, and so in any thread
+ * it starts from then on; call it before starting any others.
+ *
+ * @param size        size of the coalescing buffer; 0 to turn it off.
+ * @param latency_us  how long output may be held back
+ */
+void
+mark_set_coalesce(size_t size, long latency_us)
+{
+    struct sigaction sa;
+    sigset_t old;
+
+    free(mc->co_buf);
+    mc->co_buf = NULL;
+    mc->co_size = 0;
+    mc->co_len = 0;
+    if (size == 0) {
+        if (co_blocked && !co_inherited) {
+            alarm_mask(SIG_UNBLOCK, NULL);
+        }
+        co_blocked = false;
+        return;
+    }
+    mc->co_buf = (char *)guard_malloc(size);
+    mc->co_size = size;
+    mc->co_latency_us = latency_us > 0 ? latency_us : 1;
+
+    /*
+     * No SA_RESTART.  The tracer must wake up to flush.
+     */
+    memset(&sa, 0, sizeof (sa));
+    sa.sa_handler = co_alarm;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0;
+    sigaction(SIGALRM, &sa, NULL);
+    if (!co_blocked) {
+        alarm_mask(SIG_BLOCK, &old);
+        co_blocked = true;
+        co_inherited = (sigismember(&old, SIGALRM) == 1);
+    }
+}
+
+/**
+ * @brief Let SIGALRM in, for the wait that follows, if there is
+ * coalesced output for it to flush.
+ *
+ * The wait must be skipped if mark_due() is already true;
+ * a SIGALRM that was pending comes in here.
+ *
+ * @return true if the signal mask was changed, and is to be put
+ *         back by mark_wait_end().
+ */
+bool
+mark_wait_begin(void)
+{
+    if (!co_blocked || !co_armed) {
+        return (false);
+    }
+    alarm_mask(SIG_UNBLOCK, &co_wait_mask);
+    return (true);
+}
+
+/**
+ * @brief Block SIGALRM again, after the wait.
+ */
+void
+mark_wait_end(void)
+{
+    pthread_sigmask(SIG_SETMASK, &co_wait_mask, NULL);
+}
+
+/**
+ * @brief Is coalesced output due to be written out?
+ */
+bool
+mark_due(void)
+{
+    return (co_due != 0);
+}
+
+/**
+ * @brief Is output being coalesced?  It is for the process as a whole.
+ */
+bool
+mark_coalescing(void)
+{
+    return (co_blocked);
+}
+
+/**
+ * @brief In a child, about to exec a program, unblock SIGALRM,
+ * if we blocked it, so that the program starts with the signal
+ * mask errmark was started with.
+ */
+void
+mark_child_signals(void)
+{
+    if (co_blocked && !co_inherited) {
+        alarm_mask(SIG_UNBLOCK, NULL);
     }
 }
 
+/**
+ * @brief Write out any coalesced output, now.
+ */
 void
-switch_to_fd(int fd)
+mark_flush(void)
 {
+    struct iovec iov[1];
+    size_t len;
+
+    co_due = 0;
+    if (mc->co_len == 0) {
+        return;
+    }
+    len = mc->co_len;
+    mc->co_len = 0;
+    iov[0].iov_base = mc->co_buf;
+    iov[0].iov_len = len;
+    writev_all(mc->co_fd, iov, 1);
+    co_timer(0);
+}
+
+/**
+ * @brief Write out coalesced output, if it has waited long enough.
+ *
+ * Meant to be called by the tracer whenever it wakes up,
+ * in particular, when a wait is interrupted by EINTR.
+ * With several tracer threads, any of them can, so it takes its turn.
+ */
+void
+mark_poll(void)
+{
+    if (co_due) {
+        order_begin();
+        mark_flush();
+        order_end();
+    }
+}
+
+/*
+ * Add |iov| to the coalescing buffer, if it fits.
+ */
+static bool
+co_append(int fd, const struct iovec *iov, int iovcnt)
+{
+    size_t total;
+    int i;
+
+    total = 0;
+    for (i = 0; i < iovcnt; ++i) {
+        total += iov[i].iov_len;
+    }
+    if (mc->co_len != 0
+        && (mc->co_fd != fd || mc->co_len + total > mc->co_size)) {
+        mark_flush();
+    }
+    if (total > mc->co_size) {
+        return (false);
+    }
+    if (total == 0) {
+        return (true);
+    }
+    if (mc->co_len == 0) {
+        mc->co_fd = fd;
+        co_timer(mc->co_latency_us);
+    }
+    for (i = 0; i < iovcnt; ++i) {
+        memcpy(mc->co_buf + mc->co_len, iov[i].iov_base, iov[i].iov_len);
+        mc->co_len += iov[i].iov_len;
+    }
+    return (true);
+}
+
+/*
+ * Put the marks for a transition from |mc->cur_fd| to |fd|,
+ * if that is what it is, into |iov|, to be written to |fd|.
+ *
+ * If fd 1 and fd 2 are not the same file, the end mark
+ * must go to the fd it belongs to; write it right away.
+ */
+static void
+transition_iov(int fd, struct iovec *iov, int *iovcnt)
+{
+    struct iovec end_iov[1];
+    int end_cnt;
+
+    if (!(fd == 1 || fd == 2) || fd == mc->cur_fd) {
+        return;
+    }
+
+    /*
+     * Anything coalesced belongs to |mc->cur_fd|, and must go out first.
+     */
+    mark_flush();
+
+    end_cnt = 0;
+    if (mc->cur_fd == 1) {
+        add_iov(mc->same_file_12 ? iov : end_iov,
+                mc->same_file_12 ? iovcnt : &end_cnt, mc->end1, mc->end1_len);
+    }
+    else if (mc->cur_fd == 2) {
+        add_iov(mc->same_file_12 ? iov : end_iov,
+                mc->same_file_12 ? iovcnt : &end_cnt, mc->end2, mc->end2_len);
+    }
+    if (end_cnt != 0) {
+        writev_all(mc->cur_fd, end_iov, end_cnt);
+    }
+
     if (fd == 1) {
-        write_start_stdout();
+        add_iov(iov, iovcnt, mc->start1, mc->start1_len);
     }
-    if (fd == 2) {
-        write_start_stderr();
+    else {
+        add_iov(iov, iovcnt, mc->start2, mc->start2_len);
+    }
+    mc->cur_fd = fd;
+}
+
+/*
+ * Write marks and data.  With |lines|, each line of the data
+ * gets the line prefix for |fd|, if there is one.
+ */
+static ssize_t
+write_marked(int fd, const void *buf, size_t len, bool lines)
+{
+    struct iovec iov[3];
+    size_t nmark;
+    size_t wrote;
+    size_t out_len;
+    int iovcnt;
+    int i;
+
+    iovcnt = 0;
+    transition_iov(fd, iov, &iovcnt);
+    nmark = 0;
+    for (i = 0; i < iovcnt; ++i) {
+        nmark += iov[i].iov_len;
+    }
+    if (lines && len != 0 && lp_wanted(fd)) {
+        out_len = lp_lines(fd, (const char *)buf, len);
+        add_iov(iov, &iovcnt, mc->lp_buf, out_len);
+    }
+    else {
+        out_len = len;
+        add_iov(iov, &iovcnt, buf, len);
+    }
+    if (iovcnt == 0) {
+        return (0);
+    }
+
+    if (mc->co_size != 0) {
+        if (co_append(fd, iov, iovcnt)) {
+            if (co_due) {
+                mark_flush();
+            }
+            /*
+             * The caller cannot be told about a failure to write
+             * later on, anyway.
+             */
+            return (len);
+        }
+    }
+
+    wrote = writev_all(fd, iov, iovcnt);
+    if (wrote < nmark || (wrote == nmark && out_len != 0)) {
+        /*
+         * None of the data; errno says why.
+         */
+        return (-1);
+    }
+    if (out_len != len) {
+        /*
+         * How much of the data, without prefixes, made it out
+         * is not worth working out, for an error.
+         */
+        return (wrote == nmark + out_len ? (ssize_t)len : -1);
+    }
+    return (wrote - nmark);
+}
+
+/**
+ * @brief Write data on behalf of the traced program, with marks.
+ *
+ * The end mark of the previous fd, the start mark of |fd|, if this
+ * is a transition, and the data itself, all go out in one writev()
+ * to |fd|.  That is one system call per intercepted write(),
+ * where there used to be a flush, a write() per mark, and
+ * a write() per stdio buffer full of data.
+ * With coalescing on, it all goes into the coalescing buffer,
+ * instead, if it fits.
+ * With a line prefix for |fd|, each line starts with it.
+ * With an |on_data| sink, it gets the data first, as it is.
+ *
+ * @param fd   1 or 2
+ * @param buf  the data
+ * @param len  size of the data, in bytes
+ * @return     number of bytes of the data written
+ */
+ssize_t
+mark_write(int fd, const void *buf, size_t len)
+{
+    uint64_t t0;
+    ssize_t rv;
+
+    t0 = stats_tick();
+    if (mc->on_data != NULL) {
+        mc->on_data(mc->ctx, mc->writer, fd, buf, len);
+    }
+    rv = write_marked(fd, buf, len, true);
+    stats_phase(STATS_OUTPUT, t0);
+    return (rv);
+}
+
+/**
+ * @brief Does the output to |fd| have to pass through mark_write()?
+ *
+ * True if there is more to be done to it than marking it:
+ * line prefixes, highlighting or timestamps, coalescing,
+ * or a sink that wants it.  Data that the kernel moves
+ * from one file to another must then be taken out of the kernel.
+ */
+bool
+mark_wants_data(int fd)
+{
+    return (mc->on_write != NULL || mc->on_data != NULL
+        || mc->co_size != 0 || lp_wanted(fd));
+}
+
+/**
+ * @brief Does output go to an |on_write| sink, rather than to fd 1 and 2?
+ */
+bool
+mark_has_sink(void)
+{
+    return (mc->on_write != NULL);
+}
+
+/**
+ * @brief Data written to |fd| by the kernel, on behalf of the writer;
+ * hand it to the |on_data| sink, if there is one.
+ */
+void
+mark_data(int fd, const void *buf, size_t len)
+{
+    if (mc->on_data != NULL) {
+        mc->on_data(mc->ctx, mc->writer, fd, buf, len);
     }
 }
 
 void
 before_write(int fd, void *buf, size_t len)
 {
-    if (buf == NULL || len == (size_t)(-1)) {
+    uint64_t t0;
+
+    /*
+     * |buf| may well be NULL.  The data moved by sendfile()
+     * and friends never is in the memory of the writer.
+     */
+    (void)buf;
+    if (len == (size_t)(-1)) {
         return;
     }
 
-    if ((fd == 1 || fd == 2) && fd != cur_fd) {
-        switch_from_fd(cur_fd);
-        switch_to_fd(fd);
-        cur_fd = fd;
+    t0 = stats_tick();
+    if ((fd == 1 || fd == 2) && fd != mc->cur_fd) {
+        write_marked(fd, NULL, 0, true);
     }
+
+    /*
+     * The data does not pass through here, so the only timestamp
+     * and prefix it can get are the ones at its start, and it cannot
+     * be highlighted.  Assume that it ends a line.
+     */
+    if (lp_wanted(fd)) {
+        struct lp_writer *w = lp_find(fd);
+        const char *stamp;
+        size_t stamp_len, out;
+
+        stamp = stamp_now(&stamp_len);
+        lp_reserve(stamp_len + mc->lp_prefix_len[fd]);
+        out = 0;
+        if (mc->ts_per_write || w == NULL) {
+            lp_put(&out, stamp, stamp_len);
+        }
+        if (w == NULL && mc->lp_prefix[fd] != NULL) {
+            lp_put(&out, mc->lp_prefix[fd], mc->lp_prefix_len[fd]);
+        }
+        if (out != 0) {
+            write_marked(fd, mc->lp_buf, out, false);
+        }
+        lp_save(fd, w, true, 0, -1);
+    }
+
+    /*
+     * The kernel is about to do the write.
+     * Nothing coalesced, or queued, may come after it.
+     */
+    mark_flush();
+    uring_sink_drain();
+    stats_phase(STATS_OUTPUT, t0);
 }
 
 void
@@ -220,7 +1191,8 @@ after_write(int fd, void *buf, size_t len)
         return;
     }
 
-    if (buf == NULL || len == (size_t)(-1)) {
+    (void)buf;
+    if (len == (size_t)(-1)) {
         return;
     }
 
@@ -233,11 +1205,39 @@ after_write(int fd, void *buf, size_t len)
 void
 mark_open(void)
 {
-    cur_fd = -1;
+    struct stat st1, st2;
+
+    mc->cur_fd = -1;
+    mc->same_file_12 = false;
+    if (fstat(1, &st1) == 0 && fstat(2, &st2) == 0) {
+        mc->same_file_12 = (st1.st_dev == st2.st_dev
+            && st1.st_ino == st2.st_ino);
+    }
 }
 
 void
 mark_close(void)
 {
-    switch_from_fd(cur_fd);
+    struct iovec iov[1];
+    int iovcnt;
+
+    mark_flush();
+    iovcnt = 0;
+    if (mc->cur_fd == 1) {
+        add_iov(iov, &iovcnt, mc->end1, mc->end1_len);
+    }
+    else if (mc->cur_fd == 2) {
+        add_iov(iov, &iovcnt, mc->end2, mc->end2_len);
+    }
+    if (iovcnt != 0) {
+        writev_all(mc->cur_fd, iov, iovcnt);
+    }
+    uring_sink_drain();
+    mc->cur_fd = -1;
+}
+
+unsigned long
+mark_output_calls(void)
+{
+    return (mc->nr_output_calls);
 }
@@ -0,0 +1,205 @@
+/*
+ * Filename: src/liberrmark/newline-scan.c
+ * Project: errmark
+ * Library: liberrmark
+ * Brief: Find the newlines in a buffer, 32 bytes at a time
+ *
+ * Copyright (C) 2016-2019 Guy Shaw
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Output of a compiler, or of make, is lots of short lines.
+ * Calling memchr() once per line means setting up a vector search
+ * for every 40 bytes or so.  Instead, a block of 32 bytes is compared
+ * with '\n' in one go, and the result kept as a bit mask, one bit
+ * per byte; each newline in the block is then one count-trailing-zeros
+ * away, and the block is only loaded once.
+ *
+ * The comparison uses AVX2, if the CPU has it, or SSE2, which every
+ * x86_64 has.  Elsewhere, and for the last few bytes of a buffer,
+ * the mask is made one byte at a time.  Nothing is read past the end
+ * of the buffer.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <errmark.h>
+#include <stdbool.h>
+#include <stddef.h>		// Import size_t
+#include <stdint.h>		// Import uint32_t
+
+#if defined(__SSE2__)
+#include <immintrin.h>		// Import _mm_cmpeq_epi8(), _mm256_cmpeq_epi8()
+#endif
+
+#define NL_BLOCK 32
+
+/*
+ * Find the first block, at or after |p|, with a newline in it,
+ * and its mask.  Full blocks are compared all at once; what is left
+ * at the end, less than a block, one byte at a time.  If there is
+ * no newline, the result is the short block at the end, with a mask of 0.
+ */
+typedef const char *(*find_block_fn)(const char *, const char *, uint32_t *);
+
+static uint32_t
+tail_mask(const char *p, const char *end)
+{
+    uint32_t m;
+    int i;
+
+    m = 0;
+    for (i = 0; i < end - p; ++i) {
+        if (p[i] == '\n') {
+            m |= (uint32_t)1 << i;
+        }
+    }
+    return (m);
+}
+
+static const char *
+find_block_scalar(const char *p, const char *end, uint32_t *mask)
+{
+    uint32_t m;
+
+    while (end - p >= NL_BLOCK) {
+        m = tail_mask(p, p + NL_BLOCK);
+        if (m != 0) {
+            *mask = m;
+            return (p);
+        }
+        p += NL_BLOCK;
+    }
+    *mask = tail_mask(p, end);
+    return (p);
+}
+
+#if defined(__SSE2__)
+
+static const char *
+find_block_sse2(const char *p, const char *end, uint32_t *mask)
+{
+    __m128i nl = _mm_set1_epi8('\n');
+    __m128i lo, hi;
+    uint32_t m;
+
+    while (end - p >= NL_BLOCK) {
+        lo = _mm_loadu_si128((const __m128i *)p);
+        hi = _mm_loadu_si128((const __m128i *)(p + 16));
+        m = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(lo, nl))
+            | ((uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(hi, nl)) << 16);
+        if (m != 0) {
+            *mask = m;
+            return (p);
+        }
+        p += NL_BLOCK;
+    }
+    *mask = tail_mask(p, end);
+    return (p);
+}
+
+__attribute__((target("avx2")))
+static const char *
+find_block_avx2(const char *p, const char *end, uint32_t *mask)
+{
+    __m256i nl = _mm256_set1_epi8('\n');
+    __m256i v;
+    uint32_t m;
+
+    while (end - p >= NL_BLOCK) {
+        v = _mm256_loadu_si256((const __m256i *)p);
+        m = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+        if (m != 0) {
+            *mask = m;
+            return (p);
+        }
+        p += NL_BLOCK;
+    }
+    *mask = tail_mask(p, end);
+    return (p);
+}
+
+#endif /* __SSE2__ */
+
+static find_block_fn find_block = NULL;
+
+static void
+choose_find_block(void)
+{
+#if defined(__SSE2__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        find_block = find_block_avx2;
+        return;
+    }
+    find_block = find_block_sse2;
+#else
+    find_block = find_block_scalar;
+#endif
+}
+
+/**
+ * @brief Start looking for newlines in |len| bytes of |buf|.
+ */
+void
+nl_scan_init(struct nl_scan *s, const char *buf, size_t len)
+{
+    if (find_block == NULL) {
+        choose_find_block();
+    }
+    s->end = buf + len;
+    s->blk = find_block(buf, s->end, &s->mask);
+}
+
+/**
+ * @brief The next newline, or NULL if there are no more.
+ */
+const char *
+nl_scan_next(struct nl_scan *s)
+{
+    const char *nl;
+
+    while (s->mask == 0) {
+        if (s->end - s->blk < NL_BLOCK) {
+            return (NULL);
+        }
+        s->blk = find_block(s->blk + NL_BLOCK, s->end, &s->mask);
+    }
+    nl = s->blk + __builtin_ctz(s->mask);
+    s->mask &= s->mask - 1;
+    return (nl);
+}
+
+/**
+ * @brief Which implementation is in use: "avx2", "sse2" or "scalar".
+ */
+const char *
+nl_scan_impl(void)
+{
+    if (find_block == NULL) {
+        choose_find_block();
+    }
+#if defined(__SSE2__)
+    if (find_block == find_block_avx2) {
+        return ("avx2");
+    }
+    if (find_block == find_block_sse2) {
+        return ("sse2");
+    }
+#endif
+    (void)find_block_scalar;
+    return ("scalar");
+}
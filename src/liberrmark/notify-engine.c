@@ -0,0 +1,578 @@
+/*
+ * Filename: src/liberrmark/notify-engine.c
+ * Project: errmark
+ * Library: liberrmark
+ * Brief: Intercept writes using seccomp user notification, without ptrace
+ *
+ * Copyright (C) 2016-2019 Guy Shaw
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The child installs a seccomp filter that returns SECCOMP_RET_USER_NOTIF
+ * for writes to marked file descriptors, and hands the listener fd
+ * for that filter back to us over a socketpair.
+ *
+ * For each notification, we read the data to be written straight out
+ * of the memory of the writing process, emit marks and data ourself,
+ * in one writev(), and reply with the number of bytes written.  The write() itself
+ * is never performed by the kernel.
+ *
+ * The child is never stopped by ptrace, so:
+ *   - multi-threaded programs and children of the child need nothing
+ *     special; the filter and its listener are inherited;
+ *   - strace or gdb can still attach to the child;
+ *   - there is no saving or restoring of registers.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <cscript.h>     // for eprintf, fshow_wait_status, guard_malloc
+#include <errmark.h>     // for cmd_t, seccomp_install_filter, pmem_read
+#include <errno.h>       // for errno, EINTR, ENOENT, EFAULT
+#include <poll.h>        // for poll
+#include <signal.h>      // for SIGKILL
+#include <stdbool.h>
+#include <stdio.h>       // for fwrite, perror, stdout
+#include <stdlib.h>      // for exit, free
+#include <string.h>      // for memset
+#include <sys/ioctl.h>   // for ioctl
+#include <sys/socket.h>  // for socketpair, sendmsg, recvmsg
+#include <sys/utsname.h> // for uname
+#include <sys/wait.h>    // for wait4
+#include <syscall.h>     // for SYS_write, SYS_seccomp
+#include <unistd.h>      // for execvp, fork, close
+#include <linux/seccomp.h>
+
+/*
+ * Send |fd| to the other end of |sock|.  An |fd| of -1 means we
+ * have nothing to send, and the errno value |err| is sent, instead.
+ */
+static void
+send_fd(int sock, int fd, int err)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    union {
+        char buf[CMSG_SPACE(sizeof (int))];
+        struct cmsghdr align;
+    } u;
+    struct cmsghdr *cmsg;
+
+    memset(&msg, 0, sizeof (msg));
+    iov.iov_base = &err;
+    iov.iov_len = sizeof (err);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (fd != -1) {
+        msg.msg_control = u.buf;
+        msg.msg_controllen = sizeof (u.buf);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof (int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof (int));
+    }
+    while (sendmsg(sock, &msg, 0) == -1 && errno == EINTR) {
+        continue;
+    }
+}
+
+/*
+ * Receive a file descriptor sent by send_fd().
+ * Return -1, with errno set, if none was sent.
+ */
+static int
+recv_fd(int sock)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    union {
+        char buf[CMSG_SPACE(sizeof (int))];
+        struct cmsghdr align;
+    } u;
+    struct cmsghdr *cmsg;
+    int err;
+    int fd;
+    ssize_t rv;
+
+    memset(&msg, 0, sizeof (msg));
+    err = 0;
+    iov.iov_base = &err;
+    iov.iov_len = sizeof (err);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = u.buf;
+    msg.msg_controllen = sizeof (u.buf);
+
+    do {
+        rv = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    } while (rv == -1 && errno == EINTR);
+    if (rv <= 0) {
+        return (-1);
+    }
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS) {
+        errno = err;
+        return (-1);
+    }
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof (int));
+    return (fd);
+}
+
+/*
+ * Buffer for the data of one write(), reused from one
+ * notification to the next, grown as needed, up to PMEM_CHUNK;
+ * bigger writes are done in PMEM_CHUNK sized pieces.
+ * One per tracer thread; see errmark-ctx.c.
+ */
+static __thread char *wbuf = NULL;
+static __thread size_t wbuf_sz = 0;
+
+static char *
+get_wbuf(size_t len)
+{
+    if (len > wbuf_sz) {
+        free(wbuf);
+        wbuf = (char *)guard_malloc(len);
+        wbuf_sz = len;
+    }
+    return (wbuf);
+}
+
+/*
+ * Handle one notification: a system call of the write() family
+ * to a marked fd.  Fill in the response.  Return false if the notification
+ * is no longer valid (the writer died), and must not be answered.
+ *
+ * write() and writev() are performed by us, and so are the rest of
+ * the family, where they come down to one of them (see write-decode.c),
+ * and the data moving calls, where they can be (see splice-copy.c).
+ * Anything else is marked, and then left to the kernel to perform,
+ * as is.  There is no stop at its exit, as there is with ptrace,
+ * so it is copied, and recorded, in full, before it is done.
+ */
+static bool
+notify_write(cmd_t *cmd, int nfd, struct seccomp_notif *req,
+    struct seccomp_notif_resp *resp)
+{
+    static __thread struct write_call wc;       // One per tracer thread
+    unsigned long args[6];
+    bool copy;
+    char *buf;
+    ssize_t rv, wv;
+    size_t ri, roff, sz;
+    size_t done;
+    size_t i;
+    int err;
+    int fd;
+
+    resp->id = req->id;
+    resp->flags = 0;
+    resp->val = 0;
+    resp->error = 0;
+
+    for (i = 0; i < 6; ++i) {
+        args[i] = (unsigned long)req->data.args[i];
+    }
+
+    if (read_call_is_stdin(req->data.nr, args)) {
+        mark_flush();
+        resp->flags = SECCOMP_USER_NOTIF_FLAG_CONTINUE;
+        return (true);
+    }
+
+    fd = write_call_fd(req->data.nr, args);
+    if (fd < 0
+        || !tracee_fd_is_marked(req->pid, fd)
+        || !write_call_decode(&wc, req->pid, req->data.nr, args)) {
+        resp->flags = SECCOMP_USER_NOTIF_FLAG_CONTINUE;
+        return (true);
+    }
+    ++cmd->nr_writes;
+    stats_write(wc.fd, wc.len);
+
+    copy = copy_wanted(wc.fd);
+    mark_set_writer(req->pid);
+    rv = 0;
+    buf = NULL;
+    if (wc.spliced) {
+        long spliced_rv;
+
+        /*
+         * Nothing to read from the writer.  Make sure it is still
+         * the writer, before acting on its behalf.
+         */
+        if (ioctl(nfd, SECCOMP_IOCTL_NOTIF_ID_VALID, &req->id) == -1) {
+            return (false);
+        }
+        if (cmd->mark_state == 0) {
+            mark_open();
+            cmd->mark_state = 1;
+        }
+        if (splice_copy(&wc, req->pid, &spliced_rv)) {
+            if (spliced_rv < 0) {
+                resp->error = (int)spliced_rv;
+            }
+            else {
+                resp->val = spliced_rv;
+            }
+        }
+        else {
+            before_write(wc.fd, wc.raddr, wc.len);
+            resp->flags = SECCOMP_USER_NOTIF_FLAG_CONTINUE;
+            record_write(req->pid, wc.fd, NULL, wc.len, REC_F_NO_DATA);
+        }
+        after_write(wc.fd, wc.raddr, wc.len);
+        return (true);
+    }
+    if (!wc.emulatable && !copy && !record_active()) {
+        /*
+         * Nothing to read: only marked, and left to the kernel.
+         */
+        if (ioctl(nfd, SECCOMP_IOCTL_NOTIF_ID_VALID, &req->id) == -1) {
+            return (false);
+        }
+        if (cmd->mark_state == 0) {
+            mark_open();
+            cmd->mark_state = 1;
+        }
+        before_write(wc.fd, wc.raddr, wc.len);
+        resp->flags = SECCOMP_USER_NOTIF_FLAG_CONTINUE;
+        after_write(wc.fd, wc.raddr, wc.len);
+        return (true);
+    }
+
+    /*
+     * Gather the write, however many iovecs, one read per piece
+     * of up to PMEM_CHUNK bytes, as gather_write() does; however
+     * much the writer asked for, that is all we hold at a time.
+     */
+    buf = get_wbuf(wc.len < PMEM_CHUNK ? wc.len : PMEM_CHUNK);
+    ri = 0;
+    roff = 0;
+    done = 0;
+    err = 0;
+    for (;;) {
+        rv = pmem_read_piece(req->pid, buf, PMEM_CHUNK,
+                             wc.iov, wc.iovcnt, &ri, &roff, &sz);
+
+        /*
+         * The pid in the notification could have been reused
+         * by the time we read its memory.  Make sure we read
+         * from the process that is still waiting for our answer,
+         * before we do anything with what we read.
+         */
+        if (ioctl(nfd, SECCOMP_IOCTL_NOTIF_ID_VALID, &req->id) == -1) {
+            return (false);
+        }
+        if (rv == -1) {
+            if (wc.emulatable && done == 0) {
+                resp->error = -EFAULT;
+                return (true);
+            }
+            sz = 0;
+        }
+
+        if (cmd->mark_state == 0) {
+            mark_open();
+            cmd->mark_state = 1;
+        }
+        if (done == 0 && !wc.emulatable) {
+            before_write(wc.fd, wc.raddr, wc.len);
+        }
+        if (sz == 0) {
+            break;
+        }
+        if (wc.emulatable) {
+            wv = mark_write(wc.fd, buf, rv);
+            if (wv < rv) {
+                /*
+                 * Only what got out is copied, and recorded,
+                 * and the writer is told, as write() would.
+                 */
+                err = (wv < 0 && errno != 0) ? errno : EIO;
+                rv = (wv > 0) ? wv : 0;
+            }
+        }
+        if (copy && rv > 0) {
+            copy_write(wc.fd, buf, rv);
+        }
+        if (rv > 0) {
+            record_write(req->pid, wc.fd, buf, rv, 0);
+        }
+        done += rv;
+        if (err != 0 || (size_t)rv < sz) {
+            break;
+        }
+    }
+    after_write(wc.fd, wc.raddr, wc.len);
+    if (!wc.emulatable) {
+        resp->flags = SECCOMP_USER_NOTIF_FLAG_CONTINUE;
+    }
+    else if (done == 0 && err != 0) {
+        resp->error = -err;
+    }
+    else {
+        resp->val = done;
+    }
+    return (true);
+}
+
+/*
+ * Does the kernel say, with POLLHUP on the listener, when no process
+ * is left using the filter?  Linux 5.8 and later do.
+ */
+static bool
+notify_reports_hup(void)
+{
+    struct utsname un;
+    int major, minor;
+
+    if (uname(&un) == -1 || sscanf(un.release, "%d.%d", &major, &minor) != 2) {
+        return (false);
+    }
+    return (major > 5 || (major == 5 && minor >= 8));
+}
+
+/*
+ * Reap the child, if it has exited.
+ */
+static void
+reap_child(cmd_t *cmd)
+{
+    int status;
+
+    if (wait4(cmd->child, &status, WNOHANG, &cmd->child_rusage) == cmd->child) {
+        cmd->child_status = status;
+        cmd->child_exited = true;
+    }
+}
+
+/*
+ * Serve notifications until no process is left using the filter.
+ *
+ * The child may be gone long before its children and grandchildren,
+ * which have the filter, too, and their writes must still be answered.
+ * So, where the kernel reports POLLHUP, that is the only way out.
+ * The child must be reaped, all the same: a zombie still holds
+ * the filter.  A pidfd (Linux 5.3) says when; without one, look
+ * every POLL_MS.  Kernels older than 5.8 do not report POLLHUP;
+ * for them, stop when the child is gone, and nothing is pending.
+ */
+#define POLL_MS 100
+
+static void
+notify_loop(cmd_t *cmd, int nfd)
+{
+    struct seccomp_notif_sizes sizes;
+    struct seccomp_notif *req;
+    struct seccomp_notif_resp *resp;
+    struct pollfd pfd[2];
+    bool hup;
+    bool ok;
+    unsigned long nr_writes;
+    uint64_t t0;
+    int timeout;
+
+    if (syscall(SYS_seccomp, SECCOMP_GET_NOTIF_SIZES, 0, &sizes) == -1) {
+        sizes.seccomp_notif = sizeof (*req);
+        sizes.seccomp_notif_resp = sizeof (*resp);
+    }
+    if (sizes.seccomp_notif < sizeof (*req)) {
+        sizes.seccomp_notif = sizeof (*req);
+    }
+    if (sizes.seccomp_notif_resp < sizeof (*resp)) {
+        sizes.seccomp_notif_resp = sizeof (*resp);
+    }
+    req = (struct seccomp_notif *)guard_malloc(sizes.seccomp_notif);
+    resp = (struct seccomp_notif_resp *)guard_malloc(sizes.seccomp_notif_resp);
+
+    hup = notify_reports_hup();
+    pfd[0].fd = nfd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = -1;
+#if defined(SYS_pidfd_open)
+    pfd[1].fd = (int)syscall(SYS_pidfd_open, cmd->child, 0);
+#endif
+    pfd[1].events = POLLIN;
+    while (true) {
+        int rv;
+
+        mark_poll();
+        if (cmd->child_exited) {
+            timeout = hup ? -1 : 0;
+        }
+        else {
+            timeout = (pfd[1].fd != -1) ? -1 : POLL_MS;
+        }
+        /*
+         * SIGALRM, for coalesced output, is let in only while we wait.
+         */
+        if (mark_wait_begin()) {
+            rv = mark_due() ? (errno = EINTR, -1) : poll(pfd, 2, timeout);
+            mark_wait_end();
+        }
+        else {
+            rv = poll(pfd, 2, timeout);
+        }
+        if (rv == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (rv == 0) {
+            if (cmd->child_exited) {
+                break;
+            }
+            reap_child(cmd);
+            continue;
+        }
+        if (pfd[1].revents != 0) {
+            reap_child(cmd);
+            close(pfd[1].fd);
+            pfd[1].fd = -1;
+        }
+        if (pfd[0].revents == 0) {
+            continue;
+        }
+        if (!(pfd[0].revents & POLLIN)) {
+            break;
+        }
+
+        memset(req, 0, sizes.seccomp_notif);
+        if (ioctl(nfd, SECCOMP_IOCTL_NOTIF_RECV, req) == -1) {
+            if (errno == EINTR || errno == ENOENT) {
+                continue;
+            }
+            break;
+        }
+        t0 = stats_tick();
+        stats_syscall(req->data.nr);
+        nr_writes = cmd->nr_writes;
+        memset(resp, 0, sizes.seccomp_notif_resp);
+        order_begin();
+        ok = notify_write(cmd, nfd, req, resp);
+        order_end();
+        if (ok) {
+            /*
+             * ENOENT, if the writer died while we were at it;
+             * nothing to be done about that.
+             */
+            ioctl(nfd, SECCOMP_IOCTL_NOTIF_SEND, resp);
+        }
+        stats_stop(STATS_STOP_NOTIFY, t0);
+        if (cmd->nr_writes != nr_writes) {
+            stats_latency(stats_tick() - t0);
+        }
+    }
+
+    if (pfd[1].fd != -1) {
+        close(pfd[1].fd);
+    }
+    free(req);
+    free(resp);
+}
+
+/**
+ * @brief Run a program, intercepting its writes using seccomp user notification.
+ *
+ * If the filter cannot be installed (kernels older than 5.0),
+ * the child waits for us to attach, instead, and we fall back
+ * to the ptrace engine.
+ *
+ * @return the wait status of the child.
+ */
+int
+notify_run_program(cmd_t *cmd)
+{
+    int sv[2];
+    int nfd;
+    int status;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1) {
+        cmd->engine = ENGINE_PTRACE;
+        return (errmark_run_program(cmd));
+    }
+
+    cmd->mark_state = 0;
+    cmd->child_exited = false;
+    cmd->child = fork();
+    if (cmd->child == 0) {
+        close(sv[0]);
+        nfd = seccomp_install_filter(SECCOMP_RET_USER_NOTIF,
+                                     SECCOMP_FILTER_FLAG_NEW_LISTENER,
+                                     cmd->coalesce_us != 0);
+        send_fd(sv[1], nfd, errno);
+        if (nfd == -1) {
+            /*
+             * Wait for the ptrace engine to attach.
+             */
+            raise(SIGSTOP);
+        }
+        else {
+            close(nfd);
+        }
+        close(sv[1]);
+        mark_child_signals();
+        cmd->rc = execvp(cmd->cmd_path, cmd->argv);
+        perror("execvp()");
+        exit(2);
+    }
+
+    close(sv[1]);
+    if (cmd->verbose) {
+        eprintf("child pid=%d\n", cmd->child);
+    }
+
+    nfd = recv_fd(sv[0]);
+    close(sv[0]);
+    if (nfd == -1) {
+        if (cmd->verbose) {
+            eprintf("seccomp listener not available; using ptrace engine.\n");
+        }
+        cmd->engine = ENGINE_PTRACE;
+        return (errmark_trace_child(cmd));
+    }
+
+    notify_loop(cmd, nfd);
+    close(nfd);
+
+    if (cmd->mark_state) {
+        order_begin();
+        mark_close();
+        order_end();
+    }
+
+    if (cmd->child_exited) {
+        status = cmd->child_status;
+    }
+    else {
+        while (wait4(cmd->child, &status, 0, &cmd->child_rusage) == -1
+               && errno == EINTR) {
+            continue;
+        }
+    }
+
+    if (cmd->verbose) {
+        eprintf("writes=%lu output=%lu\n", cmd->nr_writes, mark_output_calls());
+        if (status != 0) {
+            fshow_wait_status(stderr, cmd->cmd_name, status);
+        }
+    }
+    return (status);
+}
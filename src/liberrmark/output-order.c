@@ -0,0 +1,131 @@
+/*
+ * Filename: src/liberrmark/output-order.c
+ * Project: errmark
+ * Library: liberrmark
+ * Brief: Output takes turns, when several errmark_ctx run at once
+ *
+ * Copyright (C) 2016-2019 Guy Shaw
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Each thread that runs an errmark_ctx (see errmark-ctx.c) is the
+ * tracer of its own command, and all of them trace at the same time.
+ * What is not in an errmark_ctx, the marks of the process, the copy
+ * ring, the record file, is shared, and is only touched while holding
+ * the output order, between order_begin() and order_end().  That is
+ * a ticket lock: each output takes the next number, and goes out when
+ * all those before it are done.  The number is taken when the output
+ * is about to be written, after the write has been decoded, so the
+ * output of each command comes out in the order it wrote it, and
+ * the writes of different commands, at about the same time, come out
+ * in the order their tracers got to them.
+ *
+ * Until a second thread has started, there is nothing to take turns
+ * with, and it all costs nothing; once one has, output always takes
+ * turns (see order_share()).
+ */
+
+#define _GNU_SOURCE 1
+
+#include <errmark.h>
+#include <stdbool.h>
+#include <stdint.h>		// Import uint32_t
+#include <limits.h>		// Import INT_MAX
+#include <unistd.h>		// Import syscall()
+#include <linux/futex.h>	// Import FUTEX_WAIT, FUTEX_WAKE
+#include <syscall.h>		// Import SYS_futex
+
+#define ORDER_SPINS  200
+
+static bool shared = false;
+static uint32_t next_ticket = 0;
+static uint32_t now_serving = 0;
+static uint32_t order_waiters = 0;
+
+static void
+futex_wait(uint32_t *uaddr, uint32_t val)
+{
+    syscall(SYS_futex, uaddr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void
+futex_wake(uint32_t *uaddr)
+{
+    syscall(SYS_futex, uaddr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+/**
+ * @brief From now on, there may be more than one tracer thread,
+ * each running an errmark_ctx, and output takes turns.
+ *
+ * Called before the calling thread does any output, and never undone:
+ * a thread must not skip order_begin(), and then do order_end().
+ */
+void
+order_share(void)
+{
+    __atomic_store_n(&shared, true, __ATOMIC_SEQ_CST);
+}
+
+static inline bool
+order_active(void)
+{
+    return (__atomic_load_n(&shared, __ATOMIC_RELAXED));
+}
+
+/**
+ * @brief Wait for the turn of the next output, and take it.
+ *
+ * Does nothing, until there is more than one tracer thread.
+ */
+void
+order_begin(void)
+{
+    uint32_t ticket;
+    uint32_t serving;
+    int spins;
+
+    if (!order_active()) {
+        return;
+    }
+    ticket = __atomic_fetch_add(&next_ticket, 1, __ATOMIC_RELAXED);
+    spins = 0;
+    while ((serving = __atomic_load_n(&now_serving, __ATOMIC_ACQUIRE)) != ticket) {
+        if (++spins < ORDER_SPINS) {
+            continue;
+        }
+        __atomic_add_fetch(&order_waiters, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&now_serving, __ATOMIC_SEQ_CST) == serving) {
+            futex_wait(&now_serving, serving);
+        }
+        __atomic_sub_fetch(&order_waiters, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+/**
+ * @brief Done with the output; let the next one go.
+ */
+void
+order_end(void)
+{
+    if (!order_active()) {
+        return;
+    }
+    __atomic_add_fetch(&now_serving, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&order_waiters, __ATOMIC_SEQ_CST) != 0) {
+        futex_wake(&now_serving);
+    }
+}
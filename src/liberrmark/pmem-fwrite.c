@@ -1,105 +1,279 @@
+#define _GNU_SOURCE 1
+
 #include <stdbool.h>
 #include <stdio.h>
 #include <sys/types.h>		// Import size_t
-#include <stdint.h>		// Import uintptr_t
-#include <errno.h>		// Import errno, EIO
-#include <sys/ptrace.h>		// Import PTRACE_PEEKDATA
+
+#include <errmark.h>		// Import pmem_read()
+#include <stdlib.h>		// Import free()
+#include <cscript.h>		// Import guard_malloc()
+#include <limits.h>		// Import IOV_MAX
+#include <errno.h>		// Import errno, EFAULT, EIO
+#include <sys/uio.h>		// Import struct iovec
+
+/*
+ * Bounce buffer, reused from one call to the next.
+ * It grows as needed, up to PMEM_CHUNK; bigger regions
+ * are done in PMEM_CHUNK sized pieces.
+ * One per tracer thread; see errmark-ctx.c.
+ */
+static __thread char *bounce_buf = NULL;
+static __thread size_t bounce_sz = 0;
 
 /**
- * @brief write a region of data from the process being traced.
- *
- * Get data from the process being traced, at the given address,
- * and write it to a file.
+ * @brief read the next piece of a gather write done by the process being traced.
  *
- * This could be done in two steps: read the entire memory region
- * into a buffer in our own address space; then write our copy
- * of the data.  But, if we are not going to do anything else with
- * the data, then we may as well write it one word at a time,
- * directly from the tracee's address space.
+ * Read the next piece, of at most |max| bytes, of the remote regions
+ * |remote|[|*ri|..], starting |*roff| bytes into region |*ri|,
+ * and advance (*ri, *roff) past what was asked for.
+ * For the common case of a piece that fits in one buffer,
+ * this is exactly one call to pmem_readv().
  *
- * @param f       output stream
  * @param tracee  pid of process being traced
- * @param raddr   address of region of data
- * @param len     size in bytes of the region
- * @return        number of bytes actually read successfully
+ * @param buf     where to put the piece
+ * @param max     size of |buf|
+ * @param remote  regions of the address space of |tracee|
+ * @param rcnt    number of remote regions
+ * @param ri      region to start at; start with 0
+ * @param roff    offset into that region; start with 0
+ * @param asked   set to the size of the piece; 0 at the end
+ * @return        number of bytes read, as pmem_readv()
  */
-
 ssize_t
-pmem_fwrite(FILE *f, pid_t tracee, void *raddr, size_t len)
+pmem_read_piece(pid_t tracee, char *buf, size_t max,
+    const struct iovec *remote, size_t rcnt, size_t *ri, size_t *roff,
+    size_t *asked)
 {
-    union {
-        long iword;
-        char bytes[sizeof (size_t)];
-    } data;
-    size_t phase;
-    size_t bytes_read;
+    static __thread struct iovec piece[IOV_MAX];
+    struct iovec liov;
+    size_t pcnt;
+    size_t sz;
 
-    bytes_read = 0;
+    pcnt = 0;
+    sz = 0;
+    while (*ri < rcnt && sz < max && pcnt < IOV_MAX) {
+        size_t n;
 
-    /*
-     * Take care of any possible unaligned data at the start.
-     */
-    phase = ((uintptr_t)raddr & (sizeof (data) - 1));
-    if (phase != 0) {
-        size_t sz;
-        size_t remsz;
-
-        remsz = sizeof (data) - phase;
-        sz = (len > remsz) ? remsz : len;
-        errno = 0;
-        data.iword = ptrace(PTRACE_PEEKDATA, tracee, raddr, NULL);
-        if (data.iword == -1 && errno != 0) {
-            if (bytes_read != 0 && errno == EIO) {
-                return (bytes_read);
-            }
-            else {
-                return (-1);
-            }
+        n = remote[*ri].iov_len - *roff;
+        if (n > max - sz) {
+            n = max - sz;
+        }
+        if (n != 0) {
+            piece[pcnt].iov_base = (char *)remote[*ri].iov_base + *roff;
+            piece[pcnt].iov_len = n;
+            ++pcnt;
+        }
+        sz += n;
+        *roff += n;
+        if (*roff >= remote[*ri].iov_len) {
+            ++*ri;
+            *roff = 0;
         }
-        bytes_read = sz;
-        fwrite(data.bytes, sz, 1, f);
-        raddr = (void *)((char *)raddr + sz);
-        len -= sz;
     }
 
-    /*
-     * Write whole words (long).
-     */
-    while (len >= sizeof (data)) {
-        errno = 0;
-        data.iword = ptrace(PTRACE_PEEKDATA, tracee, raddr, NULL);
-        if (data.iword == -1 && errno != 0) {
-            if (bytes_read != 0 && errno == EIO) {
-                return (bytes_read);
+    *asked = sz;
+    if (sz == 0) {
+        return (0);
+    }
+    liov.iov_base = buf;
+    liov.iov_len = sz;
+    return (pmem_readv(tracee, &liov, 1, piece, pcnt));
+}
+
+/*
+ * Gather the data described by the remote iovec array |remote|,
+ * as one logical stream of bytes, from the process being traced,
+ * and send it to |f|, to |fd| with marks, to the copies of what
+ * is written to |copy_fd|, and to the |on_data| sink, as written
+ * to |data_fd|, whichever of them there are.
+ * It is recorded, too, as written
+ * to |rec_fd|, if that is not -1, and there is a --record file.
+ *
+ * The data is gathered into a buffer of our own using one call
+ * to pmem_readv(), not one per segment, in pieces of up to PMEM_CHUNK
+ * bytes.  Each piece is written using one fwrite() or mark_write().
+ *
+ * Return the number of bytes read, or, with |fd|, written to it,
+ * which is where it stops if mark_write() fails; then, the copies
+ * and the record get only what was written.  -errno if nothing
+ * could be read, or written: -EFAULT, -EPIPE, -ENOSPC, ...
+ */
+static ssize_t
+gather_write(FILE *f, int fd, int copy_fd, int rec_fd, int data_fd,
+    pid_t tracee, const struct iovec *remote, size_t rcnt)
+{
+    size_t bytes_read;
+    size_t ri, roff;
+    ssize_t wv;
+    int err;
+
+    bytes_read = 0;
+    err = 0;
+    ri = 0;
+    roff = 0;
+    while (ri < rcnt) {
+        size_t sz;
+        ssize_t rv;
+
+        if (bounce_sz < PMEM_CHUNK) {
+            size_t want;
+            size_t i;
+
+            /*
+             * Grow the bounce buffer only as far as needed.
+             */
+            want = 0;
+            for (i = ri; i < rcnt && want < PMEM_CHUNK; ++i) {
+                want += remote[i].iov_len;
+            }
+            if (want > PMEM_CHUNK) {
+                want = PMEM_CHUNK;
             }
-            else {
-                return (-1);
+            if (want > bounce_sz) {
+                free(bounce_buf);
+                bounce_buf = (char *)guard_malloc(want);
+                bounce_sz = want;
             }
         }
-        fwrite(data.bytes, sizeof (data), 1, f);
-        raddr = (void *)((char *)raddr + sizeof (data));
-        len -= sizeof (data);
-        bytes_read += sizeof (data);
-    }
-
-    /*
-     * Take care of any runt word at the end.
-     */
-    if (len > 0) {
-        errno = 0;
-        data.iword = ptrace(PTRACE_PEEKDATA, tracee, raddr, NULL);
-        if (data.iword == -1 && errno != 0) {
-            if (bytes_read != 0 && errno == EIO) {
-                return (bytes_read);
+        rv = pmem_read_piece(tracee, bounce_buf, bounce_sz,
+                             remote, rcnt, &ri, &roff, &sz);
+        if (rv == -1) {
+            if (bytes_read == 0) {
+                return (-EFAULT);
             }
-            else {
-                return (-1);
+            break;
+        }
+        if (sz == 0) {
+            /*
+             * Nothing but empty regions left.
+             */
+            break;
+        }
+        if (f != NULL) {
+            fwrite(bounce_buf, rv, 1, f);
+        }
+        if (fd >= 0) {
+            wv = mark_write(fd, bounce_buf, rv);
+            if (wv < rv) {
+                err = (wv < 0 && errno != 0) ? errno : EIO;
+                rv = (wv > 0) ? wv : 0;
             }
         }
-        fwrite(data.bytes, len, 1, f);
-        bytes_read += len;
+        if (data_fd >= 0) {
+            mark_data(data_fd, bounce_buf, rv);
+        }
+        if (copy_fd >= 0 && rv > 0) {
+            copy_write(copy_fd, bounce_buf, rv);
+        }
+        if (rec_fd >= 0 && rv > 0) {
+            record_write(tracee, rec_fd, bounce_buf, rv, 0);
+        }
+        bytes_read += rv;
+        if (err != 0 || (size_t)rv < sz) {
+            break;
+        }
     }
 
-    fflush(f);
+    if (f != NULL) {
+        fflush(f);
+    }
+    if (bytes_read == 0 && err != 0) {
+        return (-err);
+    }
     return (bytes_read);
 }
+
+/**
+ * @brief write the data of a gather write done by the process being traced.
+ *
+ * Get the data described by the remote iovec array |remote|
+ * from the process being traced, and write it to a file,
+ * and to the copies, if there are any.
+ *
+ * @param f       output stream, or NULL
+ * @param copy_fd copy as written to this fd, or -1
+ * @param rec_fd  fd to record the data as written to, or -1
+ * @param tracee  pid of process being traced
+ * @param remote  regions of the address space of |tracee|
+ * @param rcnt    number of remote regions
+ * @return        number of bytes actually read successfully,
+ *                or -EFAULT, if nothing could be read.
+ */
+ssize_t
+pmem_fwritev(FILE *f, int copy_fd, int rec_fd, pid_t tracee,
+    const struct iovec *remote, size_t rcnt)
+{
+    return (gather_write(f, -1, copy_fd, rec_fd, -1, tracee, remote, rcnt));
+}
+
+/**
+ * @brief write, with marks, the data of a write done by the process being traced.
+ *
+ * Like pmem_fwritev(), but the data goes to file descriptor |fd|,
+ * using mark_write(), so that marks and data go out together,
+ * in one system call.  It is recorded, if there is a --record file.
+ *
+ * @param fd      1 or 2
+ * @param copy    copy it, too
+ * @param tracee  pid of process being traced
+ * @param remote  regions of the address space of |tracee|
+ * @param rcnt    number of remote regions
+ * @return        number of bytes actually written, or -errno,
+ *                if nothing could be read, or written.
+ */
+ssize_t
+pmem_mark_writev(int fd, bool copy, pid_t tracee,
+    const struct iovec *remote, size_t rcnt)
+{
+    return (gather_write(NULL, fd, copy ? fd : -1, fd, -1, tracee, remote, rcnt));
+}
+
+/**
+ * @brief copy, and record, data that the kernel has written, for the process being traced.
+ *
+ * Like pmem_mark_writev(), but the data has already gone out, by way
+ * of the kernel.  It goes only to the copies, to the record, and to
+ * the |on_data| sink.
+ *
+ * @param fd      1 or 2
+ * @param copy    copy it
+ * @param tracee  pid of process being traced
+ * @param remote  regions of the address space of |tracee|, as much
+ *                of them as was written
+ * @param rcnt    number of remote regions
+ * @return        number of bytes actually read successfully,
+ *                or -EFAULT, if nothing could be read.
+ */
+ssize_t
+pmem_passed_writev(int fd, bool copy, pid_t tracee,
+    const struct iovec *remote, size_t rcnt)
+{
+    return (gather_write(NULL, -1, copy ? fd : -1, fd, fd, tracee, remote, rcnt));
+}
+
+/**
+ * @brief write a region of data from the process being traced.
+ *
+ * Get data from the process being traced, at the given address,
+ * and write it to a file.
+ *
+ * It used to be done one word at a time, directly from the tracee's
+ * address space; but that costs one ptrace() system call
+ * and one call to fwrite() for every 8 bytes.
+ *
+ * @param f       output stream
+ * @param tracee  pid of process being traced
+ * @param raddr   address of region of data
+ * @param len     size in bytes of the region
+ * @return        number of bytes actually read successfully
+ */
+
+ssize_t
+pmem_fwrite(FILE *f, pid_t tracee, void *raddr, size_t len)
+{
+    struct iovec riov;
+
+    riov.iov_base = raddr;
+    riov.iov_len = len;
+    return (pmem_fwritev(f, -1, -1, tracee, &riov, 1));
+}
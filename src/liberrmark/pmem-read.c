@@ -0,0 +1,361 @@
+/*
+ * Filename: src/liberrmark/pmem-read.c
+ * Project: errmark
+ * Library: liberrmark
+ * Brief: Bulk read of regions of memory of a traced process
+ *
+ * Copyright (C) 2016-2019 Guy Shaw
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <errmark.h>
+#include <stdbool.h>
+#include <stdio.h>		// Import snprintf()
+#include <sys/types.h>		// Import size_t, ssize_t, pid_t
+#include <stdint.h>		// Import uintptr_t
+#include <errno.h>		// Import errno, EIO, EFAULT, EPERM, ENOSYS
+#include <fcntl.h>		// Import open()
+#include <unistd.h>		// Import pread(), close()
+#include <limits.h>		// Import IOV_MAX
+#include <string.h>		// Import memcpy()
+#include <sys/ptrace.h>		// Import PTRACE_PEEKDATA
+#include <sys/uio.h>		// Import process_vm_readv(), struct iovec
+
+/*
+ * There are three ways to get at the memory of a traced process.
+ * In order of preference:
+ *
+ *   1) process_vm_readv(2), which can read any number of regions
+ *      of any size in one system call;
+ *
+ *   2) pread(2) on /proc/<pid>/mem, which costs one system call
+ *      per contiguous remote region;
+ *
+ *   3) ptrace(PTRACE_PEEKDATA), which costs one system call
+ *      per word.
+ *
+ * process_vm_readv() can be refused (seccomp policy, container
+ * runtimes, kernels built without CONFIG_CROSS_MEMORY_ATTACH),
+ * and /proc may not be mounted.  Once a method has been refused,
+ * we remember that, and do not try it again.
+ */
+
+static enum pmem_method forced_method = PMEM_AUTO;
+static bool vm_readv_refused = false;
+static bool proc_mem_refused = false;
+
+/*
+ * Cache of one open /proc/<pid>/mem file descriptor.
+ * Consecutive reads are almost always from the same tracee.
+ * One per tracer thread, since each has tracees of its own.
+ */
+static __thread pid_t mem_pid = 0;
+static __thread int   mem_fd  = -1;
+
+void
+pmem_set_method(enum pmem_method method)
+{
+    forced_method = method;
+}
+
+/*
+ * Forget anything we know about the address space of |tracee|.
+ * Must be called when a tracee exits or execs, because an open
+ * /proc/<pid>/mem refers to the old address space.
+ */
+void
+pmem_forget(pid_t tracee)
+{
+    if (mem_fd != -1 && (tracee == mem_pid || tracee == 0)) {
+        close(mem_fd);
+        mem_fd = -1;
+        mem_pid = 0;
+    }
+}
+
+static inline bool
+is_refusal(int err)
+{
+    return (err == ENOSYS || err == EPERM || err == EACCES);
+}
+
+/*
+ * A region reader copies one contiguous remote region into one
+ * contiguous local buffer.  It returns the number of bytes read,
+ * which is less than |len| only at an unreadable page,
+ * or -1 with errno set if nothing could be read.
+ */
+typedef ssize_t (*region_reader_t)(pid_t, char *, uintptr_t, size_t);
+
+static ssize_t
+proc_mem_read(pid_t tracee, char *buf, uintptr_t raddr, size_t len)
+{
+    size_t bytes_read;
+    ssize_t rv;
+
+    if (mem_fd == -1 || mem_pid != tracee) {
+        char fname[32];
+
+        pmem_forget(0);
+        snprintf(fname, sizeof (fname), "/proc/%d/mem", (int)tracee);
+        mem_fd = open(fname, O_RDONLY | O_CLOEXEC);
+        if (mem_fd == -1) {
+            return (-1);
+        }
+        mem_pid = tracee;
+    }
+
+    errno = 0;
+    bytes_read = 0;
+    while (bytes_read < len) {
+        rv = pread(mem_fd, buf + bytes_read, len - bytes_read,
+                   (off_t)(raddr + bytes_read));
+        if (rv == -1 && errno == EINTR) {
+            continue;
+        }
+        if (rv <= 0) {
+            break;
+        }
+        bytes_read += rv;
+    }
+
+    if (bytes_read == 0 && len != 0) {
+        if (errno == 0) {
+            errno = EIO;
+        }
+        return (-1);
+    }
+    return (bytes_read);
+}
+
+static ssize_t
+peekdata_read(pid_t tracee, char *buf, uintptr_t raddr, size_t len)
+{
+    union {
+        long   iword;
+        char bytes[sizeof (long)];
+    } data;
+    size_t phase;
+    size_t bytes_read;
+    uintptr_t waddr;
+
+    bytes_read = 0;
+    phase = (raddr & (sizeof (data) - 1));
+    waddr = raddr - phase;
+
+    /*
+     * Always peek at aligned words.  The first word may contribute
+     * only its tail, and the last word only its head.
+     */
+    while (bytes_read < len) {
+        size_t sz;
+
+        errno = 0;
+        data.iword = ptrace(PTRACE_PEEKDATA, tracee, (void *)waddr, NULL);
+        if (data.iword == -1 && errno != 0) {
+            if (bytes_read != 0 && (errno == EIO || errno == EFAULT)) {
+                return (bytes_read);
+            }
+            return (-1);
+        }
+        sz = sizeof (data) - phase;
+        if (sz > len - bytes_read) {
+            sz = len - bytes_read;
+        }
+        memcpy(buf + bytes_read, data.bytes + phase, sz);
+        bytes_read += sz;
+        waddr += sizeof (data);
+        phase = 0;
+    }
+
+    return (bytes_read);
+}
+
+/*
+ * Scatter/gather using a region reader, one remote region at a time,
+ * splitting each remote region across as many local buffers as needed.
+ */
+static ssize_t
+walk_regions(region_reader_t reader, pid_t tracee,
+    const struct iovec *local, size_t lcnt,
+    const struct iovec *remote, size_t rcnt)
+{
+    size_t li, ri;
+    size_t loff, roff;
+    size_t total;
+
+    li = 0;
+    loff = 0;
+    total = 0;
+    for (ri = 0; ri < rcnt; ++ri) {
+        roff = 0;
+        while (roff < remote[ri].iov_len) {
+            size_t sz;
+            ssize_t rv;
+
+            while (li < lcnt && loff >= local[li].iov_len) {
+                ++li;
+                loff = 0;
+            }
+            if (li >= lcnt) {
+                return (total);
+            }
+            sz = remote[ri].iov_len - roff;
+            if (sz > local[li].iov_len - loff) {
+                sz = local[li].iov_len - loff;
+            }
+            rv = reader(tracee, (char *)local[li].iov_base + loff,
+                        (uintptr_t)remote[ri].iov_base + roff, sz);
+            if (rv == -1) {
+                return (total != 0 ? (ssize_t)total : -1);
+            }
+            total += rv;
+            loff += rv;
+            roff += rv;
+            if ((size_t)rv < sz) {
+                return (total);
+            }
+        }
+    }
+
+    return (total);
+}
+
+static ssize_t
+vm_read_region(pid_t tracee, char *buf, uintptr_t raddr, size_t len)
+{
+    struct iovec liov, riov;
+
+    liov.iov_base = buf;
+    liov.iov_len  = len;
+    riov.iov_base = (void *)raddr;
+    riov.iov_len  = len;
+    return (process_vm_readv(tracee, &liov, 1, &riov, 1, 0));
+}
+
+/*
+ * pmem_readv(), by whichever method works.
+ */
+static ssize_t
+readv_method(pid_t tracee,
+    const struct iovec *local, size_t lcnt,
+    const struct iovec *remote, size_t rcnt)
+{
+    enum pmem_method method;
+    ssize_t rv;
+
+    method = forced_method;
+
+    if (method == PMEM_AUTO || method == PMEM_VM_READV) {
+        if (!vm_readv_refused || method == PMEM_VM_READV) {
+            /*
+             * The kernel accepts at most IOV_MAX elements on either side.
+             * That is never an issue for the iovecs of a write-like
+             * system call, but if it happens, go one region at a time.
+             */
+            if (lcnt <= IOV_MAX && rcnt <= IOV_MAX) {
+                rv = process_vm_readv(tracee, local, lcnt, remote, rcnt, 0);
+            }
+            else {
+                rv = walk_regions(vm_read_region, tracee,
+                                  local, lcnt, remote, rcnt);
+            }
+            if (rv != -1 || !is_refusal(errno) || method != PMEM_AUTO) {
+                return (rv);
+            }
+            vm_readv_refused = true;
+        }
+    }
+
+    if (method == PMEM_AUTO || method == PMEM_PROC_MEM) {
+        if (!proc_mem_refused || method == PMEM_PROC_MEM) {
+            errno = 0;
+            rv = walk_regions(proc_mem_read, tracee,
+                              local, lcnt, remote, rcnt);
+            if (rv != -1 || method != PMEM_AUTO) {
+                return (rv);
+            }
+            if (mem_fd != -1) {
+                return (rv);
+            }
+            /*
+             * We could not even open /proc/<pid>/mem.
+             */
+            if (is_refusal(errno)) {
+                proc_mem_refused = true;
+            }
+        }
+    }
+
+    return (walk_regions(peekdata_read, tracee, local, lcnt, remote, rcnt));
+}
+
+/**
+ * @brief Scatter read regions of memory of the process being traced
+ *
+ * Read the remote regions described by |remote|, in order,
+ * as one logical stream of bytes, and scatter that stream
+ * across the local buffers described by |local|.
+ *
+ * If some page of the remote regions cannot be read,
+ * the bytes before that page are still delivered, and
+ * their count is returned.  No bytes after an unreadable page
+ * are read, even if they belong to a later remote region.
+ *
+ * @param tracee  pid of process being traced
+ * @param local   local buffers
+ * @param lcnt    number of local buffers
+ * @param remote  regions of the address space of |tracee|
+ * @param rcnt    number of remote regions
+ * @return        number of bytes actually read successfully,
+ *                or -1, with errno set, if nothing could be read.
+ */
+ssize_t
+pmem_readv(pid_t tracee,
+    const struct iovec *local, size_t lcnt,
+    const struct iovec *remote, size_t rcnt)
+{
+    uint64_t t0;
+    ssize_t rv;
+
+    t0 = stats_tick();
+    rv = readv_method(tracee, local, lcnt, remote, rcnt);
+    stats_phase(STATS_MEM, t0);
+    return (rv);
+}
+
+/**
+ * @brief Read one region of memory of the process being traced
+ *
+ * @param buf     destination buffer, already allocated to hold len bytes.
+ * @param tracee  pid of process being traced
+ * @param raddr   address of region of data
+ * @param len     size in bytes of the region
+ * @return        number of bytes actually read successfully,
+ *                or -1, with errno set, if nothing could be read.
+ */
+ssize_t
+pmem_read(void *buf, pid_t tracee, const void *raddr, size_t len)
+{
+    struct iovec liov, riov;
+
+    liov.iov_base = buf;
+    liov.iov_len  = len;
+    riov.iov_base = (void *)raddr;
+    riov.iov_len  = len;
+    return (pmem_readv(tracee, &liov, 1, &riov, 1));
+}
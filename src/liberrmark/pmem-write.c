@@ -0,0 +1,81 @@
+/*
+ * Filename: src/liberrmark/pmem-write.c
+ * Project: errmark
+ * Library: liberrmark
+ * Brief: Write a region of memory of a traced process
+ *
+ * Copyright (C) 2016-2019 Guy Shaw
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Needed only when errmark performs a system call on behalf
+ * of a tracee, and that system call has an output argument,
+ * such as the offset of sendfile(2).  Those are a few bytes,
+ * now and then, so there is no caching, and no PTRACE_POKEDATA.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <errmark.h>
+#include <stdio.h>		// Import snprintf()
+#include <sys/types.h>		// Import size_t, ssize_t, pid_t
+#include <stdint.h>		// Import uintptr_t
+#include <errno.h>		// Import errno
+#include <fcntl.h>		// Import open()
+#include <unistd.h>		// Import pwrite(), close()
+#include <sys/uio.h>		// Import process_vm_writev(), struct iovec
+
+/**
+ * @brief Write one region of memory of the process being traced
+ *
+ * @param tracee  pid of process being traced
+ * @param raddr   address of region of data
+ * @param buf     data to be written
+ * @param len     size in bytes of the region
+ * @return        number of bytes actually written,
+ *                or -1, with errno set, if nothing could be written.
+ */
+ssize_t
+pmem_write(pid_t tracee, void *raddr, const void *buf, size_t len)
+{
+    struct iovec liov, riov;
+    char fname[32];
+    ssize_t rv;
+    int fd;
+
+    liov.iov_base = (void *)buf;
+    liov.iov_len  = len;
+    riov.iov_base = raddr;
+    riov.iov_len  = len;
+    rv = process_vm_writev(tracee, &liov, 1, &riov, 1, 0);
+    if (rv != -1 || (errno != ENOSYS && errno != EPERM)) {
+        return (rv);
+    }
+
+    /*
+     * /proc/<pid>/mem can write even to read-only pages;
+     * but then, we only ever write where the tracee
+     * asked the kernel to write.
+     */
+    snprintf(fname, sizeof (fname), "/proc/%d/mem", (int)tracee);
+    fd = open(fname, O_WRONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return (-1);
+    }
+    rv = pwrite(fd, buf, len, (off_t)(uintptr_t)raddr);
+    close(fd);
+    return (rv);
+}
@@ -0,0 +1,355 @@
+/*
+ * Filename: src/liberrmark/record-write.c
+ * Project: errmark
+ * Library: liberrmark
+ * Brief: Append captured output to a --record file, through mmap
+ *
+ * Copyright (C) 2016-2019 Guy Shaw
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * See errmark.h for the format.
+ *
+ * Records are written into a window of the file, mapped shared.
+ * Adding a record is a clock_gettime() (vDSO) and a memcpy();
+ * no system call.  When a record does not fit in what is left
+ * of the window, the next window is mapped, starting at the page
+ * the record starts in.  That is two system calls per REC_WINDOW bytes.
+ *
+ * The file is extended ahead of the records, REC_GROW bytes at a time,
+ * with posix_fallocate(), which gives it the disk blocks, and not
+ * just the size.  A store into a hole in a shared mapping, with
+ * the disk full, is SIGBUS; a failed posix_fallocate() is ENOSPC,
+ * and recording stops.  The window can go past the end of the file;
+ * nothing is stored there.
+ *
+ * The first page of the file, the file header, is mapped on its own,
+ * so that |data_end| can be kept up to date, as well.
+ *
+ * An index entry is taken every REC_INDEX_BYTES of data, or every
+ * REC_INDEX_RECORDS records, whichever comes first, and kept in
+ * memory.  It is appended to the file by record_close().
+ */
+
+#define _GNU_SOURCE 1
+
+#include <errmark.h>
+#include <cscript.h>		// Import guard_malloc(), guard_realloc(), eprintf()
+#include <stdbool.h>
+#include <stdint.h>		// Import uint64_t
+#include <stdlib.h>		// Import free()
+#include <string.h>		// Import memcpy(), memset(), strlen()
+#include <errno.h>		// Import errno
+#include <fcntl.h>		// Import open(), posix_fallocate()
+#include <time.h>		// Import clock_gettime()
+#include <unistd.h>		// Import ftruncate(), sysconf(), close()
+#include <sys/mman.h>		// Import mmap(), munmap()
+
+#define REC_WINDOW        (64 * 1024 * 1024)
+#define REC_GROW          (1024 * 1024)
+#define REC_INDEX_BYTES   (256 * 1024)
+#define REC_INDEX_RECORDS 4096
+
+static int rec_fd = -1;
+static struct rec_file_header *rec_hdr = NULL;
+static size_t page_size;
+
+static char  *win = NULL;       // Mapped window of the file
+static off_t  win_off = 0;      // File offset of |win|
+static size_t win_len = 0;
+static off_t  file_size = 0;   // Allocated so far
+static uint64_t rec_end = 0;    // File offset just past the last record
+
+static struct rec_index_entry *rec_index = NULL;
+static size_t index_count = 0;
+static size_t index_alloc = 0;
+static uint64_t index_next_off = 0;
+static unsigned long index_next_nr = 0;
+
+static unsigned long nr_records = 0;
+static unsigned long nr_remaps = 0;
+
+static inline uint64_t
+clock_ns(clockid_t clk)
+{
+    struct timespec ts;
+
+    clock_gettime(clk, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+/*
+ * Make sure that [off, off + need) is in the window.
+ */
+static bool
+map_window(uint64_t off, size_t need)
+{
+    off_t new_off;
+    size_t new_len;
+
+    new_off = (off_t)(off & ~((uint64_t)page_size - 1));
+    new_len = (off - new_off) + need;
+    if (new_len < REC_WINDOW) {
+        new_len = REC_WINDOW;
+    }
+    new_len = (new_len + page_size - 1) & ~(page_size - 1);
+
+    if (win != NULL) {
+        munmap(win, win_len);
+        win = NULL;
+    }
+    win = mmap(NULL, new_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+               rec_fd, new_off);
+    if (win == MAP_FAILED) {
+        win = NULL;
+        return (false);
+    }
+    win_off = new_off;
+    win_len = new_len;
+    ++nr_remaps;
+    return (true);
+}
+
+/*
+ * Make sure that the file has disk blocks up to |end|.
+ */
+static bool
+grow(uint64_t end)
+{
+    off_t new_size;
+    int err;
+
+    if ((off_t)end <= file_size) {
+        return (true);
+    }
+    new_size = (off_t)((end + REC_GROW - 1) & ~((uint64_t)REC_GROW - 1));
+    err = posix_fallocate(rec_fd, file_size, new_size - file_size);
+    if (err != 0) {
+        errno = err;
+        return (false);
+    }
+    file_size = new_size;
+    return (true);
+}
+
+/*
+ * Room for |need| bytes at |rec_end|; NULL if the file cannot grow.
+ */
+static char *
+reserve(size_t need)
+{
+    if (rec_fd < 0 || !grow(rec_end + need)) {
+        return (NULL);
+    }
+    if (win == NULL
+        || rec_end + need > (uint64_t)win_off + win_len) {
+        if (!map_window(rec_end, need)) {
+            return (NULL);
+        }
+    }
+    return (win + (rec_end - win_off));
+}
+
+static void
+add_index(uint64_t t_ns, uint64_t off)
+{
+    if (index_count == index_alloc) {
+        index_alloc = index_alloc ? 2 * index_alloc : 1024;
+        rec_index = (struct rec_index_entry *)
+            guard_realloc(rec_index, index_alloc * sizeof (*rec_index));
+    }
+    rec_index[index_count].t_ns = t_ns;
+    rec_index[index_count].off = off;
+    ++index_count;
+}
+
+static void
+append(pid_t pid, int fd, const void *buf, size_t len, unsigned int flags,
+    size_t data_len)
+{
+    struct rec_header *rh;
+    size_t need;
+    char *p;
+
+    need = sizeof (*rh) + REC_ALIGN(data_len);
+    p = reserve(need);
+    if (p == NULL) {
+        /*
+         * Out of disk, most likely.  Stop recording, and say so, once.
+         */
+        fshow_errno(stderr, "errmark: --record: cannot extend the file;"
+            " recording stopped - ", errno);
+        record_close(false);
+        return;
+    }
+
+    rh = (struct rec_header *)p;
+    rh->t_ns = clock_ns(CLOCK_MONOTONIC);
+    rh->pid = (int32_t)pid;
+    rh->fd = (int16_t)fd;
+    rh->flags = (uint16_t)flags;
+    rh->len = (uint32_t)len;
+    rh->reserved = 0;
+    if (data_len != 0) {
+        memcpy(p + sizeof (*rh), buf, data_len);
+        memset(p + sizeof (*rh) + data_len, 0, REC_ALIGN(data_len) - data_len);
+    }
+
+    if (!(flags & REC_F_MARKS)
+        && (rec_end >= index_next_off || nr_records >= index_next_nr)) {
+        add_index(rh->t_ns, rec_end);
+        index_next_off = rec_end + REC_INDEX_BYTES;
+        index_next_nr = nr_records + REC_INDEX_RECORDS;
+    }
+    rec_end += need;
+    rec_hdr->data_end = rec_end;
+    ++nr_records;
+}
+
+static void
+record_marks(int fd)
+{
+    char const *m_start, *m_end;
+    char *buf;
+    size_t ls, le;
+
+    getmark(fd, &m_start, &m_end);
+    ls = strlen(m_start);
+    le = strlen(m_end);
+    buf = (char *)guard_malloc(ls + le + 2);
+    memcpy(buf, m_start, ls + 1);
+    memcpy(buf + ls + 1, m_end, le + 1);
+    append(0, fd, buf, ls + le + 2, REC_F_MARKS, ls + le + 2);
+    free(buf);
+}
+
+/**
+ * @brief Start recording to |fname|, which is created, or truncated.
+ *
+ * The marks must already be set.
+ *
+ * @return false, with errno set, if it cannot be done.
+ */
+bool
+record_open(const char *fname)
+{
+    void *hp;
+
+    page_size = (size_t)sysconf(_SC_PAGESIZE);
+    rec_fd = open(fname, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (rec_fd == -1) {
+        return (false);
+    }
+    file_size = 0;
+    rec_end = 0;
+    if (!grow(page_size) || !map_window(0, page_size)) {
+        close(rec_fd);
+        rec_fd = -1;
+        return (false);
+    }
+    hp = mmap(NULL, page_size, PROT_READ | PROT_WRITE, MAP_SHARED, rec_fd, 0);
+    if (hp == MAP_FAILED) {
+        munmap(win, win_len);
+        win = NULL;
+        close(rec_fd);
+        rec_fd = -1;
+        return (false);
+    }
+    rec_hdr = (struct rec_file_header *)hp;
+    memset(rec_hdr, 0, sizeof (*rec_hdr));
+    memcpy(rec_hdr->magic, REC_MAGIC, sizeof (rec_hdr->magic));
+    rec_hdr->version = REC_VERSION;
+    rec_hdr->header_size = sizeof (*rec_hdr);
+    rec_hdr->mono0_ns = clock_ns(CLOCK_MONOTONIC);
+    rec_hdr->real0_ns = clock_ns(CLOCK_REALTIME);
+    rec_end = sizeof (*rec_hdr);
+    rec_hdr->data_end = rec_end;
+
+    nr_records = 0;
+    nr_remaps = 0;
+    index_count = 0;
+    index_next_off = 0;
+    index_next_nr = 0;
+
+    record_marks(1);
+    record_marks(2);
+    return (true);
+}
+
+bool
+record_active(void)
+{
+    return (rec_fd >= 0);
+}
+
+/**
+ * @brief Add a record of |len| bytes of |buf|, written by |pid| to |fd|.
+ *
+ * With REC_F_NO_DATA in |flags|, |buf| is ignored, and only
+ * the fact that |len| bytes were written is recorded.
+ */
+void
+record_write(pid_t pid, int fd, const void *buf, size_t len, unsigned int flags)
+{
+    if (rec_fd < 0) {
+        return;
+    }
+    append(pid, fd, buf, len, flags, (flags & REC_F_NO_DATA) ? 0 : len);
+}
+
+/**
+ * @brief Append the index, and finish the file.
+ */
+void
+record_close(bool verbose)
+{
+    size_t isz;
+    char *p;
+
+    if (rec_fd < 0) {
+        return;
+    }
+
+    isz = index_count * sizeof (*rec_index);
+    p = (isz != 0) ? reserve(isz) : NULL;
+    if (p != NULL) {
+        memcpy(p, rec_index, isz);
+        rec_hdr->index_off = rec_end;
+        rec_hdr->index_count = index_count;
+    }
+    file_size = (off_t)(rec_end + (p != NULL ? isz : 0));
+
+    if (win != NULL) {
+        munmap(win, win_len);
+        win = NULL;
+    }
+    munmap(rec_hdr, page_size);
+    rec_hdr = NULL;
+    if (ftruncate(rec_fd, file_size) == -1) {
+        fshow_errno(stderr, "errmark: --record: ftruncate() failed - ", errno);
+    }
+    close(rec_fd);
+    rec_fd = -1;
+
+    if (verbose) {
+        eprintf("record: records=%lu bytes=%llu index=%zu remaps=%lu\n",
+            nr_records, (unsigned long long)file_size, index_count, nr_remaps);
+    }
+    free(rec_index);
+    rec_index = NULL;
+    index_count = 0;
+    index_alloc = 0;
+}
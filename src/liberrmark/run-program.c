@@ -21,11 +21,13 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#include <cscript.h>     // for eprintf, fshow_wait_status, guard_malloc, debug
+#define _GNU_SOURCE 1
+
+#include <cscript.h>     // for eprintf, fshow_wait_status, guard_malloc
 #include <errmark.h>     // for cmd_t, guard_ptrace, mark_close, after_write
 #include <signal.h>      // for SIGCHLD, SIGTRAP
 #include <stdbool.h>     // for false
-#include <stddef.h>      // for NULL, size_t
+#include <stddef.h>      // for NULL, size_t, offsetof
 #include <stdio.h>       // for fprintf, fwrite, stderr, perror, stdout
 #include <stdlib.h>      // for exit
 #include <sys/ptrace.h>  // for PTRACE_SETREGS, PTRACE_GETREGS, PTRACE_SYSCALL
@@ -33,6 +35,12 @@
 #include <sys/wait.h>    // for wait, WSTOPSIG, WIFSTOPPED
 #include <syscall.h>     // for SYS_write
 #include <unistd.h>      // for execvp, fork, sleep
+#include <errno.h>       // for errno, EINTR
+#include <dirent.h>      // for opendir, readdir
+#include <string.h>      // for memset, strerror
+#include <time.h>        // for timer_create
+#include <fcntl.h>       // for open, O_RDONLY, F_DUPFD_CLOEXEC
+#include <linux/seccomp.h>  // for SECCOMP_RET_TRACE
 #include <errmark.h>
 #include <cscript.h>
 
@@ -92,124 +100,878 @@
 #error "Need either __i386__  or  __x86_64__"
 #endif
 
-static int
-ptrace_cmd(cmd_t *cmd)
+/*
+ * Offset of a register in struct user, for PTRACE_POKEUSER.
+ * struct user begins with struct user_regs_struct.
+ */
+#define REG_OFFSET(reg) ((void *)offsetof(struct user_regs_struct, reg))
+
+/*
+ * Change one register of a stopped tracee.
+ * One small ptrace() call, with no need to fetch the others first.
+ */
+static inline void
+poke_reg(cmd_t *cmd, pid_t pid, void *offset, long value)
+{
+    uint64_t t0;
+
+    t0 = stats_tick();
+    guard_ptrace(cmd, PTRACE_POKEUSER, pid, offset, (void *)value);
+    stats_phase(STATS_REGS, t0);
+}
+
+/*
+ * What we need to know about a system call, at its entry.
+ */
+struct syscall_args {
+    long nr;
+    unsigned long args[6];
+};
+
+static void
+regs_to_args(const struct user_regs_struct *regs, struct syscall_args *sa)
+{
+    sa->nr = regs->reg_syscall;
+    sa->args[0] = regs->reg_arg1;
+    sa->args[1] = regs->reg_arg2;
+    sa->args[2] = regs->reg_arg3;
+#if defined(__x86_64__)
+    sa->args[3] = regs->r10;
+    sa->args[4] = regs->r8;
+    sa->args[5] = regs->r9;
+#else
+    sa->args[3] = regs->esi;
+    sa->args[4] = regs->edi;
+    sa->args[5] = regs->ebp;
+#endif
+}
+
+/*
+ * Get the system call number and arguments of a tracee
+ * that is at a syscall-enter-stop or a seccomp stop.
+ *
+ * PTRACE_GET_SYSCALL_INFO (Linux 5.3) copies out just that,
+ * rather than the whole register set.  If the kernel does not
+ * know about it, fall back to PTRACE_GETREGS, for good; if it
+ * does, but has nothing to say about this stop, for this stop.
+ *
+ * Return false if the tracee is gone.
+ */
+static bool
+get_syscall_args(cmd_t *cmd, pid_t pid, struct syscall_args *sa)
 {
     struct user_regs_struct regs;
-    int exit_status = 0;
-    int status;
-    int toggle = 0;
     long ptrace_rc;
 
-    int wfd;
-    void *waddr;
-    size_t wlen;
+#if defined(PTRACE_GET_SYSCALL_INFO)
+    if (cmd->syscall_info) {
+        struct __ptrace_syscall_info info;
+        size_t i;
 
-    while (1) {
-        status = 0;
-        wait(&status);
-        if (status != 0 && !(WIFSTOPPED(status) && (WSTOPSIG(status) == SIGTRAP || WSTOPSIG(status) == SIGCHLD))) {
-            exit_status = status;
-            if (cmd->mark_state) {
-                mark_close();
+        ++cmd->nr_ptrace;
+        ++cmd->nr_ptrace_get;
+        ptrace_rc = ptrace(PTRACE_GET_SYSCALL_INFO, pid,
+                           (void *)sizeof (info), &info);
+        if (ptrace_rc > 0) {
+            if (info.op == PTRACE_SYSCALL_INFO_ENTRY) {
+                sa->nr = info.entry.nr;
+                for (i = 0; i < 6; ++i) {
+                    sa->args[i] = info.entry.args[i];
+                }
+                return (true);
+            }
+            if (info.op == PTRACE_SYSCALL_INFO_SECCOMP) {
+                sa->nr = info.seccomp.nr;
+                for (i = 0; i < 6; ++i) {
+                    sa->args[i] = info.seccomp.args[i];
+                }
+                return (true);
             }
+        }
+        else if (ptrace_rc == -1L && errno == ESRCH) {
+            cmd->child_exited = true;
+            return (false);
+        }
+        else if (ptrace_rc == -1L && (errno == EIO || errno == EINVAL)) {
             if (cmd->verbose) {
-                eprintf("status=0x%02x\n", status);
+                eprintf("PTRACE_GET_SYSCALL_INFO not usable; using PTRACE_GETREGS.\n");
             }
-            break;
+            cmd->syscall_info = false;
         }
+        /*
+         * Otherwise, the kernel knows it, but this stop is not one
+         * it has the arguments for, as when a tracee attached to
+         * by --pid was in the middle of a system call; just this
+         * once, the registers will do.
+         */
+    }
+#endif
 
-        ptrace_rc = guard_ptrace(cmd, PTRACE_GETREGS, cmd->child, NULL, &regs);
-        if (ptrace_rc == -1L && cmd->child_exited) {
-            break;
-        }
+    ptrace_rc = guard_ptrace(cmd, PTRACE_GETREGS, pid, NULL, &regs);
+    if (ptrace_rc == -1L) {
+        return (false);
+    }
+    regs_to_args(&regs, sa);
+    return (true);
+}
 
-        if (regs.reg_syscall == SYS_write) {
-            if (debug) {
-                fprintf(stderr, "SYS_write; toggle=%d\n", toggle);
-            }
+/*
+ * Whether a tracee that is at a syscall stop is at the entry
+ * to a system call, rather than at the exit from one.
+ * At the entry, the kernel has set the return value to -ENOSYS.
+ */
+static bool
+at_syscall_entry(cmd_t *cmd, pid_t pid)
+{
+    struct user_regs_struct regs;
 
-            if (toggle == 0) {
-                toggle = 1;
-                wfd = (int)regs.reg_arg1;
-                waddr = (void *)regs.reg_arg2;
-                wlen = (size_t)regs.reg_arg3;
+#if defined(PTRACE_GET_SYSCALL_INFO)
+    if (cmd->syscall_info) {
+        struct __ptrace_syscall_info info;
 
-                if (debug) {
-                    fprintf(stderr, "wfd  =%d\n",  wfd);
-                    fprintf(stderr, "waddr=%p\n",  waddr);
-                    fprintf(stderr, "wlen =%zu\n", wlen);
-                }
+        ++cmd->nr_ptrace;
+        ++cmd->nr_ptrace_get;
+        if (ptrace(PTRACE_GET_SYSCALL_INFO, pid,
+                   (void *)sizeof (info), &info) > 0) {
+            return (info.op == PTRACE_SYSCALL_INFO_ENTRY);
+        }
+    }
+#endif
 
-#if 0
-                if (wlen > 100) {
-                    fprintf(stderr, "wlen forced to 100.\n");
-                    wlen = 100;
-                }
+    if (guard_ptrace(cmd, PTRACE_GETREGS, pid, NULL, &regs) == -1L) {
+        return (true);
+    }
+    return ((long)regs.reg_retn == -ENOSYS);
+}
+
+static inline bool
+nullifiable(const struct write_call *wc)
+{
+    return (wc->nr == SYS_write || wc->nr == SYS_writev
+#if defined(SYS_pwritev2)
+        || wc->nr == SYS_pwritev2
 #endif
+        );
+}
 
-                if (wfd == 1 || wfd == 2) {
-                    /*
-                     * It is the start of a write system call,
-                     * just before it will be performed by the kernel,
-                     * and the destination fd is one we are interested in.
-                     */
-                    if (cmd->mark_state == 0) {
-                        mark_open();
-                        cmd->mark_state = 1;
-                    }
-                    before_write(wfd, waddr, wlen);
-                    if (cmd->nullify) {
-                        regs.reg_arg3 = 0;
-                    }
-                    guard_ptrace(cmd, PTRACE_SETREGS, cmd->child, NULL, &regs);
-                    if (cmd->trace_fbt) {
-                        fprintf(cmd->trace_fbt, "> write\n");
-                    }
-
-                    if (wfd == 2 && cmd->copy_fh != NULL) {
-                        char *ebuf;
-
-                        ebuf = (char *)guard_malloc(wlen);
-                        pmem_copy(ebuf, cmd->child, waddr, wlen);
-                        fwrite(ebuf, wlen, 1, stdout);
-                        fwrite(ebuf, wlen, 1, cmd->copy_fh);
-                    }
-                    else {
-                        pmem_fwrite(stdout, cmd->child, waddr, wlen);
-                    }
-                }
+/*
+ * A write() to a marked fd is about to be performed by the kernel.
+ * Emit marks, and the data, to the fd the tracee is writing to.
+ *
+ * If emulating, cancel the write() itself, and supply its return value
+ * right now.  A system call number of -1 makes the kernel skip the call,
+ * leaving the return value register as we set it, so there is nothing
+ * left to do at the syscall-exit-stop.  Otherwise, nullify the write()
+ * by setting its length to 0, and fix up the return value at exit.
+ * For writev(), the "length" is the number of iovecs.
+ *
+ * The rest of the write() family cannot be emulated, unless the output
+ * goes to an |on_write| sink; see write-decode.c.
+ * The data moving calls are performed by us, if they can be; see
+ * splice-copy.c.  Anything else is marked, and then performed by
+ * the kernel, as is; the marks have to go out before the data does.
+ * What the kernel wrote is copied, and recorded, at the exit.
+ *
+ * Only the registers that change are written back.
+ */
+static void
+write_entry(cmd_t *cmd, struct tracee *t, struct write_call *wc)
+{
+    bool copy;
+    long wrote;
+
+    /*
+     * Only write(), writev() and pwritev2() have a length that
+     * can be nullified; for sendto() and sendmsg(), it is either
+     * emulate, or leave it to the kernel.  With an |on_write| sink,
+     * the output never goes to the fd, so whatever else the kernel
+     * would do with it does not matter; if it were left to the kernel,
+     * the data would get out past the sink.
+     */
+    if (wc->emulatable) {
+        t->emulated = cmd->nullify && cmd->emulate;
+    }
+    else {
+        t->emulated = cmd->nullify && !wc->spliced && mark_has_sink();
+    }
+    t->nullified = wc->emulatable && cmd->nullify && !t->emulated
+        && nullifiable(wc);
+    t->passed = false;
+    ++cmd->nr_writes;
+
+    if (cmd->mark_state == 0) {
+        mark_open();
+        cmd->mark_state = 1;
+    }
+    if (cmd->trace_fbt) {
+        fprintf(cmd->trace_fbt, "> write\n");
+    }
+
+    stats_write(t->wfd, t->wlen);
+    copy = copy_wanted(t->wfd);
+    mark_set_writer(t->tid);
+    wrote = 0;
+    if (t->emulated || t->nullified) {
+        /*
+         * Marks and data, in one system call.
+         */
+        wrote = pmem_mark_writev(t->wfd, copy, t->tid, wc->iov, wc->iovcnt);
+        t->wrote = wrote;
+    }
+    else if (wc->spliced && splice_copy(wc, t->tid, &wrote)) {
+        /*
+         * Performed by us: marks only if there was data, and the data
+         * copied and recorded, without it ever passing through user
+         * memory, unless it had to.
+         */
+        t->emulated = true;
+    }
+    else {
+        before_write(t->wfd, t->waddr, t->wlen);
+        t->passed = true;
+    }
+
+    if (t->emulated) {
+        after_write(t->wfd, t->waddr, t->wlen);
+        poke_reg(cmd, t->tid, REG_OFFSET(reg_syscall), -1);
+        poke_reg(cmd, t->tid, REG_OFFSET(reg_retn), wrote);
+        if (cmd->trace_fbt) {
+            fprintf(cmd->trace_fbt, "< write\n");
+        }
+    }
+    else if (t->nullified) {
+        if (wc->iovcnt != 0) {
+            poke_reg(cmd, t->tid, REG_OFFSET(reg_arg3), 0);
+        }
+    }
+    else {
+        /*
+         * Performed by the kernel, as is.  The marks are in place;
+         * the rest waits for the exit.
+         */
+        after_write(t->wfd, t->waddr, t->wlen);
+        if (cmd->trace_fbt) {
+            fprintf(cmd->trace_fbt, "< write\n");
+        }
+    }
+}
+
+/*
+ * The kernel has performed a write() of the family that was left
+ * to it.  Copy, record, and hand to the sink, as much of the data
+ * as it wrote, if it wrote any.  The arguments are still in the
+ * registers, and the data, if it ever was in memory, is still there.
+ */
+static void
+write_pass_exit(cmd_t *cmd, struct tracee *t)
+{
+    static __thread struct write_call wc;       // One per tracer thread
+    struct user_regs_struct regs;
+    struct syscall_args sa;
+    size_t left;
+    size_t i;
+    long rv;
+
+    if (guard_ptrace(cmd, PTRACE_GETREGS, t->tid, NULL, &regs) == -1L) {
+        return;
+    }
+    rv = (long)regs.reg_retn;
+    regs_to_args(&regs, &sa);
+    if (rv <= 0 || !write_call_decode(&wc, t->tid, sa.nr, sa.args)) {
+        return;
+    }
+    if (wc.spliced) {
+        record_write(t->tid, t->wfd, NULL, rv, REC_F_NO_DATA);
+        return;
+    }
+    left = (size_t)rv;
+    for (i = 0; i < wc.iovcnt && left != 0; ++i) {
+        if (wc.iov[i].iov_len > left) {
+            wc.iov[i].iov_len = left;
+        }
+        left -= wc.iov[i].iov_len;
+    }
+    pmem_passed_writev(t->wfd, copy_wanted(t->wfd), t->tid, wc.iov, i);
+}
+
+/*
+ * The kernel has performed the (nullified) write(),
+ * or one that was left to it.
+ */
+static void
+write_exit(cmd_t *cmd, struct tracee *t)
+{
+    if (t->passed) {
+        t->passed = false;
+        write_pass_exit(cmd, t);
+        return;
+    }
+    after_write(t->wfd, t->waddr, t->wlen);
+    if (t->nullified) {
+        /*
+         * Since we have nullified the write(),
+         * we need to provide a fake return value:
+         * what we wrote for it, short as it may be,
+         * or -errno, if we wrote nothing.
+         */
+        poke_reg(cmd, t->tid, REG_OFFSET(reg_retn), t->wrote);
+        t->nullified = false;
+    }
+    if (cmd->trace_fbt) {
+        fprintf(cmd->trace_fbt, "< write\n");
+    }
+}
+
+/*
+ * Decode a system call at its entry, and deal with it
+ * if it is of the write() family, and its fd is marked.
+ */
+static void
+syscall_entry(cmd_t *cmd, struct tracee *t, struct syscall_args *sa)
+{
+    struct write_call wc;
+    int fd;
+
+    if (cmd->coalesce_us != 0 && read_call_is_stdin(sa->nr, sa->args)) {
+        order_begin();
+        mark_flush();
+        order_end();
+        return;
+    }
+
+    fd = write_call_fd(sa->nr, sa->args);
+    if (fd < 0) {
+        return;
+    }
+
+    if (cmd->debug) {
+        fprintf(stderr, "write syscall %ld; tid=%d\n", sa->nr, t->tid);
+    }
+
+    if (!tracee_fd_is_marked(t->tid, fd)) {
+        return;
+    }
+    if (!write_call_decode(&wc, t->tid, sa->nr, sa->args)) {
+        return;
+    }
+
+    t->wfd = fd;
+    t->waddr = wc.raddr;
+    t->wlen = wc.len;
+
+    if (cmd->debug) {
+        fprintf(stderr, "wfd  =%d\n",  t->wfd);
+        fprintf(stderr, "waddr=%p\n",  t->waddr);
+        fprintf(stderr, "wlen =%zu\n", t->wlen);
+        fprintf(stderr, "niov =%zu\n", wc.iovcnt);
+    }
+
+    /*
+     * It is the start of a write system call,
+     * just before it will be performed by the kernel,
+     * and the destination fd is one we are interested in.
+     */
+    t->marked = true;
+    order_begin();
+    write_entry(cmd, t, &wc);
+    order_end();
+
+    if (cmd->debug) {
+        fprintf(stderr, ".\n");
+        if (cmd->slow) {
+            sleep(1);
+        }
+    }
+}
+
+/*
+ * Syscall-enter-stop or syscall-exit-stop.
+ *
+ * With the ptrace engine, every system call gets both.
+ * With the seccomp engine, we only ever ask for the exit stop,
+ * and only for a write() that was not emulated.
+ *
+ * The system call is looked at only at its entry.  At the exit,
+ * there is something to do only for a write() that was nullified,
+ * and everything needed to do it was saved at the entry, or one
+ * that was left to the kernel, which is looked at again.
+ */
+static void
+syscall_stop(cmd_t *cmd, struct tracee *t)
+{
+    struct syscall_args sa;
+    uint64_t t0;
+    bool ok;
+
+    if (t->resync) {
+        t->resync = false;
+        t->in_syscall = !at_syscall_entry(cmd, t->tid);
+    }
+    if (!t->in_syscall) {
+        t->in_syscall = true;
+        t0 = stats_tick();
+        ok = get_syscall_args(cmd, t->tid, &sa);
+        stats_phase(STATS_REGS, t0);
+        if (ok) {
+            stats_syscall(sa.nr);
+            syscall_entry(cmd, t, &sa);
+        }
+        return;
+    }
+
+    t->in_syscall = false;
+    if (!t->marked) {
+        return;
+    }
+    t->marked = false;
+    if (t->emulated) {
+        /*
+         * The exit from an emulated write().
+         * Nothing to look at, and nothing to change.
+         */
+        t->emulated = false;
+        return;
+    }
+    order_begin();
+    write_exit(cmd, t);
+    order_end();
+}
+
+/*
+ * A seccomp stop, at entry to a write() to a marked fd.
+ *
+ * When emulating, that is all there is to it; the tracee never
+ * gets to the write() itself.  Otherwise, we ask to see the
+ * syscall-exit-stop for this one system call.
+ */
+static void
+seccomp_stop(cmd_t *cmd, struct tracee *t)
+{
+    syscall_stop(cmd, t);
+    if (!t->marked || t->emulated) {
+        t->in_syscall = false;
+        t->marked = false;
+        t->emulated = false;
+    }
+}
+
+/*
+ * A thread other than the thread group leader has called execve().
+ * The kernel has given it the tid of the leader, which is gone.
+ * Carry its state over to its new identity.
+ */
+static void
+exec_event(cmd_t *cmd, pid_t pid)
+{
+    struct tracee *t;
+    struct tracee state;
+    unsigned long former;
+
+    former = 0;
+    guard_ptrace(cmd, PTRACE_GETEVENTMSG, pid, NULL, &former);
+    pmem_forget(pid);
+    if (former == 0 || (pid_t)former == pid) {
+        return;
+    }
+    pmem_forget((pid_t)former);
+    mark_forget((pid_t)former);
+
+    t = tracee_lookup(&cmd->tracees, (pid_t)former);
+    if (t == NULL) {
+        return;
+    }
+    state = *t;
+    tracee_remove(&cmd->tracees, (pid_t)former);
+    t = tracee_insert(&cmd->tracees, pid);
+    *t = state;
+    t->tid = pid;
+}
+
+static inline bool
+is_group_stop_sig(int sig)
+{
+    return (sig == SIGSTOP || sig == SIGTSTP || sig == SIGTTIN || sig == SIGTTOU);
+}
+
+/*
+ * Let a tracee go on, delivering |sig| to it.
+ *
+ * With the seccomp engine, tracees run freely until the filter
+ * stops one of them at the entry to a write(), unless we are
+ * waiting for the exit from a write().  Otherwise, stop at
+ * every system call.
+ */
+static void
+resume_tracee(cmd_t *cmd, pid_t pid, int sig)
+{
+    struct tracee *t;
+    enum __ptrace_request resume;
+
+    resume = PTRACE_SYSCALL;
+    if (cmd->engine == ENGINE_SECCOMP) {
+        t = tracee_lookup(&cmd->tracees, pid);
+        if (t == NULL || !t->in_syscall) {
+            resume = PTRACE_CONT;
+        }
+    }
+    guard_ptrace(cmd, resume, pid, NULL, (void *)(long)sig);
+}
+
+/*
+ * In a batch, tracee |t| has just started a new process or thread.
+ * It belongs to the same command.  Put it in the table now, so that
+ * the command is not taken to be done, if |t| exits before the new
+ * one is first seen.
+ */
+static void
+batch_new_tracee(cmd_t *cmd, struct tracee *t)
+{
+    errmark_ctx_t *ctx;
+    struct tracee *nt;
+    unsigned long msg;
+
+    msg = 0;
+    if (guard_ptrace(cmd, PTRACE_GETEVENTMSG, t->tid, NULL, &msg) == -1L
+        || msg == 0) {
+        return;
+    }
+    ctx = t->ctx;
+    nt = tracee_insert(&cmd->tracees, (pid_t)msg);
+    if (nt->ctx == NULL) {
+        nt->ctx = ctx;
+    }
+}
+
+/*
+ * Account for the time, since |t0|, that tracee |t| was stopped
+ * for a write(), if this stop was for one; |in_write| says it was
+ * in the middle of one, or has just started one.  Once the write()
+ * is done with, as far as we are concerned, the total goes
+ * into the histogram.
+ */
+static void
+write_stop_done(struct tracee *t, bool in_write, uint64_t t0)
+{
+    if (in_write || t->marked) {
+        t->wticks += stats_tick() - t0;
+        if (!t->marked) {
+            stats_latency(t->wticks);
+            t->wticks = 0;
+        }
+    }
+}
+
+/*
+ * Deal with a ptrace-stop of tracee |t|, which started at |t0|,
+ * and let it go on.
+ *
+ * @return what kind of stop it was
+ */
+static enum stats_stop
+handle_stop(cmd_t *cmd, struct tracee *t, int status, uint64_t t0)
+{
+    unsigned long nr_writes;
+    pid_t pid;
+    bool was_marked;
+    int event;
+    int sig;
+
+    pid = t->tid;
+    sig = WSTOPSIG(status);
+    event = (unsigned int)status >> 16;
+
+    switch (event) {
+    case 0:
+        break;
+    case PTRACE_EVENT_SECCOMP:
+        was_marked = t->marked;
+        nr_writes = cmd->nr_writes;
+        seccomp_stop(cmd, t);
+        resume_tracee(cmd, pid, 0);
+        write_stop_done(t, was_marked || cmd->nr_writes != nr_writes, t0);
+        return (STATS_STOP_SECCOMP);
+    case PTRACE_EVENT_STOP:
+        if (is_group_stop_sig(sig)) {
+            guard_ptrace(cmd, PTRACE_LISTEN, pid, NULL, NULL);
+            return (STATS_STOP_EVENT);
+        }
+        /*
+         * Initial stop of a new tracee, or PTRACE_INTERRUPT.
+         */
+        resume_tracee(cmd, pid, 0);
+        return (STATS_STOP_EVENT);
+    case PTRACE_EVENT_EXEC:
+        exec_event(cmd, pid);
+        resume_tracee(cmd, pid, 0);
+        return (STATS_STOP_EVENT);
+    default:
+        /*
+         * PTRACE_EVENT_FORK, PTRACE_EVENT_VFORK, PTRACE_EVENT_CLONE.
+         * The new tracee is reported on its own.
+         */
+        if (t->ctx != NULL) {
+            batch_new_tracee(cmd, t);
+        }
+        resume_tracee(cmd, pid, 0);
+        return (STATS_STOP_EVENT);
+    }
+
+    if (sig != (SIGTRAP | 0x80)) {
+        /*
+         * Signal-delivery-stop.  Pass the signal on.
+         * With PTRACE_O_TRACESYSGOOD, that includes a genuine SIGTRAP.
+         */
+        resume_tracee(cmd, pid, sig);
+        return (STATS_STOP_SIGNAL);
+    }
+
+    was_marked = t->marked;
+    nr_writes = cmd->nr_writes;
+    syscall_stop(cmd, t);
+    resume_tracee(cmd, pid, 0);
+    write_stop_done(t, was_marked || cmd->nr_writes != nr_writes, t0);
+    return (STATS_STOP_SYSCALL);
+}
+
+/*
+ * Follow forks, vforks, clones and execs, so that children of the
+ * program get marked, too, and, with the seccomp engine, seccomp stops.
+ *
+ * Under the seccomp filter, once there is no tracer, every write()
+ * to a marked fd fails with ENOSYS.  A program we started would go
+ * on, unable to write to stdout or stderr, if errmark were killed;
+ * it had better go, too.  One we attached to has no such filter.
+ */
+static long
+trace_options(cmd_t *cmd)
+{
+    long options;
+
+    options = PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACEEXEC
+        | PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK | PTRACE_O_TRACECLONE;
+    if (cmd->engine == ENGINE_SECCOMP) {
+        options |= PTRACE_O_TRACESECCOMP;
+        if (cmd->attach_pid == 0) {
+            options |= PTRACE_O_EXITKILL;
+        }
+    }
+    return (options);
+}
+
+/*
+ * Set by SIGINT, SIGTERM or SIGHUP, or when --duration is up,
+ * when we are attached to a process that we did not start.
+ */
+static volatile sig_atomic_t detach_requested = 0;
+
+static void
+detach_signal(int sig)
+{
+    (void)sig;
+    detach_requested = 1;
+}
+
+/*
+ * Let go of tracee |pid|, at the ptrace-stop it reported in |status|.
+ *
+ * If it is at the exit from a write() we nullified, it gets its
+ * return value first, as usual.  If it is at the entry to a system
+ * call, that goes ahead, untouched.  A signal it was about to get,
+ * it still gets.  A thread it has just started is still to be let go of.
+ */
+static void
+detach_stop(cmd_t *cmd, pid_t pid, int status)
+{
+    struct tracee *t;
+    unsigned long msg;
+    int event;
+    int sig;
+
+    t = tracee_insert(&cmd->tracees, pid);
+    sig = WSTOPSIG(status);
+    event = (unsigned int)status >> 16;
+
+    switch (event) {
+    case 0:
+        if (sig == (SIGTRAP | 0x80)) {
+            if (t->in_syscall && t->marked) {
+                syscall_stop(cmd, t);
             }
-            else {
-                if (wfd == 1 || wfd == 2) {
-                    after_write(wfd, waddr, wlen);
-                    if (cmd->nullify) {
-                        /*
-                         * Since we have nullified the write(),
-                         * we need to provide a fake return value
-                         * of the original number of bytes to be written.
-                         */
-                        regs.reg_retn = wlen;
-                    }
-                }
-                guard_ptrace(cmd, PTRACE_SETREGS, cmd->child, NULL, &regs);
-                if (cmd->trace_fbt) {
-                    fprintf(cmd->trace_fbt, "< write\n");
-                }
-                toggle = 0;
+            sig = 0;
+        }
+        break;
+    case PTRACE_EVENT_FORK:
+    case PTRACE_EVENT_VFORK:
+    case PTRACE_EVENT_CLONE:
+        msg = 0;
+        if (ptrace(PTRACE_GETEVENTMSG, pid, NULL, &msg) == 0 && msg != 0) {
+            tracee_insert(&cmd->tracees, (pid_t)msg);
+        }
+        sig = 0;
+        break;
+    default:
+        sig = 0;
+        break;
+    }
+    ptrace(PTRACE_DETACH, pid, NULL, (void *)(long)sig);
+    tracee_remove(&cmd->tracees, pid);
+    pmem_forget(pid);
+}
+
+/*
+ * Let go of all tracees, and leave them to run as if we had never
+ * been there.  Each one is interrupted, and let go of at the first
+ * stop it gets to.
+ */
+static void
+detach_all(cmd_t *cmd)
+{
+    struct tracee_table *tab;
+    int status;
+    pid_t pid;
+    size_t i;
+
+    tab = &cmd->tracees;
+    for (i = 0; i < tab->size; ++i) {
+        if (tab->slots[i].tid != 0) {
+            ptrace(PTRACE_INTERRUPT, tab->slots[i].tid, NULL, NULL);
+        }
+    }
+    while (tab->count != 0) {
+        pid = wait4(-1, &status, __WALL, NULL);
+        if (pid == -1) {
+            if (errno == EINTR) {
+                continue;
             }
-            if (cmd->debug) {
-                fprintf(stderr, ".\n");
-                if (cmd->slow) {
-                    sleep(1);
+            break;
+        }
+        if (WIFEXITED(status) || WIFSIGNALED(status)) {
+            tracee_remove(tab, pid);
+            pmem_forget(pid);
+            mark_forget(pid);
+        }
+        else if (WIFSTOPPED(status)) {
+            detach_stop(cmd, pid, status);
+        }
+    }
+    if (cmd->verbose) {
+        eprintf("detached from pid %d\n", (int)cmd->child);
+    }
+}
+
+/*
+ * wait4(), for any of our tracees.  SIGALRM, which is blocked
+ * when output is coalesced, is let in only here, to cut the wait
+ * short when the output has waited long enough.
+ */
+static pid_t
+wait_tracee(int *status, int flags, struct rusage *ru)
+{
+    pid_t pid;
+
+    if (!mark_wait_begin()) {
+        return (wait4(-1, status, flags, ru));
+    }
+    if (mark_due()) {
+        pid = -1;
+        errno = EINTR;
+    }
+    else {
+        pid = wait4(-1, status, flags, ru);
+    }
+    mark_wait_end();
+    return (pid);
+}
+
+/*
+ * Wait for tracees to stop, and deal with each stop,
+ * until there are none left.
+ *
+ * @return the wait status of |cmd->child|, if it exited
+ */
+static int
+trace_loop(cmd_t *cmd)
+{
+    struct tracee *t;
+    struct rusage ru;
+    int exit_status = 0;
+    int wait_flags;
+    int status;
+    uint64_t t0;
+    pid_t pid;
+
+    /*
+     * With several errmark_ctx running at once, each thread
+     * waits only for the tracees it traces.
+     */
+    wait_flags = __WALL | __WNOTHREAD;
+
+    while (1) {
+        /*
+         * SIGALRM interrupts wait4() when coalesced output
+         * has waited long enough.
+         */
+        mark_poll();
+        if (detach_requested) {
+            detach_all(cmd);
+            break;
+        }
+        status = 0;
+        pid = wait_tracee(&status, wait_flags, &ru);
+        t0 = stats_tick();
+        if (pid == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            /*
+             * ECHILD: no tracees left.
+             */
+            break;
+        }
+
+        if (WIFEXITED(status) || WIFSIGNALED(status)) {
+            tracee_remove(&cmd->tracees, pid);
+            pmem_forget(pid);
+            mark_forget(pid);
+            if (pid == cmd->child) {
+                exit_status = status;
+                cmd->child_rusage = ru;
+                if (cmd->verbose) {
+                    eprintf("status=0x%02x\n", status);
                 }
             }
+            continue;
+        }
+
+        if (!WIFSTOPPED(status)) {
+            continue;
         }
-        guard_ptrace(cmd, PTRACE_SYSCALL, cmd->child, NULL, NULL);
+
+        ++cmd->nr_stops;
+        t = tracee_lookup(&cmd->tracees, pid);
+        if (t == NULL) {
+            t = tracee_insert(&cmd->tracees, pid);
+        }
+        stats_stop(handle_stop(cmd, t, status, t0), t0);
     }
 
-    if (cmd->mark_state) {
-        mark_close();
+    return (exit_status);
+}
+
+/*
+ * What errmark did, for --verbose, and how the program ended.
+ */
+static void
+trace_report(cmd_t *cmd, int exit_status)
+{
+    if (cmd->verbose) {
+        eprintf("stops=%lu writes=%lu output=%lu\n",
+            cmd->nr_stops, cmd->nr_writes, mark_output_calls());
+        eprintf("ptrace=%lu (%.2f per stop): get=%lu set=%lu other=%lu\n",
+            cmd->nr_ptrace,
+            cmd->nr_stops ? (double)cmd->nr_ptrace / cmd->nr_stops : 0.0,
+            cmd->nr_ptrace_get, cmd->nr_ptrace_set,
+            cmd->nr_ptrace - cmd->nr_ptrace_get - cmd->nr_ptrace_set);
     }
 
     if (exit_status != 0) {
@@ -217,18 +979,92 @@ ptrace_cmd(cmd_t *cmd)
             fshow_wait_status(stderr, cmd->cmd_name, exit_status);
         }
     }
+}
+
+static int
+ptrace_cmd(cmd_t *cmd)
+{
+    int exit_status;
 
+    exit_status = trace_loop(cmd);
+    if (cmd->mark_state) {
+        order_begin();
+        mark_close();
+        order_end();
+    }
+    trace_report(cmd, exit_status);
     return (exit_status);
 }
 
+/*
+ * The child has stopped itself, so that we can attach to it
+ * before it runs the program.  It may have installed a seccomp filter.
+ *
+ * Attach with PTRACE_SEIZE, and follow forks, vforks, clones and execs;
+ * children of the child get marked, too.  With the seccomp engine,
+ * following them is not optional: they inherit the filter, and a write()
+ * that the filter sends to a tracer fails with ENOSYS if there is none.
+ *
+ * If the seccomp engine was asked for, but there is no filter,
+ * fall back to the ptrace engine.
+ */
+static struct tracee *
+attach_child(cmd_t *cmd, pid_t child)
+{
+    struct tracee *t;
+    int status;
+
+    if (waitpid(child, &status, WUNTRACED) == -1 || !WIFSTOPPED(status)) {
+        return (NULL);
+    }
+
+    if (cmd->engine == ENGINE_SECCOMP && !seccomp_filter_active(child)) {
+        if (cmd->verbose) {
+            eprintf("seccomp filter not installed; using ptrace engine.\n");
+        }
+        cmd->engine = ENGINE_PTRACE;
+    }
+    guard_ptrace(cmd, PTRACE_SEIZE, child, NULL, (void *)trace_options(cmd));
+    t = tracee_insert(&cmd->tracees, child);
+    kill(child, SIGCONT);
+    return (t);
+}
+
+/*
+ * Trace a child that has already been started,
+ * and has stopped itself, waiting for us to attach.
+ */
 int
-errmark_run_program(cmd_t *cmd)
+errmark_trace_child(cmd_t *cmd)
+{
+    tracee_table_init(&cmd->tracees);
+    attach_child(cmd, cmd->child);
+    cmd->rc = ptrace_cmd(cmd);
+    tracee_table_free(&cmd->tracees);
+    return (cmd->rc);
+}
+
+/*
+ * Start the program, stopped, so that we can attach to it
+ * before it runs.
+ */
+static void
+start_child(cmd_t *cmd)
 {
-    cmd->mark_state = 0;
-    cmd->child_exited = false;
     cmd->child = fork();
     if (cmd->child == 0) {
-        guard_ptrace(cmd, PTRACE_TRACEME, 0, NULL, NULL);
+        if (cmd->engine == ENGINE_SECCOMP) {
+            /*
+             * Failure is not fatal.  The tracer finds out for itself.
+             */
+            seccomp_install_filter(SECCOMP_RET_TRACE, 0,
+                                   cmd->coalesce_us != 0);
+        }
+        /*
+         * Wait for the tracer to attach before doing anything else.
+         */
+        raise(SIGSTOP);
+        mark_child_signals();
         cmd->rc = execvp(cmd->cmd_path, cmd->argv);
         if (cmd->rc == -1) {
             // XXX Use libexplain
@@ -239,14 +1075,575 @@ errmark_run_program(cmd_t *cmd)
         }
         exit(2);
     }
-    else {
-        if (cmd->verbose) {
-            eprintf("child pid=%d\n", cmd->child);
+    if (cmd->verbose) {
+        eprintf("child pid=%d\n", cmd->child);
+    }
+}
+
+int
+errmark_run_program(cmd_t *cmd)
+{
+    if (cmd->engine == ENGINE_NOTIFY) {
+        return (notify_run_program(cmd));
+    }
+
+    cmd->mark_state = 0;
+    cmd->child_exited = false;
+    start_child(cmd);
+    return (errmark_trace_child(cmd));
+}
+
+/*
+ * Batches.
+ *
+ * errmark_run_batch() runs many commands at once, each with an
+ * errmark_ctx of its own, all traced by the one loop here, with one
+ * tracee table.  Each tracee knows what command it belongs to; a new
+ * one belongs to the command of the process or thread that started it.
+ * The marks of that command are made the ones to use before a stop
+ * is dealt with, so output goes to the sinks of that command.
+ *
+ * A command is done when the process started for it has exited,
+ * and so has everything it started that is still traced.
+ *
+ * A tracee that cannot be told what command it belongs to, because
+ * its parent, and all of its ancestors, are gone by the time it is
+ * first seen, still must not have its output go straight to fd 1
+ * and fd 2, in the middle of that of the commands.  Its output,
+ * and that of all the others like it, is held back, apart, and goes
+ * out after that of the commands.
+ */
+
+static errmark_ctx_t *(*batch_next_fn)(void *arg);
+static void (*batch_done_fn)(errmark_ctx_t *, void *arg);
+static void *batch_arg;
+
+struct stray_out {
+    char *buf;
+    size_t len;
+    size_t alloc;
+};
+
+static errmark_ctx_t *batch_stray;      // For tracees of no known command
+static struct stray_out stray_out[3];
+
+/*
+ * on_write sink of |batch_stray|.
+ */
+static void
+stray_write(errmark_ctx_t *ctx, pid_t pid, int fd, const void *buf, size_t len)
+{
+    struct stray_out *o;
+
+    (void)ctx;
+    (void)pid;
+    o = &stray_out[fd == 1 ? 1 : 2];
+    if (o->len + len > o->alloc) {
+        while (o->len + len > o->alloc) {
+            o->alloc = (o->alloc != 0) ? o->alloc * 2 : 4096;
+        }
+        o->buf = (char *)guard_realloc(o->buf, o->alloc);
+    }
+    memcpy(o->buf + o->len, buf, len);
+    o->len += len;
+}
+
+/*
+ * Everything is done.  Out goes what |batch_stray| held back.
+ */
+static void
+stray_flush(void)
+{
+    struct stray_out *o;
+    const char *p;
+    size_t left;
+    ssize_t rv;
+    int fd;
+
+    mark_ctx_use(batch_stray->marks);
+    mark_close();
+    mark_ctx_use(NULL);
+    for (fd = 1; fd <= 2; ++fd) {
+        o = &stray_out[fd];
+        p = o->buf;
+        left = o->len;
+        while (left != 0) {
+            rv = write(fd, p, left);
+            if (rv == -1 && errno == EINTR) {
+                continue;
+            }
+            if (rv <= 0) {
+                break;
+            }
+            p += rv;
+            left -= (size_t)rv;
+        }
+        free(o->buf);
+        memset(o, 0, sizeof (*o));
+    }
+    errmark_ctx_free(batch_stray);
+    batch_stray = NULL;
+}
+
+/*
+ * The parent of process |pid|, from /proc; 0 if it is gone.
+ */
+static pid_t
+proc_ppid(pid_t pid)
+{
+    char fname[32];
+    char buf[256];
+    char *p;
+    ssize_t len;
+    int fd;
+
+    snprintf(fname, sizeof (fname), "/proc/%d/stat", (int)pid);
+    fd = open(fname, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return (0);
+    }
+    len = read(fd, buf, sizeof (buf) - 1);
+    close(fd);
+    if (len <= 0) {
+        return (0);
+    }
+    buf[len] = '\0';
+    /*
+     * pid (comm) state ppid ...
+     */
+    p = strrchr(buf, ')');
+    if (p == NULL || p[1] == '\0' || p[2] == '\0') {
+        return (0);
+    }
+    return ((pid_t)strtol(p + 3, NULL, 10));
+}
+
+/*
+ * What command tracee |pid|, seen for the first time, belongs to:
+ * that of its thread group, or that of its parent, or of the nearest
+ * of its ancestors that is traced.  It is usually known already,
+ * from the event of the parent; see batch_new_tracee().  This is
+ * for when the new one is reported first, or its parent is gone.
+ * Failing that, it goes with the strays.
+ */
+static errmark_ctx_t *
+batch_ctx_of(cmd_t *cmd, pid_t pid)
+{
+    struct tracee *t;
+    pid_t other;
+    int depth;
+
+    other = tracee_tgid(pid);
+    if (other != pid) {
+        t = tracee_lookup(&cmd->tracees, other);
+        if (t != NULL && t->ctx != NULL) {
+            return (t->ctx);
+        }
+    }
+    for (depth = 0; depth < 64 && other > 1; ++depth) {
+        other = proc_ppid(other);
+        t = (other > 1) ? tracee_lookup(&cmd->tracees, other) : NULL;
+        if (t != NULL && t->ctx != NULL) {
+            return (t->ctx);
+        }
+    }
+    return (batch_stray);
+}
+
+/*
+ * Is anything that belongs to |ctx| still traced?
+ */
+static bool
+batch_busy(cmd_t *cmd, errmark_ctx_t *ctx)
+{
+    struct tracee_table *tab;
+    size_t i;
+
+    tab = &cmd->tracees;
+    for (i = 0; i < tab->size; ++i) {
+        if (tab->slots[i].tid != 0 && tab->slots[i].ctx == ctx) {
+            return (true);
+        }
+    }
+    return (false);
+}
+
+/*
+ * Start the command of |ctx|, and trace it.
+ *
+ * @return false if it could not be attached to; it is gone.
+ */
+static bool
+batch_start(cmd_t *cmd, errmark_ctx_t *ctx)
+{
+    struct tracee *t;
+    cmd_t *job;
+
+    job = &ctx->cmd;
+    job->engine = cmd->engine;
+    ctx->exited = false;
+    mark_ctx_use(ctx->marks);
+    mark_open();
+    start_child(job);
+    t = attach_child(cmd, job->child);
+    if (t == NULL) {
+        job->child_status = 127 << 8;
+        ctx->exited = true;
+        return (false);
+    }
+    t->ctx = ctx;
+    return (true);
+}
+
+/*
+ * The next command to run, or NULL.
+ */
+static errmark_ctx_t *
+batch_next(void)
+{
+    return (batch_next_fn(batch_arg));
+}
+
+/*
+ * The command of |ctx| is done.  The end mark goes to its sink,
+ * and then it is handed back.
+ */
+static void
+batch_finish(errmark_ctx_t *ctx)
+{
+    mark_ctx_use(ctx->marks);
+    order_begin();
+    mark_close();
+    order_end();
+    mark_ctx_use(NULL);
+    batch_done_fn(ctx, batch_arg);
+}
+
+/*
+ * Run commands, |jobs| of them at a time, until there are no more,
+ * and all of them are done.
+ *
+ * @return the number of commands that did not exit with status 0
+ */
+static unsigned long
+batch_loop(cmd_t *cmd, int jobs)
+{
+    errmark_ctx_t *ctx;
+    struct tracee *t;
+    struct rusage ru;
+    unsigned long failed;
+    uint64_t t0;
+    bool more;
+    int running;
+    int status;
+    pid_t pid;
+
+    failed = 0;
+    running = 0;
+    more = true;
+    while (1) {
+        while (more && running < jobs) {
+            ctx = batch_next();
+            if (ctx == NULL) {
+                more = false;
+            }
+            else if (batch_start(cmd, ctx)) {
+                ++running;
+            }
+            else {
+                ++failed;
+                batch_finish(ctx);
+            }
+        }
+        if (running == 0) {
+            break;
+        }
+
+        status = 0;
+        pid = wait4(-1, &status, __WALL | __WNOTHREAD, &ru);
+        t0 = stats_tick();
+        if (pid == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+
+        t = tracee_lookup(&cmd->tracees, pid);
+        if (WIFEXITED(status) || WIFSIGNALED(status)) {
+            ctx = (t != NULL) ? t->ctx : NULL;
+            tracee_remove(&cmd->tracees, pid);
+            pmem_forget(pid);
+            if (ctx == NULL) {
+                continue;
+            }
+            mark_ctx_use(ctx->marks);
+            mark_forget(pid);
+            if (pid == ctx->cmd.child) {
+                ctx->cmd.child_status = status;
+                ctx->cmd.child_rusage = ru;
+                ctx->exited = true;
+            }
+            if (ctx->exited && !batch_busy(cmd, ctx)) {
+                if (ctx->cmd.child_status != 0) {
+                    ++failed;
+                }
+                --running;
+                batch_finish(ctx);
+            }
+            continue;
+        }
+
+        if (!WIFSTOPPED(status)) {
+            continue;
+        }
+
+        ++cmd->nr_stops;
+        if (t == NULL) {
+            t = tracee_insert(&cmd->tracees, pid);
+            t->ctx = batch_ctx_of(cmd, pid);
+        }
+        if (t->ctx == NULL) {
+            t->ctx = batch_stray;
+        }
+        mark_ctx_use(t->ctx->marks);
+        stats_stop(handle_stop(cmd, t, status, t0), t0);
+    }
+    mark_ctx_use(NULL);
+    return (failed);
+}
+
+/**
+ * @brief Run a batch of commands, |jobs| of them at a time.
+ *
+ * |next| gives the next command to run, set up with
+ * errmark_ctx_set_argv() and sinks, or NULL when there are no more.
+ * Each one is handed to |done| when it and all it started
+ * have exited, with its wait status in |cmd.child_status|;
+ * |done| can free it.
+ *
+ * How to trace them, and the counters, are those of |cmd|.
+ * They are all traced by the calling thread.
+ *
+ * @return the number of commands that did not exit with status 0
+ */
+unsigned long
+errmark_run_batch(cmd_t *cmd, int jobs,
+    errmark_ctx_t *(*next)(void *arg),
+    void (*done)(errmark_ctx_t *, void *arg), void *arg)
+{
+    unsigned long failed;
+
+    batch_next_fn = next;
+    batch_done_fn = done;
+    batch_arg = arg;
+    cmd->child_exited = false;
+    /*
+     * The marks of each command are set up when it starts.
+     * Those of the process are for any tracee that cannot be
+     * told what command it belongs to, with output held back.
+     */
+    cmd->mark_state = 1;
+    batch_stray = errmark_ctx_new();
+    errmark_ctx_inherit_marks(batch_stray);
+    errmark_ctx_set_sink(batch_stray, stray_write, NULL, NULL);
+    mark_ctx_use(batch_stray->marks);
+    mark_open();
+    mark_ctx_use(NULL);
+
+    tracee_table_init(&cmd->tracees);
+    failed = batch_loop(cmd, jobs);
+    tracee_table_free(&cmd->tracees);
+
+    stray_flush();
+    trace_report(cmd, 0);
+    return (failed);
+}
+
+/*
+ * Make our stdout and stderr the very same open files as those
+ * of the process we attach to.  Then its writes to them are ones
+ * that tracee_fd_is_marked() picks out, and the marks and the data
+ * we write go where its output goes, at the same file offset.
+ *
+ * Our own messages must not go there, too.  Before fd 2 is replaced,
+ * it is saved, and stderr and errprint_fh, and dbgprint_fh, if it
+ * was one of ours, are pointed at it.
+ */
+static void
+adopt_fds(cmd_t *cmd)
+{
+    FILE *ourerr;
+    int ourfd;
+    int fd;
+
+    ourfd = fcntl(2, F_DUPFD_CLOEXEC, 3);
+    ourerr = (ourfd == -1) ? NULL : fdopen(ourfd, "w");
+    if (ourerr != NULL) {
+        setvbuf(ourerr, NULL, _IONBF, 0);
+        fflush(stdout);
+        fflush(stderr);
+        if (dbgprint_fh == stdout || dbgprint_fh == stderr) {
+            dbgprint_fh = ourerr;
+        }
+        if (errprint_fh == stdout || errprint_fh == stderr) {
+            errprint_fh = ourerr;
         }
-        cmd->rc = ptrace_cmd(cmd);
-        if (cmd->mark_state) {
-            mark_close();
+        stderr = ourerr;
+    }
+
+    for (fd = 1; fd <= 2; ++fd) {
+        ourfd = tracee_getfd(cmd->attach_pid, fd);
+        if (ourfd == -1) {
+            eprintf("Cannot get fd %d of pid %d: %s; it is not marked.\n",
+                fd, (int)cmd->attach_pid, strerror(errno));
+            continue;
         }
+        dup2(ourfd, fd);
+        close(ourfd);
+    }
+}
+
+/*
+ * Attach to every thread of the process, as it runs.
+ *
+ * Threads can be started while we go through /proc/<pid>/task,
+ * so go through it again, until there are none we have not seen.
+ * Threads started by those already attached are attached by
+ * the kernel, because of PTRACE_O_TRACECLONE; for them,
+ * PTRACE_SEIZE fails, and that is fine.
+ *
+ * Each thread is interrupted, so that, from its first stop on,
+ * it stops at every system call.  It may be in the middle of one,
+ * so it is not known whether its first syscall stop is an entry
+ * or an exit, until it gets there.
+ */
+static bool
+attach_threads(cmd_t *cmd)
+{
+    char dname[32];
+    struct dirent *de;
+    struct tracee *t;
+    DIR *dir;
+    long options;
+    pid_t tid;
+    bool more;
+
+    options = trace_options(cmd);
+    snprintf(dname, sizeof (dname), "/proc/%d/task", (int)cmd->attach_pid);
+    do {
+        dir = opendir(dname);
+        if (dir == NULL) {
+            eprintf("%s: %s\n", dname, strerror(errno));
+            return (false);
+        }
+        more = false;
+        while ((de = readdir(dir)) != NULL) {
+            tid = (pid_t)strtol(de->d_name, NULL, 10);
+            if (tid <= 0 || tracee_lookup(&cmd->tracees, tid) != NULL) {
+                continue;
+            }
+            if (ptrace(PTRACE_SEIZE, tid, NULL, (void *)options) == -1) {
+                if (cmd->tracees.count == 0) {
+                    eprintf("Cannot attach to pid %d: %s\n",
+                        (int)tid, strerror(errno));
+                    closedir(dir);
+                    return (false);
+                }
+                continue;
+            }
+            ptrace(PTRACE_INTERRUPT, tid, NULL, NULL);
+            t = tracee_insert(&cmd->tracees, tid);
+            t->resync = true;
+            more = true;
+        }
+        closedir(dir);
+    } while (more);
+
+    if (cmd->verbose) {
+        eprintf("attached to pid %d: threads=%zu\n",
+            (int)cmd->attach_pid, cmd->tracees.count);
+    }
+    return (true);
+}
+
+/*
+ * Detach when --duration is up, as for SIGTERM.
+ * A POSIX timer, because ITIMER_REAL is for --coalesce.
+ */
+static void
+start_duration_timer(cmd_t *cmd)
+{
+    struct sigevent sev;
+    struct itimerspec its;
+    timer_t timer;
+
+    memset(&sev, 0, sizeof (sev));
+    sev.sigev_notify = SIGEV_SIGNAL;
+    sev.sigev_signo = SIGTERM;
+    if (timer_create(CLOCK_MONOTONIC, &sev, &timer) == -1) {
+        eprintf("timer_create() failed: %s; --duration ignored.\n",
+            strerror(errno));
+        return;
+    }
+    memset(&its, 0, sizeof (its));
+    its.it_value.tv_sec = cmd->duration_ms / 1000;
+    its.it_value.tv_nsec = (cmd->duration_ms % 1000) * 1000000;
+    /*
+     * Keep firing, in case the first one comes just before
+     * the tracer goes to sleep in wait4().
+     */
+    its.it_interval.tv_nsec = 100 * 1000000;
+    timer_settime(timer, 0, &its, NULL);
+}
+
+/**
+ * @brief Mark the output of |cmd->attach_pid|, a process that is already running.
+ *
+ * Only the ptrace engine can do this; a seccomp filter can only be
+ * installed by the process itself.  Marking goes on until the process
+ * exits, or until SIGINT, SIGTERM or SIGHUP, or |cmd->duration_ms|
+ * is up.  Then we detach, and the process runs on as it did before.
+ *
+ * @return the wait status of the process, if it exited; otherwise 0.
+ */
+int
+errmark_attach_program(cmd_t *cmd)
+{
+    struct sigaction sa;
+
+    if (cmd->engine != ENGINE_PTRACE) {
+        if (cmd->verbose) {
+            eprintf("Attaching to a running process; using ptrace engine.\n");
+        }
+        cmd->engine = ENGINE_PTRACE;
+    }
+    cmd->mark_state = 0;
+    cmd->child_exited = false;
+    cmd->child = cmd->attach_pid;
+
+    /*
+     * No SA_RESTART.  The tracer must wake up to detach.
+     */
+    memset(&sa, 0, sizeof (sa));
+    sa.sa_handler = detach_signal;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGHUP, &sa, NULL);
+
+    tracee_table_init(&cmd->tracees);
+    if (!attach_threads(cmd)) {
+        tracee_table_free(&cmd->tracees);
+        cmd->rc = 2 << 8;
         return (cmd->rc);
     }
+    adopt_fds(cmd);
+    if (cmd->duration_ms != 0) {
+        start_duration_timer(cmd);
+    }
+    cmd->rc = ptrace_cmd(cmd);
+    tracee_table_free(&cmd->tracees);
+    return (cmd->rc);
 }
@@ -0,0 +1,283 @@
+/*
+ * Filename: src/liberrmark/seccomp-filter.c
+ * Project: errmark
+ * Library: liberrmark
+ * Brief: seccomp-BPF program that selects the system calls errmark intercepts
+ *
+ * Copyright (C) 2016-2019 Guy Shaw
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <errmark.h>
+#include <stdbool.h>
+#include <stddef.h>		// Import offsetof()
+#include <stdint.h>		// Import uint32_t
+#include <stdio.h>		// Import fopen(), fgets()
+#include <stdlib.h>		// Import strtol()
+#include <string.h>		// Import strncmp()
+#include <errno.h>		// Import errno
+#include <unistd.h>		// Import syscall()
+#include <sys/prctl.h>		// Import prctl(), PR_SET_NO_NEW_PRIVS
+#include <syscall.h>		// Import SYS_write, SYS_writev, ...
+#include <linux/audit.h>	// Import AUDIT_ARCH_*
+#include <linux/filter.h>	// Import struct sock_filter, BPF_STMT, BPF_JUMP
+#include <linux/seccomp.h>	// Import SECCOMP_RET_*, struct seccomp_data
+
+#if defined(__i386__)
+#define ERRMARK_AUDIT_ARCH AUDIT_ARCH_I386
+#elif defined(__x86_64__)
+#define ERRMARK_AUDIT_ARCH AUDIT_ARCH_X86_64
+#else
+#error "Need either __i386__  or  __x86_64__"
+#endif
+
+/*
+ * The system calls that can write to a marked file descriptor,
+ * and which argument holds that file descriptor.
+ */
+struct traced_syscall {
+    long nr;
+    int  fd_arg;
+};
+
+static const struct traced_syscall traced_syscalls[] = {
+    { SYS_write,    0 },
+    { SYS_writev,   0 },
+    { SYS_pwrite64, 0 },
+    { SYS_pwritev,  0 },
+#if defined(SYS_pwritev2)
+    { SYS_pwritev2, 0 },
+#endif
+#if defined(SYS_sendto)
+    { SYS_sendto,   0 },
+#endif
+#if defined(SYS_sendmsg)
+    { SYS_sendmsg,  0 },
+#endif
+    { SYS_vmsplice, 0 },
+    { SYS_sendfile, 0 },
+    { SYS_tee,      1 },
+    { SYS_splice,   2 },
+    { SYS_copy_file_range, 2 },
+};
+
+#define NR_TRACED_SYSCALLS \
+    (sizeof (traced_syscalls) / sizeof (traced_syscalls[0]))
+
+/*
+ * The system calls that read from stdin.
+ * Only of interest when output is coalesced.
+ */
+static const struct traced_syscall input_syscalls[] = {
+    { SYS_read,     0 },
+    { SYS_readv,    0 },
+    { SYS_pread64,  0 },
+    { SYS_preadv,   0 },
+#if defined(SYS_preadv2)
+    { SYS_preadv2,  0 },
+#endif
+};
+
+#define NR_INPUT_SYSCALLS \
+    (sizeof (input_syscalls) / sizeof (input_syscalls[0]))
+
+/*
+ * The file descriptors that get marked.
+ */
+static const int marked_fds[] = { 1, 2 };
+
+#define NR_MARKED_FDS (sizeof (marked_fds) / sizeof (marked_fds[0]))
+
+static const int input_fds[] = { 0 };
+
+#define NR_INPUT_FDS (sizeof (input_fds) / sizeof (input_fds[0]))
+
+/*
+ * Offset of the low 32 bits of argument |i| in struct seccomp_data.
+ * File descriptors are int, so the high bits do not matter.
+ */
+#define ARG_LO(i) \
+    (offsetof(struct seccomp_data, args) + (i) * sizeof (uint64_t))
+
+/*
+ * Length of the block of instructions for one system call:
+ * load fd argument; for each fd of interest, compare and return |action|;
+ * return ALLOW.
+ */
+#define SYSCALL_BLOCK_LEN(nfds) (1 + 2 * (nfds) + 1)
+
+#define FILTER_LEN \
+    (4 \
+     + NR_TRACED_SYSCALLS * (1 + SYSCALL_BLOCK_LEN(NR_MARKED_FDS)) \
+     + NR_INPUT_SYSCALLS * (1 + SYSCALL_BLOCK_LEN(NR_INPUT_FDS)) \
+     + 1)
+
+/*
+ * Add the blocks of instructions for the system calls |tsv|,
+ * that return |action| if their fd is one of |fdv|.
+ */
+static size_t
+build_blocks(struct sock_filter *prog, size_t pc, uint32_t action,
+    const struct traced_syscall *tsv, size_t nsc,
+    const int *fdv, size_t nfds)
+{
+    size_t i, j;
+
+    for (i = 0; i < nsc; ++i) {
+        const struct traced_syscall *tsc = &tsv[i];
+
+        prog[pc++] = (struct sock_filter)
+            BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, tsc->nr, 0,
+                     SYSCALL_BLOCK_LEN(nfds));
+        prog[pc++] = (struct sock_filter)
+            BPF_STMT(BPF_LD | BPF_W | BPF_ABS, ARG_LO(tsc->fd_arg));
+        for (j = 0; j < nfds; ++j) {
+            prog[pc++] = (struct sock_filter)
+                BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, fdv[j], 0, 1);
+            prog[pc++] = (struct sock_filter)
+                BPF_STMT(BPF_RET | BPF_K, action);
+        }
+        prog[pc++] = (struct sock_filter)
+            BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW);
+    }
+    return (pc);
+}
+
+/*
+ * Build the filter program into |prog|, which must hold FILTER_LEN
+ * instructions.  Matching system calls return |action|;
+ * everything else is allowed to run at full speed.
+ * Reads from stdin match only if |input|.
+ */
+static size_t
+build_filter(struct sock_filter *prog, uint32_t action, bool input)
+{
+    size_t pc;
+
+    pc = 0;
+    prog[pc++] = (struct sock_filter)
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, arch));
+    prog[pc++] = (struct sock_filter)
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ERRMARK_AUDIT_ARCH, 1, 0);
+    prog[pc++] = (struct sock_filter)
+        BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW);
+    prog[pc++] = (struct sock_filter)
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, nr));
+
+    pc = build_blocks(prog, pc, action, traced_syscalls, NR_TRACED_SYSCALLS,
+                      marked_fds, NR_MARKED_FDS);
+    if (input) {
+        pc = build_blocks(prog, pc, action, input_syscalls, NR_INPUT_SYSCALLS,
+                          input_fds, NR_INPUT_FDS);
+    }
+
+    prog[pc++] = (struct sock_filter)
+        BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW);
+    return (pc);
+}
+
+/**
+ * @brief Install the errmark seccomp filter in the calling process.
+ *
+ * Meant to be called in the child, after fork() and before execvp().
+ * Sets no_new_privs, as required for an unprivileged process
+ * to install a seccomp filter.
+ *
+ * @param action  SECCOMP_RET_* action for the intercepted system calls
+ * @param flags   SECCOMP_FILTER_FLAG_* flags
+ * @param input   also intercept reads from stdin
+ * @return        the value returned by seccomp(2);
+ *                -1, with errno set, on failure.
+ */
+int
+seccomp_install_filter(uint32_t action, unsigned int flags, bool input)
+{
+    struct sock_filter prog[FILTER_LEN];
+    struct sock_fprog fprog;
+
+    fprog.len = (unsigned short)build_filter(prog, action, input);
+    fprog.filter = prog;
+
+    if (prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) == -1) {
+        return (-1);
+    }
+    return (syscall(SYS_seccomp, SECCOMP_SET_MODE_FILTER, flags, &fprog));
+}
+
+/*
+ * Get the seccomp mode and the number of seccomp filters
+ * of process |pid|, or of ourself if |pid| is 0.
+ * Older kernels do not report the number of filters;
+ * then it is left as -1.
+ */
+static bool
+get_seccomp_status(pid_t pid, long *mode, long *nfilters)
+{
+    char fname[32];
+    char line[128];
+    FILE *f;
+
+    if (pid == 0) {
+        snprintf(fname, sizeof (fname), "/proc/self/status");
+    }
+    else {
+        snprintf(fname, sizeof (fname), "/proc/%d/status", (int)pid);
+    }
+    f = fopen(fname, "r");
+    if (f == NULL) {
+        return (false);
+    }
+
+    *mode = 0;
+    *nfilters = -1;
+    while (fgets(line, sizeof (line), f) != NULL) {
+        if (strncmp(line, "Seccomp:", 8) == 0) {
+            *mode = strtol(line + 8, NULL, 10);
+        }
+        else if (strncmp(line, "Seccomp_filters:", 16) == 0) {
+            *nfilters = strtol(line + 16, NULL, 10);
+        }
+    }
+    fclose(f);
+    return (true);
+}
+
+/**
+ * @brief Did process |pid| install a seccomp filter of its own?
+ *
+ * Used by the tracer to find out whether the child managed
+ * to install its filter, without needing a side channel.
+ * The child inherits any filters that apply to us, so it is
+ * the difference that matters.
+ */
+bool
+seccomp_filter_active(pid_t pid)
+{
+    long mode, nfilters;
+    long self_mode, self_nfilters;
+
+    if (!get_seccomp_status(pid, &mode, &nfilters)) {
+        return (false);
+    }
+    if (!get_seccomp_status(0, &self_mode, &self_nfilters)) {
+        return (false);
+    }
+    if (nfilters >= 0 && self_nfilters >= 0) {
+        return (nfilters > self_nfilters);
+    }
+    return (mode == SECCOMP_MODE_FILTER && self_mode != SECCOMP_MODE_FILTER);
+}
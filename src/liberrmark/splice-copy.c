@@ -0,0 +1,470 @@
+/*
+ * Filename: src/liberrmark/splice-copy.c
+ * Project: errmark
+ * Library: liberrmark
+ * Brief: Copy data moved by sendfile() and friends, without reading it
+ *
+ * Copyright (C) 2016-2019 Guy Shaw
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * sendfile(), splice(), tee() and copy_file_range() move data
+ * from one file descriptor to another, inside the kernel.
+ * Left to the kernel, they must be marked before they are performed,
+ * whether they then write anything or not.  The data sent to stdout
+ * or stderr never is anywhere we can read it from, to copy it, to
+ * prefix its lines, to coalesce it, or to hand it to a sink.
+ *
+ * So, errmark performs the system call, instead:
+ *
+ *   1) get a copy of the input file descriptor of the tracee,
+ *      using pidfd_getfd(), so that it shares the file offset;
+ *   2) splice() a piece of the input into a pipe of our own;
+ *   3) tee() that pipe into a second pipe;
+ *   4) splice() one pipe to stdout or stderr, and the other to the copy file.
+ *
+ * The data never leaves the kernel, unless there is more than one
+ * copy of it to make, or it is compressed or tagged on the way;
+ * then, the second pipe is read, and handed to copy_write().
+ * One call moves at most one pipe full of data, which is
+ * a legitimate short count.
+ *
+ * The tracer must never block waiting for input; other tracees
+ * (maybe the very one that would provide the input) are waiting
+ * for it.  So, this is done only for input from a regular file,
+ * or from a pipe that has data right now.  Anything else is left
+ * to the kernel, and does not get copied.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <errmark.h>
+#include <cscript.h>		// Import guard_realloc()
+#include <stdbool.h>
+#include <stdio.h>		// Import fflush(), fileno()
+#include <errno.h>		// Import errno, EINTR, EINVAL
+#include <fcntl.h>		// Import splice(), tee(), pipe2(), F_SETPIPE_SZ
+#include <poll.h>		// Import poll()
+#include <unistd.h>		// Import close(), read(), write(), pwrite(), lseek()
+#include <sys/stat.h>		// Import fstat(), S_ISREG(), S_ISFIFO()
+#include <syscall.h>		// Import SYS_sendfile, SYS_tee, ...
+
+#define SPLICE_PIPE_SZ (1024 * 1024)
+
+/*
+ * The pipe that carries the data, and the one that carries the copy.
+ */
+static int data_pipe[2] = { -1, -1 };
+static int copy_pipe[2] = { -1, -1 };
+static size_t pipe_cap = 0;
+
+static bool
+open_pipes(void)
+{
+    int sz;
+
+    if (pipe_cap != 0) {
+        return (true);
+    }
+    if (pipe2(data_pipe, O_CLOEXEC) == -1) {
+        return (false);
+    }
+    if (pipe2(copy_pipe, O_CLOEXEC) == -1) {
+        close(data_pipe[0]);
+        close(data_pipe[1]);
+        return (false);
+    }
+    /*
+     * Bigger pipes mean fewer stops for a big sendfile().
+     * It is fine if we are not allowed that much.
+     */
+    fcntl(data_pipe[1], F_SETPIPE_SZ, SPLICE_PIPE_SZ);
+    fcntl(copy_pipe[1], F_SETPIPE_SZ, SPLICE_PIPE_SZ);
+    sz = fcntl(data_pipe[1], F_GETPIPE_SZ);
+    if (sz > fcntl(copy_pipe[1], F_GETPIPE_SZ)) {
+        sz = fcntl(copy_pipe[1], F_GETPIPE_SZ);
+    }
+    pipe_cap = (sz > 0) ? (size_t)sz : 4096;
+    return (true);
+}
+
+/*
+ * Something went wrong half way, and there may be data left
+ * in the pipes.  Start afresh, next time.
+ */
+static void
+reset_pipes(void)
+{
+    close(data_pipe[0]);
+    close(data_pipe[1]);
+    close(copy_pipe[0]);
+    close(copy_pipe[1]);
+    pipe_cap = 0;
+}
+
+/*
+ * Move |len| bytes from pipe |rd| to |fd|, at |*offp|
+ * if |offp| is not NULL.  If |fd| does not support splice(),
+ * fall back to read() and write().
+ *
+ * Return the number of bytes moved, which is less than |len|
+ * only if there was an error, with errno set.
+ */
+static size_t
+drain(int rd, int fd, loff_t *offp, size_t len)
+{
+    char buf[8192];
+    size_t moved;
+    ssize_t rv;
+
+    moved = 0;
+    while (moved != len) {
+        rv = splice(rd, NULL, fd, offp, len - moved, SPLICE_F_MOVE);
+        if (rv == -1 && errno == EINTR) {
+            continue;
+        }
+        if (rv == -1 && errno == EINVAL) {
+            break;
+        }
+        if (rv <= 0) {
+            if (rv == 0) {
+                errno = EIO;
+            }
+            return (moved);
+        }
+        moved += rv;
+    }
+
+    while (moved != len) {
+        ssize_t nr;
+        ssize_t off;
+
+        nr = read(rd, buf, len - moved < sizeof (buf) ? len - moved : sizeof (buf));
+        if (nr == -1 && errno == EINTR) {
+            continue;
+        }
+        if (nr <= 0) {
+            if (nr == 0) {
+                errno = EIO;
+            }
+            return (moved);
+        }
+        for (off = 0; off < nr; off += rv) {
+            if (offp != NULL) {
+                rv = pwrite(fd, buf + off, nr - off, *offp);
+            }
+            else {
+                rv = write(fd, buf + off, nr - off);
+            }
+            if (rv == -1 && errno == EINTR) {
+                rv = 0;
+                continue;
+            }
+            if (rv <= 0) {
+                if (rv == 0) {
+                    errno = EIO;
+                }
+                return (moved + off);
+            }
+            if (offp != NULL) {
+                *offp += rv;
+            }
+        }
+        moved += nr;
+    }
+    return (moved);
+}
+
+/*
+ * Is there input to be had from |fd| without waiting for it?
+ */
+static bool
+input_ready(int fd, bool *is_fifo)
+{
+    struct stat st;
+    struct pollfd pfd;
+
+    *is_fifo = false;
+    if (fstat(fd, &st) == -1) {
+        return (false);
+    }
+    if (S_ISREG(st.st_mode) || S_ISBLK(st.st_mode)) {
+        return (true);
+    }
+    if (!S_ISFIFO(st.st_mode)) {
+        return (false);
+    }
+    *is_fifo = true;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    return (poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLIN));
+}
+
+/*
+ * Read the offset at |raddr| in |tracee|.  sendfile() takes an off_t;
+ * the others take a loff_t.
+ */
+static bool
+get_offset(pid_t tracee, long nr, void *raddr, loff_t *off)
+{
+    if (nr == SYS_sendfile) {
+        off_t o;
+
+        if (pmem_read(&o, tracee, raddr, sizeof (o)) != (ssize_t)sizeof (o)) {
+            return (false);
+        }
+        *off = o;
+        return (true);
+    }
+    return (pmem_read(off, tracee, raddr, sizeof (*off)) == (ssize_t)sizeof (*off));
+}
+
+static void
+put_offset(pid_t tracee, long nr, void *raddr, loff_t off)
+{
+    if (nr == SYS_sendfile) {
+        off_t o;
+
+        o = (off_t)off;
+        pmem_write(tracee, raddr, &o, sizeof (o));
+        return;
+    }
+    pmem_write(tracee, raddr, &off, sizeof (off));
+}
+
+/*
+ * Move exactly |len| bytes of the copy of what was written to |fd|,
+ * from the copy pipe, to its sinks.  If there is just the one,
+ * and it takes the data as it is, without it going through user memory.
+ */
+static bool
+drain_copy(int fd, size_t len)
+{
+    char buf[8192];
+    ssize_t nr;
+    int dfd;
+
+    dfd = copy_direct_fd(fd);
+    if (dfd >= 0) {
+        copy_sync();
+        return (drain(copy_pipe[0], dfd, NULL, len) == len);
+    }
+    while (len != 0) {
+        nr = read(copy_pipe[0], buf, len < sizeof (buf) ? len : sizeof (buf));
+        if (nr == -1 && errno == EINTR) {
+            continue;
+        }
+        if (nr <= 0) {
+            return (false);
+        }
+        copy_write(fd, buf, nr);
+        len -= nr;
+    }
+    return (true);
+}
+
+/*
+ * The |n| bytes in the data pipe are for |fd|, and they go through
+ * mark_write(), as the data of a write() does, to be prefixed,
+ * coalesced, or handed to the sinks of the mark context.
+ * Return the number of bytes written, with errno set if that is
+ * not all of them.
+ */
+static size_t
+mark_from_pipe(int fd, pid_t tracee, size_t n)
+{
+    static __thread char *buf = NULL;
+    static __thread size_t buf_sz = 0;
+    size_t got;
+    ssize_t rv;
+
+    if (buf_sz < n) {
+        buf = (char *)guard_realloc(buf, n);
+        buf_sz = n;
+    }
+    got = 0;
+    while (got != n) {
+        rv = read(data_pipe[0], buf + got, n - got);
+        if (rv == -1 && errno == EINTR) {
+            continue;
+        }
+        if (rv <= 0) {
+            errno = EIO;
+            return (0);
+        }
+        got += rv;
+    }
+    rv = mark_write(fd, buf, n);
+    if (rv <= 0) {
+        if (rv == 0) {
+            errno = EIO;
+        }
+        return (0);
+    }
+    if (copy_wanted(fd)) {
+        copy_write(fd, buf, rv);
+    }
+    record_write(tracee, fd, buf, rv, 0);
+    if ((size_t)rv < n) {
+        errno = EIO;
+    }
+    return (rv);
+}
+
+/*
+ * The |n| bytes in the data pipe are for |fd|, as they are.
+ * Marks first, then the data, and a copy of it, all without it
+ * going through user memory.  Return as for mark_from_pipe();
+ * |*ok| is false if the pipes must be reset.
+ */
+static size_t
+splice_from_pipe(int fd, pid_t tracee, loff_t *offp, size_t n, bool *ok)
+{
+    ssize_t ncopy;
+    size_t done;
+    int err;
+
+    before_write(fd, NULL, n);
+    ncopy = copy_wanted(fd) ? tee(data_pipe[0], copy_pipe[1], n, 0) : 0;
+    done = drain(data_pipe[0], fd, offp, n);
+    err = errno;
+    if (ncopy > (ssize_t)done) {
+        ncopy = done;
+    }
+    *ok = (ncopy <= 0 || drain_copy(fd, ncopy));
+    if (done != 0) {
+        record_write(tracee, fd, NULL, done, REC_F_NO_DATA);
+    }
+    errno = err;
+    return (done);
+}
+
+/**
+ * @brief Perform a data moving system call on behalf of a tracee,
+ *        with marks, and a copy of the data for the sinks of its fd.
+ *
+ * The output goes to our own file descriptor of the same number
+ * as the one the tracee gave, which must refer to the same file.
+ * The marks go out only once the data is in hand, and only if there
+ * is some.  If the mark context wants to see the data, to prefix it,
+ * coalesce it, or hand it to a sink, it is read into memory, and goes
+ * through mark_write(); otherwise, it stays in the kernel.
+ * It is recorded, if there is a --record file.
+ *
+ * @param wc      the decoded system call, with wc->spliced set
+ * @param tracee  tid of the writing thread
+ * @param retval  what the system call returns to the tracee: the number
+ *                of bytes that got to |wc->fd|, or -errno if none did
+ * @return        true if it has been done; false if it has not been
+ *                touched, and must be left to the kernel.
+ */
+bool
+splice_copy(struct write_call *wc, pid_t tracee, long *retval)
+{
+    loff_t in_off, out_off;
+    bool is_fifo;
+    bool ok;
+    size_t len, done;
+    ssize_t n;
+    int err;
+    int in;
+
+    if (!wc->spliced || (wc->nr == SYS_copy_file_range && wc->flags != 0)) {
+        return (false);
+    }
+    if (!open_pipes()) {
+        return (false);
+    }
+    if (wc->in_off != NULL && !get_offset(tracee, wc->nr, wc->in_off, &in_off)) {
+        return (false);
+    }
+    if (wc->out_off != NULL && !get_offset(tracee, wc->nr, wc->out_off, &out_off)) {
+        return (false);
+    }
+
+    in = tracee_getfd(tracee, wc->in_fd);
+    if (in == -1) {
+        return (false);
+    }
+    if (!input_ready(in, &is_fifo) || (wc->nr == SYS_tee && !is_fifo)) {
+        close(in);
+        return (false);
+    }
+
+    len = wc->len < pipe_cap ? wc->len : pipe_cap;
+    do {
+        if (wc->nr == SYS_tee) {
+            n = tee(in, data_pipe[1], len, SPLICE_F_NONBLOCK);
+        }
+        else {
+            n = splice(in, wc->in_off != NULL ? &in_off : NULL,
+                       data_pipe[1], NULL, len,
+                       is_fifo ? SPLICE_F_NONBLOCK : 0);
+        }
+    } while (n == -1 && errno == EINTR);
+    if (n == -1) {
+        /*
+         * Nothing has been moved.  Let the kernel do it, and deal
+         * with the error, if any, itself.
+         */
+        close(in);
+        return (false);
+    }
+
+    if (n != 0) {
+        ok = true;
+        if (wc->out_off == NULL && mark_wants_data(wc->fd)) {
+            done = mark_from_pipe(wc->fd, tracee, n);
+        }
+        else {
+            done = splice_from_pipe(wc->fd, tracee,
+                                    wc->out_off != NULL ? &out_off : NULL,
+                                    n, &ok);
+        }
+        err = errno;
+        if (done < (size_t)n) {
+            /*
+             * The output failed part way.  What did not get
+             * there goes back to the input, if it is a file,
+             * and the tracee is told what did, or why nothing did,
+             * as write() would.
+             */
+            ok = false;
+            if (wc->nr != SYS_tee) {
+                if (wc->in_off != NULL) {
+                    in_off -= n - done;
+                }
+                else if (!is_fifo) {
+                    lseek(in, (off_t)done - n, SEEK_CUR);
+                }
+            }
+            n = (done != 0) ? (ssize_t)done : -err;
+        }
+        if (!ok) {
+            reset_pipes();
+        }
+    }
+    close(in);
+
+    if (wc->in_off != NULL && wc->nr != SYS_tee) {
+        put_offset(tracee, wc->nr, wc->in_off, in_off);
+    }
+    if (wc->out_off != NULL) {
+        put_offset(tracee, wc->nr, wc->out_off, out_off);
+    }
+    *retval = n;
+    return (true);
+}
@@ -0,0 +1,381 @@
+/*
+ * Filename: src/liberrmark/stats.c
+ * Project: errmark
+ * Library: liberrmark
+ * Brief: What errmark costs the program it runs, for --stats
+ *
+ * Copyright (C) 2016-2019 Guy Shaw
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The counters are always kept; --stats only says where to report them.
+ * They are plain variables, touched only by the thread that traces,
+ * so there are no locks and no atomics.  Time is counted in ticks
+ * of stats_tick(), which is the time stamp counter, on x86; one
+ * rdtsc costs about as much as a function call.  Ticks are turned
+ * into nanoseconds only for the report, using the ticks and the
+ * CLOCK_MONOTONIC nanoseconds that went by between stats_start()
+ * and then.
+ *
+ * The time a program is stopped for a write is the time from when
+ * errmark is told of the stop until it lets the program go on again,
+ * over all the stops for that write.  The histogram of that time
+ * has one bucket per power of 2 ticks.
+ *
+ * With several errmark_ctx running at once, each tracer thread has
+ * counters of its own, and adds them to the total when it is done.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <errmark.h>
+#include <cscript.h>		// Import eprintf(), errprint_fh, guard_calloc()
+#include <stdbool.h>
+#include <stdint.h>		// Import uint64_t
+#include <stdio.h>		// Import fopen(), fprintf()
+#include <stdlib.h>		// Import qsort()
+#include <string.h>		// Import strerror()
+#include <errno.h>		// Import errno
+#include <pthread.h>		// Import pthread_mutex_lock()
+#include <time.h>		// Import clock_gettime()
+#include <sys/resource.h>	// Import getrusage()
+
+#define STATS_NR_SYSCALLS 512
+#define STATS_HIST        48
+
+static const char *stop_names[STATS_NR_STOPS] = {
+    "syscall", "seccomp", "event", "signal", "notify",
+};
+
+static const char *phase_names[STATS_NR_PHASES] = {
+    "registers", "memory", "output",
+};
+
+static uint64_t start_tick;
+static struct timespec start_ts;
+
+struct stats_counts {
+    unsigned long stops[STATS_NR_STOPS];
+    unsigned long stops_by_nr[STATS_NR_SYSCALLS + 1];
+    uint64_t stopped_ticks;
+    uint64_t phase_ticks[STATS_NR_PHASES];
+    unsigned long writes[3];
+    unsigned long long write_bytes[3];
+    unsigned long latency_hist[STATS_HIST];
+};
+
+/*
+ * Each tracer thread counts into its own; see stats_thread_start().
+ */
+static struct stats_counts counts;
+static __thread struct stats_counts *sc = &counts;
+static pthread_mutex_t counts_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Start the clock that ticks are measured against.
+ */
+void
+stats_start(void)
+{
+    clock_gettime(CLOCK_MONOTONIC, &start_ts);
+    start_tick = stats_tick();
+}
+
+/**
+ * @brief The program was stopped, since |t0|, for a stop of kind |kind|.
+ */
+void
+stats_stop(enum stats_stop kind, uint64_t t0)
+{
+    ++sc->stops[kind];
+    sc->stopped_ticks += stats_tick() - t0;
+}
+
+/**
+ * @brief A stop was at the entry to system call |nr|.
+ */
+void
+stats_syscall(long nr)
+{
+    if (nr < 0 || nr >= STATS_NR_SYSCALLS) {
+        nr = STATS_NR_SYSCALLS;
+    }
+    ++sc->stops_by_nr[nr];
+}
+
+/**
+ * @brief The time since |t0| was spent on |phase|.
+ */
+void
+stats_phase(enum stats_phase phase, uint64_t t0)
+{
+    sc->phase_ticks[phase] += stats_tick() - t0;
+}
+
+/**
+ * @brief A write of |len| bytes to |fd| was intercepted.
+ */
+void
+stats_write(int fd, size_t len)
+{
+    if (fd == 1 || fd == 2) {
+        ++sc->writes[fd];
+        sc->write_bytes[fd] += len;
+    }
+}
+
+/**
+ * @brief A write kept the writer stopped for |ticks|, all told.
+ */
+void
+stats_latency(uint64_t ticks)
+{
+    int b;
+
+    b = (ticks == 0) ? 0 : 64 - __builtin_clzll(ticks);
+    if (b >= STATS_HIST) {
+        b = STATS_HIST - 1;
+    }
+    ++sc->latency_hist[b];
+}
+
+/**
+ * @brief The calling thread is a tracer, with counters of its own, from now on.
+ */
+void
+stats_thread_start(void)
+{
+    sc = (struct stats_counts *)guard_calloc(1, sizeof (*sc));
+}
+
+/**
+ * @brief The calling tracer thread is done; add its counters to the total.
+ */
+void
+stats_thread_done(void)
+{
+    size_t i;
+
+    pthread_mutex_lock(&counts_lock);
+    for (i = 0; i < STATS_NR_STOPS; ++i) {
+        counts.stops[i] += sc->stops[i];
+    }
+    for (i = 0; i <= STATS_NR_SYSCALLS; ++i) {
+        counts.stops_by_nr[i] += sc->stops_by_nr[i];
+    }
+    counts.stopped_ticks += sc->stopped_ticks;
+    for (i = 0; i < STATS_NR_PHASES; ++i) {
+        counts.phase_ticks[i] += sc->phase_ticks[i];
+    }
+    for (i = 0; i < 3; ++i) {
+        counts.writes[i] += sc->writes[i];
+        counts.write_bytes[i] += sc->write_bytes[i];
+    }
+    for (i = 0; i < STATS_HIST; ++i) {
+        counts.latency_hist[i] += sc->latency_hist[i];
+    }
+    pthread_mutex_unlock(&counts_lock);
+    free(sc);
+    sc = &counts;
+}
+
+static double
+tv_sec(const struct timeval *tv)
+{
+    return (tv->tv_sec + tv->tv_usec / 1e6);
+}
+
+static int
+cmp_by_count(const void *a, const void *b)
+{
+    unsigned long ca = counts.stops_by_nr[*(const int *)a];
+    unsigned long cb = counts.stops_by_nr[*(const int *)b];
+
+    if (ca != cb) {
+        return (ca < cb ? 1 : -1);
+    }
+    return (*(const int *)a - *(const int *)b);
+}
+
+static void
+report_text(FILE *f, double ns_per_tick, const int *nrs, int nr_nrs,
+    const struct rusage *child, const struct rusage *self)
+{
+    unsigned long total_stops;
+    double stopped, other;
+    int b, lo, hi, i;
+
+    total_stops = 0;
+    for (i = 0; i < STATS_NR_STOPS; ++i) {
+        total_stops += counts.stops[i];
+    }
+    fprintf(f, "errmark stats\n");
+    fprintf(f, "  stops       %lu:", total_stops);
+    for (i = 0; i < STATS_NR_STOPS; ++i) {
+        fprintf(f, " %s=%lu", stop_names[i], counts.stops[i]);
+    }
+    fprintf(f, "\n");
+    if (nr_nrs != 0) {
+        fprintf(f, "  by system call number:\n");
+        for (i = 0; i < nr_nrs; ++i) {
+            if (nrs[i] == STATS_NR_SYSCALLS) {
+                fprintf(f, "      other %lu\n", counts.stops_by_nr[nrs[i]]);
+            }
+            else {
+                fprintf(f, "    %7d %lu\n", nrs[i], counts.stops_by_nr[nrs[i]]);
+            }
+        }
+    }
+    for (i = 1; i <= 2; ++i) {
+        fprintf(f, "  fd %d        writes=%lu bytes=%llu\n",
+            i, counts.writes[i], counts.write_bytes[i]);
+    }
+    stopped = counts.stopped_ticks * ns_per_tick / 1e9;
+    other = stopped;
+    fprintf(f, "  stopped     %.6f s:", stopped);
+    for (i = 0; i < STATS_NR_PHASES; ++i) {
+        fprintf(f, " %s=%.6f", phase_names[i], counts.phase_ticks[i] * ns_per_tick / 1e9);
+        other -= counts.phase_ticks[i] * ns_per_tick / 1e9;
+    }
+    fprintf(f, " other=%.6f\n", other > 0.0 ? other : 0.0);
+
+    lo = STATS_HIST;
+    hi = -1;
+    for (b = 0; b < STATS_HIST; ++b) {
+        if (counts.latency_hist[b] != 0) {
+            lo = (b < lo) ? b : lo;
+            hi = b;
+        }
+    }
+    if (hi >= 0) {
+        fprintf(f, "  stopped per write:\n");
+        for (b = lo; b <= hi; ++b) {
+            fprintf(f, "    < %9.3f us  %lu\n",
+                (double)((uint64_t)1 << b) * ns_per_tick / 1e3,
+                counts.latency_hist[b]);
+        }
+    }
+    fprintf(f, "  rusage      %10s %10s %10s\n", "user", "sys", "maxrss_kb");
+    fprintf(f, "    child     %10.3f %10.3f %10ld\n",
+        tv_sec(&child->ru_utime), tv_sec(&child->ru_stime), child->ru_maxrss);
+    fprintf(f, "    errmark   %10.3f %10.3f %10ld\n",
+        tv_sec(&self->ru_utime), tv_sec(&self->ru_stime), self->ru_maxrss);
+}
+
+static void
+report_json_rusage(FILE *f, const char *name, const struct rusage *ru)
+{
+    fprintf(f, "  \"%s\": {\"user\": %.6f, \"sys\": %.6f, \"maxrss_kb\": %ld}",
+        name, tv_sec(&ru->ru_utime), tv_sec(&ru->ru_stime), ru->ru_maxrss);
+}
+
+static void
+report_json(FILE *f, double ns_per_tick, const int *nrs, int nr_nrs,
+    const struct rusage *child, const struct rusage *self)
+{
+    const char *sep;
+    int b, i;
+
+    fprintf(f, "{\n  \"stops\": {");
+    for (i = 0; i < STATS_NR_STOPS; ++i) {
+        fprintf(f, "%s\"%s\": %lu", i ? ", " : "", stop_names[i], counts.stops[i]);
+    }
+    fprintf(f, "},\n  \"stops_by_syscall\": {");
+    for (i = 0; i < nr_nrs; ++i) {
+        if (nrs[i] == STATS_NR_SYSCALLS) {
+            fprintf(f, "%s\"other\": %lu", i ? ", " : "", counts.stops_by_nr[nrs[i]]);
+        }
+        else {
+            fprintf(f, "%s\"%d\": %lu", i ? ", " : "", nrs[i], counts.stops_by_nr[nrs[i]]);
+        }
+    }
+    fprintf(f, "},\n  \"fds\": {");
+    for (i = 1; i <= 2; ++i) {
+        fprintf(f, "%s\"%d\": {\"writes\": %lu, \"bytes\": %llu}",
+            i > 1 ? ", " : "", i, counts.writes[i], counts.write_bytes[i]);
+    }
+    fprintf(f, "},\n  \"stopped_ns\": {\"total\": %.0f",
+        counts.stopped_ticks * ns_per_tick);
+    for (i = 0; i < STATS_NR_PHASES; ++i) {
+        fprintf(f, ", \"%s\": %.0f", phase_names[i], counts.phase_ticks[i] * ns_per_tick);
+    }
+    fprintf(f, "},\n  \"stopped_per_write\": [");
+    sep = "";
+    for (b = 0; b < STATS_HIST; ++b) {
+        if (counts.latency_hist[b] != 0) {
+            fprintf(f, "%s{\"lt_ns\": %.0f, \"count\": %lu}", sep,
+                (double)((uint64_t)1 << b) * ns_per_tick, counts.latency_hist[b]);
+            sep = ", ";
+        }
+    }
+    fprintf(f, "],\n");
+    report_json_rusage(f, "rusage_child", child);
+    fprintf(f, ",\n");
+    report_json_rusage(f, "rusage_errmark", self);
+    fprintf(f, "\n}\n");
+}
+
+/**
+ * @brief Report the counters, to |fname|, or to |errprint_fh| if it is NULL.
+ *
+ * @param json   JSON, instead of text
+ * @param child  the rusage of the program, from wait4()
+ */
+bool
+stats_report(const char *fname, bool json, const struct rusage *child)
+{
+    struct timespec now;
+    struct rusage self;
+    uint64_t ticks;
+    double ns, ns_per_tick;
+    int nrs[STATS_NR_SYSCALLS + 1];
+    int nr_nrs;
+    FILE *f;
+    int i;
+
+    ticks = stats_tick() - start_tick;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ns = (now.tv_sec - start_ts.tv_sec) * 1e9 + (now.tv_nsec - start_ts.tv_nsec);
+    ns_per_tick = (ticks != 0) ? ns / ticks : 1.0;
+    getrusage(RUSAGE_SELF, &self);
+
+    nr_nrs = 0;
+    for (i = 0; i <= STATS_NR_SYSCALLS; ++i) {
+        if (counts.stops_by_nr[i] != 0) {
+            nrs[nr_nrs++] = i;
+        }
+    }
+    qsort(nrs, nr_nrs, sizeof (nrs[0]), cmp_by_count);
+
+    f = errprint_fh;
+    if (fname != NULL) {
+        f = fopen(fname, "w");
+        if (f == NULL) {
+            eprintf("errmark: --stats: %s: %s\n", fname, strerror(errno));
+            return (false);
+        }
+    }
+    if (json) {
+        report_json(f, ns_per_tick, nrs, nr_nrs, child, &self);
+    }
+    else {
+        report_text(f, ns_per_tick, nrs, nr_nrs, child, &self);
+    }
+    if (fname != NULL) {
+        fclose(f);
+    }
+    return (true);
+}
@@ -0,0 +1,162 @@
+/*
+ * Filename: src/liberrmark/timestamp.c
+ * Project: errmark
+ * Library: liberrmark
+ * Brief: Timestamps for output, formatted only when they change
+ *
+ * Copyright (C) 2016-2019 Guy Shaw
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A timestamp is shown to the millisecond:
+ *
+ *     STAMP_WALL   [13:04:59.123]   time of day
+ *     STAMP_MONO   [+12.345]        since stamp_set()
+ *     STAMP_DELTA  [~0.002]         since the timestamp before
+ *
+ * stamp_now() reads the clock once, with clock_gettime(), which is
+ * a vDSO call, not a system call.  The text is kept, and only made
+ * again when the millisecond changes; the part for the whole seconds,
+ * which, for STAMP_WALL, takes localtime_r() and strftime(),
+ * only when the second changes.  Output comes in bursts, so most
+ * lines in a burst get the same timestamp, and cost no formatting.
+ *
+ * There is one clock, and one text, for the process.  With more than
+ * one tracer thread, it is only used while holding the output order
+ * (see output-order.c), like the rest of the output.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <errmark.h>
+#include <stdbool.h>
+#include <stdio.h>		// Import snprintf()
+#include <string.h>		// Import memcpy()
+#include <time.h>		// Import clock_gettime(), localtime_r(), strftime()
+
+static enum stamp_clock stamp_clock = STAMP_NONE;
+static struct timespec stamp_base;      // Start, or the stamp before
+
+static long long sec_key = -1;          // Seconds that |sec_txt| is for
+static char sec_txt[32];
+static size_t sec_len = 0;
+
+static long long ms_key = -1;           // Milliseconds that |txt| is for
+static char txt[48];
+static size_t txt_len = 0;
+
+static unsigned long nr_reads = 0;
+static unsigned long nr_formats = 0;
+
+/**
+ * @brief Choose the clock for timestamps, and start it.
+ */
+void
+stamp_set(enum stamp_clock clk)
+{
+    stamp_clock = clk;
+    clock_gettime(CLOCK_MONOTONIC, &stamp_base);
+    sec_key = -1;
+    ms_key = -1;
+}
+
+/*
+ * |t| minus |base|, in milliseconds.
+ */
+static long long
+ms_since(const struct timespec *t, const struct timespec *base)
+{
+    return ((long long)(t->tv_sec - base->tv_sec) * 1000
+        + (t->tv_nsec - base->tv_nsec) / 1000000);
+}
+
+static void
+format_sec(long long sec)
+{
+    struct tm tm;
+    time_t t;
+
+    if (stamp_clock == STAMP_WALL) {
+        t = (time_t)sec;
+        localtime_r(&t, &tm);
+        sec_len = strftime(sec_txt, sizeof (sec_txt), "[%H:%M:%S", &tm);
+    }
+    else {
+        sec_len = (size_t)snprintf(sec_txt, sizeof (sec_txt), "[%c%lld",
+            stamp_clock == STAMP_MONO ? '+' : '~', sec);
+    }
+    sec_key = sec;
+}
+
+/**
+ * @brief The timestamp for output being written now.
+ *
+ * @param len  set to the length of the text
+ * @return     the text, "" if timestamps are off; good until
+ *             the next call
+ */
+const char *
+stamp_now(size_t *len)
+{
+    struct timespec now;
+    long long ms;
+    int frac;
+
+    if (stamp_clock == STAMP_NONE) {
+        *len = 0;
+        return ("");
+    }
+    ++nr_reads;
+    if (stamp_clock == STAMP_WALL) {
+        clock_gettime(CLOCK_REALTIME, &now);
+        ms = (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+    }
+    else {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        ms = ms_since(&now, &stamp_base);
+        if (stamp_clock == STAMP_DELTA) {
+            stamp_base = now;
+        }
+    }
+    if (ms != ms_key) {
+        ++nr_formats;
+        if (ms / 1000 != sec_key) {
+            format_sec(ms / 1000);
+        }
+        memcpy(txt, sec_txt, sec_len);
+        frac = (int)(ms % 1000);
+        txt[sec_len + 0] = '.';
+        txt[sec_len + 1] = '0' + frac / 100;
+        txt[sec_len + 2] = '0' + frac / 10 % 10;
+        txt[sec_len + 3] = '0' + frac % 10;
+        txt[sec_len + 4] = ']';
+        txt[sec_len + 5] = ' ';
+        txt_len = sec_len + 6;
+        ms_key = ms;
+    }
+    *len = txt_len;
+    return (txt);
+}
+
+/**
+ * @brief How many timestamps were taken, and how many had to be formatted.
+ */
+void
+stamp_stats(unsigned long *reads, unsigned long *formats)
+{
+    *reads = nr_reads;
+    *formats = nr_formats;
+}
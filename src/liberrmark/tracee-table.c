@@ -0,0 +1,198 @@
+/*
+ * Filename: src/liberrmark/tracee-table.c
+ * Project: errmark
+ * Library: liberrmark
+ * Brief: Table of per-thread interception state, keyed by tid
+ *
+ * Copyright (C) 2016-2019 Guy Shaw
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Open addressing, with linear probing.
+ *
+ * Entries are removed by shifting later entries of the same probe
+ * sequence back into the hole, rather than by leaving a tombstone.
+ * A build farm creates and reaps thousands of short-lived processes;
+ * tombstones would pile up, and lookups would get slower and slower
+ * until the next rehash.  With backward shift deletion, the cost
+ * of a lookup depends only on the number of live tracees.
+ *
+ * Entries are stored in the table itself, so a pointer to an entry
+ * is valid only until the next call to tracee_insert() or
+ * tracee_remove().
+ */
+
+#include <errmark.h>
+#include <cscript.h>		// Import guard_calloc()
+#include <stdint.h>		// Import uint32_t
+#include <stdlib.h>		// Import free()
+#include <string.h>		// Import memset()
+
+#define TRACEE_TABLE_MIN 64
+
+static inline size_t
+tid_hash(pid_t tid, size_t mask)
+{
+    /*
+     * Fibonacci hashing.  Consecutive tids, which is what
+     * a fork storm produces, are spread all over the table.
+     */
+    return ((size_t)(((uint32_t)tid * 2654435769U) >> 7) & mask);
+}
+
+void
+tracee_table_init(struct tracee_table *tab)
+{
+    tab->slots = NULL;
+    tab->size = 0;
+    tab->count = 0;
+}
+
+void
+tracee_table_free(struct tracee_table *tab)
+{
+    free(tab->slots);
+    tracee_table_init(tab);
+}
+
+static void
+tracee_table_resize(struct tracee_table *tab, size_t new_size)
+{
+    struct tracee *old_slots;
+    size_t old_size;
+    size_t mask;
+    size_t i;
+
+    old_slots = tab->slots;
+    old_size = tab->size;
+    tab->slots = (struct tracee *)guard_calloc(new_size, sizeof (struct tracee));
+    tab->size = new_size;
+    mask = new_size - 1;
+
+    for (i = 0; i < old_size; ++i) {
+        size_t h;
+
+        if (old_slots[i].tid == 0) {
+            continue;
+        }
+        h = tid_hash(old_slots[i].tid, mask);
+        while (tab->slots[h].tid != 0) {
+            h = (h + 1) & mask;
+        }
+        tab->slots[h] = old_slots[i];
+    }
+    free(old_slots);
+}
+
+/**
+ * @brief Find the state of tracee |tid|.
+ * @return pointer to the entry, or NULL if |tid| is not known.
+ */
+struct tracee *
+tracee_lookup(struct tracee_table *tab, pid_t tid)
+{
+    size_t mask;
+    size_t h;
+
+    if (tab->size == 0) {
+        return (NULL);
+    }
+    mask = tab->size - 1;
+    h = tid_hash(tid, mask);
+    while (tab->slots[h].tid != 0) {
+        if (tab->slots[h].tid == tid) {
+            return (&tab->slots[h]);
+        }
+        h = (h + 1) & mask;
+    }
+    return (NULL);
+}
+
+/**
+ * @brief Find the state of tracee |tid|, adding a fresh entry if needed.
+ * @return pointer to the entry; never NULL.
+ */
+struct tracee *
+tracee_insert(struct tracee_table *tab, pid_t tid)
+{
+    struct tracee *ent;
+    size_t mask;
+    size_t h;
+
+    ent = tracee_lookup(tab, tid);
+    if (ent != NULL) {
+        return (ent);
+    }
+
+    /*
+     * Keep the load factor at or below 1/2.
+     */
+    if (2 * (tab->count + 1) > tab->size) {
+        tracee_table_resize(tab,
+            tab->size ? 2 * tab->size : TRACEE_TABLE_MIN);
+    }
+
+    mask = tab->size - 1;
+    h = tid_hash(tid, mask);
+    while (tab->slots[h].tid != 0) {
+        h = (h + 1) & mask;
+    }
+    ent = &tab->slots[h];
+    memset(ent, 0, sizeof (*ent));
+    ent->tid = tid;
+    ++tab->count;
+    return (ent);
+}
+
+/**
+ * @brief Forget about tracee |tid|.
+ */
+void
+tracee_remove(struct tracee_table *tab, pid_t tid)
+{
+    struct tracee *ent;
+    size_t mask;
+    size_t hole;
+    size_t i;
+
+    ent = tracee_lookup(tab, tid);
+    if (ent == NULL) {
+        return;
+    }
+
+    mask = tab->size - 1;
+    hole = ent - tab->slots;
+    i = hole;
+    while (true) {
+        size_t home;
+
+        i = (i + 1) & mask;
+        if (tab->slots[i].tid == 0) {
+            break;
+        }
+        /*
+         * The entry at |i| can move back into the hole,
+         * unless its home slot lies cyclically in (hole, i].
+         */
+        home = tid_hash(tab->slots[i].tid, mask);
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            tab->slots[hole] = tab->slots[i];
+            hole = i;
+        }
+    }
+    memset(&tab->slots[hole], 0, sizeof (tab->slots[hole]));
+    --tab->count;
+}
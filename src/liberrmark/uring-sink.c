@@ -0,0 +1,643 @@
+/*
+ * Filename: src/liberrmark/uring-sink.c
+ * Project: errmark
+ * Library: liberrmark
+ * Brief: Write marks and data to stdout and stderr using io_uring
+ *
+ * Copyright (C) 2016-2019 Guy Shaw
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * With writev(), the tracee waits for as long as our stdout takes
+ * to accept its output: a terminal that is scrolling, a pipe to
+ * a pager that is full.  With io_uring, the write is queued, and the
+ * tracee goes on; it waits only when the pool is full.
+ *
+ * The data is copied into a pool of memory, registered with the kernel
+ * as one fixed buffer, and written using IORING_OP_WRITE_FIXED.
+ * The pool is used as a ring of bytes: each write takes a slice
+ * of it, at the head, and gives it back when it completes, so many
+ * small writes take no more room than they need.
+ * Output must come out in order, even across stdout and stderr,
+ * which are usually the same terminal.  So:
+ *
+ *   - the SQEs for one call to uring_sink_writev() are linked
+ *     (IOSQE_IO_LINK), in case the data takes more than one slice;
+ *   - the first SQE of a submission is marked IOSQE_IO_DRAIN, if
+ *     anything is still in flight, so that it does not start before
+ *     everything submitted earlier is done.
+ *
+ * Completions are reaped from the CQ ring in batches, without
+ * a system call, after each submission and whenever room is needed,
+ * and all at once
+ * by uring_sink_drain(), which must be called before anything
+ * else writes to stdout or stderr; in particular, before a write
+ * of the tracee that is performed by the kernel.
+ *
+ * No liburing; just the three system calls.  If io_uring is not
+ * there (kernels older than 5.6, or io_uring_disabled), or a write
+ * ever fails or comes up short, the sink is not used, and it is
+ * writev(), as before.
+ *
+ * A write that fails, or comes up short, is finished by write(),
+ * but not before everything queued after it is out of the way.
+ * IOSQE_IO_DRAIN holds a chain back only until the chains before
+ * it complete, not until they succeed, so by the time the failure
+ * is reaped, later chains may be running.  Those still queued are
+ * cancelled (IORING_OP_ASYNC_CANCEL), we wait for all of them to
+ * complete, one way or another, and then, oldest first, whatever
+ * part of each that the kernel did not write, we write.  A later
+ * write that the kernel had already done cannot be taken back;
+ * that much can come out of order.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <errmark.h>
+#include <cscript.h>		// Import guard_malloc()
+#include <stdbool.h>
+#include <stdint.h>		// Import uint32_t, uint64_t
+#include <stdlib.h>		// Import free()
+#include <string.h>		// Import memset(), memcpy()
+#include <errno.h>		// Import errno, EINTR
+#include <fcntl.h>		// Import fcntl(), FD_CLOEXEC
+#include <unistd.h>		// Import syscall(), write()
+#include <sys/mman.h>		// Import mmap(), munmap()
+#include <sys/uio.h>		// Import struct iovec
+#include <syscall.h>		// Import SYS_io_uring_*
+#include <linux/io_uring.h>	// Import struct io_uring_params, ...
+
+#define URING_ENTRIES 256                // SQEs in flight, at most
+#define URING_POOL    (2 * 1024 * 1024)  // Bytes in flight, at most
+#define URING_SLICE   (64 * 1024)        // Bytes per SQE, at most
+#define URING_CANCEL  ((uint64_t)-1)     // user_data of a cancel
+
+/*
+ * One write in flight.
+ */
+struct slice {
+    int fd;
+    size_t off;         // Where it is in the pool
+    size_t len;
+    size_t end;         // Head of the pool, just after it
+    int res;            // From its CQE
+    bool done;
+};
+
+struct uring {
+    int fd;
+    unsigned int features;
+
+    // SQ ring
+    void *sq_ptr;
+    size_t sq_size;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+
+    // CQ ring
+    void *cq_ptr;
+    size_t cq_size;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    // Pool, and the slices of it in flight, oldest first.
+    // All four count from the start, and are reduced modulo
+    // the size of the pool, or of slices[], only to index.
+    char *pool;
+    size_t pool_head;
+    size_t pool_tail;
+    unsigned long slice_head;
+    unsigned long slice_tail;
+    struct slice slices[URING_ENTRIES];
+    bool failed;        // A write failed, and is not yet made good
+
+    // Statistics
+    unsigned long nr_enter;
+    unsigned long nr_sqe;
+    unsigned long nr_waits;
+};
+
+static struct uring ring;
+static bool active = false;
+
+static int
+sys_io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+    return ((int)syscall(SYS_io_uring_setup, entries, p));
+}
+
+static int
+sys_io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete,
+    unsigned int flags)
+{
+    ++ring.nr_enter;
+    return ((int)syscall(SYS_io_uring_enter, fd, to_submit, min_complete,
+                         flags, NULL, 0));
+}
+
+static int
+sys_io_uring_register(int fd, unsigned int opcode, void *arg,
+    unsigned int nr_args)
+{
+    return ((int)syscall(SYS_io_uring_register, fd, opcode, arg, nr_args));
+}
+
+static void
+unmap_ring(void)
+{
+    if (ring.sqes != NULL && ring.sqes != MAP_FAILED) {
+        munmap(ring.sqes, ring.sqes_size);
+    }
+    if (ring.cq_ptr != NULL && ring.cq_ptr != MAP_FAILED
+        && ring.cq_ptr != ring.sq_ptr) {
+        munmap(ring.cq_ptr, ring.cq_size);
+    }
+    if (ring.sq_ptr != NULL && ring.sq_ptr != MAP_FAILED) {
+        munmap(ring.sq_ptr, ring.sq_size);
+    }
+    if (ring.fd >= 0) {
+        close(ring.fd);
+    }
+    free(ring.pool);
+    memset(&ring, 0, sizeof (ring));
+    ring.fd = -1;
+}
+
+/**
+ * @brief Set up io_uring for writing to stdout and stderr.
+ *
+ * @return true if it can be used; if not, everything stays
+ *         as it was, and output is written using writev().
+ */
+bool
+uring_sink_open(void)
+{
+    struct io_uring_params p;
+    struct iovec iov[1];
+
+    if (active) {
+        return (true);
+    }
+    memset(&ring, 0, sizeof (ring));
+    memset(&p, 0, sizeof (p));
+    ring.fd = sys_io_uring_setup(URING_ENTRIES, &p);
+    if (ring.fd < 0) {
+        ring.fd = -1;
+        return (false);
+    }
+    fcntl(ring.fd, F_SETFD, FD_CLOEXEC);
+    ring.features = p.features;
+    if (!(p.features & IORING_FEAT_RW_CUR_POS)) {
+        /*
+         * Before 5.6, there is no writing at the current position.
+         */
+        unmap_ring();
+        return (false);
+    }
+
+    ring.sq_size = p.sq_off.array + p.sq_entries * sizeof (unsigned int);
+    ring.cq_size = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring.cq_size > ring.sq_size) {
+            ring.sq_size = ring.cq_size;
+        }
+        ring.cq_size = ring.sq_size;
+    }
+    ring.sq_ptr = mmap(NULL, ring.sq_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+    if (ring.sq_ptr == MAP_FAILED) {
+        unmap_ring();
+        return (false);
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring.cq_ptr = ring.sq_ptr;
+    }
+    else {
+        ring.cq_ptr = mmap(NULL, ring.cq_size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+        if (ring.cq_ptr == MAP_FAILED) {
+            unmap_ring();
+            return (false);
+        }
+    }
+    ring.sqes_size = p.sq_entries * sizeof (struct io_uring_sqe);
+    ring.sqes = mmap(NULL, ring.sqes_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+    if (ring.sqes == MAP_FAILED) {
+        unmap_ring();
+        return (false);
+    }
+
+    ring.sq_head  = (unsigned int *)((char *)ring.sq_ptr + p.sq_off.head);
+    ring.sq_tail  = (unsigned int *)((char *)ring.sq_ptr + p.sq_off.tail);
+    ring.sq_mask  = (unsigned int *)((char *)ring.sq_ptr + p.sq_off.ring_mask);
+    ring.sq_array = (unsigned int *)((char *)ring.sq_ptr + p.sq_off.array);
+    ring.cq_head  = (unsigned int *)((char *)ring.cq_ptr + p.cq_off.head);
+    ring.cq_tail  = (unsigned int *)((char *)ring.cq_ptr + p.cq_off.tail);
+    ring.cq_mask  = (unsigned int *)((char *)ring.cq_ptr + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)((char *)ring.cq_ptr + p.cq_off.cqes);
+
+    /*
+     * No more SQEs in flight than there are entries in the SQ ring,
+     * so that neither ring can ever overflow.
+     */
+    ring.pool = (char *)guard_malloc(URING_POOL);
+    iov[0].iov_base = ring.pool;
+    iov[0].iov_len = URING_POOL;
+    if (sys_io_uring_register(ring.fd, IORING_REGISTER_BUFFERS, iov, 1) == -1) {
+        unmap_ring();
+        return (false);
+    }
+
+    active = true;
+    return (true);
+}
+
+bool
+uring_sink_active(void)
+{
+    return (active);
+}
+
+static void
+write_all(int fd, const char *p, size_t len)
+{
+    ssize_t rv;
+
+    while (len != 0) {
+        rv = write(fd, p, len);
+        if (rv == -1 && errno == EINTR) {
+            continue;
+        }
+        if (rv <= 0) {
+            break;
+        }
+        p += rv;
+        len -= rv;
+    }
+}
+
+/*
+ * Take whatever completions there are off the CQ ring,
+ * without a system call, and note them in their slices.
+ */
+static void
+reap_cqes(void)
+{
+    unsigned int head, tail;
+
+    head = *ring.cq_head;
+    tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        struct io_uring_cqe *cqe;
+        struct slice *sl;
+
+        cqe = &ring.cqes[head & *ring.cq_mask];
+        if (cqe->user_data != URING_CANCEL) {
+            sl = &ring.slices[cqe->user_data % URING_ENTRIES];
+            sl->res = cqe->res;
+            sl->done = true;
+            if (cqe->res != (int)sl->len) {
+                /*
+                 * Short, failed, or cancelled because an earlier
+                 * write in the same chain was.
+                 */
+                ring.failed = true;
+            }
+        }
+        ++head;
+    }
+    __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+}
+
+/*
+ * Something went wrong with a write.  Cancel everything that is
+ * still queued, wait for all of it, and then write out, in order,
+ * what the kernel did not.  Stop using io_uring, from the next
+ * write on.
+ */
+static void
+uring_failed(void)
+{
+    unsigned long i;
+    unsigned int tail;
+    unsigned int n;
+
+    active = false;
+    tail = *ring.sq_tail;
+    n = 0;
+    for (i = ring.slice_tail; i != ring.slice_head; ++i) {
+        struct io_uring_sqe *sqe;
+        unsigned int idx;
+
+        if (ring.slices[i % URING_ENTRIES].done) {
+            continue;
+        }
+        idx = tail & *ring.sq_mask;
+        sqe = &ring.sqes[idx];
+        memset(sqe, 0, sizeof (*sqe));
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = i;
+        sqe->user_data = URING_CANCEL;
+        ring.sq_array[idx] = idx;
+        ++tail;
+        ++n;
+    }
+    if (n != 0) {
+        __atomic_store_n(ring.sq_tail, tail, __ATOMIC_RELEASE);
+        while (n != 0) {
+            int rv;
+
+            rv = sys_io_uring_enter(ring.fd, n, 0, 0);
+            if (rv == -1) {
+                if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+                    continue;
+                }
+                break;
+            }
+            n -= rv;
+        }
+    }
+
+    for (i = ring.slice_tail; i != ring.slice_head; ++i) {
+        struct slice *sl = &ring.slices[i % URING_ENTRIES];
+
+        while (!sl->done) {
+            ++ring.nr_waits;
+            if (sys_io_uring_enter(ring.fd, 0, 1, IORING_ENTER_GETEVENTS) == -1
+                && errno != EINTR) {
+                /*
+                 * No way to know what became of it;
+                 * leave it, rather than write it twice.
+                 */
+                sl->res = (int)sl->len;
+                sl->done = true;
+                break;
+            }
+            reap_cqes();
+        }
+    }
+
+    for (i = ring.slice_tail; i != ring.slice_head; ++i) {
+        struct slice *sl = &ring.slices[i % URING_ENTRIES];
+        size_t done;
+
+        done = sl->res > 0 ? (size_t)sl->res : 0;
+        if (done < sl->len) {
+            write_all(sl->fd, ring.pool + sl->off + done, sl->len - done);
+        }
+    }
+    ring.failed = false;
+}
+
+/*
+ * Reap whatever completions there are, without a system call,
+ * and give the room taken by the oldest completed slices back
+ * to the pool.
+ */
+static void
+reap(void)
+{
+    reap_cqes();
+    if (ring.failed) {
+        uring_failed();
+    }
+
+    while (ring.slice_tail != ring.slice_head) {
+        struct slice *sl = &ring.slices[ring.slice_tail % URING_ENTRIES];
+
+        if (!sl->done) {
+            break;
+        }
+        ring.pool_tail = sl->end;
+        ++ring.slice_tail;
+    }
+}
+
+static bool
+uring_wait(void)
+{
+    ++ring.nr_waits;
+    if (sys_io_uring_enter(ring.fd, 0, 1, IORING_ENTER_GETEVENTS) == -1
+        && errno != EINTR) {
+        return (false);
+    }
+    reap();
+    return (true);
+}
+
+/*
+ * Submit the |n| SQEs that have been filled in.
+ */
+static void
+submit(unsigned int tail, unsigned int n)
+{
+    __atomic_store_n(ring.sq_tail, tail, __ATOMIC_RELEASE);
+    while (n != 0) {
+        int rv;
+
+        rv = sys_io_uring_enter(ring.fd, n, 0, 0);
+        if (rv == -1) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+                continue;
+            }
+            break;
+        }
+        n -= rv;
+    }
+}
+
+/*
+ * Take a slice of |len| bytes from the pool, contiguous, and an SQE
+ * to go with it.  Everything already filled in, |*nsqe| SQEs up to
+ * |*tail|, is submitted first if we have to wait.  NULL if, while
+ * waiting, io_uring was given up on.
+ */
+static struct slice *
+take_slice(size_t len, unsigned int *tail, unsigned int *nsqe)
+{
+    struct slice *sl;
+    size_t off, skip;
+
+    off = ring.pool_head % URING_POOL;
+    skip = (off + len > URING_POOL) ? URING_POOL - off : 0;
+    while (URING_POOL - (ring.pool_head - ring.pool_tail) < skip + len
+           || ring.slice_head - ring.slice_tail == URING_ENTRIES) {
+        if (*nsqe != 0) {
+            /*
+             * Let what is queued so far go, as a chain of its own.
+             */
+            submit(*tail, *nsqe);
+            *nsqe = 0;
+        }
+        if (!uring_wait() || !active) {
+            return (NULL);
+        }
+    }
+    sl = &ring.slices[ring.slice_head % URING_ENTRIES];
+    sl->off = (off + skip) % URING_POOL;
+    sl->len = len;
+    sl->done = false;
+    ring.pool_head += skip + len;
+    sl->end = ring.pool_head;
+    return (sl);
+}
+
+/**
+ * @brief Queue the data in |iov| to be written to |fd|.
+ *
+ * @return the number of bytes queued, which is all of them.
+ * Any that cannot be queued, because io_uring was given up on
+ * along the way, are written by write(), in their turn.
+ */
+size_t
+uring_sink_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+    struct io_uring_sqe *sqe;
+    unsigned int tail;
+    unsigned int nsqe;
+    size_t remaining;
+    size_t total;
+    size_t ioff;
+    int i;
+
+    remaining = 0;
+    for (i = 0; i < iovcnt; ++i) {
+        remaining += iov[i].iov_len;
+    }
+
+    tail = *ring.sq_tail;
+    nsqe = 0;
+    sqe = NULL;
+    total = 0;
+    i = 0;
+    ioff = 0;
+    while (remaining != 0) {
+        struct slice *sl;
+        unsigned int idx;
+        size_t slen, blen;
+        char *bp;
+
+        slen = remaining < URING_SLICE ? remaining : URING_SLICE;
+        sl = take_slice(slen, &tail, &nsqe);
+        if (sl == NULL) {
+            active = false;
+            for (; i < iovcnt; ++i, ioff = 0) {
+                write_all(fd, (const char *)iov[i].iov_base + ioff,
+                    iov[i].iov_len - ioff);
+            }
+            return (total + remaining);
+        }
+
+        bp = ring.pool + sl->off;
+        blen = 0;
+        while (blen < slen) {
+            size_t n;
+
+            n = iov[i].iov_len - ioff;
+            if (n > slen - blen) {
+                n = slen - blen;
+            }
+            memcpy(bp + blen, (const char *)iov[i].iov_base + ioff, n);
+            blen += n;
+            ioff += n;
+            if (ioff == iov[i].iov_len) {
+                ++i;
+                ioff = 0;
+            }
+        }
+        sl->fd = fd;
+
+        if (nsqe != 0) {
+            sqe->flags |= IOSQE_IO_LINK;
+        }
+        idx = tail & *ring.sq_mask;
+        sqe = &ring.sqes[idx];
+        memset(sqe, 0, sizeof (*sqe));
+        sqe->opcode = IORING_OP_WRITE_FIXED;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t)(uintptr_t)bp;
+        sqe->len = (uint32_t)slen;
+        sqe->off = (uint64_t)-1;        // Current file position, as write() does
+        sqe->buf_index = 0;
+        sqe->user_data = ring.slice_head;
+        if (nsqe == 0 && ring.slice_head != ring.slice_tail) {
+            /*
+             * Something submitted earlier is still in flight.
+             */
+            sqe->flags |= IOSQE_IO_DRAIN;
+        }
+        ring.sq_array[idx] = idx;
+        ++ring.slice_head;
+        ++tail;
+        ++nsqe;
+        ++ring.nr_sqe;
+        total += slen;
+        remaining -= slen;
+    }
+
+    if (nsqe != 0) {
+        submit(tail, nsqe);
+    }
+    reap();
+    return (total);
+}
+
+/**
+ * @brief Wait for everything queued to be written.
+ */
+void
+uring_sink_drain(void)
+{
+    if (ring.pool == NULL) {
+        return;
+    }
+    reap();
+    while (ring.slice_tail != ring.slice_head) {
+        if (!uring_wait()) {
+            break;
+        }
+    }
+}
+
+/**
+ * @brief Drain, and tear down the ring.
+ *
+ * With |verbose|, report the number of io_uring_enter() calls,
+ * of SQEs, and of times we had to wait for completions.
+ */
+void
+uring_sink_close(bool verbose)
+{
+    if (ring.pool == NULL) {
+        return;
+    }
+    uring_sink_drain();
+    if (verbose) {
+        eprintf("io_uring: sqe=%lu enter=%lu waits=%lu%s\n",
+            ring.nr_sqe, ring.nr_enter, ring.nr_waits,
+            active ? "" : " (fell back to writev)");
+    }
+    active = false;
+    unmap_ring();
+}
@@ -0,0 +1,286 @@
+/*
+ * Filename: src/liberrmark/write-decode.c
+ * Project: errmark
+ * Library: liberrmark
+ * Brief: Decode the system calls of the write() family
+ *
+ * Copyright (C) 2016-2019 Guy Shaw
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * write() is not the only way to write to stdout or stderr.
+ * glibc writes its fatal error messages using writev(),
+ * so do the stderr of Rust and many logging libraries,
+ * and stdout may well be a socket.
+ *
+ *   write(fd, buf, count)
+ *   writev(fd, iov, iovcnt)
+ *   pwrite64(fd, buf, count, offset)
+ *   pwritev(fd, iov, iovcnt, offset_lo, offset_hi)
+ *   pwritev2(fd, iov, iovcnt, offset_lo, offset_hi, flags)
+ *   sendto(fd, buf, len, flags, dest_addr, addrlen)
+ *   sendmsg(fd, msg, flags)
+ *   vmsplice(fd, iov, nr_segs, flags)
+ *
+ * and the ones that move data from one file descriptor to another,
+ * without it ever being in the memory of the tracee:
+ *
+ *   sendfile(out_fd, in_fd, offset, count)
+ *   splice(fd_in, off_in, fd_out, off_out, len, flags)
+ *   tee(fd_in, fd_out, len, flags)
+ *   copy_file_range(fd_in, off_in, fd_out, off_out, len, flags)
+ *
+ * Whatever the system call, the data to be written is described
+ * as a list of remote regions, so that it can be gathered
+ * using one call to pmem_readv(), and marked as one logical write.
+ *
+ * write() and writev() are emulated, and so are the others, when
+ * they come down to one of them: pwritev2() at the current position,
+ * with no flags, and sendto() and sendmsg() to a socket, with no
+ * flags, no destination address, and no ancillary data.  Otherwise,
+ * they have side effects that errmark cannot reproduce by writing
+ * to its own stdout: a file offset, message boundaries, flags,
+ * a destination address, ancillary data, pages gifted to a pipe.
+ * They are marked, and then performed by the kernel, as is.
+ * The exception is the data moving calls, which errmark performs
+ * itself, when it can; see splice-copy.c.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <errmark.h>
+#include <stdbool.h>
+#include <stddef.h>		// Import size_t
+#include <sys/socket.h>		// Import struct msghdr
+#include <sys/stat.h>		// Import fstat(), S_ISSOCK()
+#include <sys/uio.h>		// Import struct iovec
+#include <syscall.h>		// Import SYS_write, SYS_writev, ...
+
+/**
+ * @brief The fd written to by a system call of the write() family.
+ *
+ * @param nr    system call number
+ * @param args  system call arguments
+ * @return      the file descriptor, or -1 if |nr| does not write
+ *              to a file descriptor.
+ */
+int
+write_call_fd(long nr, const unsigned long *args)
+{
+    switch (nr) {
+    case SYS_write:
+    case SYS_writev:
+    case SYS_pwrite64:
+    case SYS_pwritev:
+#if defined(SYS_pwritev2)
+    case SYS_pwritev2:
+#endif
+#if defined(SYS_sendto)
+    case SYS_sendto:
+#endif
+#if defined(SYS_sendmsg)
+    case SYS_sendmsg:
+#endif
+    case SYS_vmsplice:
+    case SYS_sendfile:
+        return ((int)args[0]);
+    case SYS_tee:
+        return ((int)args[1]);
+    case SYS_splice:
+    case SYS_copy_file_range:
+        return ((int)args[2]);
+    default:
+        return (-1);
+    }
+}
+
+/**
+ * @brief Is this system call a read from stdin?
+ *
+ * Output that is held back, by coalescing, must be out
+ * before a tracee waits for input; it may well be a prompt.
+ *
+ * @param nr    system call number
+ * @param args  system call arguments
+ */
+bool
+read_call_is_stdin(long nr, const unsigned long *args)
+{
+    switch (nr) {
+    case SYS_read:
+    case SYS_readv:
+    case SYS_pread64:
+    case SYS_preadv:
+#if defined(SYS_preadv2)
+    case SYS_preadv2:
+#endif
+        return ((int)args[0] == 0);
+    default:
+        return (false);
+    }
+}
+
+/*
+ * Is our own |fd|, and so the tracee's, a socket?
+ */
+static bool
+is_socket(int fd)
+{
+    struct stat st;
+
+    return (fstat(fd, &st) == 0 && S_ISSOCK(st.st_mode));
+}
+
+/*
+ * Fetch the remote iovec array of |tracee| at |raddr|, in one read.
+ */
+static bool
+fetch_iov(struct write_call *wc, pid_t tracee, unsigned long raddr,
+    unsigned long iovcnt)
+{
+    size_t sz;
+
+    if (iovcnt > WRITE_IOV_MAX) {
+        /*
+         * The kernel will refuse it with EINVAL.
+         */
+        return (false);
+    }
+    sz = iovcnt * sizeof (struct iovec);
+    if (sz != 0 && pmem_read(wc->iov, tracee, (void *)raddr, sz) != (ssize_t)sz) {
+        return (false);
+    }
+    wc->iovcnt = iovcnt;
+    return (true);
+}
+
+/**
+ * @brief Decode a system call of the write() family.
+ *
+ * Find out what is to be written, and where in the address space
+ * of |tracee| it is.  For the vectored variants, the iovec array
+ * (and for sendmsg(), the msghdr) is read from |tracee|.
+ *
+ * @param wc      decoded system call
+ * @param tracee  tid of the writing thread
+ * @param nr      system call number
+ * @param args    system call arguments
+ * @return        false if |nr| is not of the write() family,
+ *                or its arguments cannot be read.
+ */
+bool
+write_call_decode(struct write_call *wc, pid_t tracee, long nr,
+    const unsigned long *args)
+{
+    size_t i;
+
+    wc->nr = nr;
+    wc->fd = (int)args[0];
+    wc->raddr = (void *)args[1];
+    wc->emulatable = false;
+    wc->spliced = false;
+    wc->in_fd = -1;
+    wc->in_off = NULL;
+    wc->out_off = NULL;
+    wc->flags = 0;
+    wc->iovcnt = 0;
+
+    switch (nr) {
+    case SYS_write:
+        wc->emulatable = true;
+        /* FALLTHROUGH */
+    case SYS_pwrite64:
+#if defined(SYS_sendto)
+    case SYS_sendto:
+        if (nr == SYS_sendto) {
+            wc->emulatable = (args[3] == 0 && args[4] == 0 && is_socket(wc->fd));
+        }
+#endif
+        wc->iov[0].iov_base = (void *)args[1];
+        wc->iov[0].iov_len = (size_t)args[2];
+        wc->iovcnt = 1;
+        break;
+    case SYS_writev:
+        wc->emulatable = true;
+        /* FALLTHROUGH */
+    case SYS_pwritev:
+#if defined(SYS_pwritev2)
+    case SYS_pwritev2:
+#endif
+    case SYS_vmsplice:
+        if (!fetch_iov(wc, tracee, args[1], args[2])) {
+            return (false);
+        }
+#if defined(SYS_pwritev2)
+        if (nr == SYS_pwritev2) {
+            wc->emulatable = ((long)args[3] == -1 && args[5] == 0);
+        }
+#endif
+        break;
+#if defined(SYS_sendmsg)
+    case SYS_sendmsg:
+        {
+            struct msghdr msg;
+
+            if (pmem_read(&msg, tracee, (void *)args[1], sizeof (msg))
+                != (ssize_t)sizeof (msg)) {
+                return (false);
+            }
+            if (!fetch_iov(wc, tracee, (unsigned long)msg.msg_iov,
+                           (unsigned long)msg.msg_iovlen)) {
+                return (false);
+            }
+            wc->emulatable = (args[2] == 0 && msg.msg_name == NULL
+                && msg.msg_controllen == 0 && is_socket(wc->fd));
+        }
+        break;
+#endif
+    case SYS_sendfile:
+        wc->spliced = true;
+        wc->in_fd = (int)args[1];
+        wc->in_off = (void *)args[2];
+        wc->len = (size_t)args[3];
+        wc->raddr = NULL;
+        return (true);
+    case SYS_tee:
+        wc->spliced = true;
+        wc->fd = (int)args[1];
+        wc->in_fd = (int)args[0];
+        wc->len = (size_t)args[2];
+        wc->flags = (unsigned int)args[3];
+        wc->raddr = NULL;
+        return (true);
+    case SYS_splice:
+    case SYS_copy_file_range:
+        wc->spliced = true;
+        wc->fd = (int)args[2];
+        wc->in_fd = (int)args[0];
+        wc->in_off = (void *)args[1];
+        wc->out_off = (void *)args[3];
+        wc->len = (size_t)args[4];
+        wc->flags = (unsigned int)args[5];
+        wc->raddr = NULL;
+        return (true);
+    default:
+        return (false);
+    }
+
+    wc->len = 0;
+    for (i = 0; i < wc->iovcnt; ++i) {
+        wc->len += wc->iov[i].iov_len;
+    }
+    return (true);
+}